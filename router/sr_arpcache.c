@@ -1,4 +1,5 @@
 #include <netinet/in.h>
+#include <stddef.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <time.h>
@@ -10,92 +11,406 @@
 #include "sr_router.h"
 #include "sr_if.h"
 #include "sr_protocol.h"
+#include "sr_rcu.h"
+
+static void sr_arpcache_unlink_req(struct sr_arpcache *cache, struct sr_arpreq *req);
+static void sr_arpreq_free(struct sr_arpcache *cache, struct sr_arpreq *req);
+static void sr_arpcache_hold_down(struct sr_arpcache *cache, uint32_t ip, int iface);
+
 /* 
-  This function gets called every second. For each request sent out, we keep
-  checking whether we should resend a request or destroy the arp request.
-  See the comments in the header file for an idea of what it should look like.
+  handle_arpreq gets called by a request's timer, every second. For each
+  request sent out, we check whether we should resend a request or destroy
+  the arp request. See the comments in the header file.
 */
-void send_arp_req(struct sr_instance* sr, struct sr_arpreq * req) {
-    struct sr_packet * packet = (struct sr_packet*)malloc(sizeof(struct sr_packet));
-    packet->buf = (uint8_t *)malloc(sizeof(sr_ethernet_hdr_t) + sizeof(sr_arp_hdr_t));
-    packet->len = sizeof(sr_ethernet_hdr_t) + sizeof(sr_arp_hdr_t);
-    sr_ethernet_hdr_t * ethernet_header = (sr_ethernet_hdr_t *)packet->buf;
-    sr_arp_hdr_t * arp_header = (sr_arp_hdr_t *)(packet->buf + sizeof(sr_ethernet_hdr_t));
-
-    struct sr_if * interface_to_send_on = sr_get_interface(sr, req->packets->iface);
-    packet->iface = interface_to_send_on->name;
+/* Send an ARP request for tip out of iface to dest_mac: broadcast to
+   resolve a new neighbor, the neighbor's own MAC to refresh an entry. */
+static void send_arp_request(struct sr_instance* sr, struct sr_if * iface, uint32_t tip,
+                             unsigned char * dest_mac, unsigned char * target_mac) {
+    uint8_t buf[sizeof(sr_ethernet_hdr_t) + sizeof(sr_arp_hdr_t)];
+    sr_ethernet_hdr_t * ethernet_header = (sr_ethernet_hdr_t *)buf;
+    sr_arp_hdr_t * arp_header = (sr_arp_hdr_t *)(buf + sizeof(sr_ethernet_hdr_t));
+
     arp_header->ar_hrd = htons(arp_hrd_ethernet);
     arp_header->ar_pro = htons(0x800);
     arp_header->ar_hln = ETHER_ADDR_LEN;
     arp_header->ar_pln = 4;
     arp_header->ar_op = htons(arp_op_request);
-    arp_header->ar_tip = req->ip;
-    arp_header->ar_sip = interface_to_send_on->ip;
+    arp_header->ar_tip = tip;
+    arp_header->ar_sip = iface->ip;
     /* Reconfigure ARP src/dest targets */
-    
-    uint8_t all_one[6] = {-1, -1, -1, -1, -1, -1};
-
-    set_arp_sha_tha(arp_header, interface_to_send_on->addr, all_one);
+    set_arp_sha_tha(arp_header, iface->addr, target_mac);
 
     /* Set Ethernet dest/src addrs */
-    set_ethernet_src_dst(ethernet_header, interface_to_send_on->addr, all_one);
+    set_ethernet_src_dst(ethernet_header, iface->addr, dest_mac);
 
     ethernet_header->ether_type = htons(ethertype_arp);
-    sr_send_packet(sr, packet->buf, packet->len, packet->iface);
-    free(packet->buf);
-    free(packet);
+    sr_send_packet(sr, buf, sizeof(buf), iface->index);
+}
+
+/* Queue an ARP request for ip out of iface to mac (all ones: broadcast),
+   for sr_arpcache_flush to send once the lock is dropped. */
+static void sr_arpcache_probe(struct sr_arpcache *cache, uint32_t ip, int iface,
+                              const unsigned char *mac) {
+    if (cache->nprobes == cache->probes_cap) {
+        uint32_t cap = cache->probes_cap ? 2 * cache->probes_cap : 16;
+        struct sr_arpprobe *probes = (struct sr_arpprobe *)realloc(cache->probes, cap * sizeof(struct sr_arpprobe));
+        if (!probes)
+            return;
+        cache->probes = probes;
+        cache->probes_cap = cap;
+    }
+    cache->probes[cache->nprobes].ip = ip;
+    cache->probes[cache->nprobes].iface = iface;
+    memcpy(cache->probes[cache->nprobes].mac, mac, 6);
+    cache->nprobes++;
+}
+
+void send_arp_req(struct sr_instance* sr, struct sr_arpreq * req) {
+    uint8_t all_one[6] = {-1, -1, -1, -1, -1, -1};
+
+    sr_arpcache_probe(&(sr->cache), req->ip, req->iface, all_one);
+}
+
+/* Ask a neighbor that is still in use to confirm its MAC before its entry
+   expires, so packets to it never wait for ARP. The reply refreshes the
+   entry through sr_arpcache_insert. */
+static void send_arp_refresh(struct sr_instance* sr, struct sr_arpentry * entry) {
+    sr_arpcache_probe(&(sr->cache), entry->ip, entry->iface, entry->mac);
+    sr->cache.refreshed++;
 }
 
+/* Runs with the cache lock held, so it only decides: ARP requests and
+   host unreachables go out from sr_arpcache_flush after the timer thread
+   dropped the lock. */
 void handle_arpreq(struct sr_instance *sr, struct sr_arpreq * req) {
-    time_t curtime = time(NULL);
-    if (difftime(curtime, req->sent) >= 1) {
-        if (req->times_sent >= 5) {
-            struct sr_packet * head = req->packets;
-            while (head) {
-                modify_send_icmp_host_unreachable(sr, head->buf, head->len, head->iface);
-                head = head->next;
-            }
-            sr_arpreq_destroy(&(sr->cache), req);
-        } else { 
-            send_arp_req(sr, req);
-            curtime = time(NULL);
-            req->sent = curtime;
-            req->times_sent++;
-        }
+    struct sr_arpcache *cache = &(sr->cache);
+    if (req->times_sent >= 5) {
+        sr_arpcache_unlink_req(cache, req);
+        cache->drops[sr_arpdrop_unresolved] += req->npackets;
+        sr_arpcache_hold_down(cache, req->ip, req->iface);
+        req->next = cache->failed;
+        cache->failed = req;
+    } else { 
+        send_arp_req(sr, req);
+        req->sent = time(NULL);
+        req->times_sent++;
+        sr_timer_arm(&(cache->wheel), &(req->timer), SR_TIMER_MS(SR_ARPCACHE_RETRY_MS));
     }
 }
 
-void sr_arpcache_sweepreqs(struct sr_instance *sr) {
-    /* iterate through cache request queue */
+/* A request's timer: the next ARP request is due. */
+static void sr_arpcache_req_timer(struct sr_timer *timer, void *arg) {
+    struct sr_arpreq *req = (struct sr_arpreq *)((char *)timer - offsetof(struct sr_arpreq, timer));
+
+    handle_arpreq((struct sr_instance *)arg, req);
+}
+
+/* Sends what the timers queued under the lock: ARP requests, then host
+   unreachables for the packets of requests that were given up on.  Runs
+   on the timer thread, the only one that queues, without the lock. */
+static void sr_arpcache_flush(void *arg) {
+    struct sr_instance *sr = (struct sr_instance *)arg;
     struct sr_arpcache *cache = &(sr->cache);
-    struct sr_arpreq *head = cache->requests;
+    struct sr_arpreq *req, *next;
+    struct sr_packet *head;
+    struct sr_if *iface;
+    uint32_t i;
+
+    if (cache->nprobes == 0 && !cache->failed)
+        return;
 
-    while(head) {
-        struct sr_arpreq * next = head->next;
-        handle_arpreq(sr, head);
-        head = next;
+    /* one write for the burst */
+    sr_send_batch_begin(sr);
+    for (i = 0; i < cache->nprobes; i++) {
+        iface = sr_if_get(sr, cache->probes[i].iface);
+        if (iface)
+            send_arp_request(sr, iface, cache->probes[i].ip,
+                             cache->probes[i].mac, cache->probes[i].mac);
     }
+    cache->nprobes = 0;
+
+    req = cache->failed;
+    cache->failed = NULL;
+    /* host unreachables are routed, hold off fib reclamation */
+    sr_rcu_read_lock();
+    for (; req; req = next) {
+        next = req->next;
+        for (head = req->packets; head; head = head->next)
+            modify_send_icmp_host_unreachable(sr, head->buf, head->len, head->iface);
+        sr_arpreq_free(cache, req);
+    }
+    sr_rcu_read_unlock();
+    sr_send_batch_end(sr);
 }
 
 /* You should not need to touch the rest of this code. */
 
+static uint32_t sr_arpcache_hash(uint32_t ip) {
+    uint32_t h = ip * 0x9e3779b1u;
+    return h ^ (h >> 16);
+}
+
+/* Neighbors are (ip, iface): VRFs may reuse an address on their own
+   interfaces. */
+static uint32_t sr_arpcache_key(uint32_t ip, int iface) {
+    return sr_arpcache_hash(ip ^ (uint32_t)iface * 0x85ebca6bu);
+}
+
+/* The slot that holds ip on iface down, if any does. */
+static struct sr_arphold *sr_arpcache_hold_slot(struct sr_arpcache *cache, uint32_t ip, int iface) {
+    return &(cache->holds[sr_arpcache_key(ip, iface) & (SR_ARPCACHE_HOLDS - 1)]);
+}
+
+/* No new requests for ip on iface for a while, it just did not answer five. */
+static void sr_arpcache_hold_down(struct sr_arpcache *cache, uint32_t ip, int iface) {
+    struct sr_arphold *h = sr_arpcache_hold_slot(cache, ip, iface);
+    h->ip = ip;
+    h->iface = iface;
+    h->until = sr_timer_now() + SR_TIMER_SEC(SR_ARPCACHE_HOLDDOWN);
+    if (h->until == 0)
+        h->until = 1;
+}
+
+static int sr_arpcache_held_down(struct sr_arpcache *cache, uint32_t ip, int iface) {
+    struct sr_arphold *h = sr_arpcache_hold_slot(cache, ip, iface);
+    if (h->until == 0 || h->ip != ip || h->iface != iface)
+        return 0;
+    if ((int32_t)(h->until - sr_timer_now()) > 0)
+        return 1;
+    h->until = 0;
+    return 0;
+}
+
+/* Writers hold cache->lock and bracket every change to the table. */
+static void sr_arpcache_write_begin(struct sr_arpcache *cache) {
+    __atomic_store_n(&cache->seq, cache->seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+static void sr_arpcache_write_end(struct sr_arpcache *cache) {
+    __atomic_store_n(&cache->seq, cache->seq + 1, __ATOMIC_RELEASE);
+}
+
+/* Slot of the index holding the entry for ip on iface, or SR_ARPCACHE_NONE. */
+static uint32_t sr_arpcache_find(struct sr_arptable *t, uint32_t ip, int iface) {
+    uint32_t j;
+    for (j = sr_arpcache_key(ip, iface) & t->mask; t->slots[j] != SR_ARPCACHE_NONE;
+         j = (j + 1) & t->mask) {
+        if (t->entries[t->slots[j]].ip == ip && t->entries[t->slots[j]].iface == iface)
+            return j;
+    }
+    return SR_ARPCACHE_NONE;
+}
+
+static void sr_arpcache_index(struct sr_arptable *t, uint32_t i) {
+    uint32_t j = sr_arpcache_key(t->entries[i].ip, t->entries[i].iface) & t->mask;
+    while (t->slots[j] != SR_ARPCACHE_NONE)
+        j = (j + 1) & t->mask;
+    __atomic_store_n(&t->slots[j], i, __ATOMIC_RELAXED);
+}
+
+/* Empty slot j, moving later entries of its probe run back so lookups
+   never stop early at the hole. */
+static void sr_arpcache_unindex(struct sr_arptable *t, uint32_t j) {
+    uint32_t k, h;
+    for (k = (j + 1) & t->mask; t->slots[k] != SR_ARPCACHE_NONE;
+         k = (k + 1) & t->mask) {
+        h = sr_arpcache_key(t->entries[t->slots[k]].ip,
+                            t->entries[t->slots[k]].iface) & t->mask;
+        if (((k - h) & t->mask) >= ((k - j) & t->mask)) {
+            __atomic_store_n(&t->slots[j], t->slots[k], __ATOMIC_RELAXED);
+            j = k;
+        }
+    }
+    __atomic_store_n(&t->slots[j], SR_ARPCACHE_NONE, __ATOMIC_RELAXED);
+}
+
+static void sr_arpcache_lru_unlink(struct sr_arpcache *cache, uint32_t i) {
+    struct sr_arpentry *entries = cache->table->entries;
+    struct sr_arpentry *e = &(entries[i]);
+    if (e->lru_prev != SR_ARPCACHE_NONE)
+        entries[e->lru_prev].lru_next = e->lru_next;
+    else
+        cache->lru_head = e->lru_next;
+    if (e->lru_next != SR_ARPCACHE_NONE)
+        entries[e->lru_next].lru_prev = e->lru_prev;
+    else
+        cache->lru_tail = e->lru_prev;
+}
+
+/* Lookups after this see a later tick, which is how eviction tells
+   whether the entry was used since. */
+static void sr_arpcache_lru_push(struct sr_arpcache *cache, uint32_t i) {
+    struct sr_arpentry *entries = cache->table->entries;
+    struct sr_arpentry *e = &(entries[i]);
+    e->lru_prev = SR_ARPCACHE_NONE;
+    e->lru_next = cache->lru_head;
+    e->placed = cache->tick;
+    e->used = cache->tick;
+    __atomic_store_n(&cache->tick, cache->tick + 1, __ATOMIC_RELAXED);
+    if (cache->lru_head != SR_ARPCACHE_NONE)
+        entries[cache->lru_head].lru_prev = i;
+    else
+        cache->lru_tail = i;
+    cache->lru_head = i;
+}
+
+/* Drop entry i, which must be valid. */
+static void sr_arpcache_remove(struct sr_arpcache *cache, uint32_t i) {
+    struct sr_arptable *t = cache->table;
+    struct sr_arpentry *e = &(t->entries[i]);
+    sr_arpcache_unindex(t, sr_arpcache_find(t, e->ip, e->iface));
+    sr_arpcache_lru_unlink(cache, i);
+    e->valid = 0;
+    sr_timer_cancel(&(cache->wheel), &(e->timer));
+    e->lru_next = cache->free;
+    cache->free = i;
+    cache->count--;
+    __atomic_add_fetch(&cache->gen, 1, __ATOMIC_RELEASE);
+}
+
+/* An entry's timer: time the entry out, or ask a neighbor still in use
+   to confirm its MAC before it does.  Runs once a second from
+   SR_ARPCACHE_REFRESH seconds before expiry. */
+static void sr_arpcache_entry_timer(struct sr_timer *timer, void *arg) {
+    struct sr_instance *sr = (struct sr_instance *)arg;
+    struct sr_arpcache *cache = &(sr->cache);
+    struct sr_arpentry *e = (struct sr_arpentry *)((char *)timer - offsetof(struct sr_arpentry, timer));
+    time_t curtime = time(NULL);
+    double age = difftime(curtime, e->added);
+
+    if (age > SR_ARPCACHE_TO) {
+        sr_arpcache_write_begin(cache);
+        sr_arpcache_remove(cache, e - cache->table->entries);
+        sr_arpcache_write_end(cache);
+        return;
+    }
+    if (age >= SR_ARPCACHE_TO - SR_ARPCACHE_REFRESH &&
+        difftime(curtime, __atomic_load_n(&e->last_used, __ATOMIC_RELAXED)) <= SR_ARPCACHE_REFRESH) {
+        send_arp_refresh(sr, e);
+    }
+    sr_timer_arm(&(cache->wheel), timer, SR_TIMER_SEC(1));
+}
+
+/* Advances cache->now, which readers stamp entries with. */
+static void sr_arpcache_clock(struct sr_timer *timer, void *arg) {
+    struct sr_arpcache *cache = &(((struct sr_instance *)arg)->cache);
+
+    __atomic_store_n(&cache->now, time(NULL), __ATOMIC_RELAXED);
+    sr_timer_arm(&(cache->wheel), timer, SR_TIMER_SEC(1));
+}
+
+/* Replace the table with one of up to cap entries, at most max.  The index
+   is a power of two at least twice as big. */
+static int sr_arpcache_grow(struct sr_arpcache *cache, uint32_t cap) {
+    struct sr_arptable *old = cache->table;
+    struct sr_arptable *t;
+    uint32_t oldcap = old ? old->cap : 0;
+    uint32_t nslots = 16, i;
+
+    if (cap > cache->max)
+        cap = cache->max;
+    if (cap <= oldcap)
+        return -1;
+    while (nslots < 2 * cap)
+        nslots *= 2;
+
+    t = (struct sr_arptable *)calloc(1, sizeof(struct sr_arptable));
+    if (!t)
+        return -1;
+    t->entries = (struct sr_arpentry *)calloc(cap, sizeof(struct sr_arpentry));
+    t->slots = (uint32_t *)malloc(nslots * sizeof(uint32_t));
+    if (!t->entries || !t->slots) {
+        free(t->entries);
+        free(t->slots);
+        free(t);
+        return -1;
+    }
+    t->cap = cap;
+    t->mask = nslots - 1;
+    t->retired = old;
+    memset(t->slots, 0xff, nslots * sizeof(uint32_t));
+
+    if (old)
+        memcpy(t->entries, old->entries, oldcap * sizeof(struct sr_arpentry));
+    for (i = 0; i < oldcap; i++) {
+        if (t->entries[i].valid) {
+            sr_arpcache_index(t, i);
+            sr_timer_move(&(old->entries[i].timer), &(t->entries[i].timer));
+        }
+    }
+
+    /* New entries go on the free list, lowest first */
+    for (i = cap; i-- > oldcap; ) {
+        t->entries[i].lru_next = cache->free;
+        cache->free = i;
+    }
+
+    __atomic_store_n(&cache->table, t, __ATOMIC_RELEASE);
+    /* Pointers from sr_arpcache_entry are into the old table */
+    __atomic_add_fetch(&cache->gen, 1, __ATOMIC_RELEASE);
+    return 0;
+}
+
+/* An unused entry: a free one, one from growing the cache, or the least
+   recently used one.  Entries looked up since they were placed get a
+   second chance at the head of the list. */
+static uint32_t sr_arpcache_alloc(struct sr_arpcache *cache) {
+    struct sr_arpentry *e;
+    uint32_t i, n;
+
+    if (cache->free == SR_ARPCACHE_NONE &&
+        sr_arpcache_grow(cache, 2 * cache->table->cap) != 0 &&
+        cache->lru_tail != SR_ARPCACHE_NONE) {
+        for (n = 0; n < cache->count; n++) {
+            i = cache->lru_tail;
+            e = &(cache->table->entries[i]);
+            if ((int32_t)(__atomic_load_n(&e->used, __ATOMIC_RELAXED) - e->placed) <= 0)
+                break;
+            sr_arpcache_lru_unlink(cache, i);
+            sr_arpcache_lru_push(cache, i);
+        }
+        sr_arpcache_remove(cache, cache->lru_tail);
+        cache->evicted++;
+    }
+
+    i = cache->free;
+    if (i != SR_ARPCACHE_NONE)
+        cache->free = cache->table->entries[i].lru_next;
+    return i;
+}
+
+/* Prebuilds the Ethernet header of frames to the neighbor, from its MAC
+   and that of the interface it was learned on.  The interfaces come from
+   the instance the cache was started for. */
+static void sr_arpcache_adj_build(struct sr_arpcache *cache, struct sr_arpentry *e) {
+    sr_ethernet_hdr_t *eth = (sr_ethernet_hdr_t *)e->eth;
+    struct sr_instance *sr = (struct sr_instance *)cache->wheel.arg;
+    struct sr_if *iface = sr ? sr_if_get(sr, e->iface) : NULL;
+
+    memcpy(eth->ether_dhost, e->mac, ETHER_ADDR_LEN);
+    if (iface)
+        memcpy(eth->ether_shost, iface->addr, ETHER_ADDR_LEN);
+    else
+        memset(eth->ether_shost, 0, ETHER_ADDR_LEN);
+    eth->ether_type = htons(ethertype_ip);
+}
+
 /* Checks if an IP->MAC mapping is in the cache. IP is in network byte order.
    You must free the returned structure if it is not NULL. */
-struct sr_arpentry *sr_arpcache_lookup(struct sr_arpcache *cache, uint32_t ip) {
+struct sr_arpentry *sr_arpcache_lookup(struct sr_arpcache *cache, uint32_t ip, int iface) {
     pthread_mutex_lock(&(cache->lock));
     
-    struct sr_arpentry *entry = NULL, *copy = NULL;
-    
-    int i;
-    for (i = 0; i < SR_ARPCACHE_SZ; i++) {
-        if ((cache->entries[i].valid) && (cache->entries[i].ip == ip)) {
-            entry = &(cache->entries[i]);
-        }
-    }
+    struct sr_arpentry *copy = NULL;
+    struct sr_arptable *t = cache->table;
+    uint32_t j = sr_arpcache_find(t, ip, iface);
     
     /* Must return a copy b/c another thread could jump in and modify
        table after we return. */
-    if (entry) {
+    if (j != SR_ARPCACHE_NONE) {
+        struct sr_arpentry *entry = &(t->entries[t->slots[j]]);
+        entry->used = cache->tick;
+        entry->last_used = cache->now;
         copy = (struct sr_arpentry *) malloc(sizeof(struct sr_arpentry));
         memcpy(copy, entry, sizeof(struct sr_arpentry));
     }
@@ -105,46 +420,293 @@ struct sr_arpentry *sr_arpcache_lookup(struct sr_arpcache *cache, uint32_t ip) {
     return copy;
 }
 
+/* Copies the MAC for IP on iface into mac and returns 1 if the mapping is
+   in the cache. Reads the table without the lock and retries if a writer changed
+   it meanwhile; a retired table is still valid memory, so a reader that
+   raced with growing only retries. */
+int sr_arpcache_lookup_mac(struct sr_arpcache *cache, uint32_t ip, int iface, unsigned char *mac) {
+    struct sr_arptable *t;
+    struct sr_arpentry *entry = NULL;
+    unsigned int seq;
+    uint32_t j, i, n;
+
+    do {
+        seq = __atomic_load_n(&cache->seq, __ATOMIC_ACQUIRE);
+        if (seq & 1)
+            continue;
+        t = __atomic_load_n(&cache->table, __ATOMIC_ACQUIRE);
+        entry = NULL;
+
+        /* Bounded: the probe run can shift under a writer */
+        j = sr_arpcache_key(ip, iface) & t->mask;
+        for (n = 0; n <= t->mask; n++, j = (j + 1) & t->mask) {
+            i = __atomic_load_n(&t->slots[j], __ATOMIC_RELAXED);
+            if (i == SR_ARPCACHE_NONE || i >= t->cap)
+                break;
+            if (t->entries[i].ip == ip && t->entries[i].iface == iface) {
+                entry = &(t->entries[i]);
+                memcpy(mac, entry->mac, ETHER_ADDR_LEN);
+                break;
+            }
+        }
+
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    } while ((seq & 1) || __atomic_load_n(&cache->seq, __ATOMIC_RELAXED) != seq);
+
+    if (!entry)
+        return 0;
+
+    sr_arpcache_used(cache, entry);
+    return 1;
+}
+
+/* Like sr_arpcache_lookup_mac, for the whole header of the adjacency
+   (iface, ip).  Routes do not hold on to entries, which move when the
+   table grows; the adjacency is one probe away instead. */
+int sr_arpcache_lookup_adj(struct sr_arpcache *cache, uint32_t ip, int iface, uint8_t *eth) {
+    struct sr_arptable *t;
+    struct sr_arpentry *entry = NULL;
+    unsigned int seq;
+    uint32_t j, i, n;
+
+    do {
+        seq = __atomic_load_n(&cache->seq, __ATOMIC_ACQUIRE);
+        if (seq & 1)
+            continue;
+        t = __atomic_load_n(&cache->table, __ATOMIC_ACQUIRE);
+        entry = NULL;
+
+        j = sr_arpcache_key(ip, iface) & t->mask;
+        for (n = 0; n <= t->mask; n++, j = (j + 1) & t->mask) {
+            i = __atomic_load_n(&t->slots[j], __ATOMIC_RELAXED);
+            if (i == SR_ARPCACHE_NONE || i >= t->cap)
+                break;
+            if (t->entries[i].ip == ip && t->entries[i].iface == iface) {
+                entry = &(t->entries[i]);
+                memcpy(eth, entry->eth, sizeof(entry->eth));
+                break;
+            }
+        }
+
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    } while ((seq & 1) || __atomic_load_n(&cache->seq, __ATOMIC_RELAXED) != seq);
+
+    if (!entry)
+        return 0;
+
+    sr_arpcache_used(cache, entry);
+    return 1;
+}
+
+/* Returns the entry for IP on iface, or NULL. The pointer stays valid, and
+   the entry stays the one for IP, until cache->gen changes. */
+struct sr_arpentry *sr_arpcache_entry(struct sr_arpcache *cache, uint32_t ip, int iface) {
+    pthread_mutex_lock(&(cache->lock));
+    
+    struct sr_arptable *t = cache->table;
+    uint32_t j = sr_arpcache_find(t, ip, iface);
+    struct sr_arpentry *entry = (j != SR_ARPCACHE_NONE) ? &(t->entries[t->slots[j]]) : NULL;
+    
+    pthread_mutex_unlock(&(cache->lock));
+    
+    return entry;
+}
+
+/* Marks entry as used for LRU and refresh, without dirtying its line when
+   it already is. */
+void sr_arpcache_used(struct sr_arpcache *cache, struct sr_arpentry *entry) {
+    uint32_t tick = __atomic_load_n(&cache->tick, __ATOMIC_RELAXED);
+    time_t now = __atomic_load_n(&cache->now, __ATOMIC_RELAXED);
+
+    if (__atomic_load_n(&entry->used, __ATOMIC_RELAXED) != tick)
+        __atomic_store_n(&entry->used, tick, __ATOMIC_RELAXED);
+    if (__atomic_load_n(&entry->last_used, __ATOMIC_RELAXED) != now)
+        __atomic_store_n(&entry->last_used, now, __ATOMIC_RELAXED);
+}
+
 /* Adds an ARP request to the ARP request queue. If the request is already on
    the queue, adds the packet to the linked list of packets for this sr_arpreq
    that corresponds to this ARP request. You should free the passed *packet.
    
    A pointer to the ARP request is returned; it should not be freed. The caller
    can remove the ARP request from the queue by calling sr_arpreq_destroy. */
+/* A pool buffer: the queue entry and the frame in one block. */
+struct sr_pktbuf {
+    struct sr_packet pkt;       /* pkt.buf points at data */
+    unsigned int refs;          /* Holders: the receive path, a request */
+    struct sr_pktbuf *next_free;
+    uint8_t data[SR_PKTBUF_SZ];
+};
+
+/* The pool buffer buf is the frame of, or NULL if it is not from the pool */
+static struct sr_pktbuf *sr_pktbuf_of(struct sr_arpcache *cache, uint8_t *buf) {
+    if (!cache->pool || buf < cache->pool->data ||
+        buf >= (uint8_t *)(cache->pool + SR_ARPCACHE_POOL))
+        return NULL;
+    return (struct sr_pktbuf *)(buf - offsetof(struct sr_pktbuf, data));
+}
+
+/* Takes a buffer from the pool with one reference, or returns NULL.
+   Call with pool_lock held. */
+static struct sr_pktbuf *sr_pktbuf_alloc(struct sr_arpcache *cache) {
+    struct sr_pktbuf *b = cache->pool_free;
+    if (b) {
+        cache->pool_free = b->next_free;
+        cache->pool_avail--;
+        b->refs = 1;
+    }
+    return b;
+}
+
+/* Drops a reference, the last one returns the buffer to the pool.
+   Call with pool_lock held. */
+static void sr_pktbuf_release(struct sr_arpcache *cache, struct sr_pktbuf *b) {
+    if (--b->refs == 0) {
+        b->next_free = cache->pool_free;
+        cache->pool_free = b;
+        cache->pool_avail++;
+    }
+}
+
+/* Takes a packet's worth of tokens from b, which gains rate packets' worth
+   a second up to burst.  Tokens are counted in ticks, SR_TIMER_HZ to a
+   packet, so the refill is exact at the tick's resolution. */
+static int sr_arpbucket_take(struct sr_arpbucket *b, uint32_t now,
+                             uint32_t rate, uint32_t burst) {
+    uint32_t cap = burst * SR_TIMER_HZ;
+    uint32_t elapsed = now - b->stamp;
+
+    if (elapsed > cap)
+        elapsed = cap;
+    b->tokens += elapsed * rate;
+    if (b->tokens > cap)
+        b->tokens = cap;
+    b->stamp = now;
+
+    if (b->tokens < SR_TIMER_HZ)
+        return 0;
+    b->tokens -= SR_TIMER_HZ;
+    return 1;
+}
+
+int sr_arpcache_admit(struct sr_arpcache *cache, const unsigned char *mac, uint32_t ip) {
+    uint32_t now = sr_timer_now();
+    uint32_t key = ip ^ ((uint32_t)mac[2] << 24 | (uint32_t)mac[3] << 16 |
+                         (uint32_t)mac[4] << 8 | mac[5]);
+    struct sr_arpbucket *b = &(cache->buckets[sr_arpcache_hash(key) & (SR_ARPGUARD_SZ - 1)]);
+
+    /* A sender not seen lately starts with a full bucket */
+    if (b->ip != ip || memcmp(b->mac, mac, 6) != 0) {
+        b->ip = ip;
+        memcpy(b->mac, mac, 6);
+        b->tokens = SR_ARPGUARD_BURST * SR_TIMER_HZ;
+        b->stamp = now;
+    }
+
+    if (!sr_arpbucket_take(b, now, SR_ARPGUARD_RATE, SR_ARPGUARD_BURST)) {
+        cache->ignored[sr_arpignore_source]++;
+        return 0;
+    }
+    if (!sr_arpbucket_take(&(cache->total), now, SR_ARPGUARD_TOTAL_RATE,
+                           SR_ARPGUARD_TOTAL_BURST)) {
+        cache->ignored[sr_arpignore_total]++;
+        return 0;
+    }
+    return 1;
+}
+
+uint8_t *sr_arpcache_buf_get(struct sr_arpcache *cache, unsigned int len) {
+    struct sr_pktbuf *b = NULL;
+    if (len <= SR_PKTBUF_SZ) {
+        pthread_mutex_lock(&(cache->pool_lock));
+        b = sr_pktbuf_alloc(cache);
+        pthread_mutex_unlock(&(cache->pool_lock));
+    }
+    return b ? b->data : (uint8_t *)malloc(len);
+}
+
+void sr_arpcache_buf_put(struct sr_arpcache *cache, uint8_t *buf) {
+    struct sr_pktbuf *b = sr_pktbuf_of(cache, buf);
+    if (!b) {
+        free(buf);
+        return;
+    }
+    pthread_mutex_lock(&(cache->pool_lock));
+    sr_pktbuf_release(cache, b);
+    pthread_mutex_unlock(&(cache->pool_lock));
+}
+
+/* The queue entry for packet: its own pool buffer, referenced once more,
+   or a copy in a new one.  NULL if the pool is empty or the frame too long. */
+static struct sr_packet *sr_arpcache_hold(struct sr_arpcache *cache,
+                                          uint8_t *packet, unsigned int len) {
+    struct sr_pktbuf *b = sr_pktbuf_of(cache, packet);
+    
+    pthread_mutex_lock(&(cache->pool_lock));
+    if (b) {
+        b->refs++;
+    } else if (len <= SR_PKTBUF_SZ && (b = sr_pktbuf_alloc(cache))) {
+        memcpy(b->data, packet, len);
+    }
+    pthread_mutex_unlock(&(cache->pool_lock));
+    
+    if (!b)
+        return NULL;
+    b->pkt.buf = b->data;
+    return &(b->pkt);
+}
+
 struct sr_arpreq *sr_arpcache_queuereq(struct sr_arpcache *cache,
                                        uint32_t ip,
                                        uint8_t *packet,           /* borrowed */
                                        unsigned int packet_len,
-                                       char *iface)
+                                       int iface)
 {
     pthread_mutex_lock(&(cache->lock));
     
     struct sr_arpreq *req;
     for (req = cache->requests; req != NULL; req = req->next) {
-        if (req->ip == ip) {
+        if (req->ip == ip && req->iface == iface) {
             break;
         }
     }
     
-    /* If the IP wasn't found, add it */
-    if (!req) {
+    struct sr_packet *new_pkt = NULL;
+    if (packet && packet_len) {
+        if (!req && sr_arpcache_held_down(cache, ip, iface)) {
+            cache->drops[sr_arpdrop_held_down]++;
+        } else if (req && req->npackets >= cache->max_queue) {
+            cache->drops[sr_arpdrop_queue_full]++;
+        } else if (!(new_pkt = sr_arpcache_hold(cache, packet, packet_len))) {
+            cache->drops[sr_arpdrop_no_buffer]++;
+        }
+    }
+    
+    /* If the IP wasn't found, add it, but only with a packet to send on */
+    if (!req && new_pkt) {
         req = (struct sr_arpreq *) calloc(1, sizeof(struct sr_arpreq));
         req->ip = ip;
+        req->iface = iface;
         req->next = cache->requests;
         cache->requests = req;
+        /* First ARP request on the next tick */
+        sr_timer_init(&(req->timer), sr_arpcache_req_timer);
+        sr_timer_arm(&(cache->wheel), &(req->timer), 0);
     }
     
-    /* Add the packet to the list of packets for this request */
-    if (packet && packet_len && iface) {
-        struct sr_packet *new_pkt = (struct sr_packet *)malloc(sizeof(struct sr_packet));
-        
-        new_pkt->buf = (uint8_t *)malloc(packet_len);
-        memcpy(new_pkt->buf, packet, packet_len);
+    /* Add the packet to the end of the list of packets for this request */
+    if (new_pkt) {
+        if (req->npackets)
+            cache->coalesced++;
         new_pkt->len = packet_len;
-        new_pkt->iface = (char *)malloc(sr_IFACE_NAMELEN);
-        strncpy(new_pkt->iface, iface, sr_IFACE_NAMELEN);
-        new_pkt->next = req->packets;
-        req->packets = new_pkt;
+        new_pkt->iface = iface;
+        new_pkt->next = NULL;
+        if (req->last)
+            req->last->next = new_pkt;
+        else
+            req->packets = new_pkt;
+        req->last = new_pkt;
+        req->npackets++;
     }
     
     pthread_mutex_unlock(&(cache->lock));
@@ -153,18 +715,19 @@ struct sr_arpreq *sr_arpcache_queuereq(struct sr_arpcache *cache,
 }
 
 /* This method performs two functions:
-   1) Looks up this IP in the request queue. If it is found, returns a pointer
-      to the sr_arpreq with this IP. Otherwise, returns NULL.
+   1) Looks up this IP on iface in the request queue. If it is found, returns
+      a pointer to the sr_arpreq with this IP. Otherwise, returns NULL.
    2) Inserts this IP to MAC mapping in the cache, and marks it valid. */
 struct sr_arpreq *sr_arpcache_insert(struct sr_arpcache *cache,
                                      unsigned char *mac,
-                                     uint32_t ip)
+                                     uint32_t ip,
+                                     int iface)
 {
     pthread_mutex_lock(&(cache->lock));
     
     struct sr_arpreq *req, *prev = NULL, *next = NULL; 
     for (req = cache->requests; req != NULL; req = req->next) {
-        if (req->ip == ip) {            
+        if (req->ip == ip && req->iface == iface) {
             if (prev) {
                 next = req->next;
                 prev->next = next;
@@ -173,25 +736,59 @@ struct sr_arpreq *sr_arpcache_insert(struct sr_arpcache *cache,
                 next = req->next;
                 cache->requests = next;
             }
+            /* The caller sends the packets and destroys the request */
+            sr_timer_cancel(&(cache->wheel), &(req->timer));
             
             break;
         }
         prev = req;
     }
     
-    int i;
-    for (i = 0; i < SR_ARPCACHE_SZ; i++) {
-        if (!(cache->entries[i].valid))
-            break;
+    /* It answered after all */
+    struct sr_arphold *h = sr_arpcache_hold_slot(cache, ip, iface);
+    if (h->ip == ip && h->iface == iface)
+        h->until = 0;
+    
+    sr_arpcache_write_begin(cache);
+    
+    struct sr_arptable *t = cache->table;
+    uint32_t j = sr_arpcache_find(t, ip, iface);
+    uint32_t i;
+    
+    /* Refresh an entry we already have, or take a new one */
+    if (j != SR_ARPCACHE_NONE) {
+        i = t->slots[j];
+        sr_arpcache_lru_unlink(cache, i);
+    } else {
+        i = sr_arpcache_alloc(cache);
+        t = cache->table;
     }
     
-    if (i != SR_ARPCACHE_SZ) {
-        memcpy(cache->entries[i].mac, mac, 6);
-        cache->entries[i].ip = ip;
-        cache->entries[i].added = time(NULL);
-        cache->entries[i].valid = 1;
+    if (i != SR_ARPCACHE_NONE) {
+        /* A refresh that confirms the MAC leaves learned flows alone */
+        int changed = j == SR_ARPCACHE_NONE ||
+                      memcmp(t->entries[i].mac, mac, 6) != 0;
+        memcpy(t->entries[i].mac, mac, 6);
+        t->entries[i].iface = iface;
+        sr_arpcache_adj_build(cache, &(t->entries[i]));
+        t->entries[i].added = time(NULL);
+        t->entries[i].last_used = t->entries[i].added;
+        if (j == SR_ARPCACHE_NONE) {
+            t->entries[i].ip = ip;
+            t->entries[i].valid = 1;
+            sr_arpcache_index(t, i);
+            sr_timer_init(&(t->entries[i].timer), sr_arpcache_entry_timer);
+            cache->count++;
+        }
+        sr_timer_arm(&(cache->wheel), &(t->entries[i].timer),
+                     SR_TIMER_SEC(SR_ARPCACHE_TO - SR_ARPCACHE_REFRESH));
+        sr_arpcache_lru_push(cache, i);
+        if (changed)
+            __atomic_add_fetch(&cache->gen, 1, __ATOMIC_RELEASE);
     }
     
+    sr_arpcache_write_end(cache);
+    
     pthread_mutex_unlock(&(cache->lock));
     
     return req;
@@ -199,39 +796,38 @@ struct sr_arpreq *sr_arpcache_insert(struct sr_arpcache *cache,
 
 /* Frees all memory associated with this arp request entry. If this arp request
    entry is on the arp request queue, it is removed from the queue. */
+/* Takes req off the request queue, if it is on it. */
+static void sr_arpcache_unlink_req(struct sr_arpcache *cache, struct sr_arpreq *req) {
+    struct sr_arpreq **p;
+    for (p = &(cache->requests); *p; p = &((*p)->next)) {
+        if (*p == req) {
+            *p = req->next;
+            break;
+        }
+    }
+}
+
+/* Frees a request that is off the queue, giving its buffers back. */
+static void sr_arpreq_free(struct sr_arpcache *cache, struct sr_arpreq *req) {
+    struct sr_packet *pkt, *nxt;
+    
+    pthread_mutex_lock(&(cache->pool_lock));
+    for (pkt = req->packets; pkt; pkt = nxt) {
+        nxt = pkt->next;
+        sr_pktbuf_release(cache, (struct sr_pktbuf *)pkt);
+    }
+    pthread_mutex_unlock(&(cache->pool_lock));
+    
+    free(req);
+}
+
 void sr_arpreq_destroy(struct sr_arpcache *cache, struct sr_arpreq *entry) {
     pthread_mutex_lock(&(cache->lock));
     
     if (entry) {
-        struct sr_arpreq *req, *prev = NULL, *next = NULL; 
-        for (req = cache->requests; req != NULL; req = req->next) {
-            if (req == entry) {                
-                if (prev) {
-                    next = req->next;
-                    prev->next = next;
-                } 
-                else {
-                    next = req->next;
-                    cache->requests = next;
-                }
-                
-                break;
-            }
-            prev = req;
-        }
-        
-        struct sr_packet *pkt, *nxt;
-        
-        for (pkt = entry->packets; pkt; pkt = nxt) {
-            nxt = pkt->next;
-            if (pkt->buf)
-                free(pkt->buf);
-            if (pkt->iface)
-                free(pkt->iface);
-            free(pkt);
-        }
-        
-        free(entry);
+        sr_arpcache_unlink_req(cache, entry);
+        sr_timer_cancel(&(cache->wheel), &(entry->timer));
+        sr_arpreq_free(cache, entry);
     }
     
     pthread_mutex_unlock(&(cache->lock));
@@ -242,62 +838,112 @@ void sr_arpcache_dump(struct sr_arpcache *cache) {
     fprintf(stderr, "\nMAC            IP         ADDED                      VALID\n");
     fprintf(stderr, "-----------------------------------------------------------\n");
     
-    int i;
-    for (i = 0; i < SR_ARPCACHE_SZ; i++) {
-        struct sr_arpentry *cur = &(cache->entries[i]);
+    pthread_mutex_lock(&(cache->lock));
+    
+    uint32_t i;
+    for (i = 0; i < cache->table->cap; i++) {
+        struct sr_arpentry *cur = &(cache->table->entries[i]);
+        if (!cur->valid)
+            continue;
         unsigned char *mac = cur->mac;
         fprintf(stderr, "%.1x%.1x%.1x%.1x%.1x%.1x   %.8x   %.24s   %d\n", mac[0], mac[1], mac[2], mac[3], mac[4], mac[5], ntohl(cur->ip), ctime(&(cur->added)), cur->valid);
     }
     
-    fprintf(stderr, "\n");
+    fprintf(stderr, "%u of %u entries, %lu evicted, %lu refreshed\n",
+            cache->count, cache->table->cap, cache->evicted, cache->refreshed);
+    fprintf(stderr, "%u of %u buffers free, %lu packets joined a request, "
+            "queued packets dropped: %lu queue full, %lu no buffer, "
+            "%lu unresolved, %lu held down\n",
+            cache->pool_avail, SR_ARPCACHE_POOL, cache->coalesced,
+            cache->drops[sr_arpdrop_queue_full],
+            cache->drops[sr_arpdrop_no_buffer],
+            cache->drops[sr_arpdrop_unresolved],
+            cache->drops[sr_arpdrop_held_down]);
+    fprintf(stderr, "ARP ignored: %lu sender over rate, %lu all over rate, "
+            "%lu not for us\n\n",
+            cache->ignored[sr_arpignore_source],
+            cache->ignored[sr_arpignore_total],
+            cache->ignored[sr_arpignore_not_for_us]);
+    
+    pthread_mutex_unlock(&(cache->lock));
 }
 
 /* Initialize table + table lock. Returns 0 on success. */
-int sr_arpcache_init(struct sr_arpcache *cache) {  
-    /* Seed RNG to kick out a random entry if all entries full. */
-    srand(time(NULL));
-    
-    /* Invalidate all entries */
-    memset(cache->entries, 0, sizeof(cache->entries));
+int sr_arpcache_init(struct sr_arpcache *cache, uint32_t max_entries,
+                     uint32_t max_queue) {  
+    /* Start small, entries are added as neighbors show up */
+    memset(cache, 0, sizeof(struct sr_arpcache));
+    cache->max = max_entries ? max_entries : SR_ARPCACHE_MAX;
+    cache->max_queue = max_queue ? max_queue : SR_ARPCACHE_QUEUE;
+    cache->free = SR_ARPCACHE_NONE;
+    cache->lru_head = SR_ARPCACHE_NONE;
+    cache->lru_tail = SR_ARPCACHE_NONE;
     cache->requests = NULL;
+    cache->gen = 0;
+    cache->now = time(NULL);
+    if (sr_arpcache_grow(cache, SR_ARPCACHE_SZ) != 0)
+        return -1;
+    
+    /* All buffers for waiting packets up front, none on the forwarding path */
+    cache->pool = (struct sr_pktbuf *)malloc(SR_ARPCACHE_POOL * sizeof(struct sr_pktbuf));
+    if (!cache->pool)
+        return -1;
+    uint32_t i;
+    for (i = SR_ARPCACHE_POOL; i-- > 0; ) {
+        cache->pool[i].next_free = cache->pool_free;
+        cache->pool_free = &(cache->pool[i]);
+    }
+    cache->pool_avail = SR_ARPCACHE_POOL;
+    pthread_mutex_init(&(cache->pool_lock), NULL);
+    
+    cache->buckets = (struct sr_arpbucket *)calloc(SR_ARPGUARD_SZ, sizeof(struct sr_arpbucket));
+    if (!cache->buckets)
+        return -1;
+    cache->total.tokens = SR_ARPGUARD_TOTAL_BURST * SR_TIMER_HZ;
+    cache->total.stamp = sr_timer_now();
     
     /* Acquire mutex lock */
     pthread_mutexattr_init(&(cache->attr));
     pthread_mutexattr_settype(&(cache->attr), PTHREAD_MUTEX_RECURSIVE);
     int success = pthread_mutex_init(&(cache->lock), &(cache->attr));
     
+    /* Timers fire under the cache lock */
+    sr_wheel_init(&(cache->wheel), &(cache->lock), NULL);
+    cache->wheel.flush = sr_arpcache_flush;
+    sr_timer_init(&(cache->clock), sr_arpcache_clock);
+    
     return success;
 }
 
 /* Destroys table + table lock. Returns 0 on success. */
 int sr_arpcache_destroy(struct sr_arpcache *cache) {
+    sr_wheel_stop(&(cache->wheel));
+    struct sr_arptable *t, *next;
+    for (t = cache->table; t; t = next) {
+        next = t->retired;
+        free(t->entries);
+        free(t->slots);
+        free(t);
+    }
+    cache->table = NULL;
+    free(cache->probes);
+    cache->probes = NULL;
+    free(cache->pool);
+    cache->pool = NULL;
+    free(cache->buckets);
+    cache->buckets = NULL;
+    pthread_mutex_destroy(&(cache->pool_lock));
     return pthread_mutex_destroy(&(cache->lock)) && pthread_mutexattr_destroy(&(cache->attr));
 }
 
-/* Thread which sweeps through the cache and invalidates entries that were added
-   more than SR_ARPCACHE_TO seconds ago. */
-void *sr_arpcache_timeout(void *sr_ptr) {
-    struct sr_instance *sr = sr_ptr;
+/* Has the timer thread run the cache's timers, which get sr. */
+void sr_arpcache_start(struct sr_instance *sr) {
     struct sr_arpcache *cache = &(sr->cache);
     
-    while (1) {
-        sleep(1.0);
-        
-        pthread_mutex_lock(&(cache->lock));
-    
-        time_t curtime = time(NULL);
-        
-        int i;    
-        for (i = 0; i < SR_ARPCACHE_SZ; i++) {
-            if ((cache->entries[i].valid) && (difftime(curtime,cache->entries[i].added) > SR_ARPCACHE_TO)) {
-                cache->entries[i].valid = 0;
-            }
-        }
-        
-        sr_arpcache_sweepreqs(sr);
-
-        pthread_mutex_unlock(&(cache->lock));
-    }
+    pthread_mutex_lock(&(cache->lock));
+    cache->wheel.arg = sr;
+    sr_timer_arm(&(cache->wheel), &(cache->clock), SR_TIMER_SEC(1));
+    pthread_mutex_unlock(&(cache->lock));
     
-    return NULL;
+    sr_wheel_start(&(cache->wheel));
 }
@@ -50,17 +50,21 @@
 
    To meet the guidelines in the assignment (ARP requests are sent every second
    until we send 5 ARP requests, then we send ICMP host unreachable back to
-   all packets waiting on this ARP request), you must fill out the following
-   function that is called every second and is defined in sr_arpcache.c:
+   all packets waiting on this ARP request), every request has a timer
+   (sr_timer.h) that calls handle_arpreq when the next request is due:
 
-   void sr_arpcache_sweepreqs(struct sr_instance *sr) {
-       for each request on sr->cache.requests:
-           handle_arpreq(request)
+   void handle_arpreq(struct sr_instance *sr, struct sr_arpreq *req) {
+       if req->times_sent >= 5:
+           take req off the queue for icmp host unreachables
+       else:
+           queue an arp request, rearm the timer
    }
 
-   Since handle_arpreq as defined in the comments above could destroy your
-   current request, make sure to save the next pointer before calling
-   handle_arpreq when traversing through the ARP requests linked list.
+   Timers fire with the cache lock held, so the requests and unreachables
+   are only sent once the timer thread has dropped it.
+
+   Entries have a timer too, which times them out SR_ARPCACHE_TO seconds
+   after they were added and refreshes the ones in use before that.
  */
 
 #ifndef SR_ARPCACHE_H
@@ -70,66 +74,248 @@
 #include <time.h>
 #include <pthread.h>
 #include "sr_if.h"
+#include "sr_protocol.h"
+#include "sr_timer.h"
 
-#define SR_ARPCACHE_SZ    100  
+#define SR_ARPCACHE_SZ    100      /* entries the cache starts with */
+#define SR_ARPCACHE_MAX   65536    /* default limit on entries, see -a */
 #define SR_ARPCACHE_TO    15.0
+#define SR_ARPCACHE_REFRESH 3.0    /* seconds before expiry that entries used
+                                      as recently are refreshed */
+#define SR_ARPCACHE_NONE  ((uint32_t)-1)  /* no entry */
+#define SR_ARPCACHE_RETRY_MS 1000  /* between ARP requests for one IP */
+#define SR_ARPCACHE_QUEUE 32       /* default limit on packets waiting on one
+                                      request, see -q */
+#define SR_ARPCACHE_POOL  512      /* buffers for packets waiting on ARP */
+#define SR_PKTBUF_SZ      2048     /* longest frame a pool buffer holds */
+#define SR_ARPCACHE_HOLDDOWN 5     /* seconds no new request is made for an IP
+                                      that never answered */
+#define SR_ARPCACHE_HOLDS 256      /* IPs held down at once, power of two */
+#define SR_ARPGUARD_SZ    1024     /* per-source buckets, power of two */
+#define SR_ARPGUARD_RATE  10       /* inbound ARP packets a second per source */
+#define SR_ARPGUARD_BURST 20
+#define SR_ARPGUARD_TOTAL_RATE  2000 /* inbound ARP packets a second, all sources */
+#define SR_ARPGUARD_TOTAL_BURST 4000
+
+/* Why packets waiting on ARP were dropped, counted in cache->drops */
+enum sr_arpdrop {
+    sr_arpdrop_queue_full = 0,  /* The request already held max_queue packets */
+    sr_arpdrop_no_buffer,       /* The pool was empty, or the frame too long */
+    sr_arpdrop_unresolved,      /* The neighbor never answered */
+    sr_arpdrop_held_down,       /* The neighbor did not answer a moment ago */
+    SR_ARPDROP_REASONS
+};
+
+/* Why inbound ARP packets were ignored, counted in cache->ignored */
+enum sr_arpignore {
+    sr_arpignore_source = 0,    /* The sender was over its rate */
+    sr_arpignore_total,         /* All senders together were over theirs */
+    sr_arpignore_not_for_us,    /* A request for another host's IP */
+    SR_ARPIGNORE_REASONS
+};
 
 struct sr_packet {
     uint8_t *buf;               /* A raw Ethernet frame, presumably with the dest MAC empty */
     unsigned int len;           /* Length of raw Ethernet frame */
-    char *iface;                /* The outgoing interface */
+    int iface;                  /* The outgoing interface, sr_if_index(..) */
     struct sr_packet *next;
 };
 
+/* An ARP request due to be sent, see sr_arpcache.c */
+struct sr_arpprobe {
+    uint32_t ip;                /* Target */
+    int iface;                  /* Interface to send it out of */
+    unsigned char mac[6];       /* The neighbor's to refresh it, all ones
+                                   to resolve it */
+};
+
 struct sr_arpentry {
     unsigned char mac[6]; 
     uint32_t ip;                /* IP addr in network byte order */
     time_t added;         
     int valid;
+    int iface;                  /* Interface the neighbor answered on, with
+                                   ip the key: VRFs may reuse an address */
+    uint8_t eth[sizeof(sr_ethernet_hdr_t)]; /* Adjacency: the header of IP frames
+                                   to the neighbor out of iface */
+    time_t last_used;           /* cache->now when last looked up */
+    uint32_t used;              /* cache->tick when last looked up */
+    uint32_t placed;            /* cache->tick when put at the LRU list head */
+    uint32_t lru_prev;          /* Entry used more recently */
+    uint32_t lru_next;          /* Entry used less recently, or next free entry */
+    struct sr_timer timer;      /* Expiry and refresh */
+};
+
+/* A token bucket of one sender of ARP packets, see sr_arpcache_admit */
+struct sr_arpbucket {
+    uint32_t ip;
+    unsigned char mac[6];
+    uint32_t tokens;            /* SR_TIMER_HZ to a packet */
+    uint32_t stamp;             /* Tick tokens were last added at */
+};
+
+/* An IP that did not answer on iface, no requests are made for it until
+   until */
+struct sr_arphold {
+    uint32_t ip;
+    int iface;
+    uint32_t until;             /* Tick, 0 if the slot is free */
 };
 
 struct sr_arpreq {
     uint32_t ip;
+    int iface;                  /* Interface the request goes out of; packets
+                                   routed to ip out of another one wait on
+                                   their own request */
     time_t sent;                /* Last time this ARP request was sent. You 
                                    should update this. If the ARP request was 
                                    never sent, will be 0. */
     uint32_t times_sent;        /* Number of times this request was sent. You 
                                    should update this. */
-    struct sr_packet *packets;  /* List of pkts waiting on this req to finish */
+    struct sr_packet *packets;  /* List of pkts waiting on this req to finish,
+                                   oldest first */
+    struct sr_packet *last;     /* Newest packet, where new ones are added */
+    uint32_t npackets;          /* Never more than cache->max_queue */
+    struct sr_timer timer;      /* Next ARP request, or giving up */
     struct sr_arpreq *next;
 };
 
+/* The entries are indexed by IP and interface in an open-addressing hash
+   table, so the same address can be a neighbor on two interfaces (in two
+   VRFs) at once, and kept on a list from most to least recently used.
+   The cache grows up to max entries; once it is that big, inserting a
+   new entry evicts the least recently used one.
+
+   Lookups that only need the MAC (sr_arpcache_lookup_mac) take no lock:
+   writers hold the lock and make seq odd while they change the table, and
+   readers retry when seq changed under them.  Growing publishes a bigger
+   table; the replaced one is kept on retired, since readers may still be
+   in it, until the cache is destroyed.  Tables double, so the retired
+   ones together are smaller than the current one.
+
+   Packets waiting on a request live in buffers from a pool allocated with
+   the cache.  The router receives frames into pool buffers
+   (sr_arpcache_buf_get), so queueing one takes a reference to its buffer
+   instead of copying it; other frames are copied into a pool buffer once.
+   A request holds at most max_queue packets.  Past that, and when the pool
+   runs dry, new packets are dropped (tail drop): the ones already waiting
+   are sent first once the neighbor answers.
+
+   ARP from the network goes through sr_arpcache_admit first: a token
+   bucket per sender (MAC and IP) and one for all senders keep a flood of
+   ARP from taking the forwarding thread.  The buckets sit in a table
+   indexed by a hash of the sender, a new sender taking over the slot.
+   Going the other way, one request is made per IP and interface however
+   many packets wait on it (they are counted in coalesced), and an IP that
+   did not answer there is held down for SR_ARPCACHE_HOLDDOWN seconds: packets to it
+   are dropped instead of starting another round of requests. */
+struct sr_arptable {
+    struct sr_arpentry *entries; /* cap entries, valid ones are in use */
+    uint32_t cap;
+    uint32_t *slots;            /* (IP, iface) hash -> entry, SR_ARPCACHE_NONE if empty */
+    uint32_t mask;              /* Number of slots - 1 */
+    struct sr_arptable *retired; /* The table this one replaced */
+};
+
+struct sr_pktbuf;
+
 struct sr_arpcache {
-    struct sr_arpentry entries[SR_ARPCACHE_SZ];
+    struct sr_arptable *table;
+    unsigned int seq;           /* Odd while a writer changes the table */
+    uint32_t tick;              /* Advanced whenever an entry is placed */
+    time_t now;                 /* Updated every second, a clock for readers */
+    uint32_t max;               /* table->cap never grows beyond this */
+    uint32_t count;             /* Valid entries */
+    uint32_t lru_head;          /* Most recently used entry */
+    uint32_t lru_tail;          /* Least recently used entry, evicted first */
+    uint32_t free;              /* List of unused entries */
+    unsigned long evicted;      /* Entries evicted to make room */
+    unsigned long refreshed;    /* Unicast requests to keep entries in use */
     struct sr_arpreq *requests;
+    uint32_t max_queue;         /* Packets one request may hold */
+    struct sr_pktbuf *pool;     /* SR_ARPCACHE_POOL buffers */
+    struct sr_pktbuf *pool_free; /* Buffers nobody holds */
+    uint32_t pool_avail;        /* Buffers on pool_free */
+    pthread_mutex_t pool_lock;  /* Guards pool_free and buffer references */
+    unsigned long drops[SR_ARPDROP_REASONS]; /* Queued packets dropped, by reason */
+    unsigned long coalesced;    /* Packets queued on a request already made */
+    struct sr_arphold holds[SR_ARPCACHE_HOLDS]; /* IPs held down, by hash */
+    struct sr_arpbucket *buckets; /* SR_ARPGUARD_SZ, the forwarding thread's */
+    struct sr_arpbucket total;  /* Of all senders */
+    unsigned long ignored[SR_ARPIGNORE_REASONS]; /* Inbound ARP, by reason */
+    unsigned int gen;           /* bumped whenever an entry is added or dropped */
+    struct sr_wheel wheel;      /* Timers of entries and requests */
+    struct sr_timer clock;      /* Advances now */
+    struct sr_arpprobe *probes; /* Due ARP requests, sent after unlocking */
+    uint32_t nprobes;
+    uint32_t probes_cap;
+    struct sr_arpreq *failed;   /* Requests given up on, answered with host
+                                   unreachables after unlocking */
     pthread_mutex_t lock;
     pthread_mutexattr_t attr;
 };
 
 /* Checks if an IP->MAC mapping is in the cache. IP is in network byte order. 
    You must free the returned structure if it is not NULL. */
-struct sr_arpentry *sr_arpcache_lookup(struct sr_arpcache *cache, uint32_t ip);
+struct sr_arpentry *sr_arpcache_lookup(struct sr_arpcache *cache, uint32_t ip, int iface);
+
+/* Copies the MAC for IP, learned on iface, into mac and returns 1 if the
+   mapping is in the cache, returns 0 otherwise.  Takes no lock and
+   allocates nothing, for the forwarding path. */
+int sr_arpcache_lookup_mac(struct sr_arpcache *cache, uint32_t ip, int iface, unsigned char *mac);
+
+/* Copies the ready-made Ethernet header of IP frames to IP out of iface
+   into eth and returns 1 if the neighbor is in the cache for iface,
+   returns 0 otherwise.  Lock-free like sr_arpcache_lookup_mac;
+   the forwarding path's one lookup for a resolved next hop. */
+int sr_arpcache_lookup_adj(struct sr_arpcache *cache, uint32_t ip, int iface, uint8_t *eth);
+
+/* Returns the entry for IP on iface, or NULL, for callers that remember
+   decisions (sr_flowcache.h). The pointer stays valid, and the entry stays
+   the one for IP, until cache->gen changes. */
+struct sr_arpentry *sr_arpcache_entry(struct sr_arpcache *cache, uint32_t ip, int iface);
+
+/* Marks an entry as used, as a lookup would: it is then evicted late and
+   refreshed before it expires. */
+void sr_arpcache_used(struct sr_arpcache *cache, struct sr_arpentry *entry);
 
 /* Adds an ARP request to the ARP request queue. If the request is already on
    the queue, adds the packet to the linked list of packets for this sr_arpreq
    that corresponds to this ARP request. The packet argument should not be
-   freed by the caller.
+   freed by the caller.  A packet in a pool buffer is queued as it is and
+   must not be changed afterwards; others are copied.
 
    A pointer to the ARP request is returned; it should be freed. The caller
-   can remove the ARP request from the queue by calling sr_arpreq_destroy. */
+   can remove the ARP request from the queue by calling sr_arpreq_destroy.
+   Returns NULL when the packet was dropped and no request was waiting. */
 struct sr_arpreq *sr_arpcache_queuereq(struct sr_arpcache *cache,
                          uint32_t ip,
                          uint8_t *packet,               /* borrowed */
                          unsigned int packet_len,
-                         char *iface);
+                         int iface);
 
 /* This method performs two functions:
-   1) Looks up this IP in the request queue. If it is found, returns a pointer
-      to the sr_arpreq with this IP. Otherwise, returns NULL.
-   2) Inserts this IP to MAC mapping in the cache, and marks it valid. */
+   1) Looks up this IP in the request queue of iface. If it is found, returns
+      a pointer to the sr_arpreq with this IP. Otherwise, returns NULL.
+   2) Inserts this IP to MAC mapping, learned on interface iface, in the
+      cache, and marks it valid. */
 struct sr_arpreq *sr_arpcache_insert(struct sr_arpcache *cache,
                                      unsigned char *mac,
-                                     uint32_t ip);
+                                     uint32_t ip,
+                                     int iface);
+
+/* Returns 1 if an ARP packet from mac/ip should be processed, 0 if its
+   sender, or all senders together, are sending too fast.  Counts the
+   packets it turns down in cache->ignored.  Not locked: only the thread
+   that receives packets may call it. */
+int sr_arpcache_admit(struct sr_arpcache *cache, const unsigned char *mac, uint32_t ip);
+
+/* Returns a buffer for a frame of len bytes: one from the pool when there
+   is one and the frame fits, malloc'd memory otherwise.  Give it back with
+   sr_arpcache_buf_put; a pool buffer that was queued meanwhile stays with
+   its request until that is done with it. */
+uint8_t *sr_arpcache_buf_get(struct sr_arpcache *cache, unsigned int len);
+void sr_arpcache_buf_put(struct sr_arpcache *cache, uint8_t *buf);
 
 /* Frees all memory associated with this arp request entry. If this arp request
    entry is on the arp request queue, it is removed from the queue. */
@@ -140,11 +326,12 @@ void sr_arpcache_dump(struct sr_arpcache *cache);
 
 /* You shouldn't have to call these methods--they're already called in the
    starter code for you. The init call is a constructor, the destroy call is
-   a destructor, and a cleanup thread times out cache entries every 15
-   seconds. */
+   a destructor, and start has the timer thread run the cache's timers. The cache holds at most max_entries entries (0: SR_ARPCACHE_MAX),
+   a request at most max_queue packets (0: SR_ARPCACHE_QUEUE). */
 
-int   sr_arpcache_init(struct sr_arpcache *cache);
+int   sr_arpcache_init(struct sr_arpcache *cache, uint32_t max_entries,
+                       uint32_t max_queue);
 int   sr_arpcache_destroy(struct sr_arpcache *cache);
-void *sr_arpcache_timeout(void *cache_ptr);
+void  sr_arpcache_start(struct sr_instance *sr);
 
 #endif
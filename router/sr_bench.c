@@ -0,0 +1,653 @@
+/*-----------------------------------------------------------------------------
+ * file:  sr_bench.c
+ *
+ * Description:
+ *
+ * Built-in benchmarks, see sr_bench.h.
+ *
+ *---------------------------------------------------------------------------*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "sr_bench.h"
+#include "sr_router.h"
+#include "sr_rt.h"
+#include "sr_rcu.h"
+#include "sr_nat.h"
+
+#define SR_BENCH_SECONDS        2       /* per measurement */
+#define SR_BENCH_ADDRS          (1 << 20)
+#define SR_BENCH_CHURN_PREFIXES 500000
+#define SR_BENCH_CHURN_BATCH    1000    /* updates per sr_fib_update(..) */
+#define SR_BENCH_ARP_SECONDS    0.5     /* per lookup measurement */
+#define SR_BENCH_NAT_PER_IP     60000   /* mappings per external address */
+#define SR_BENCH_NAT_MAPPINGS   100000  /* shared by the natmt threads */
+#define SR_BENCH_NAT_THREADS    8       /* natmt runs 1, 2, 4 .. this many */
+
+struct sr_bench_prefix
+{
+    struct in_addr dest;
+    struct in_addr mask;
+};
+
+struct sr_bench_reader
+{
+    struct sr_instance* sr;
+    const uint32_t* addrs;      /* SR_BENCH_ADDRS, network byte order */
+    int stop;
+    unsigned long lookups;
+    uint32_t sink;
+};
+
+static uint32_t sr_bench_rand(uint32_t* state)
+{
+    uint32_t x = *state;
+
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    return *state = x;
+}
+
+static double sr_bench_now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* A prefix with a length mix resembling a full table: mostly /24s. */
+static void sr_bench_prefix(uint32_t* state, struct sr_bench_prefix* p)
+{
+    uint32_t r = sr_bench_rand(state) % 100;
+    uint32_t len;
+
+    if(r < 60)
+    { len = 24; }
+    else if(r < 75)
+    { len = 19 + r % 5; }
+    else if(r < 90)
+    { len = 8 + r % 11; }
+    else
+    { len = 25 + r % 8; }
+
+    p->mask.s_addr = htonl((uint32_t)(0xffffffffu << (32 - len)));
+    p->dest.s_addr = htonl(sr_bench_rand(state)) & p->mask.s_addr;
+}
+
+static void* sr_bench_lookups(void* reader_ptr)
+{
+    struct sr_bench_reader* r = (struct sr_bench_reader*)reader_ptr;
+    struct sr_rt* rt = 0;
+    unsigned long i = 0;
+    uint32_t sink = 0;
+
+    while(!__atomic_load_n(&r->stop, __ATOMIC_ACQUIRE))
+    {
+        sr_rcu_read_lock();
+        rt = sr_fib_lookup(sr_rcu_deref(&r->sr->fib),
+                           r->addrs[i & (SR_BENCH_ADDRS - 1)]);
+        if(rt)
+        { sink ^= rt->gw.s_addr; }
+        sr_rcu_read_unlock();
+        i++;
+    }
+
+    r->lookups = i;
+    r->sink = sink;
+    return 0;
+}
+
+static void sr_bench_start(struct sr_bench_reader* r, pthread_t* thread)
+{
+    r->stop = 0;
+    r->lookups = 0;
+    pthread_create(thread, 0, sr_bench_lookups, r);
+}
+
+static double sr_bench_stop(struct sr_bench_reader* r, pthread_t thread,
+                            double seconds)
+{
+    __atomic_store_n(&r->stop, 1, __ATOMIC_RELEASE);
+    pthread_join(thread, 0);
+    return r->lookups / seconds;
+}
+
+/*---------------------------------------------------------------------
+ * Method: sr_bench_churn(..)
+ * Scope: Local
+ *
+ * Build a table of SR_BENCH_CHURN_PREFIXES prefixes, measure lookups on
+ * it, then keep replacing random prefixes (a withdraw and an add each)
+ * in batches while the lookups go on.
+ *
+ *---------------------------------------------------------------------*/
+
+static int sr_bench_churn(struct sr_instance* sr)
+{
+    struct sr_bench_prefix* prefixes = 0;
+    struct sr_rt_update* batch = 0;
+    struct sr_bench_reader reader;
+    struct sr_fib* fib = 0;
+    struct in_addr gw;
+    pthread_t thread;
+    uint32_t* addrs = 0;
+    uint32_t state = 0x2545f491;
+    unsigned long updates = 0;
+    unsigned long rejected = 0;
+    double idle, busy, start, elapsed;
+    uint32_t i, k;
+    int ret;
+
+    prefixes = (struct sr_bench_prefix*)malloc(SR_BENCH_CHURN_PREFIXES *
+                                               sizeof(*prefixes));
+    batch = (struct sr_rt_update*)calloc(SR_BENCH_CHURN_BATCH, sizeof(*batch));
+    addrs = (uint32_t*)malloc(SR_BENCH_ADDRS * sizeof(uint32_t));
+    fib = sr_fib_create(sr->lpm_type);
+    if(prefixes == 0 || batch == 0 || addrs == 0 || fib == 0)
+    {
+        fprintf(stderr, "churn: out of memory\n");
+        return 1;
+    }
+
+    start = sr_bench_now();
+    for(i = 0; i < SR_BENCH_CHURN_PREFIXES; i++)
+    {
+        sr_bench_prefix(&state, &prefixes[i]);
+        gw.s_addr = htonl(0x0a000000 | (i & 0xffff));
+        if(sr_fib_add_entry(fib, prefixes[i].dest, gw, prefixes[i].mask,
+                            (i & 1) ? "eth1" : "eth2") != 0)
+        {
+            fprintf(stderr, "churn: cannot build the table\n");
+            return 1;
+        }
+    }
+    sr_fib_publish(&sr->fib, fib);
+    printf("churn: %s, %d prefixes built in %.1f ms, %lu bytes\n",
+           sr_lpm_type_name(sr->lpm_type), SR_BENCH_CHURN_PREFIXES,
+           (sr_bench_now() - start) * 1e3,
+           (unsigned long)sr_lpm_memory(fib->lpm));
+
+    /* -- half the lookups land in known prefixes, half anywhere -- */
+    for(i = 0; i < SR_BENCH_ADDRS; i++)
+    {
+        addrs[i] = htonl(sr_bench_rand(&state));
+        if((i & 1) == 0)
+        {
+            k = sr_bench_rand(&state) % SR_BENCH_CHURN_PREFIXES;
+            addrs[i] = prefixes[k].dest.s_addr |
+                       (addrs[i] & ~prefixes[k].mask.s_addr);
+        }
+    }
+
+    memset(&reader, 0, sizeof(reader));
+    reader.sr = sr;
+    reader.addrs = addrs;
+
+    /* -- lookups alone -- */
+    sr_bench_start(&reader, &thread);
+    start = sr_bench_now();
+    while(sr_bench_now() - start < SR_BENCH_SECONDS)
+    { usleep(10000); }
+    idle = sr_bench_stop(&reader, thread, sr_bench_now() - start);
+
+    /* -- lookups while one writer churns -- */
+    sr_bench_start(&reader, &thread);
+    start = sr_bench_now();
+    do
+    {
+        for(k = 0; k + 1 < SR_BENCH_CHURN_BATCH; k += 2)
+        {
+            i = sr_bench_rand(&state) % SR_BENCH_CHURN_PREFIXES;
+            batch[k].withdraw = 1;
+            batch[k].dest = prefixes[i].dest;
+            batch[k].mask = prefixes[i].mask;
+
+            sr_bench_prefix(&state, &prefixes[i]);
+            batch[k + 1].withdraw = 0;
+            batch[k + 1].dest = prefixes[i].dest;
+            batch[k + 1].mask = prefixes[i].mask;
+            batch[k + 1].npaths = 1;
+            batch[k + 1].gw[0].s_addr = htonl(0x0a010000 | (k & 0xffff));
+            strcpy(batch[k + 1].interface[0], (k & 2) ? "eth1" : "eth2");
+        }
+
+        ret = sr_fib_update(&sr->fib, batch, k);
+        if(ret < 0)
+        {
+            fprintf(stderr, "churn: update failed\n");
+            break;
+        }
+        rejected += ret;
+        updates += k;
+        elapsed = sr_bench_now() - start;
+    } while(elapsed < SR_BENCH_SECONDS);
+    busy = sr_bench_stop(&reader, thread, elapsed);
+
+    printf("churn: lookups, idle table     %10.0f /s\n", idle);
+    printf("churn: lookups, during churn   %10.0f /s\n", busy);
+    printf("churn: updates                 %10.0f /s  (%lu in batches of %d, "
+           "%lu rejected)\n", updates / elapsed, updates,
+           SR_BENCH_CHURN_BATCH, rejected);
+
+    free(prefixes);
+    free(batch);
+    free(addrs);
+    return 0;
+} /* -- sr_bench_churn -- */
+
+#define SR_BENCH_ARP_MAC    0   /* sr_arpcache_lookup_mac(..) */
+#define SR_BENCH_ARP_COPY   1   /* sr_arpcache_lookup(..), locked and malloced */
+#define SR_BENCH_ARP_SCAN   2   /* the entries one by one, like the old array */
+
+/* ns per lookup of random neighbors in cache, over SR_BENCH_ARP_SECONDS. */
+static double sr_bench_arp_lookups(struct sr_arpcache* cache,
+                                   const uint32_t* ips, uint32_t n, int how)
+{
+    const struct sr_arptable* t = cache->table;
+    struct sr_arpentry* e = 0;
+    unsigned char mac[ETHER_ADDR_LEN];
+    uint32_t state = 0x6d2b79f5;
+    unsigned long lookups = 0;
+    unsigned long found = 0;
+    double start = sr_bench_now();
+    double elapsed;
+    uint32_t ip, i, k;
+
+    do
+    {
+        for(k = 0; k < 1024; k++)
+        {
+            ip = ips[sr_bench_rand(&state) % n];
+            if(how == SR_BENCH_ARP_MAC)
+            { found += sr_arpcache_lookup_mac(cache, ip, SR_IF_NONE, mac); }
+            else if(how == SR_BENCH_ARP_COPY)
+            {
+                if((e = sr_arpcache_lookup(cache, ip, SR_IF_NONE)) != 0)
+                {
+                    found++;
+                    free(e);
+                }
+            }
+            else
+            {
+                for(i = 0; i < t->cap; i++)
+                {
+                    if(t->entries[i].valid && t->entries[i].ip == ip)
+                    {
+                        found++;
+                        break;
+                    }
+                }
+            }
+        }
+        lookups += k;
+        elapsed = sr_bench_now() - start;
+    } while(elapsed < SR_BENCH_ARP_SECONDS);
+
+    if(found != lookups)
+    { fprintf(stderr, "arp: %lu neighbors missing\n", lookups - found); }
+    return elapsed * 1e9 / lookups;
+}
+
+/*---------------------------------------------------------------------
+ * Method: sr_bench_arp(..)
+ * Scope: Local
+ *
+ * Cost of ARP cache lookups with 100, 10k and 100k neighbors: without a
+ * lock into a caller's buffer, locked into a malloced copy, and as a
+ * linear scan of the same entries.  Then the cost of inserting twice as
+ * many neighbors as the cache may hold.
+ *
+ *---------------------------------------------------------------------*/
+
+static int sr_bench_arp(struct sr_instance* sr)
+{
+    static const uint32_t sizes[] = { 100, 10000, 100000 };
+    struct sr_arpcache cache;
+    unsigned char mac[ETHER_ADDR_LEN];
+    uint32_t* ips = 0;
+    double mac_ns, copy_ns, scan_ns, start;
+    uint32_t n, i, k;
+
+    for(k = 0; k < sizeof(sizes) / sizeof(sizes[0]); k++)
+    {
+        n = sizes[k];
+        ips = (uint32_t*)malloc(2 * n * sizeof(uint32_t));
+        if(ips == 0 || sr_arpcache_init(&cache, n, 0) != 0)
+        {
+            fprintf(stderr, "arp: out of memory\n");
+            return 1;
+        }
+
+        /* -- distinct neighbors, all in the cache -- */
+        for(i = 0; i < 2 * n; i++)
+        {
+            ips[i] = htonl(0x0a000000 + i * 7919u % 0x1000000);
+            memcpy(mac, &ips[i], sizeof(ips[i]));
+            mac[4] = mac[5] = 0;
+            if(i < n)
+            { sr_arpcache_insert(&cache, mac, ips[i], SR_IF_NONE); }
+        }
+
+        mac_ns = sr_bench_arp_lookups(&cache, ips, n, SR_BENCH_ARP_MAC);
+        copy_ns = sr_bench_arp_lookups(&cache, ips, n, SR_BENCH_ARP_COPY);
+        scan_ns = sr_bench_arp_lookups(&cache, ips, n, SR_BENCH_ARP_SCAN);
+        printf("arp: %6u neighbors  lookup %6.1f ns  locked copy %6.1f ns  "
+               "linear scan %10.1f ns\n", n, mac_ns, copy_ns, scan_ns);
+
+        /* -- the second half replaces the first, least recently used -- */
+        start = sr_bench_now();
+        for(i = n; i < 2 * n; i++)
+        { sr_arpcache_insert(&cache, mac, ips[i], SR_IF_NONE); }
+        printf("arp: %6u more      insert %6.1f ns  %lu evicted, %u entries\n",
+               n, (sr_bench_now() - start) * 1e9 / n, cache.evicted,
+               cache.count);
+
+        sr_arpcache_destroy(&cache);
+        free(ips);
+    }
+    return 0;
+} /* -- sr_bench_arp -- */
+
+/* The keys of one NAT mapping, as a packet carries them */
+struct sr_bench_nat_key
+{
+    uint32_t ip_int;
+    uint16_t aux_int;
+    uint16_t aux_ext;
+    uint32_t ip_ext;
+};
+
+/* ns per lookup of random mappings in nat, by their internal or their
+   external key, copied or borrowed, over SR_BENCH_ARP_SECONDS. */
+static double sr_bench_nat_lookups(struct sr_nat* nat,
+                                   const struct sr_bench_nat_key* keys,
+                                   uint32_t n, int external, int borrow)
+{
+    const struct sr_bench_nat_key* key;
+    struct sr_nat_mapping* m;
+    uint32_t state = 0x6d2b79f5;
+    unsigned long lookups = 0;
+    unsigned long found = 0;
+    double start = sr_bench_now();
+    double elapsed;
+    uint32_t k;
+
+    do
+    {
+        /* -- one read-side section per batch, as one per packet would be -- */
+        sr_rcu_read_lock();
+        for(k = 0; k < 1024; k++)
+        {
+            key = &keys[sr_bench_rand(&state) % n];
+            if(borrow && external)
+            {
+                m = sr_nat_borrow_external(nat, key->ip_ext, key->aux_ext,
+                                           nat_mapping_icmp);
+            }
+            else if(borrow)
+            {
+                m = sr_nat_borrow_internal(nat, key->ip_int, key->aux_int,
+                                           nat_mapping_icmp);
+            }
+            else if(external)
+            {
+                m = sr_nat_lookup_external(nat, key->ip_ext, key->aux_ext,
+                                           nat_mapping_icmp);
+            }
+            else
+            {
+                m = sr_nat_lookup_internal(nat, key->ip_int, key->aux_int,
+                                           nat_mapping_icmp);
+            }
+            if(m)
+            {
+                found++;
+                if(!borrow)
+                { free(m); }
+            }
+        }
+        sr_rcu_read_unlock();
+        lookups += k;
+        elapsed = sr_bench_now() - start;
+    } while(elapsed < SR_BENCH_ARP_SECONDS);
+
+    if(found != lookups)
+    { fprintf(stderr, "nat: %lu mappings missing\n", lookups - found); }
+    return elapsed * 1e9 / lookups;
+}
+
+/*---------------------------------------------------------------------
+ * Method: sr_bench_nat(..)
+ * Scope: Local
+ *
+ * Cost of inserting 1k, 10k, 100k and 1M ICMP mappings, then of looking
+ * them up by internal key (packets going out) and by external key
+ * (packets coming in), as copies and borrowed.  An address has 64k
+ * identifiers, so the mappings are spread over one external address per
+ * SR_BENCH_NAT_PER_IP.
+ *
+ *---------------------------------------------------------------------*/
+
+static int sr_bench_nat(struct sr_instance* sr)
+{
+    static const uint32_t sizes[] = { 1000, 10000, 100000, 1000000 };
+    struct sr_bench_nat_key* keys = 0;
+    struct sr_nat_mapping* m;
+    struct sr_nat nat;
+    double insert_ns, int_ns, ext_ns, int_borrow_ns, ext_borrow_ns, start;
+    uint32_t n, i, k;
+
+    for(k = 0; k < sizeof(sizes) / sizeof(sizes[0]); k++)
+    {
+        n = sizes[k];
+        keys = (struct sr_bench_nat_key*)malloc(n * sizeof(*keys));
+        memset(&nat, 0, sizeof(nat));
+        if(keys == 0 || sr_nat_init(&nat) != 0)
+        {
+            fprintf(stderr, "nat: out of memory\n");
+            return 1;
+        }
+        nat.sr_instance = sr;
+        nat.icmpTimeout = 3600;
+        nat.tcpEstablishedTimeout = 7440;
+        nat.tcpTransitoryTimeout = 300;
+
+        /* -- 16 pings from each of n / 16 inside hosts -- */
+        start = sr_bench_now();
+        for(i = 0; i < n; i++)
+        {
+            if(i % SR_BENCH_NAT_PER_IP == 0)
+            { nat.ip_ext = htonl(0xac400300 + i / SR_BENCH_NAT_PER_IP + 1); }
+            keys[i].ip_int = htonl(0x0a000000 + (i >> 4));
+            keys[i].aux_int = htons(i & 15);
+            m = sr_nat_insert_mapping(&nat, keys[i].ip_int, keys[i].aux_int,
+                                      nat_mapping_icmp);
+            keys[i].ip_ext = m->ip_ext;
+            keys[i].aux_ext = htons(m->aux_ext);
+            free(m);
+        }
+        insert_ns = (sr_bench_now() - start) * 1e9 / n;
+
+        int_ns = sr_bench_nat_lookups(&nat, keys, n, 0, 0);
+        ext_ns = sr_bench_nat_lookups(&nat, keys, n, 1, 0);
+        int_borrow_ns = sr_bench_nat_lookups(&nat, keys, n, 0, 1);
+        ext_borrow_ns = sr_bench_nat_lookups(&nat, keys, n, 1, 1);
+        printf("nat: %7u mappings  insert %6.1f ns  lookup internal %6.1f ns  "
+               "external %6.1f ns  borrowed %6.1f / %6.1f ns\n", n, insert_ns,
+               int_ns, ext_ns, int_borrow_ns, ext_borrow_ns);
+
+        sr_nat_destroy(&nat);
+        free(keys);
+    }
+    return 0;
+} /* -- sr_bench_nat -- */
+
+/* A natmt thread: looks up the mappings of its own flows, out and back */
+struct sr_bench_nat_worker
+{
+    struct sr_nat* nat;
+    const struct sr_bench_nat_key* keys; /* its flows */
+    uint32_t n;
+    int stop;
+    unsigned long lookups;
+    unsigned long found;
+};
+
+static void* sr_bench_nat_worker(void* worker_ptr)
+{
+    struct sr_bench_nat_worker* w = (struct sr_bench_nat_worker*)worker_ptr;
+    const struct sr_bench_nat_key* key;
+    uint32_t state = 0x9e3779b9 ^ w->n;
+    unsigned long found = 0;
+    unsigned long i = 0;
+    uint32_t k;
+
+    while(!__atomic_load_n(&w->stop, __ATOMIC_ACQUIRE))
+    {
+        sr_rcu_read_lock();
+        for(k = 0; k < 256; k++)
+        {
+            key = &w->keys[sr_bench_rand(&state) % w->n];
+            if(sr_nat_borrow_internal(w->nat, key->ip_int, key->aux_int,
+                                      nat_mapping_icmp))
+            { found++; }
+            if(sr_nat_borrow_external(w->nat, key->ip_ext, key->aux_ext,
+                                      nat_mapping_icmp))
+            { found++; }
+        }
+        sr_rcu_read_unlock();
+        i += 2 * k;
+    }
+
+    w->lookups = i;
+    w->found = found;
+    return 0;
+}
+
+/*---------------------------------------------------------------------
+ * Method: sr_bench_natmt(..)
+ * Scope: Local
+ *
+ * NAT lookups from 1, 2, 4 .. SR_BENCH_NAT_THREADS threads at once, each
+ * on flows of its own, as forwarding threads would do them.  Build with
+ * -DSR_NAT_SHARD_BITS=0 for the same run on a single lock.
+ *
+ *---------------------------------------------------------------------*/
+
+static int sr_bench_natmt(struct sr_instance* sr)
+{
+    struct sr_bench_nat_worker workers[SR_BENCH_NAT_THREADS];
+    pthread_t threads[SR_BENCH_NAT_THREADS];
+    struct sr_bench_nat_key* keys;
+    struct sr_nat_mapping* m;
+    struct sr_nat nat;
+    double start, elapsed, base = 0;
+    unsigned long lookups, found;
+    uint32_t i, t, nthreads;
+
+    keys = (struct sr_bench_nat_key*)malloc(SR_BENCH_NAT_MAPPINGS *
+                                            sizeof(*keys));
+    memset(&nat, 0, sizeof(nat));
+    if(keys == 0 || sr_nat_init(&nat) != 0)
+    {
+        fprintf(stderr, "natmt: out of memory\n");
+        return 1;
+    }
+    nat.sr_instance = sr;
+    nat.icmpTimeout = 3600;
+    nat.tcpEstablishedTimeout = 7440;
+    nat.tcpTransitoryTimeout = 300;
+
+    for(i = 0; i < SR_BENCH_NAT_MAPPINGS; i++)
+    {
+        if(i % SR_BENCH_NAT_PER_IP == 0)
+        { nat.ip_ext = htonl(0xac400300 + i / SR_BENCH_NAT_PER_IP + 1); }
+        keys[i].ip_int = htonl(0x0a000000 + (i >> 4));
+        keys[i].aux_int = htons(i & 15);
+        m = sr_nat_insert_mapping(&nat, keys[i].ip_int, keys[i].aux_int,
+                                  nat_mapping_icmp);
+        keys[i].ip_ext = m->ip_ext;
+        keys[i].aux_ext = htons(m->aux_ext);
+        free(m);
+    }
+
+    printf("natmt: %u mappings, %u shards\n", SR_BENCH_NAT_MAPPINGS,
+           SR_NAT_SHARDS);
+    for(nthreads = 1; nthreads <= SR_BENCH_NAT_THREADS; nthreads *= 2)
+    {
+        /* -- the flows split evenly between the threads -- */
+        for(t = 0; t < nthreads; t++)
+        {
+            workers[t].nat = &nat;
+            workers[t].n = SR_BENCH_NAT_MAPPINGS / nthreads;
+            workers[t].keys = keys + t * workers[t].n;
+            workers[t].stop = 0;
+            workers[t].lookups = 0;
+        }
+        start = sr_bench_now();
+        for(t = 0; t < nthreads; t++)
+        { pthread_create(&threads[t], 0, sr_bench_nat_worker, &workers[t]); }
+        sleep(SR_BENCH_SECONDS);
+        lookups = found = 0;
+        for(t = 0; t < nthreads; t++)
+        {
+            __atomic_store_n(&workers[t].stop, 1, __ATOMIC_RELEASE);
+            pthread_join(threads[t], 0);
+            lookups += workers[t].lookups;
+            found += workers[t].found;
+        }
+        elapsed = sr_bench_now() - start;
+
+        if(found != lookups)
+        { fprintf(stderr, "natmt: %lu mappings missing\n", lookups - found); }
+        if(nthreads == 1)
+        { base = lookups / elapsed; }
+        printf("natmt: %u threads  %8.2f M lookups/s  %5.2fx one thread\n",
+               nthreads, lookups / elapsed / 1e6,
+               lookups / elapsed / base);
+    }
+
+    sr_nat_destroy(&nat);
+    free(keys);
+    return 0;
+} /* -- sr_bench_natmt -- */
+
+/*---------------------------------------------------------------------
+ * Method: sr_bench(..)
+ * Scope: Global
+ *
+ * Run the benchmark called name.  Returns the exit status for main.
+ *
+ *---------------------------------------------------------------------*/
+
+int sr_bench(struct sr_instance* sr, const char* name)
+{
+    /* -- REQUIRES -- */
+    assert(sr);
+    assert(name);
+
+    if(strcmp(name, "churn") == 0)
+    { return sr_bench_churn(sr); }
+    if(strcmp(name, "arp") == 0)
+    { return sr_bench_arp(sr); }
+    if(strcmp(name, "nat") == 0)
+    { return sr_bench_nat(sr); }
+    if(strcmp(name, "natmt") == 0)
+    { return sr_bench_natmt(sr); }
+
+    fprintf(stderr, "Unknown benchmark %s (available: churn, arp, nat, "
+            "natmt)\n", name);
+    return 1;
+} /* -- sr_bench -- */
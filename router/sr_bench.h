@@ -0,0 +1,27 @@
+/*-----------------------------------------------------------------------------
+ * file:  sr_bench.h
+ *
+ * Description:
+ *
+ * Built-in benchmarks, run with "sr -B <name>" instead of connecting to a
+ * server.  They exercise the router's data structures on synthetic input
+ * and print their results to stdout.
+ *
+ *   churn  - route updates applied with sr_fib_update(..) while a reader
+ *            thread keeps looking up, against lookups on an idle table
+ *   arp    - ARP cache lookups with 100, 10k and 100k neighbors, and
+ *            inserts that evict the least recently used entries
+ *   nat    - NAT mapping inserts and lookups, by internal and external
+ *            key, copied and borrowed, with 1k to 1M mappings
+ *   natmt  - NAT lookups from 1 to 8 threads at once, on separate flows
+ *
+ *---------------------------------------------------------------------------*/
+
+#ifndef SR_BENCH_H
+#define SR_BENCH_H
+
+struct sr_instance;
+
+int sr_bench(struct sr_instance* sr, const char* name);
+
+#endif /* -- SR_BENCH_H -- */
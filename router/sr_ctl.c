@@ -0,0 +1,304 @@
+/*-----------------------------------------------------------------------------
+ * file:  sr_ctl.c
+ *
+ * Description:
+ *
+ * Route update control channel, see sr_ctl.h.
+ *
+ *---------------------------------------------------------------------------*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+#include "sr_ctl.h"
+#include "sr_router.h"
+#include "sr_rt.h"
+#include "sr_vrf.h"
+
+struct sr_ctl
+{
+    struct sr_instance* sr;
+    struct sr_fib** table;          /* where updates go */
+    int listen_fd;
+    int fd;                         /* client being served */
+    struct sr_rt_update* batch;     /* SR_CTL_BATCH_MAX updates */
+    unsigned int n;
+    unsigned long applied;          /* since the last commit */
+    unsigned long rejected;
+    unsigned long line;
+};
+
+/* Send text to the client; a client that went away is noticed on read. */
+static void sr_ctl_reply(struct sr_ctl* ctl, const char* text)
+{
+    size_t len = strlen(text);
+    ssize_t sent;
+
+    while(len > 0)
+    {
+        sent = send(ctl->fd, text, len, MSG_NOSIGNAL);
+        if(sent <= 0)
+        { return; }
+        text += sent;
+        len -= sent;
+    }
+}
+
+static void sr_ctl_flush(struct sr_ctl* ctl)
+{
+    int rejected;
+
+    if(ctl->n == 0)
+    { return; }
+
+    rejected = sr_fib_update(ctl->table, ctl->batch, ctl->n);
+    if(rejected < 0)
+    { rejected = ctl->n; }
+
+    ctl->applied += ctl->n - rejected;
+    ctl->rejected += rejected;
+    ctl->n = 0;
+}
+
+static void sr_ctl_commit(struct sr_ctl* ctl)
+{
+    char reply[64];
+
+    sr_ctl_flush(ctl);
+    snprintf(reply, sizeof(reply), "ok %lu %lu\n", ctl->applied, ctl->rejected);
+    sr_ctl_reply(ctl, reply);
+    ctl->applied = 0;
+    ctl->rejected = 0;
+}
+
+static void sr_ctl_table(struct sr_ctl* ctl, const char* name, size_t len)
+{
+    char buf[SR_VRF_NAMELEN];
+    char reply[128];
+    struct sr_fib** table = 0;
+
+    while(len > 0 && (*name == ' ' || *name == '\t'))
+    {
+        name++;
+        len--;
+    }
+
+    if(len < sizeof(buf))
+    {
+        memcpy(buf, name, len);
+        buf[len] = 0;
+        table = sr_vrf_table(ctl->sr, buf);
+    }
+    if(table == 0)
+    {
+        snprintf(reply, sizeof(reply), "error %lu: no such table\n", ctl->line);
+        sr_ctl_reply(ctl, reply);
+        return;
+    }
+
+    sr_ctl_flush(ctl);
+    ctl->table = table;
+}
+
+/*---------------------------------------------------------------------
+ * Method: sr_ctl_line(..)
+ * Scope: Local
+ *
+ * Handle one line from the client, without its newline.
+ *
+ *---------------------------------------------------------------------*/
+
+static void sr_ctl_line(struct sr_ctl* ctl, const char* line, size_t len)
+{
+    char reply[160];
+
+    ctl->line++;
+
+    while(len > 0 && (*line == ' ' || *line == '\t'))
+    {
+        line++;
+        len--;
+    }
+    while(len > 0 && (line[len - 1] == ' ' || line[len - 1] == '\t' ||
+                      line[len - 1] == '\r'))
+    { len--; }
+
+    if(len == 0 || *line == '#')
+    { return; }
+
+    if(len == 6 && memcmp(line, "commit", 6) == 0)
+    {
+        sr_ctl_commit(ctl);
+        return;
+    }
+
+    /* -- updates batched so far belong to the previous table -- */
+    if(len > 6 && memcmp(line, "table ", 6) == 0)
+    {
+        sr_ctl_table(ctl, line + 6, len - 6);
+        return;
+    }
+
+    if(sr_rt_parse_update(line, len, &ctl->batch[ctl->n]) != 0)
+    {
+        snprintf(reply, sizeof(reply), "error %lu: expected 'add dest gateway "
+                 "mask interface ...', 'withdraw dest mask', 'table name' or "
+                 "'commit'\n", ctl->line);
+        sr_ctl_reply(ctl, reply);
+        return;
+    }
+
+    if(++ctl->n == SR_CTL_BATCH_MAX)
+    { sr_ctl_flush(ctl); }
+} /* -- sr_ctl_line -- */
+
+/*---------------------------------------------------------------------
+ * Method: sr_ctl_serve(..)
+ * Scope: Local
+ *
+ * Read lines from the connected client until it disconnects.  A line
+ * longer than the buffer is answered with an error and skipped up to its
+ * newline.
+ *
+ *---------------------------------------------------------------------*/
+
+static void sr_ctl_serve(struct sr_ctl* ctl, char* buf)
+{
+    char* start = 0;
+    char* eol = 0;
+    size_t have = 0;
+    ssize_t got;
+    int skip = 0;       /* in the rest of a line too long */
+
+    ctl->table = &ctl->sr->fib;
+    ctl->n = 0;
+    ctl->applied = 0;
+    ctl->rejected = 0;
+    ctl->line = 0;
+
+    while((got = read(ctl->fd, buf + have, SR_CTL_BUF_SZ - have)) > 0)
+    {
+        have += got;
+
+        start = buf;
+        if(skip)
+        {
+            eol = memchr(buf, '\n', have);
+            if(eol == 0)
+            {
+                have = 0;
+                continue;
+            }
+            start = eol + 1;
+            skip = 0;
+        }
+        while((eol = memchr(start, '\n', buf + have - start)) != 0)
+        {
+            sr_ctl_line(ctl, start, eol - start);
+            start = eol + 1;
+        }
+        have -= start - buf;
+        memmove(buf, start, have);
+
+        if(have == SR_CTL_BUF_SZ)
+        {
+            ctl->line++;
+            sr_ctl_reply(ctl, "error: line too long\n");
+            have = 0;
+            skip = 1;
+        }
+    }
+
+    /* -- a last line without newline, then whatever is still batched -- */
+    if(have > 0)
+    { sr_ctl_line(ctl, buf, have); }
+    if(ctl->n > 0 || ctl->applied > 0 || ctl->rejected > 0)
+    { sr_ctl_commit(ctl); }
+} /* -- sr_ctl_serve -- */
+
+static void* sr_ctl_thread(void* ctl_ptr)
+{
+    struct sr_ctl* ctl = (struct sr_ctl*)ctl_ptr;
+    char* buf = (char*)malloc(SR_CTL_BUF_SZ);
+
+    assert(buf);
+
+    while(1)
+    {
+        ctl->fd = accept(ctl->listen_fd, 0, 0);
+        if(ctl->fd < 0)
+        { continue; }
+
+        sr_ctl_serve(ctl, buf);
+        close(ctl->fd);
+    }
+
+    return 0;
+} /* -- sr_ctl_thread -- */
+
+/*---------------------------------------------------------------------
+ * Method: sr_ctl_start(..)
+ * Scope: Global
+ *
+ * Listen for route updates on the Unix socket path, replacing a stale
+ * socket left there (but no other kind of file), and serve them from a
+ * thread of their own.
+ * Returns 0 on success.
+ *
+ *---------------------------------------------------------------------*/
+
+int sr_ctl_start(struct sr_instance* sr, const char* path)
+{
+    struct sockaddr_un addr;
+    struct stat st;
+    struct sr_ctl* ctl = 0;
+    pthread_t thread;
+
+    /* -- REQUIRES -- */
+    assert(sr);
+    assert(path);
+
+    if(strlen(path) >= sizeof(addr.sun_path))
+    {
+        fprintf(stderr, "Control socket path too long: %s\n", path);
+        return -1;
+    }
+
+    ctl = (struct sr_ctl*)calloc(1, sizeof(struct sr_ctl));
+    if(ctl == 0)
+    { return -1; }
+    ctl->sr = sr;
+    ctl->batch = (struct sr_rt_update*)malloc(SR_CTL_BATCH_MAX *
+                                              sizeof(struct sr_rt_update));
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+    if(lstat(path, &st) == 0 && S_ISSOCK(st.st_mode))
+    { unlink(path); }
+
+    ctl->listen_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if(ctl->batch == 0 || ctl->listen_fd < 0 ||
+       bind(ctl->listen_fd, (struct sockaddr*)&addr, sizeof(addr)) != 0 ||
+       listen(ctl->listen_fd, 4) != 0 ||
+       pthread_create(&thread, 0, sr_ctl_thread, ctl) != 0)
+    {
+        perror("control socket");
+        if(ctl->listen_fd >= 0)
+        { close(ctl->listen_fd); }
+        free(ctl->batch);
+        free(ctl);
+        return -1;
+    }
+    pthread_detach(thread);
+
+    printf("Accepting route updates on %s\n", path);
+    return 0;
+} /* -- sr_ctl_start -- */
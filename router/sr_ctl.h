@@ -0,0 +1,39 @@
+/*-----------------------------------------------------------------------------
+ * file:  sr_ctl.h
+ *
+ * Description:
+ *
+ * Local control channel for feeding route changes to a running router.
+ * A routing daemon connects to a Unix stream socket and sends lines of
+ *
+ *   add dest gateway mask interface [gateway interface]...
+ *   withdraw dest mask
+ *   table name
+ *   commit
+ *
+ * Updates are collected into a batch that is applied in place with
+ * sr_fib_update(..) on "commit", whenever it reaches SR_CTL_BATCH_MAX
+ * updates, and when the client disconnects.  Each commit is answered with
+ *
+ *   ok <applied> <rejected>
+ *
+ * counting the updates since the previous commit.  Updates go to the
+ * default table unless "table" picked a named one (sr_vrf.h); it stays
+ * picked until the next "table" line or the end of the connection.  A line that cannot be
+ * parsed is answered right away with "error <line>: <reason>" and skipped.
+ * Blank lines and lines starting with '#' are ignored.  Clients are served
+ * one at a time.
+ *
+ *---------------------------------------------------------------------------*/
+
+#ifndef SR_CTL_H
+#define SR_CTL_H
+
+#define SR_CTL_BATCH_MAX 4096   /* updates applied together */
+#define SR_CTL_BUF_SZ    65536  /* longest line accepted */
+
+struct sr_instance;
+
+int sr_ctl_start(struct sr_instance* sr, const char* path);
+
+#endif /* -- SR_CTL_H -- */
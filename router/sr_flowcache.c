@@ -0,0 +1,327 @@
+/*-----------------------------------------------------------------------------
+ * file:  sr_flowcache.c
+ *
+ * Description:
+ *
+ * Flow cache, see sr_flowcache.h.  The cache is direct mapped: a flow
+ * lives in the one slot its key hashes to and a colliding flow simply
+ * takes the slot over.
+ *
+ * Learning works across the slow path without changing its interfaces:
+ * sr_flowcache_forward(..) remembers the key of a packet it missed on
+ * (per thread), and sr_flowcache_learn(..), called where the slow path
+ * hands that same packet to the wire, turns it into an entry.
+ *
+ *---------------------------------------------------------------------------*/
+
+#include <stdlib.h>
+#include <stddef.h>
+#include <string.h>
+#include <assert.h>
+
+#include "sr_flowcache.h"
+#include "sr_router.h"
+#include "sr_if.h"
+#include "sr_rt.h"
+#include "sr_nat.h"
+#include "sr_rcu.h"
+#include "sr_utils.h"
+#include "sr_vrf.h"
+
+/* What the packet being handled by this thread missed on. */
+struct sr_flow_pending
+{
+    const uint8_t* packet;
+    unsigned int   len;
+    struct sr_flow_key key;
+    unsigned int   fib_gen;
+    unsigned int   arp_gen;
+    unsigned int   nat_gen;
+};
+
+static __thread struct sr_flow_pending sr_flow_pending;
+
+/*---------------------------------------------------------------------
+ * Method: sr_flow_key_get(..)
+ * Scope: Local
+ *
+ * Fill key (except the ingress interface) from an Ethernet frame.
+ * Returns -1 if packets like this one must not be cached.
+ *
+ *---------------------------------------------------------------------*/
+
+static int sr_flow_key_get(const uint8_t* packet, unsigned int len,
+                           struct sr_flow_key* key)
+{
+    const sr_ip_hdr_t* ip = (const sr_ip_hdr_t*)(packet + sizeof(sr_ethernet_hdr_t));
+    const uint8_t* l4 = packet + sizeof(sr_ethernet_hdr_t) + sizeof(sr_ip_hdr_t);
+    unsigned int l4_len;
+    uint16_t flags;
+
+    if(len < sizeof(sr_ethernet_hdr_t) + sizeof(sr_ip_hdr_t))
+    { return -1; }
+    l4_len = len - sizeof(sr_ethernet_hdr_t) - sizeof(sr_ip_hdr_t);
+
+    if(ip->ip_v != 4 || ip->ip_hl != sizeof(sr_ip_hdr_t) / 4 ||
+       (ntohs(ip->ip_off) & (IP_MF | IP_OFFMASK)))
+    { return -1; }
+
+    memset(key, 0, sizeof(*key));
+    key->src = ip->ip_src;
+    key->dst = ip->ip_dst;
+    key->proto = ip->ip_p;
+
+    switch(ip->ip_p)
+    {
+        case ip_protocol_tcp:
+            if(l4_len < sizeof(sr_tcp_hdr_t))
+            { return -1; }
+            flags = ntohs(((const sr_tcp_hdr_t*)l4)->flags);
+            if(flags & (tcp_flag_syn | tcp_flag_fin | tcp_flag_rst) ||
+               !(flags & tcp_flag_ack))
+            { return -1; }
+            key->sport = ((const sr_tcp_hdr_t*)l4)->src_port;
+            key->dport = ((const sr_tcp_hdr_t*)l4)->dest_port;
+            return 0;
+
+        case ip_protocol_udp:
+            if(l4_len < 8)
+            { return -1; }
+            memcpy(&key->sport, l4, sizeof(uint16_t));
+            memcpy(&key->dport, l4 + 2, sizeof(uint16_t));
+            return 0;
+
+        case ip_protocol_icmp:
+            if(l4_len < 8 || (l4[0] != 0 && l4[0] != 8))
+            { return -1; }
+            key->sport = ((const sr_icmp_t8_hdr_t*)l4)->icmp_id;
+            key->dport = l4[0];
+            return 0;
+    }
+
+    return -1;
+} /* -- sr_flow_key_get -- */
+
+static unsigned int sr_flow_hash(const struct sr_flow_key* key)
+{
+    uint32_t h;
+
+    h = key->src * 0x9e3779b1u;
+    h ^= key->dst * 0x85ebca6bu;
+    h ^= (((uint32_t)key->sport << 16) | key->dport) * 0xc2b2ae35u;
+    h ^= key->proto ^ (uint32_t)((unsigned long)key->in >> 4);
+    h ^= h >> 15;
+    h *= 0x2c1b3c6du;
+    h ^= h >> 12;
+
+    return h & (SR_FLOWCACHE_SZ - 1);
+}
+
+/*---------------------------------------------------------------------
+ * Method: sr_flow_rewrite(..)
+ * Scope: Local
+ *
+ * Apply the NAT rewrite recorded in f, patching the IP and transport
+ * checksums incrementally instead of summing the packet again.
+ *
+ *---------------------------------------------------------------------*/
+
+static void sr_flow_rewrite(uint8_t* packet, const struct sr_flow* f)
+{
+    sr_ip_hdr_t* ip = (sr_ip_hdr_t*)(packet + sizeof(sr_ethernet_hdr_t));
+    uint8_t* l4 = packet + sizeof(sr_ethernet_hdr_t) + sizeof(sr_ip_hdr_t);
+    uint16_t* sum = 0;
+    uint16_t* sport = 0;
+    uint16_t* dport = 0;
+    int pseudo = 1;     /* checksum covers the addresses */
+
+    switch(f->key.proto)
+    {
+        case ip_protocol_tcp:
+            sum = (uint16_t*)(l4 + offsetof(sr_tcp_hdr_t, checksum));
+            sport = (uint16_t*)(l4 + offsetof(sr_tcp_hdr_t, src_port));
+            dport = (uint16_t*)(l4 + offsetof(sr_tcp_hdr_t, dest_port));
+            break;
+        case ip_protocol_udp:
+            sum = (uint16_t*)(l4 + 6);
+            sport = (uint16_t*)l4;
+            dport = (uint16_t*)(l4 + 2);
+            if(*sum == 0) /* -- no checksum -- */
+            { sum = 0; }
+            break;
+        case ip_protocol_icmp:
+            sum = (uint16_t*)(l4 + offsetof(sr_icmp_t8_hdr_t, icmp_sum));
+            sport = (uint16_t*)(l4 + offsetof(sr_icmp_t8_hdr_t, icmp_id));
+            pseudo = 0;
+            break;
+    }
+
+    if(f->out.src != f->key.src)
+    {
+        if(sum && pseudo)
+        { *sum = cksum_adjust32(*sum, ip->ip_src, f->out.src); }
+        ip->ip_sum = cksum_adjust32(ip->ip_sum, ip->ip_src, f->out.src);
+        ip->ip_src = f->out.src;
+    }
+    if(f->out.dst != f->key.dst)
+    {
+        if(sum && pseudo)
+        { *sum = cksum_adjust32(*sum, ip->ip_dst, f->out.dst); }
+        ip->ip_sum = cksum_adjust32(ip->ip_sum, ip->ip_dst, f->out.dst);
+        ip->ip_dst = f->out.dst;
+    }
+    if(sport && f->out.sport != f->key.sport)
+    {
+        if(sum)
+        { *sum = cksum_adjust16(*sum, *sport, f->out.sport); }
+        *sport = f->out.sport;
+    }
+    if(dport && f->out.dport != f->key.dport)
+    {
+        if(sum)
+        { *sum = cksum_adjust16(*sum, *dport, f->out.dport); }
+        *dport = f->out.dport;
+    }
+
+    if(sum && *sum == 0 && f->key.proto == ip_protocol_udp)
+    { *sum = 0xffff; }
+} /* -- sr_flow_rewrite -- */
+
+struct sr_flowcache* sr_flowcache_create(void)
+{
+    return (struct sr_flowcache*)calloc(1, sizeof(struct sr_flowcache));
+}
+
+void sr_flowcache_destroy(struct sr_flowcache* cache)
+{
+    free(cache);
+}
+
+/*---------------------------------------------------------------------
+ * Method: sr_flowcache_forward(..)
+ * Scope: Global
+ *
+ * Forward packet, received on interface, from the cache.  The IP
+ * checksum must already have been verified and the caller must be in
+ * an RCU read-side section.
+ *
+ * RETURN VALUES:
+ *
+ *  0 if the packet was sent
+ *  -1 if it has to go through the slow path; if that path forwards
+ *     it, sr_flowcache_learn(..) adds the flow
+ *
+ *---------------------------------------------------------------------*/
+
+int sr_flowcache_forward(struct sr_instance* sr, uint8_t* packet,
+                         unsigned int len, int interface)
+{
+    sr_ip_hdr_t* ip = (sr_ip_hdr_t*)(packet + sizeof(sr_ethernet_hdr_t));
+    struct sr_flow_pending* p = &sr_flow_pending;
+    const struct sr_fib* fib = 0;
+    struct sr_flow* f;
+    unsigned int arp_gen;
+    unsigned int nat_gen;
+
+    p->packet = 0;
+
+    if(sr->flows == 0 || sr_flow_key_get(packet, len, &p->key) != 0)
+    { return -1; }
+
+    /* -- expiring packets need an ICMP error, the slow path sends it -- */
+    if(ip->ip_ttl <= 1)
+    { return -1; }
+
+    /* -- the routing table of the network the packet came from -- */
+    p->key.in = sr_if_get(sr, interface);
+    fib = sr_vrf_fib(sr, p->key.in);
+    if(fib == 0)
+    { return -1; }
+
+    arp_gen = __atomic_load_n(&sr->cache.gen, __ATOMIC_ACQUIRE);
+    nat_gen = sr->nat ? __atomic_load_n(&sr->nat->gen, __ATOMIC_ACQUIRE) : 0;
+
+    f = &sr->flows->flows[sr_flow_hash(&p->key)];
+    if(f->valid && memcmp(&f->key, &p->key, sizeof(p->key)) == 0 &&
+       f->fib_gen == fib->gen && f->arp_gen == arp_gen &&
+       f->nat_gen == nat_gen &&
+       (!f->rewrite || time(NULL) < f->refresh))
+    {
+        ip_ttl_decrement(ip);
+        if(f->rewrite)
+        { sr_flow_rewrite(packet, f); }
+        memcpy(packet, f->eth, sizeof(f->eth));
+
+        /* -- keep the neighbor from looking idle to the ARP cache -- */
+        if(f->neighbor)
+        { sr_arpcache_used(&sr->cache, f->neighbor); }
+
+        sr_send_packet(sr, packet, len, f->egress->index);
+        return 0;
+    }
+
+    /* -- miss: remember what the slow path starts from -- */
+    p->packet = packet;
+    p->len = len;
+    p->fib_gen = fib->gen;
+    p->arp_gen = arp_gen;
+    p->nat_gen = nat_gen;
+
+    return -1;
+} /* -- sr_flowcache_forward -- */
+
+/*---------------------------------------------------------------------
+ * Method: sr_flowcache_learn(..)
+ * Scope: Global
+ *
+ * Called by the slow path right before it sends a forwarded packet out
+ * of interface to mac, the address of next_hop.  If the packet is the one
+ * the cache just missed on, the decision is recorded for the rest of its
+ * flow.
+ *
+ *---------------------------------------------------------------------*/
+
+void sr_flowcache_learn(struct sr_instance* sr, const uint8_t* packet,
+                        int interface, uint32_t next_hop,
+                        const unsigned char* mac)
+{
+    struct sr_flow_pending* p = &sr_flow_pending;
+    sr_ethernet_hdr_t* eth;
+    struct sr_flow_key out;
+    struct sr_flow* f;
+    struct sr_if* egress;
+
+    if(p->packet != packet || sr->flows == 0)
+    { return; }
+    p->packet = 0;
+
+    egress = sr_if_get(sr, interface);
+    if(egress == 0 || sr_flow_key_get(packet, p->len, &out) != 0 ||
+       out.proto != p->key.proto)
+    { return; }
+    out.in = p->key.in;
+
+    f = &sr->flows->flows[sr_flow_hash(&p->key)];
+    f->key = p->key;
+    f->out = out;
+    f->rewrite = memcmp(&f->key, &f->out, sizeof(f->key)) != 0;
+    f->fib_gen = p->fib_gen;
+    f->arp_gen = p->arp_gen;
+    f->nat_gen = p->nat_gen;
+    f->refresh = time(NULL) + SR_FLOWCACHE_NAT_REFRESH;
+    f->egress = egress;
+    f->neighbor = sr_arpcache_entry(&sr->cache, next_hop, interface);
+
+    eth = (sr_ethernet_hdr_t*)f->eth;
+    memcpy(eth->ether_dhost, mac, ETHER_ADDR_LEN);
+    memcpy(eth->ether_shost, egress->addr, ETHER_ADDR_LEN);
+    eth->ether_type = htons(ethertype_ip);
+
+    f->valid = 1;
+} /* -- sr_flowcache_learn -- */
+
+/* Forget the pending miss once the slow path is done with the packet. */
+void sr_flowcache_done(void)
+{
+    sr_flow_pending.packet = 0;
+}
@@ -0,0 +1,83 @@
+/*-----------------------------------------------------------------------------
+ * file:  sr_flowcache.h
+ *
+ * Description:
+ *
+ * Exact match cache of forwarding decisions, keyed by the 5-tuple and the
+ * ingress interface.  An entry holds everything the slow path worked out
+ * for the flow: the egress interface, the Ethernet header to put on the
+ * packet and the addresses/ports NAT rewrote.  Packets of established
+ * flows are forwarded with one probe, skipping the route, ARP and NAT
+ * lookups.
+ *
+ * Entries are learned, not computed: on a miss the packet goes through
+ * the normal path and, if that path forwards it straight to a resolved
+ * next hop, sr_flowcache_learn(..) records the result.  Each entry keeps
+ * the generation of the forwarding table, ARP cache and NAT it was
+ * learned under and is ignored once any of them has changed.  Flows that
+ * NAT rewrites are sent through the slow path again every
+ * SR_FLOWCACHE_NAT_REFRESH seconds so the NAT sees them and keeps the
+ * mapping alive.
+ *
+ * TCP segments with SYN, FIN or RST, fragments, packets with IP options
+ * and ICMP other than echo always take the slow path.
+ *
+ * The cache belongs to the packet handling thread and is not locked.
+ *
+ *---------------------------------------------------------------------------*/
+
+#ifndef SR_FLOWCACHE_H
+#define SR_FLOWCACHE_H
+
+#include <time.h>
+
+#include "sr_protocol.h"
+
+#define SR_FLOWCACHE_SZ          4096   /* entries, power of two */
+#define SR_FLOWCACHE_NAT_REFRESH 1      /* seconds */
+
+struct sr_instance;
+struct sr_if;
+
+struct sr_flow_key
+{
+    uint32_t src;               /* network byte order */
+    uint32_t dst;
+    uint16_t sport;             /* ICMP echo: identifier */
+    uint16_t dport;             /* ICMP echo: type */
+    uint8_t  proto;
+    uint8_t  pad[3];
+    const struct sr_if* in;     /* ingress interface */
+};
+
+struct sr_flow
+{
+    struct sr_flow_key key;
+    struct sr_flow_key out;     /* key fields as the packet leaves (NAT) */
+    int      valid;
+    int      rewrite;           /* out differs from key */
+    unsigned int fib_gen;
+    unsigned int arp_gen;
+    unsigned int nat_gen;
+    time_t   refresh;           /* rewritten flows: next slow path pass */
+    const struct sr_if* egress;
+    struct sr_arpentry* neighbor; /* marked used on hits, valid with arp_gen */
+    uint8_t  eth[sizeof(sr_ethernet_hdr_t)];
+};
+
+struct sr_flowcache
+{
+    struct sr_flow flows[SR_FLOWCACHE_SZ];
+};
+
+struct sr_flowcache* sr_flowcache_create(void);
+void sr_flowcache_destroy(struct sr_flowcache* cache);
+
+int  sr_flowcache_forward(struct sr_instance* sr, uint8_t* packet,
+                          unsigned int len, int interface);
+void sr_flowcache_learn(struct sr_instance* sr, const uint8_t* packet,
+                        int interface, uint32_t next_hop,
+                        const unsigned char* mac);
+void sr_flowcache_done(void);
+
+#endif /* -- SR_FLOWCACHE_H -- */
@@ -13,6 +13,7 @@
 #include <assert.h>
 #include <string.h>
 #include <stdlib.h>
+#include <pthread.h>
 
 #ifdef _DARWIN_
 #include <sys/types.h>
@@ -24,6 +25,21 @@
 
 #include "sr_if.h"
 #include "sr_router.h"
+#include "sr_vrf.h"
+
+/* -- names with an index, in index order; only ever appended to -- */
+static char sr_if_names[SR_IF_MAX][sr_IFACE_NAMELEN];
+static int sr_if_nnames = 0;
+static pthread_mutex_t sr_if_names_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* slots of the first local address table, a power of two */
+#define SR_LOCAL_MIN_SLOTS 16
+
+static uint32_t sr_local_hash(uint32_t ip)
+{
+    uint32_t h = ip * 0x9e3779b1u;
+    return h ^ (h >> 16);
+}
 
 /*--------------------------------------------------------------------- 
  * Method: sr_get_interface
@@ -54,6 +70,141 @@ struct sr_if* sr_get_interface(struct sr_instance* sr, const char* name)
     return 0;
 } /* -- sr_get_interface -- */
 
+/*---------------------------------------------------------------------
+ * Method: sr_if_get(..)
+ * Scope: Global
+ *
+ * The interface with index (see sr_if_index(..)), or 0 if the router has
+ * no interface of that name.
+ *
+ *---------------------------------------------------------------------*/
+
+struct sr_if* sr_if_get(struct sr_instance* sr, int index)
+{
+    if(index < 0 || index >= SR_IF_MAX)
+    { return 0; }
+
+    return sr->ifaces[index];
+} /* -- sr_if_get -- */
+
+/*---------------------------------------------------------------------
+ * Method: sr_if_index(..)
+ * Scope: Global
+ *
+ * The index of interface name, giving it the next free one the first time
+ * it is asked for.  Routes may name interfaces the router does not have
+ * (yet), so names get indices whether or not there is such an interface.
+ * Returns SR_IF_NONE if all SR_IF_MAX indices are used.
+ *
+ *---------------------------------------------------------------------*/
+
+int sr_if_index(const char* name)
+{
+    int i = 0;
+
+    /* -- REQUIRES -- */
+    assert(name);
+
+    pthread_mutex_lock(&sr_if_names_lock);
+
+    for(i = 0; i < sr_if_nnames; i++)
+    {
+        if(strncmp(sr_if_names[i], name, sr_IFACE_NAMELEN) == 0)
+        { break; }
+    }
+
+    if(i == sr_if_nnames)
+    {
+        if(i == SR_IF_MAX)
+        { i = SR_IF_NONE; }
+        else
+        {
+            strncpy(sr_if_names[i], name, sr_IFACE_NAMELEN);
+            sr_if_names[i][sr_IFACE_NAMELEN - 1] = 0;
+            sr_if_nnames++;
+        }
+    }
+
+    pthread_mutex_unlock(&sr_if_names_lock);
+    return i;
+} /* -- sr_if_index -- */
+
+/*---------------------------------------------------------------------
+ * Method: sr_local_add(..)
+ * Scope: Global
+ *
+ * Make ip one of the router's own addresses.  The table doubles when it
+ * gets half full.  Returns 0 on success.
+ *
+ *---------------------------------------------------------------------*/
+
+int sr_local_add(struct sr_instance* sr, uint32_t ip_nbo)
+{
+    struct sr_local_set* set = 0;
+    uint32_t* slots = 0;
+    uint32_t mask = 0;
+    uint32_t i, j;
+
+    /* -- REQUIRES -- */
+    assert(sr);
+
+    set = &sr->local;
+    if(ip_nbo == 0 || sr_is_local(sr, ip_nbo))
+    { return 0; }
+
+    if(set->slots == 0 || 2 * (set->n + 1) > set->mask + 1)
+    {
+        mask = set->slots ? 2 * set->mask + 1 : SR_LOCAL_MIN_SLOTS - 1;
+        slots = (uint32_t*)calloc(mask + 1, sizeof(uint32_t));
+        if(slots == 0)
+        { return -1; }
+
+        for(i = 0; set->slots && i <= set->mask; i++)
+        {
+            if(set->slots[i] == 0)
+            { continue; }
+            for(j = sr_local_hash(set->slots[i]) & mask; slots[j];
+                j = (j + 1) & mask);
+            slots[j] = set->slots[i];
+        }
+        free(set->slots);
+        set->slots = slots;
+        set->mask = mask;
+    }
+
+    for(j = sr_local_hash(ip_nbo) & set->mask; set->slots[j];
+        j = (j + 1) & set->mask);
+    set->slots[j] = ip_nbo;
+    set->n++;
+
+    return 0;
+} /* -- sr_local_add -- */
+
+/*---------------------------------------------------------------------
+ * Method: sr_is_local(..)
+ * Scope: Global
+ *
+ * Whether ip is one of the router's own addresses.
+ *
+ *---------------------------------------------------------------------*/
+
+int sr_is_local(struct sr_instance* sr, uint32_t ip_nbo)
+{
+    const struct sr_local_set* set = &sr->local;
+    uint32_t j;
+
+    if(set->slots == 0 || ip_nbo == 0)
+    { return 0; }
+
+    for(j = sr_local_hash(ip_nbo) & set->mask; set->slots[j];
+        j = (j + 1) & set->mask)
+    {
+        if(set->slots[j] == ip_nbo)
+        { return 1; }
+    }
+    return 0;
+} /* -- sr_is_local -- */
+
 /*--------------------------------------------------------------------- 
  * Method: sr_add_interface(..)
  * Scope: Global
@@ -65,18 +216,30 @@ struct sr_if* sr_get_interface(struct sr_instance* sr, const char* name)
 void sr_add_interface(struct sr_instance* sr, const char* name)
 {
     struct sr_if* if_walker = 0;
+    int index = 0;
 
     /* -- REQUIRES -- */
     assert(name);
     assert(sr);
 
+    index = sr_if_index(name);
+    if(index == SR_IF_NONE)
+    {
+        fprintf(stderr, "Too many interfaces, cannot add %s\n", name);
+        exit(1);
+    }
+
     /* -- empty list special case -- */
     if(sr->if_list == 0)
     {
         sr->if_list = (struct sr_if*)malloc(sizeof(struct sr_if));
         assert(sr->if_list);
         sr->if_list->next = 0;
+        sr->if_list->speed = 0;
         strncpy(sr->if_list->name,name,sr_IFACE_NAMELEN);
+        sr->if_list->index = index;
+        sr->ifaces[index] = sr->if_list;
+        sr_vrf_bind(sr, sr->if_list);
         return;
     }
 
@@ -89,7 +252,11 @@ void sr_add_interface(struct sr_instance* sr, const char* name)
     assert(if_walker->next);
     if_walker = if_walker->next;
     strncpy(if_walker->name,name,sr_IFACE_NAMELEN);
+    if_walker->speed = 0;
     if_walker->next = 0;
+    if_walker->index = index;
+    sr->ifaces[index] = if_walker;
+    sr_vrf_bind(sr, if_walker);
 } /* -- sr_add_interface -- */ 
 
 /*--------------------------------------------------------------------- 
@@ -138,8 +305,34 @@ void sr_set_ether_ip(struct sr_instance* sr, uint32_t ip_nbo)
     /* -- copy address -- */
     if_walker->ip = ip_nbo;
 
+    if(sr_local_add(sr, ip_nbo) != 0)
+    { fprintf(stderr, "Out of memory adding a local address\n"); }
+
 } /* -- sr_set_ether_ip -- */
 
+/*--------------------------------------------------------------------- 
+ * Method: sr_set_ether_speed(..)
+ * Scope: Global
+ *
+ * set the link speed of the LAST interface in the interface list
+ *
+ *---------------------------------------------------------------------*/
+
+void sr_set_ether_speed(struct sr_instance* sr, uint32_t speed)
+{
+    struct sr_if* if_walker = 0;
+
+    /* -- REQUIRES -- */
+    assert(sr->if_list);
+
+    if_walker = sr->if_list;
+    while(if_walker->next)
+    {if_walker = if_walker->next; }
+
+    if_walker->speed = speed;
+
+} /* -- sr_set_ether_speed -- */
+
 /*--------------------------------------------------------------------- 
  * Method: sr_print_if_list(..)
  * Scope: Global
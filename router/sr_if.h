@@ -26,13 +26,22 @@
 
 #include "sr_protocol.h"
 
+#define SR_IF_MAX  64    /* interface names that can be indexed */
+#define SR_IF_NONE (-1)  /* index of no interface */
+
 struct sr_instance;
+struct sr_vrf;
 
 /* ----------------------------------------------------------------------------
  * struct sr_if
  *
  * Node in the interface list for each router
  *
+ * Every interface name the router uses, in routes as well as in the list,
+ * has a dense index (sr_if_index(..)).  The packet path carries indices and
+ * gets the interface with sr_if_get(..); names are only used at the VNS
+ * boundary and in configuration.
+ *
  * -------------------------------------------------------------------------- */
 
 struct sr_if
@@ -41,13 +50,37 @@ struct sr_if
   unsigned char addr[ETHER_ADDR_LEN];
   uint32_t ip;
   uint32_t speed;
+  int index;          /* sr_if_index(name) */
+  struct sr_vrf* vrf; /* routing table for packets received here, 0: default */
   struct sr_if* next;
 };
 
+/* ----------------------------------------------------------------------------
+ * struct sr_local_set
+ *
+ * The addresses the router owns, so deciding whether a packet is for us
+ * costs one hash probe however many addresses there are.  Open addressing
+ * with linear probing; 0.0.0.0 marks an empty slot.  Only changed while
+ * interfaces are set up, by the thread that handles packets.
+ *
+ * -------------------------------------------------------------------------- */
+
+struct sr_local_set
+{
+  uint32_t* slots;    /* network byte order, 0: empty */
+  uint32_t mask;      /* number of slots - 1 */
+  uint32_t n;
+};
+
 struct sr_if* sr_get_interface(struct sr_instance* sr, const char* name);
+struct sr_if* sr_if_get(struct sr_instance* sr, int index);
+int sr_if_index(const char* name);
+int sr_local_add(struct sr_instance* sr, uint32_t ip_nbo);
+int sr_is_local(struct sr_instance* sr, uint32_t ip_nbo);
 void sr_add_interface(struct sr_instance*, const char*);
 void sr_set_ether_addr(struct sr_instance*, const unsigned char*);
 void sr_set_ether_ip(struct sr_instance*, uint32_t ip_nbo);
+void sr_set_ether_speed(struct sr_instance*, uint32_t speed);
 void sr_print_if_list(struct sr_instance*);
 void sr_print_if(struct sr_if*);
 
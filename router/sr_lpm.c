@@ -0,0 +1,1107 @@
+/*-----------------------------------------------------------------------------
+ * file:  sr_lpm.c
+ *
+ * Description:
+ *
+ * DIR-24-8 and tree bitmap longest prefix match backends.  See sr_lpm.h.
+ *
+ *---------------------------------------------------------------------------*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+
+#include "sr_lpm.h"
+
+/* ----------------------------------------------------------------------------
+ * Changes under lookups
+ *
+ * A table may be changed while other threads look up in it.  Every change
+ * becomes visible through a single aligned store, made after everything
+ * it points at has been written:
+ *
+ *  - DIR-24-8 entries are one word each, and a new tbl8 group is filled
+ *    before the tbl24 entry pointing at it is stored.
+ *  - A trie node keeps each bitmap in one 64 bit word together with the
+ *    index of the block it describes.  Blocks are copied, not edited,
+ *    when a bitmap changes.
+ *  - Pools grow into a new array and leave the old one intact.
+ *
+ * Memory a lookup may still be reading (replaced blocks, folded tbl8
+ * groups, outgrown arrays) is retired rather than freed and only reused
+ * by sr_lpm_reclaim(..).
+ * -------------------------------------------------------------------------- */
+
+/* ----------------------------------------------------------------------------
+ * Pools
+ *
+ * Pool of fixed size elements handed out in blocks of 1..POOL_BLOCK_MAX.
+ * Freed blocks are kept on a free list per block size; the link is stored
+ * in the first word of the block.  Index 0 is never handed out.
+ * -------------------------------------------------------------------------- */
+
+#define POOL_BLOCK_MAX  16
+#define POOL_INIT       64
+
+/* A block (base == 0) or an outgrown array waiting for sr_lpm_reclaim. */
+struct sr_lpm_retired {
+    uint8_t* base;
+    uint32_t idx;
+    uint32_t n;
+};
+
+struct sr_lpm_pool {
+    uint8_t* base;
+    size_t   esize;
+    uint32_t used;
+    uint32_t cap;
+    uint32_t free_list[POOL_BLOCK_MAX + 1];
+    struct sr_lpm_retired* retired;
+    uint32_t nretired;
+    uint32_t retired_cap;
+};
+
+/* ----------------------------------------------------------------------------
+ * DIR-24-8
+ *
+ * Every table entry is a 32 bit word:
+ *
+ *   bit  31     : entry points at a tbl8 group instead of holding a next hop
+ *   bits 24..29 : length of the prefix that wrote this entry
+ *   bits  0..23 : next hop, or tbl8 group number when bit 31 is set
+ *
+ * Keeping the prefix length in the entry lets routes be inserted in any
+ * order: a prefix only overwrites entries written by a shorter (or equal)
+ * prefix, and a deleted prefix finds exactly the entries it wrote.
+ * -------------------------------------------------------------------------- */
+
+#define DIR_EXT          0x80000000
+#define DIR_DEPTH_SHIFT  24
+#define DIR_DEPTH_MASK   0x3f
+#define DIR_IDX_MASK     0x00ffffff
+#define DIR_TBL24_SZ     (1 << 24)
+#define DIR_TBL8_SZ      256
+
+#define DIR_ENTRY(nh, depth) ( ((uint32_t)(depth) << DIR_DEPTH_SHIFT) | (nh) )
+#define DIR_DEPTH(e)         ( ((e) >> DIR_DEPTH_SHIFT) & DIR_DEPTH_MASK )
+
+struct sr_lpm_dir {
+    uint32_t* tbl24;
+    struct sr_lpm_pool tbl8;    /* groups of DIR_TBL8_SZ entries */
+};
+
+#define DIR_GROUP(base, g) ((uint32_t*)(base) + (size_t)(g) * DIR_TBL8_SZ)
+
+/* ----------------------------------------------------------------------------
+ * Tree bitmap
+ *
+ * Each node covers TBM_STRIDE address bits.  The internal bitmap holds the
+ * prefixes that end inside the node (bit (1 << l) - 1 + v for the l bit
+ * value v, l = 0..3) and the external bitmap holds the 16 possible children.
+ * Children of a node are contiguous in the node pool, results contiguous in
+ * the result pool, so a node only needs the index of the first of each.
+ * -------------------------------------------------------------------------- */
+
+#define TBM_STRIDE      4
+
+/* A bitmap and the index of the block it describes, stored as one word. */
+union sr_lpm_tbm_word {
+    struct {
+        uint32_t index;
+        uint16_t bitmap;
+        uint16_t pad;
+    } f;
+    uint64_t w;
+};
+
+struct sr_lpm_tbm_node {
+    union sr_lpm_tbm_word ext;  /* children */
+    union sr_lpm_tbm_word in;   /* results of prefixes ending here */
+};
+
+struct sr_lpm_tbm {
+    struct sr_lpm_pool nodes;
+    struct sr_lpm_pool results;
+};
+
+#define TBM_NODES(t)   ((struct sr_lpm_tbm_node*)((t)->nodes.base))
+#define TBM_RESULTS(t) ((uint32_t*)((t)->results.base))
+
+struct sr_lpm {
+    sr_lpm_type type;
+    int         shared;     /* arrays borrowed from an image, see import */
+    union {
+        struct sr_lpm_dir dir;
+        struct sr_lpm_tbm tbm;
+    } u;
+};
+
+/* tbm_match[nib] has the internal bitmap bits of every prefix, of length
+   0..3, that the 4 bit chunk nib falls under. */
+static uint16_t tbm_match[1 << TBM_STRIDE];
+
+#define popcount(x) ((unsigned int)__builtin_popcount((unsigned int)(x)))
+
+/*---------------------------------------------------------------------
+ * Pool helpers
+ *---------------------------------------------------------------------*/
+
+static int pool_init(struct sr_lpm_pool* p, size_t esize)
+{
+    memset(p, 0, sizeof(*p));
+    p->esize = esize;
+    p->cap = POOL_INIT;
+    p->used = 1; /* -- index 0 is reserved -- */
+    p->base = (uint8_t*)calloc(p->cap, esize);
+
+    return p->base ? 0 : -1;
+}
+
+/* Keep base, or block idx/n, away from reuse until the next reclaim.  If
+   the record cannot be kept the memory is leaked, never reused early. */
+static void pool_retire(struct sr_lpm_pool* p, uint8_t* base, uint32_t idx,
+                        uint32_t n)
+{
+    struct sr_lpm_retired* grown;
+    uint32_t cap;
+
+    if (p->nretired == p->retired_cap) {
+        cap = p->retired_cap ? p->retired_cap * 2 : POOL_INIT;
+        grown = (struct sr_lpm_retired*)realloc(p->retired, cap * sizeof(*grown));
+        if (!grown) {
+            return;
+        }
+        p->retired = grown;
+        p->retired_cap = cap;
+    }
+
+    p->retired[p->nretired].base = base;
+    p->retired[p->nretired].idx = idx;
+    p->retired[p->nretired].n = n;
+    p->nretired++;
+}
+
+/* Returns the first index of a block of n elements, 0 on failure.  The
+   pool may move, so pointers into it must be reloaded afterwards. */
+static uint32_t pool_alloc(struct sr_lpm_pool* p, uint32_t n)
+{
+    uint32_t idx;
+    uint32_t cap;
+    uint8_t* grown;
+
+    assert(n > 0 && n <= POOL_BLOCK_MAX);
+
+    if (p->free_list[n]) {
+        idx = p->free_list[n];
+        memcpy(&p->free_list[n], p->base + idx * p->esize, sizeof(uint32_t));
+        return idx;
+    }
+
+    if (p->used + n > p->cap) {
+        cap = p->cap * 2;
+        grown = (uint8_t*)malloc((size_t)cap * p->esize);
+        if (!grown) {
+            return 0;
+        }
+        memcpy(grown, p->base, (size_t)p->used * p->esize);
+        pool_retire(p, p->base, 0, 0);
+        __atomic_store_n(&p->base, grown, __ATOMIC_RELEASE);
+        p->cap = cap;
+    }
+
+    idx = p->used;
+    p->used += n;
+    return idx;
+}
+
+static void pool_free(struct sr_lpm_pool* p, uint32_t idx, uint32_t n)
+{
+    if (n == 0) {
+        return;
+    }
+    pool_retire(p, 0, idx, n);
+}
+
+static void pool_reclaim(struct sr_lpm_pool* p)
+{
+    struct sr_lpm_retired* r;
+    uint32_t i;
+
+    for (i = 0; i < p->nretired; i++) {
+        r = &p->retired[i];
+        if (r->base) {
+            free(r->base);
+        } else {
+            memcpy(p->base + r->idx * p->esize, &p->free_list[r->n],
+                   sizeof(uint32_t));
+            p->free_list[r->n] = r->idx;
+        }
+    }
+    p->nretired = 0;
+}
+
+static void pool_destroy(struct sr_lpm_pool* p)
+{
+    uint32_t i;
+
+    for (i = 0; i < p->nretired; i++) {
+        free(p->retired[i].base);
+    }
+    free(p->retired);
+    free(p->base);
+}
+
+/*---------------------------------------------------------------------
+ * DIR-24-8 helpers
+ *---------------------------------------------------------------------*/
+
+static int dir_init(struct sr_lpm_dir* d)
+{
+    d->tbl24 = (uint32_t*)calloc(DIR_TBL24_SZ, sizeof(uint32_t));
+    if (!d->tbl24) {
+        return -1;
+    }
+    if (pool_init(&d->tbl8, DIR_TBL8_SZ * sizeof(uint32_t)) != 0) {
+        free(d->tbl24);
+        return -1;
+    }
+    return 0;
+}
+
+static uint32_t dir_alloc_group(struct sr_lpm_dir* d)
+{
+    uint32_t group = pool_alloc(&d->tbl8, 1);
+
+    if (group == 0 || group > DIR_IDX_MASK) {
+        return DIR_EXT; /* out of groups */
+    }
+    return group;
+}
+
+static void dir_fill(uint32_t* tbl, uint32_t count, uint32_t entry,
+                     unsigned int len)
+{
+    uint32_t i;
+
+    for (i = 0; i < count; i++) {
+        if (DIR_DEPTH(tbl[i]) <= len) {
+            tbl[i] = entry;
+        }
+    }
+}
+
+/* Give the entries a len bit prefix wrote back to what covers it. */
+static void dir_refill(uint32_t* tbl, uint32_t count, unsigned int len,
+                       uint32_t parent)
+{
+    uint32_t i;
+
+    for (i = 0; i < count; i++) {
+        if (!(tbl[i] & DIR_EXT) && DIR_DEPTH(tbl[i]) == len) {
+            tbl[i] = parent;
+        }
+    }
+}
+
+static int dir_insert(struct sr_lpm_dir* d, uint32_t prefix, unsigned int len,
+                      uint32_t nh)
+{
+    uint32_t entry = DIR_ENTRY(nh, len);
+    uint32_t first, count, i, group;
+    uint32_t* tbl8;
+
+    if (len <= 24) {
+        first = prefix >> 8;
+        count = 1u << (24 - len);
+        for (i = first; i < first + count; i++) {
+            if (d->tbl24[i] & DIR_EXT) {
+                group = d->tbl24[i] & DIR_IDX_MASK;
+                dir_fill(DIR_GROUP(d->tbl8.base, group), DIR_TBL8_SZ, entry, len);
+            } else if (DIR_DEPTH(d->tbl24[i]) <= len) {
+                d->tbl24[i] = entry;
+            }
+        }
+        return 0;
+    }
+
+    i = prefix >> 8;
+    if (!(d->tbl24[i] & DIR_EXT)) {
+        group = dir_alloc_group(d);
+        if (group == DIR_EXT) {
+            return -1;
+        }
+        /* -- the new group inherits whatever covered the /24 -- */
+        tbl8 = DIR_GROUP(d->tbl8.base, group);
+        for (first = 0; first < DIR_TBL8_SZ; first++) {
+            tbl8[first] = d->tbl24[i];
+        }
+        __atomic_store_n(&d->tbl24[i], DIR_EXT | group, __ATOMIC_RELEASE);
+    }
+    group = d->tbl24[i] & DIR_IDX_MASK;
+
+    first = prefix & 0xff;
+    count = 1u << (32 - len);
+    dir_fill(DIR_GROUP(d->tbl8.base, group) + first, count, entry, len);
+
+    return 0;
+}
+
+static int dir_delete(struct sr_lpm_dir* d, uint32_t prefix, unsigned int len,
+                      uint32_t parent)
+{
+    uint32_t first, count, i, group;
+    uint32_t* tbl8;
+
+    if (len <= 24) {
+        first = prefix >> 8;
+        count = 1u << (24 - len);
+        for (i = first; i < first + count; i++) {
+            if (d->tbl24[i] & DIR_EXT) {
+                group = d->tbl24[i] & DIR_IDX_MASK;
+                dir_refill(DIR_GROUP(d->tbl8.base, group), DIR_TBL8_SZ, len, parent);
+            } else if (DIR_DEPTH(d->tbl24[i]) == len) {
+                d->tbl24[i] = parent;
+            }
+        }
+        return 0;
+    }
+
+    i = prefix >> 8;
+    if (!(d->tbl24[i] & DIR_EXT)) {
+        return -1;
+    }
+    group = d->tbl24[i] & DIR_IDX_MASK;
+    tbl8 = DIR_GROUP(d->tbl8.base, group);
+    dir_refill(tbl8 + (prefix & 0xff), 1u << (32 - len), len, parent);
+
+    /* -- a group that is no longer split folds back into tbl24 -- */
+    for (first = 1; first < DIR_TBL8_SZ && tbl8[first] == tbl8[0]; first++)
+        ;
+    if (first == DIR_TBL8_SZ) {
+        __atomic_store_n(&d->tbl24[i], tbl8[0], __ATOMIC_RELEASE);
+        pool_free(&d->tbl8, group, 1);
+    }
+    return 0;
+}
+
+static uint32_t dir_lookup(const struct sr_lpm_dir* d, uint32_t ip)
+{
+    const uint32_t* tbl24 = __atomic_load_n(&d->tbl24, __ATOMIC_ACQUIRE);
+    uint32_t e = __atomic_load_n(&tbl24[ip >> 8], __ATOMIC_ACQUIRE);
+
+    if (e & DIR_EXT) {
+        e = DIR_GROUP(__atomic_load_n(&d->tbl8.base, __ATOMIC_ACQUIRE),
+                      e & DIR_IDX_MASK)[ip & 0xff];
+    }
+
+    return e & DIR_IDX_MASK;
+}
+
+/*---------------------------------------------------------------------
+ * Tree bitmap helpers
+ *---------------------------------------------------------------------*/
+
+static void tbm_build_match(void)
+{
+    unsigned int nib, l;
+
+    if (tbm_match[0] != 0) {
+        return;
+    }
+    for (nib = 0; nib < (1 << TBM_STRIDE); nib++) {
+        for (l = 0; l < TBM_STRIDE; l++) {
+            tbm_match[nib] |= 1 << ((1u << l) - 1 + (nib >> (TBM_STRIDE - l)));
+        }
+    }
+}
+
+static int tbm_init(struct sr_lpm_tbm* t)
+{
+    tbm_build_match();
+
+    if (pool_init(&t->nodes, sizeof(struct sr_lpm_tbm_node)) != 0) {
+        return -1;
+    }
+    if (pool_init(&t->results, sizeof(uint32_t)) != 0) {
+        free(t->nodes.base);
+        return -1;
+    }
+
+    /* -- the root lives at index 0, which the pool never hands out -- */
+    memset(TBM_NODES(t), 0, sizeof(struct sr_lpm_tbm_node));
+    return 0;
+}
+
+/* Point word at block index with the given bitmap, as one store. */
+static void tbm_set(union sr_lpm_tbm_word* word, uint32_t index,
+                    unsigned int bitmap)
+{
+    union sr_lpm_tbm_word v;
+
+    v.w = 0;
+    v.f.index = bitmap ? index : 0;
+    v.f.bitmap = (uint16_t)bitmap;
+    __atomic_store_n(&word->w, v.w, __ATOMIC_RELEASE);
+}
+
+/* Make room for child nib (at position rank) under node idx. */
+static int tbm_add_child(struct sr_lpm_tbm* t, uint32_t idx, unsigned int nib,
+                         unsigned int rank)
+{
+    struct sr_lpm_tbm_node* nodes;
+    union sr_lpm_tbm_word ext = TBM_NODES(t)[idx].ext;
+    uint32_t n   = popcount(ext.f.bitmap);
+    uint32_t blk = pool_alloc(&t->nodes, n + 1);
+
+    if (blk == 0) {
+        return -1;
+    }
+
+    nodes = TBM_NODES(t);
+    memcpy(&nodes[blk], &nodes[ext.f.index], rank * sizeof(*nodes));
+    memset(&nodes[blk + rank], 0, sizeof(*nodes));
+    memcpy(&nodes[blk + rank + 1], &nodes[ext.f.index + rank],
+           (n - rank) * sizeof(*nodes));
+
+    tbm_set(&nodes[idx].ext, blk, ext.f.bitmap | (1u << nib));
+    pool_free(&t->nodes, ext.f.index, n);
+    return 0;
+}
+
+/* Drop child nib (at position rank) of node idx. */
+static int tbm_del_child(struct sr_lpm_tbm* t, uint32_t idx, unsigned int nib,
+                         unsigned int rank)
+{
+    struct sr_lpm_tbm_node* nodes;
+    union sr_lpm_tbm_word ext = TBM_NODES(t)[idx].ext;
+    uint32_t n   = popcount(ext.f.bitmap);
+    uint32_t blk = 0;
+
+    if (n > 1) {
+        blk = pool_alloc(&t->nodes, n - 1);
+        if (blk == 0) {
+            return -1;
+        }
+        nodes = TBM_NODES(t);
+        memcpy(&nodes[blk], &nodes[ext.f.index], rank * sizeof(*nodes));
+        memcpy(&nodes[blk + rank], &nodes[ext.f.index + rank + 1],
+               (n - rank - 1) * sizeof(*nodes));
+    }
+
+    tbm_set(&TBM_NODES(t)[idx].ext, blk, ext.f.bitmap & ~(1u << nib));
+    pool_free(&t->nodes, ext.f.index, n);
+    return 0;
+}
+
+/* Add result bit (at position rank) with next hop nh to node idx. */
+static int tbm_add_result(struct sr_lpm_tbm* t, uint32_t idx, unsigned int bit,
+                          unsigned int rank, uint32_t nh)
+{
+    uint32_t* results;
+    union sr_lpm_tbm_word in = TBM_NODES(t)[idx].in;
+    uint32_t n   = popcount(in.f.bitmap);
+    uint32_t blk = pool_alloc(&t->results, n + 1);
+
+    if (blk == 0) {
+        return -1;
+    }
+
+    results = TBM_RESULTS(t);
+    memcpy(&results[blk], &results[in.f.index], rank * sizeof(*results));
+    results[blk + rank] = nh;
+    memcpy(&results[blk + rank + 1], &results[in.f.index + rank],
+           (n - rank) * sizeof(*results));
+
+    tbm_set(&TBM_NODES(t)[idx].in, blk, in.f.bitmap | (1u << bit));
+    pool_free(&t->results, in.f.index, n);
+    return 0;
+}
+
+/* Drop result bit (at position rank) of node idx. */
+static int tbm_del_result(struct sr_lpm_tbm* t, uint32_t idx, unsigned int bit,
+                          unsigned int rank)
+{
+    uint32_t* results;
+    union sr_lpm_tbm_word in = TBM_NODES(t)[idx].in;
+    uint32_t n   = popcount(in.f.bitmap);
+    uint32_t blk = 0;
+
+    if (n > 1) {
+        blk = pool_alloc(&t->results, n - 1);
+        if (blk == 0) {
+            return -1;
+        }
+        results = TBM_RESULTS(t);
+        memcpy(&results[blk], &results[in.f.index], rank * sizeof(*results));
+        memcpy(&results[blk + rank], &results[in.f.index + rank + 1],
+               (n - rank - 1) * sizeof(*results));
+    }
+
+    tbm_set(&TBM_NODES(t)[idx].in, blk, in.f.bitmap & ~(1u << bit));
+    pool_free(&t->results, in.f.index, n);
+    return 0;
+}
+
+/* Internal bitmap bit of the last len % TBM_STRIDE bits of prefix. */
+static unsigned int tbm_bit(uint32_t prefix, unsigned int pos, unsigned int len)
+{
+    unsigned int l = len - pos;
+    unsigned int bit = (1u << l) - 1;
+
+    if (l) {
+        bit += (prefix >> (32 - pos - l)) & ((1u << l) - 1);
+    }
+    return bit;
+}
+
+static int tbm_insert(struct sr_lpm_tbm* t, uint32_t prefix, unsigned int len,
+                      uint32_t nh)
+{
+    struct sr_lpm_tbm_node* node;
+    uint32_t     idx = 0;
+    unsigned int pos = 0;
+    unsigned int nib, rank, bit;
+
+    /* -- walk (and grow) the path down to the node the prefix ends in -- */
+    while (len - pos >= TBM_STRIDE) {
+        nib = (prefix >> (32 - TBM_STRIDE - pos)) & ((1 << TBM_STRIDE) - 1);
+        node = &TBM_NODES(t)[idx];
+        rank = popcount(node->ext.f.bitmap & ((1u << nib) - 1));
+        if (!(node->ext.f.bitmap & (1u << nib))) {
+            if (tbm_add_child(t, idx, nib, rank) != 0) {
+                return -1;
+            }
+        }
+        idx = TBM_NODES(t)[idx].ext.f.index + rank;
+        pos += TBM_STRIDE;
+    }
+
+    bit = tbm_bit(prefix, pos, len);
+    node = &TBM_NODES(t)[idx];
+    rank = popcount(node->in.f.bitmap & ((1u << bit) - 1));
+    if (node->in.f.bitmap & (1u << bit)) {
+        __atomic_store_n(&TBM_RESULTS(t)[node->in.f.index + rank], nh,
+                         __ATOMIC_RELEASE);
+        return 0;
+    }
+
+    return tbm_add_result(t, idx, bit, rank, nh);
+}
+
+static int tbm_delete(struct sr_lpm_tbm* t, uint32_t prefix, unsigned int len)
+{
+    struct sr_lpm_tbm_node* node;
+    uint32_t     path[32 / TBM_STRIDE + 1];
+    unsigned int nibs[32 / TBM_STRIDE + 1];
+    unsigned int depth = 0;
+    unsigned int pos = 0;
+    unsigned int nib, rank, bit;
+
+    path[0] = 0;
+    while (len - pos >= TBM_STRIDE) {
+        nib = (prefix >> (32 - TBM_STRIDE - pos)) & ((1 << TBM_STRIDE) - 1);
+        node = &TBM_NODES(t)[path[depth]];
+        if (!(node->ext.f.bitmap & (1u << nib))) {
+            return -1;
+        }
+        nibs[depth] = nib;
+        path[depth + 1] = node->ext.f.index +
+                          popcount(node->ext.f.bitmap & ((1u << nib) - 1));
+        depth++;
+        pos += TBM_STRIDE;
+    }
+
+    bit = tbm_bit(prefix, pos, len);
+    node = &TBM_NODES(t)[path[depth]];
+    if (!(node->in.f.bitmap & (1u << bit))) {
+        return -1;
+    }
+    rank = popcount(node->in.f.bitmap & ((1u << bit) - 1));
+    if (tbm_del_result(t, path[depth], bit, rank) != 0) {
+        return -1;
+    }
+
+    /* -- unhook nodes left with neither prefixes nor children -- */
+    while (depth > 0) {
+        node = &TBM_NODES(t)[path[depth]];
+        if (node->in.f.bitmap || node->ext.f.bitmap) {
+            break;
+        }
+        depth--;
+        nib = nibs[depth];
+        rank = popcount(TBM_NODES(t)[path[depth]].ext.f.bitmap & ((1u << nib) - 1));
+        if (tbm_del_child(t, path[depth], nib, rank) != 0) {
+            break; /* -- an empty node is harmless, just not reclaimed -- */
+        }
+    }
+
+    return 0;
+}
+
+static uint32_t tbm_lookup(const struct sr_lpm_tbm* t, uint32_t ip)
+{
+    const struct sr_lpm_tbm_node* nodes = (const struct sr_lpm_tbm_node*)
+        __atomic_load_n(&t->nodes.base, __ATOMIC_ACQUIRE);
+    const struct sr_lpm_tbm_node* node = &nodes[0];
+    const uint32_t* results;
+    union sr_lpm_tbm_word ext;
+    union sr_lpm_tbm_word in;
+    uint32_t     best = SR_LPM_NONE;
+    unsigned int pos = 0;
+    unsigned int nib, match, bit;
+
+    for (;;) {
+        nib = (pos < 32) ? (ip >> (32 - TBM_STRIDE - pos)) & ((1 << TBM_STRIDE) - 1) : 0;
+
+        /* -- longest prefix ending in this node: highest matching bit -- */
+        in.w = __atomic_load_n(&node->in.w, __ATOMIC_ACQUIRE);
+        match = in.f.bitmap & tbm_match[nib];
+        if (match) {
+            bit = 31 - __builtin_clz(match);
+            results = (const uint32_t*)
+                __atomic_load_n(&t->results.base, __ATOMIC_ACQUIRE);
+            best = results[in.f.index +
+                           popcount(in.f.bitmap & ((1u << bit) - 1))];
+        }
+
+        if (pos >= 32) {
+            break;
+        }
+        ext.w = __atomic_load_n(&node->ext.w, __ATOMIC_ACQUIRE);
+        if (!(ext.f.bitmap & (1u << nib))) {
+            break;
+        }
+        node = &nodes[ext.f.index + popcount(ext.f.bitmap & ((1u << nib) - 1))];
+        pos += TBM_STRIDE;
+    }
+
+    return best;
+}
+
+/*---------------------------------------------------------------------
+ * Image helpers
+ *---------------------------------------------------------------------*/
+
+static void* copy_of(const void* src, size_t len)
+{
+    void* dst;
+
+    if (len == 0) {
+        return 0;
+    }
+    dst = malloc(len);
+    if (dst) {
+        memcpy(dst, src, len);
+    }
+    return dst;
+}
+
+/* Give an imported table private copies of its arrays so it can be
+   modified.  Capacities are trimmed to what is in use; the usual
+   doubling takes over from there.  The borrowed arrays stay valid for
+   lookups already running, as the image outlives the table. */
+static int lpm_unshare(struct sr_lpm* lpm)
+{
+    struct sr_lpm_pool* p[2];
+    void* copy[2];
+    int i;
+
+    if (lpm->type == sr_lpm_dir24_8) {
+        copy[0] = copy_of(lpm->u.dir.tbl24, (size_t)DIR_TBL24_SZ * sizeof(uint32_t));
+        p[0] = 0;
+        p[1] = &lpm->u.dir.tbl8;
+    } else {
+        p[0] = &lpm->u.tbm.nodes;
+        p[1] = &lpm->u.tbm.results;
+        copy[0] = copy_of(p[0]->base, (size_t)p[0]->used * p[0]->esize);
+    }
+    copy[1] = copy_of(p[1]->base, (size_t)p[1]->used * p[1]->esize);
+
+    if (!copy[0] || !copy[1]) {
+        free(copy[0]);
+        free(copy[1]);
+        return -1;
+    }
+
+    if (lpm->type == sr_lpm_dir24_8) {
+        __atomic_store_n(&lpm->u.dir.tbl24, (uint32_t*)copy[0], __ATOMIC_RELEASE);
+    }
+    for (i = 0; i < 2; i++) {
+        if (p[i]) {
+            __atomic_store_n(&p[i]->base, (uint8_t*)copy[i], __ATOMIC_RELEASE);
+            p[i]->cap = p[i]->used;
+        }
+    }
+
+    lpm->shared = 0;
+    return 0;
+}
+
+/*---------------------------------------------------------------------
+ * Method: sr_lpm_create(..)
+ * Scope: Global
+ *
+ * Create an empty table using the given backend.  Returns 0 if the
+ * backing memory could not be allocated.
+ *
+ *---------------------------------------------------------------------*/
+
+struct sr_lpm* sr_lpm_create(sr_lpm_type type)
+{
+    struct sr_lpm* lpm = (struct sr_lpm*)calloc(1, sizeof(struct sr_lpm));
+    int ret;
+
+    if (!lpm) {
+        return 0;
+    }
+
+    lpm->type = type;
+    switch (type) {
+        case sr_lpm_dir24_8:
+            ret = dir_init(&lpm->u.dir);
+            break;
+        case sr_lpm_trie:
+            ret = tbm_init(&lpm->u.tbm);
+            break;
+        default:
+            ret = -1;
+    }
+
+    if (ret != 0) {
+        free(lpm);
+        return 0;
+    }
+    return lpm;
+} /* -- sr_lpm_create -- */
+
+/*---------------------------------------------------------------------
+ * Method: sr_lpm_destroy(..)
+ * Scope: Global
+ *
+ *---------------------------------------------------------------------*/
+
+void sr_lpm_destroy(struct sr_lpm* lpm)
+{
+    if (!lpm) {
+        return;
+    }
+
+    if (lpm->shared) {
+        free(lpm);
+        return;
+    }
+
+    switch (lpm->type) {
+        case sr_lpm_dir24_8:
+            free(lpm->u.dir.tbl24);
+            pool_destroy(&lpm->u.dir.tbl8);
+            break;
+        case sr_lpm_trie:
+            pool_destroy(&lpm->u.tbm.nodes);
+            pool_destroy(&lpm->u.tbm.results);
+            break;
+    }
+    free(lpm);
+} /* -- sr_lpm_destroy -- */
+
+/*---------------------------------------------------------------------
+ * Method: sr_lpm_insert(..)
+ * Scope: Global
+ *
+ * Insert prefix/len with next hop nh, replacing the next hop if the exact
+ * prefix is already present.  Bits of prefix past len are ignored.
+ *
+ * RETURN VALUES:
+ *
+ *  0 on success
+ *  -1 on bad arguments or when the table cannot grow
+ *
+ *---------------------------------------------------------------------*/
+
+int sr_lpm_insert(struct sr_lpm* lpm, uint32_t prefix, unsigned int len,
+                  uint32_t nh)
+{
+    /* -- REQUIRES -- */
+    assert(lpm);
+
+    if (len > 32 || nh == SR_LPM_NONE || nh > SR_LPM_NH_MAX) {
+        return -1;
+    }
+    prefix &= len ? (uint32_t)(0xffffffffu << (32 - len)) : 0;
+
+    if (lpm->shared && lpm_unshare(lpm) != 0) {
+        return -1;
+    }
+
+    switch (lpm->type) {
+        case sr_lpm_dir24_8:
+            return dir_insert(&lpm->u.dir, prefix, len, nh);
+        case sr_lpm_trie:
+            return tbm_insert(&lpm->u.tbm, prefix, len, nh);
+    }
+    return -1;
+} /* -- sr_lpm_insert -- */
+
+/*---------------------------------------------------------------------
+ * Method: sr_lpm_delete(..)
+ * Scope: Global
+ *
+ * Remove prefix/len, which must be in the table.  Only the range of
+ * addresses the prefix covers is touched.  parent_nh/parent_len name
+ * the longest prefix left in the table that covers prefix/len
+ * (SR_LPM_NONE/0 if there is none); DIR-24-8 refills the range with
+ * it, the trie finds it on its own and ignores it.
+ *
+ * RETURN VALUES:
+ *
+ *  0 on success
+ *  -1 on bad arguments, if the trie does not hold the prefix or the
+ *     table could not be changed
+ *
+ *---------------------------------------------------------------------*/
+
+int sr_lpm_delete(struct sr_lpm* lpm, uint32_t prefix, unsigned int len,
+                  uint32_t parent_nh, unsigned int parent_len)
+{
+    /* -- REQUIRES -- */
+    assert(lpm);
+
+    if (len > 32 || parent_nh > SR_LPM_NH_MAX ||
+        (parent_nh != SR_LPM_NONE && parent_len >= len)) {
+        return -1;
+    }
+    prefix &= len ? (uint32_t)(0xffffffffu << (32 - len)) : 0;
+
+    if (lpm->shared && lpm_unshare(lpm) != 0) {
+        return -1;
+    }
+
+    switch (lpm->type) {
+        case sr_lpm_dir24_8:
+            return dir_delete(&lpm->u.dir, prefix, len,
+                    parent_nh ? DIR_ENTRY(parent_nh, parent_len) : 0);
+        case sr_lpm_trie:
+            return tbm_delete(&lpm->u.tbm, prefix, len);
+    }
+    return -1;
+} /* -- sr_lpm_delete -- */
+
+/*---------------------------------------------------------------------
+ * Method: sr_lpm_reclaim(..)
+ * Scope: Global
+ *
+ * Reuse or free the memory earlier inserts and deletes retired.  Call
+ * only once no lookup that started before those changes can still be
+ * running (after an RCU grace period), or while the table is private
+ * to the caller.
+ *
+ *---------------------------------------------------------------------*/
+
+void sr_lpm_reclaim(struct sr_lpm* lpm)
+{
+    /* -- REQUIRES -- */
+    assert(lpm);
+
+    switch (lpm->type) {
+        case sr_lpm_dir24_8:
+            pool_reclaim(&lpm->u.dir.tbl8);
+            break;
+        case sr_lpm_trie:
+            pool_reclaim(&lpm->u.tbm.nodes);
+            pool_reclaim(&lpm->u.tbm.results);
+            break;
+    }
+} /* -- sr_lpm_reclaim -- */
+
+/*---------------------------------------------------------------------
+ * Method: sr_lpm_lookup(..)
+ * Scope: Global
+ *
+ * Return the next hop of the longest prefix covering ip, or SR_LPM_NONE.
+ *
+ *---------------------------------------------------------------------*/
+
+uint32_t sr_lpm_lookup(const struct sr_lpm* lpm, uint32_t ip)
+{
+    if (lpm->type == sr_lpm_dir24_8) {
+        return dir_lookup(&lpm->u.dir, ip);
+    }
+    return tbm_lookup(&lpm->u.tbm, ip);
+} /* -- sr_lpm_lookup -- */
+
+sr_lpm_type sr_lpm_get_type(const struct sr_lpm* lpm)
+{
+    return lpm->type;
+}
+
+/*---------------------------------------------------------------------
+ * Method: sr_lpm_export(..)
+ * Scope: Global
+ *
+ * Describe the arrays that make up the table.  Everything in them is
+ * index based, so writing the parts out and handing them back to
+ * sr_lpm_import(..) later, at any address, yields the same table.
+ * The image points into lpm and is only valid until it changes.
+ *
+ *---------------------------------------------------------------------*/
+
+void sr_lpm_export(const struct sr_lpm* lpm, struct sr_lpm_image* img)
+{
+    const struct sr_lpm_pool* p[2];
+    int i;
+
+    /* -- REQUIRES -- */
+    assert(lpm);
+    assert(img);
+
+    memset(img, 0, sizeof(*img));
+    img->type = lpm->type;
+
+    if (lpm->type == sr_lpm_dir24_8) {
+        img->count[0] = DIR_TBL24_SZ;
+        img->part[0]  = lpm->u.dir.tbl24;
+        img->size[0]  = (size_t)DIR_TBL24_SZ * sizeof(uint32_t);
+        p[0] = 0;
+        p[1] = &lpm->u.dir.tbl8;
+    } else {
+        p[0] = &lpm->u.tbm.nodes;
+        p[1] = &lpm->u.tbm.results;
+    }
+
+    for (i = 0; i < 2; i++) {
+        if (p[i]) {
+            img->count[i] = p[i]->used;
+            img->part[i]  = p[i]->base;
+            img->size[i]  = (size_t)p[i]->used * p[i]->esize;
+        }
+    }
+} /* -- sr_lpm_export -- */
+
+/*---------------------------------------------------------------------
+ * Method: sr_lpm_import(..)
+ * Scope: Global
+ *
+ * Build a table directly on top of the arrays described by img, without
+ * copying them; they must stay valid and unchanged until the table is
+ * destroyed.  The first insert gives the table its own copies.
+ * Returns 0 if the image does not describe a table of this layout.
+ *
+ *---------------------------------------------------------------------*/
+
+struct sr_lpm* sr_lpm_import(const struct sr_lpm_image* img)
+{
+    struct sr_lpm* lpm;
+    struct sr_lpm_pool* p[2];
+    size_t esize[2];
+    int i;
+
+    /* -- REQUIRES -- */
+    assert(img);
+
+    switch (img->type) {
+        case sr_lpm_dir24_8:
+            esize[0] = sizeof(uint32_t);
+            esize[1] = DIR_TBL8_SZ * sizeof(uint32_t);
+            if (img->count[0] != DIR_TBL24_SZ ||
+                img->count[1] > DIR_IDX_MASK + 1) {
+                return 0;
+            }
+            break;
+        case sr_lpm_trie:
+            esize[0] = sizeof(struct sr_lpm_tbm_node);
+            esize[1] = sizeof(uint32_t);
+            break;
+        default:
+            return 0;
+    }
+    for (i = 0; i < 2; i++) {
+        if (img->count[i] == 0 ||
+            img->size[i] != (size_t)img->count[i] * esize[i]) {
+            return 0;
+        }
+    }
+
+    lpm = (struct sr_lpm*)calloc(1, sizeof(struct sr_lpm));
+    if (!lpm) {
+        return 0;
+    }
+    lpm->type = (sr_lpm_type)img->type;
+    lpm->shared = 1;
+
+    if (lpm->type == sr_lpm_dir24_8) {
+        lpm->u.dir.tbl24 = (uint32_t*)img->part[0];
+        p[0] = 0;
+        p[1] = &lpm->u.dir.tbl8;
+    } else {
+        tbm_build_match();
+        p[0] = &lpm->u.tbm.nodes;
+        p[1] = &lpm->u.tbm.results;
+    }
+
+    for (i = 0; i < 2; i++) {
+        if (p[i]) {
+            p[i]->base = (uint8_t*)img->part[i];
+            p[i]->esize = esize[i];
+            p[i]->used = p[i]->cap = img->count[i];
+        }
+    }
+
+    return lpm;
+} /* -- sr_lpm_import -- */
+
+/*---------------------------------------------------------------------
+ * Method: sr_lpm_memory(..)
+ * Scope: Global
+ *
+ * Bytes of lookup state currently allocated by the table.
+ *
+ *---------------------------------------------------------------------*/
+
+size_t sr_lpm_memory(const struct sr_lpm* lpm)
+{
+    size_t bytes = sizeof(struct sr_lpm);
+
+    switch (lpm->type) {
+        case sr_lpm_dir24_8:
+            bytes += (size_t)DIR_TBL24_SZ * sizeof(uint32_t);
+            bytes += (size_t)lpm->u.dir.tbl8.cap * lpm->u.dir.tbl8.esize;
+            break;
+        case sr_lpm_trie:
+            bytes += (size_t)lpm->u.tbm.nodes.cap * lpm->u.tbm.nodes.esize;
+            bytes += (size_t)lpm->u.tbm.results.cap * lpm->u.tbm.results.esize;
+            break;
+    }
+    return bytes;
+} /* -- sr_lpm_memory -- */
+
+const char* sr_lpm_type_name(sr_lpm_type type)
+{
+    return (type == sr_lpm_dir24_8) ? "dir-24-8" : "trie";
+}
+
+/* Parse a backend name as given on the command line.  Returns 0 on
+   success. */
+int sr_lpm_parse_type(const char* name, sr_lpm_type* type)
+{
+    if (!strcmp(name, "dir24") || !strcmp(name, "dir-24-8")) {
+        *type = sr_lpm_dir24_8;
+        return 0;
+    }
+    if (!strcmp(name, "trie")) {
+        *type = sr_lpm_trie;
+        return 0;
+    }
+    return -1;
+}
+
+/* Number of leading one bits in a (host order) netmask. */
+unsigned int sr_lpm_mask_len(uint32_t mask)
+{
+    unsigned int len = 0;
+
+    while (len < 32 && (mask & (0x80000000u >> len))) {
+        len++;
+    }
+    return len;
+}
@@ -0,0 +1,85 @@
+/*-----------------------------------------------------------------------------
+ * file:  sr_lpm.h
+ *
+ * Description:
+ *
+ * Longest prefix match engine used by the forwarding path.  The routing
+ * table list in sr_rt.c is only the configuration source; every route is
+ * also inserted here and packets are matched against this structure.
+ *
+ * Two backends are available and selected when the table is created:
+ *
+ *   sr_lpm_dir24_8 - flat DIR-24-8 table.  A 2^24 entry first level indexed
+ *                    by the top 24 bits of the address, with 256 entry
+ *                    second level groups for prefixes longer than /24.
+ *                    One memory access for most lookups, two at worst.
+ *
+ *   sr_lpm_trie    - compressed multibit trie (tree bitmap, stride 4).
+ *                    Nodes and results are kept in dense arrays indexed by
+ *                    popcount, which keeps memory use close to the number
+ *                    of prefixes at the cost of up to nine node visits.
+ *
+ * All addresses and prefixes handed to this module are in HOST byte order.
+ * Next hops are opaque non-zero values below SR_LPM_NH_MAX; a lookup that
+ * matches nothing returns SR_LPM_NONE.
+ *
+ * Prefixes can be inserted and deleted while other threads look up in the
+ * same table, as long as there is a single writer and lookups run inside
+ * RCU read-side sections (sr_rcu.h): the writer calls sr_lpm_reclaim(..)
+ * after a grace period to recycle the memory its changes retired.
+ *
+ *---------------------------------------------------------------------------*/
+
+#ifndef SR_LPM_H
+#define SR_LPM_H
+
+#ifdef _LINUX_
+#include <stdint.h>
+#endif /* _LINUX_ */
+
+#ifdef _DARWIN_
+#include <inttypes.h>
+#endif /* _DARWIN_ */
+
+#include <stddef.h>
+
+#define SR_LPM_NONE   0
+#define SR_LPM_NH_MAX 0x00ffffff
+
+typedef enum {
+    sr_lpm_dir24_8,
+    sr_lpm_trie
+} sr_lpm_type;
+
+struct sr_lpm;
+
+/* A table as a fixed number of flat arrays, see sr_lpm_export(..). */
+#define SR_LPM_IMAGE_PARTS 2
+
+struct sr_lpm_image {
+    uint32_t    type;                        /* sr_lpm_type */
+    uint32_t    count[SR_LPM_IMAGE_PARTS];   /* elements in each part */
+    const void* part[SR_LPM_IMAGE_PARTS];
+    size_t      size[SR_LPM_IMAGE_PARTS];    /* bytes in each part */
+};
+
+struct sr_lpm* sr_lpm_create(sr_lpm_type type);
+void        sr_lpm_destroy(struct sr_lpm* lpm);
+int         sr_lpm_insert(struct sr_lpm* lpm, uint32_t prefix, unsigned int len,
+                          uint32_t nh);
+int         sr_lpm_delete(struct sr_lpm* lpm, uint32_t prefix, unsigned int len,
+                          uint32_t parent_nh, unsigned int parent_len);
+void        sr_lpm_reclaim(struct sr_lpm* lpm);
+uint32_t    sr_lpm_lookup(const struct sr_lpm* lpm, uint32_t ip);
+sr_lpm_type sr_lpm_get_type(const struct sr_lpm* lpm);
+size_t      sr_lpm_memory(const struct sr_lpm* lpm);
+
+void           sr_lpm_export(const struct sr_lpm* lpm, struct sr_lpm_image* img);
+struct sr_lpm* sr_lpm_import(const struct sr_lpm_image* img);
+
+const char* sr_lpm_type_name(sr_lpm_type type);
+int         sr_lpm_parse_type(const char* name, sr_lpm_type* type);
+
+unsigned int sr_lpm_mask_len(uint32_t mask);
+
+#endif /* -- SR_LPM_H -- */
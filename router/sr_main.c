@@ -23,6 +23,9 @@
 #include <string.h>
 #include <unistd.h>
 #include <pwd.h>
+#include <signal.h>
+#include <pthread.h>
+#include <time.h>
 #include <sys/types.h>
 
 #ifdef _LINUX_
@@ -32,7 +35,13 @@
 #include "sr_dumper.h"
 #include "sr_router.h"
 #include "sr_rt.h"
+#include "sr_lpm.h"
+#include "sr_rcu.h"
+#include "sr_snapshot.h"
 #include "sr_nat.h"
+#include "sr_bench.h"
+#include "sr_ortc.h"
+#include "sr_vrf.h"
 
 extern char* optarg;
 
@@ -51,6 +60,7 @@ static void sr_init_instance(struct sr_instance* );
 static void sr_destroy_instance(struct sr_instance* );
 static void sr_set_user(struct sr_instance* );
 static void sr_load_rt_wrap(struct sr_instance* sr, char* rtable);
+static void sr_load_vrfs(struct sr_instance* sr);
 
 /*-----------------------------------------------------------------------------
  *---------------------------------------------------------------------------*/
@@ -70,11 +80,24 @@ int main(int argc, char **argv)
     unsigned int port = DEFAULT_PORT;
     unsigned int topo = DEFAULT_TOPO;
     char *logfile = 0;
+    char *ctl_path = 0;
+    char *bench = 0;
+    char *vrf_list = 0;
+    uint32_t arp_max = 0;
+    uint32_t arp_queue = 0;
+    int ortc = 0;
+    sr_lpm_type lpm_type = sr_lpm_dir24_8;
+    sigset_t sighup;
     struct sr_instance sr;
 
     printf("Using %s\n", VERSION_INFO);
 
-    while ((c = getopt(argc, argv, "hns:v:p:u:t:r:l:T:I:E:R:")) != EOF)
+    /* -- SIGHUP reloads the routing table, only the reload thread sees it -- */
+    sigemptyset(&sighup);
+    sigaddset(&sighup, SIGHUP);
+    pthread_sigmask(SIG_BLOCK, &sighup, 0);
+
+    while ((c = getopt(argc, argv, "hns:v:p:u:t:r:l:T:I:E:R:L:C:B:AVF:a:q:")) != EOF)
     {
         switch (c)
         {
@@ -117,11 +140,61 @@ int main(int argc, char **argv)
             case 'R':
                 tcpTransitoryTimeout = atoi(optarg);
                 break;
+            case 'L':
+                if(sr_lpm_parse_type(optarg, &lpm_type) != 0)
+                {
+                    fprintf(stderr, "Unknown LPM backend %s\n", optarg);
+                    usage(argv[0]);
+                    exit(1);
+                }
+                break;
+            case 'C':
+                ctl_path = optarg;
+                break;
+            case 'B':
+                bench = optarg;
+                break;
+            case 'A':
+                ortc |= SR_ORTC_ON;
+                break;
+            case 'V':
+                ortc |= SR_ORTC_ON | SR_ORTC_VERIFY;
+                break;
+            case 'F':
+                vrf_list = optarg;
+                break;
+            case 'a':
+                arp_max = strtoul(optarg, 0, 10);
+                if(arp_max == 0)
+                {
+                    fprintf(stderr, "Bad ARP cache size %s\n", optarg);
+                    usage(argv[0]);
+                    exit(1);
+                }
+                break;
+            case 'q':
+                arp_queue = strtoul(optarg, 0, 10);
+                if(arp_queue == 0)
+                {
+                    fprintf(stderr, "Bad ARP queue depth %s\n", optarg);
+                    usage(argv[0]);
+                    exit(1);
+                }
+                break;
         } /* switch */
     } /* -- while -- */
 
     /* -- zero out sr instance -- */
     sr_init_instance(&sr);
+    sr.lpm_type = lpm_type;
+    sr.ctl_path = ctl_path;
+    sr.ortc = ortc;
+    sr.arp_max = arp_max;
+    sr.arp_queue = arp_queue;
+
+    /* -- benchmarks run on their own, without a server -- */
+    if(bench != 0)
+    { return sr_bench(&sr, bench); }
 
     /* -- set up routing table from file -- */
     if(template == NULL) {
@@ -131,6 +204,13 @@ int main(int argc, char **argv)
     else
         strncpy(sr.template, template, 30);
 
+    /* -- named tables, bound to interfaces as the server reports them -- */
+    if(vrf_list) {
+        if(sr_vrf_config(&sr, vrf_list) != 0)
+        { exit(1); }
+        sr_load_vrfs(&sr);
+    }
+
     sr.topo_id = topo;
     strncpy(sr.host,host,32);
 
@@ -178,7 +258,6 @@ int main(int argc, char **argv)
 
         sr_nat_init(sr.nat);
         sr.nat->sr_instance = &sr;
-        sr.nat->possible_conns = NULL;
         sr.nat->tcpTransitoryTimeout = tcpTransitoryTimeout;
         sr.nat->tcpEstablishedTimeout = tcpEstablishedTimeout;
         sr.nat->icmpTimeout = icmpTimeout;
@@ -208,7 +287,11 @@ static void usage(char* argv0)
     printf("Format: %s [-h] [-v host] [-s server] [-p port] \n",argv0);
     printf("           [-T template_name] [-u username] \n");
     printf("           [-t topo id] [-r routing table] \n");
-    printf("           [-l log file] \n");
+    printf("           [-l log file] [-L dir24|trie] \n");
+    printf("           [-C control socket] [-B benchmark] \n");
+    printf("           [-A compress routes] [-V compress and verify] \n");
+    printf("           [-F named routing tables] [-a ARP cache entries] \n");
+    printf("           [-q packets waiting per ARP request] \n");
     printf("   defaults server=%s port=%d host=%s  \n",
             DEFAULT_SERVER, DEFAULT_PORT, DEFAULT_HOST );
 } /* -- usage -- */
@@ -273,11 +356,21 @@ static void sr_init_instance(struct sr_instance* sr)
     assert(sr);
 
     sr->sockfd = -1;
+    pthread_mutex_init(&sr->send_lock, 0);
     sr->user[0] = 0;
     sr->host[0] = 0;
     sr->topo_id = 0;
     sr->if_list = 0;
-    sr->routing_table = 0;
+    memset(sr->ifaces, 0, sizeof(sr->ifaces));
+    memset(&sr->local, 0, sizeof(sr->local));
+    sr->fib = 0;
+    sr->vrfs = 0;
+    sr->rtable_path = 0;
+    sr->lpm_type = sr_lpm_dir24_8;
+    sr->ortc = 0;
+    sr->ctl_path = 0;
+    sr->arp_max = 0;
+    sr->arp_queue = 0;
     sr->logfile = 0;
 } /* -- sr_init_instance -- */
 
@@ -296,52 +389,113 @@ static void sr_init_instance(struct sr_instance* sr)
  *
  *---------------------------------------------------------------------------*/
 
-int sr_verify_routing_table(struct sr_instance* sr)
+/* Routes of fib whose interface does not exist. */
+static int sr_verify_table(struct sr_instance* sr, const struct sr_fib* fib)
 {
     struct sr_rt* rt_walker = 0;
-    struct sr_if* if_walker = 0;
+    int ret = 0;
+
+    for(rt_walker = fib->routing_table; rt_walker; rt_walker = rt_walker->next)
+    {
+        /* -- check to see if interface exists -- */
+        if(sr_if_get(sr, rt_walker->ifindex) == 0)
+        { ret++; } /* -- interface not found! -- */
+    }
+
+    return ret;
+}
+
+int sr_verify_routing_table(struct sr_instance* sr)
+{
+    struct sr_vrf* vrf = 0;
+    struct sr_fib* fib = 0;
     int ret = 0;
 
     /* -- REQUIRES --*/
     assert(sr);
 
-    if( (sr->if_list == 0) || (sr->routing_table == 0))
+    sr_rcu_read_lock();
+    fib = sr_rcu_deref(&sr->fib);
+
+    if( (sr->if_list == 0) || (fib == 0) || (fib->routing_table == 0))
     {
+        sr_rcu_read_unlock();
         return 999; /* doh! */
     }
 
-    rt_walker = sr->routing_table;
+    ret = sr_verify_table(sr, fib);
 
-    while(rt_walker)
+    /* -- named tables may be empty, but must not use unknown interfaces -- */
+    for(vrf = sr->vrfs; vrf; vrf = vrf->next)
     {
-        /* -- check to see if interface exists -- */
-        if_walker = sr->if_list;
-        while(if_walker)
-        {
-            if( strncmp(if_walker->name,rt_walker->interface,sr_IFACE_NAMELEN)
-                    == 0)
-            { break; }
-            if_walker = if_walker->next;
-        }
-        if(if_walker == 0)
-        { ret++; } /* -- interface not found! -- */
-
-        rt_walker = rt_walker->next;
-    } /* -- while -- */
+        fib = sr_rcu_deref(&vrf->fib);
+        if(fib)
+        { ret += sr_verify_table(sr, fib); }
+    }
 
+    sr_rcu_read_unlock();
     return ret;
 } /* -- sr_verify_routing_table -- */
 
-static void sr_load_rt_wrap(struct sr_instance* sr, char* rtable) {
-    if(sr_load_rt(sr, rtable) != 0) {
-        fprintf(stderr,"Error setting up routing table from file %s\n",
-                rtable);
-        exit(1);
+/* Load rtable into *table, from its snapshot if that is fresh. */
+static void sr_load_table(struct sr_instance* sr, struct sr_fib** table,
+        const char* rtable) {
+    struct timespec start, done;
+    struct sr_fib* fib = 0;
+
+    /* -- prefer a fresh snapshot of the table, it needs no rebuild -- */
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    fib = sr_snapshot_load(rtable, sr->lpm_type, sr->ortc & SR_ORTC_ON);
+    if(fib) {
+        sr_fib_publish(table, fib);
+        clock_gettime(CLOCK_MONOTONIC, &done);
+        printf("Loaded %lu prefixes from snapshot of %s in %.1f ms\n",
+                (unsigned long)(fib->nroutes - 1), rtable,
+                (done.tv_sec - start.tv_sec) * 1e3 +
+                (done.tv_nsec - start.tv_nsec) / 1e6);
+    }
+    else {
+        if(sr_load_rt(sr, table, rtable) != 0) {
+            fprintf(stderr,"Error setting up routing table from file %s\n",
+                    rtable);
+            exit(1);
+        }
+        if(*table && sr_snapshot_save(*table, rtable) != 0) {
+            fprintf(stderr,"Warning: could not write snapshot of %s\n",
+                    rtable);
+        }
+    }
+}
+
+static void sr_load_vrfs(struct sr_instance* sr) {
+    struct sr_vrf* vrf = 0;
+
+    for(vrf = sr->vrfs; vrf; vrf = vrf->next) {
+        sr_load_table(sr, &vrf->fib, vrf->rtable_path);
+        printf("Routing table %s: %lu routes", vrf->name,
+                vrf->fib ? (unsigned long)vrf->fib->nlist : 0UL);
+        if(vrf->fib) {
+            printf(", %s, %lu bytes",
+                    sr_lpm_type_name(sr_lpm_get_type(vrf->fib->lpm)),
+                    (unsigned long)sr_lpm_memory(vrf->fib->lpm));
+        }
+        printf("\n");
     }
+}
+
+static void sr_load_rt_wrap(struct sr_instance* sr, char* rtable) {
+    sr_load_table(sr, &sr->fib, rtable);
+    sr->rtable_path = rtable;
 
 
     printf("Loading routing table\n");
     printf("---------------------------------------------\n");
     sr_print_routing_table(sr);
     printf("---------------------------------------------\n");
+    if(sr->fib)
+    {
+        printf("Forwarding table: %s, %lu bytes\n",
+                sr_lpm_type_name(sr_lpm_get_type(sr->fib->lpm)),
+                (unsigned long)sr_lpm_memory(sr->fib->lpm));
+    }
 }
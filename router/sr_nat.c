@@ -1,5 +1,6 @@
 
 #include <stdio.h>
+#include <stddef.h>
 #include <stdlib.h>
 #include <string.h>
 #include <signal.h>
@@ -10,8 +11,14 @@
 #include "sr_arpcache.h"
 #include "sr_utils.h"
 #include "sr_router.h"
+#include "sr_rcu.h"
 
-int EXT_ID = 1;
+static void sr_nat_mapping_timer(struct sr_timer *timer, void *arg);
+static void sr_nat_conn_timer(struct sr_timer *timer, void *arg);
+static void sr_nat_possible_timer(struct sr_timer *timer, void *arg);
+static void sr_nat_flush(void *arg);
+static void sr_nat_free_conns(struct sr_nat_shard *shard, struct sr_nat_mapping *mapping);
+static void sr_nat_reclaim(struct sr_nat_mapping *mappings, struct sr_nat_connection *conns);
 
 int sr_nat_init(struct sr_nat *nat) { /* Initializes the nat */
 
@@ -20,20 +27,48 @@ int sr_nat_init(struct sr_nat *nat) { /* Initializes the nat */
 	/* Acquire mutex lock */
 	pthread_mutexattr_init(&(nat->attr));
 	pthread_mutexattr_settype(&(nat->attr), PTHREAD_MUTEX_RECURSIVE);
-	int success = pthread_mutex_init(&(nat->lock), &(nat->attr));
+	int success = 0;
+	unsigned int i;
 
-	/* Initialize timeout thread */
+	for (i = 0; i < SR_NAT_SHARDS; i++) {
+		struct sr_nat_shard *shard = &(nat->shards[i]);
 
-	pthread_attr_init(&(nat->thread_attr));
-	pthread_attr_setdetachstate(&(nat->thread_attr), PTHREAD_CREATE_JOINABLE);
-	pthread_attr_setscope(&(nat->thread_attr), PTHREAD_SCOPE_SYSTEM);
-	pthread_attr_setscope(&(nat->thread_attr), PTHREAD_SCOPE_SYSTEM);
-	pthread_create(&(nat->thread), &(nat->thread_attr), sr_nat_timeout, nat);
+		if (pthread_mutex_init(&(shard->lock), &(nat->attr)) != 0) {
+			success = -1;
+		}
+		/* Timeouts run on the shared timer thread, under shard->lock */
+		sr_wheel_init(&(shard->wheel), &(shard->lock), shard);
+		shard->wheel.flush = sr_nat_flush;
+		shard->unanswered = NULL;
+		sr_wheel_start(&(shard->wheel));
+	}
 
 	/* CAREFUL MODIFYING CODE ABOVE THIS LINE! */
 
-	nat->mappings = NULL;
 	/* Initialize any variables here */
+	nat->ip_ext = 0;
+	/* names get indices before the interfaces exist */
+	nat->if_int = sr_if_index("eth1");
+	nat->gen = 0;
+	for (i = 0; i < SR_NAT_SHARDS; i++) {
+		struct sr_nat_shard *shard = &(nat->shards[i]);
+
+		shard->nat = nat;
+		shard->id = i;
+		shard->mask = SR_NAT_BUCKETS - 1;
+		shard->count = 0;
+		shard->ports = NULL;
+		shard->possible_conns = NULL;
+		shard->retired = NULL;
+		shard->retired_conns = NULL;
+		shard->reclaiming = NULL;
+		shard->reclaiming_conns = NULL;
+		shard->by_int = (struct sr_nat_mapping **)calloc(SR_NAT_BUCKETS, sizeof(struct sr_nat_mapping *));
+		shard->by_ext = (struct sr_nat_mapping **)calloc(SR_NAT_BUCKETS, sizeof(struct sr_nat_mapping *));
+		if (!(shard->by_int) || !(shard->by_ext)) {
+			success = -1;
+		}
+	}
 
 	return success;
 }
@@ -41,397 +76,779 @@ int sr_nat_init(struct sr_nat *nat) { /* Initializes the nat */
 
 int sr_nat_destroy(struct sr_nat *nat) {  /* Destroys the nat (free memory) */
 
-	pthread_mutex_lock(&(nat->lock));
-
-	/* free nat memory here */
-
-	pthread_kill(nat->thread, SIGKILL);
-	return pthread_mutex_destroy(&(nat->lock)) &&
-		pthread_mutexattr_destroy(&(nat->attr));
-
-}
-
-void *sr_nat_timeout(void *nat_ptr) {  /* Periodic Timout handling */
-	struct sr_nat *nat = (struct sr_nat *)nat_ptr;
-	while (1) {
-		sleep(1.0);
-		pthread_mutex_lock(&(nat->lock));
-
-		time_t curtime = time(NULL);
-
-		/* handle periodic tasks here */
-		struct sr_nat_mapping *mapping = nat->mappings;
-		struct sr_nat_mapping *to_free = NULL;
-		struct sr_nat_mapping *prev = NULL;
-		struct sr_nat_connection *conn = NULL;
-		struct sr_nat_connection *conn_to_free = NULL;
-		struct sr_nat_connection *prev_conn = NULL;
-
-		while (mapping) {
-			if (mapping->type == nat_mapping_icmp) {
-				if (difftime(curtime,mapping->last_updated) > nat->icmpTimeout) {
-					to_free = mapping;
-					if (prev) {
-						prev->next = mapping->next;
-					} else {
-						nat->mappings = mapping->next;
-					}
-					mapping = mapping->next;
-					free(to_free);
-				} else {
-					prev = mapping;
-					mapping = mapping->next;
-				}
-			} else if (mapping->type == nat_mapping_tcp) {
-				conn = mapping->conns;
-				prev_conn = NULL;
-				while (conn) {
-					if (conn->state == tcp_state_established) {
-						if (difftime(curtime, conn->last_updated) >= nat->tcpEstablishedTimeout) {
-							conn_to_free = conn;
-							if (prev_conn) {
-								prev_conn->next = conn->next;
-							} else {
-								mapping->conns = conn->next;
-							}
-							conn = conn->next;
-							free(conn_to_free);
-						} else {
-							prev_conn = conn;
-							conn = conn->next;
-						}
-					} else {
-						if (difftime(curtime, conn->last_updated) >= nat->tcpTransitoryTimeout) {
-							conn_to_free = conn;
-							if (prev_conn) {
-								prev_conn->next = conn->next;
-							} else {
-								mapping->conns = conn->next;
-							}
-							conn = conn->next;
-							free(conn_to_free);
-						} else {
-							prev_conn = conn;
-							conn = conn->next;
-						}
-					}
-				}
-				if (!(mapping->conns)) {
-					to_free = mapping;
-					if (prev) {
-						prev->next = mapping->next;
-					} else {
-						nat->mappings = mapping->next;
-					}
-					mapping = mapping->next;
-					free(to_free);
-				} else {
-					prev = mapping;
-					mapping = mapping->next;
-				}
+	unsigned int s;
+	int failed = 0;
+
+	for (s = 0; s < SR_NAT_SHARDS; s++) {
+		struct sr_nat_shard *shard = &(nat->shards[s]);
+
+		sr_wheel_stop(&(shard->wheel));
+
+		pthread_mutex_lock(&(shard->lock));
+
+		/* free nat memory here */
+		uint32_t i;
+		struct sr_nat_mapping *mapping, *next;
+		struct sr_possible_connection *p_conn, *next_p_conn;
+		for (i = 0; shard->by_int && i <= shard->mask; i++) {
+			for (mapping = shard->by_int[i]; mapping; mapping = next) {
+				next = mapping->next_int;
+				sr_nat_free_conns(shard, mapping);
+				free(mapping);
 			}
 		}
+		free(shard->by_int);
+		free(shard->by_ext);
+		shard->by_int = shard->by_ext = NULL;
+		shard->count = 0;
+		sr_nat_reclaim(shard->retired, shard->retired_conns);
+		sr_nat_reclaim(shard->reclaiming, shard->reclaiming_conns);
+		shard->retired = NULL;
+		shard->retired_conns = NULL;
+		shard->reclaiming = NULL;
+		shard->reclaiming_conns = NULL;
+		struct sr_nat_ports *ports, *next_ports;
+		for (ports = shard->ports; ports; ports = next_ports) {
+			next_ports = ports->next;
+			free(ports);
+		}
+		shard->ports = NULL;
+		for (p_conn = shard->possible_conns; p_conn; p_conn = next_p_conn) {
+			next_p_conn = p_conn->next;
+			free(p_conn->unsolicited_packet);
+			free(p_conn);
+		}
+		shard->possible_conns = NULL;
 
-		struct sr_possible_connection *p_conn = nat->possible_conns;
-		struct sr_possible_connection *p_conn_to_free = NULL;
-		struct sr_possible_connection *prev_p_conn = NULL;
-
-		while (p_conn) {
-			if (difftime(curtime,p_conn->recv_time) >= 6) {
-				modify_send_icmp_port_unreachable(nat->sr_instance, p_conn->unsolicited_packet, p_conn->len, p_conn->interface);
-				p_conn_to_free = p_conn;
-				if (prev_p_conn) {
-					prev_p_conn->next = p_conn->next;
-				} else {
-					nat->possible_conns = p_conn->next;
-				}
-				p_conn = p_conn->next;
-				free(p_conn_to_free);
-			} else {
-				prev_p_conn = p_conn;
-				p_conn = p_conn->next;
-			}
-		}	
+		pthread_mutex_unlock(&(shard->lock));
+
+		failed |= pthread_mutex_destroy(&(shard->lock));
+	}
 
+	return failed || pthread_mutexattr_destroy(&(nat->attr));
 
-		pthread_mutex_unlock(&(nat->lock));
+}
+
+/* Every bit of the input moves the low bits that pick a bucket. */
+static uint32_t sr_nat_mix(uint32_t h) {
+	h ^= h >> 16;
+	h *= 0x85ebca6bu;
+	h ^= h >> 13;
+	h *= 0xc2b2ae35u;
+	return h ^ (h >> 16);
+}
+
+static uint32_t sr_nat_hash(uint32_t ip, uint16_t aux, sr_nat_mapping_type type) {
+	return sr_nat_mix(sr_nat_mix(ip) ^ ((uint32_t)aux << 8 | type));
+}
+
+/* The shard of an internal key.  Its hash's top bits pick it, the low
+   bits the bucket within. */
+static struct sr_nat_shard *sr_nat_shard_int(struct sr_nat *nat, sr_nat_mapping_type type, uint32_t ip_int, uint16_t aux_int) {
+	return &(nat->shards[(sr_nat_hash(ip_int, aux_int, type) >> 24) & (SR_NAT_SHARDS - 1)]);
+}
+
+/* The shard that owns an external port (ICMP id), in host byte order. */
+static struct sr_nat_shard *sr_nat_shard_ext(struct sr_nat *nat, uint16_t aux_ext) {
+	return &(nat->shards[aux_ext & (SR_NAT_SHARDS - 1)]);
+}
+
+/* The mapping for an internal key, or NULL.  Call with shard->lock held. */
+static struct sr_nat_mapping *sr_nat_find_internal(struct sr_nat_shard *shard, sr_nat_mapping_type type, uint32_t ip_int, uint16_t aux_int) {
+	struct sr_nat_mapping *mapping = shard->by_int[sr_nat_hash(ip_int, aux_int, type) & shard->mask];
+
+	while (mapping && !(mapping->type == type && mapping->ip_int == ip_int && mapping->aux_int == aux_int)) {
+		mapping = mapping->next_int;
 	}
-	return NULL;
+	return mapping;
 }
 
-/* Get the mapping associated with given external port.
-	 You must free the returned structure if it is not NULL. */
-struct sr_nat_mapping *sr_nat_lookup_external(struct sr_nat *nat,
-		uint16_t aux_ext, sr_nat_mapping_type type ) {
+/* The mapping for an external key, aux_ext in host byte order, or NULL.
+   Call with shard->lock held. */
+static struct sr_nat_mapping *sr_nat_find_external(struct sr_nat_shard *shard, sr_nat_mapping_type type, uint32_t ip_ext, uint16_t aux_ext) {
+	struct sr_nat_mapping *mapping = shard->by_ext[sr_nat_hash(ip_ext, aux_ext, type) & shard->mask];
 
-	pthread_mutex_lock(&(nat->lock));
+	while (mapping && !(mapping->type == type && mapping->ip_ext == ip_ext && mapping->aux_ext == aux_ext)) {
+		mapping = mapping->next_ext;
+	}
+	return mapping;
+}
 
-	/* handle lookup here, malloc and assign to copy */
-	struct sr_nat_mapping *copy = NULL;
+static void sr_nat_link(struct sr_nat_mapping **by_int, struct sr_nat_mapping **by_ext, uint32_t mask, struct sr_nat_mapping *mapping) {
+	struct sr_nat_mapping **bucket;
 
-	struct sr_nat_mapping *mapping = nat->mappings;
+	bucket = &(by_int[sr_nat_hash(mapping->ip_int, mapping->aux_int, mapping->type) & mask]);
+	mapping->next_int = *bucket;
+	*bucket = mapping;
+	bucket = &(by_ext[sr_nat_hash(mapping->ip_ext, mapping->aux_ext, mapping->type) & mask]);
+	mapping->next_ext = *bucket;
+	*bucket = mapping;
+}
 
-	while (mapping) {
-		if ((mapping->type == type) && (mapping->aux_ext == ntohs(aux_ext))) {
-			copy = (struct sr_nat_mapping *) malloc(sizeof(struct sr_nat_mapping));
-			memcpy(copy, mapping, sizeof(struct sr_nat_mapping));
-			break;
+/* Double the buckets of both tables.  On failure the tables stay as they
+   are, only with longer chains.  Call with shard->lock held. */
+static void sr_nat_grow(struct sr_nat_shard *shard) {
+	uint32_t mask = 2 * shard->mask + 1;
+	struct sr_nat_mapping **by_int = (struct sr_nat_mapping **)calloc(mask + 1, sizeof(struct sr_nat_mapping *));
+	struct sr_nat_mapping **by_ext = (struct sr_nat_mapping **)calloc(mask + 1, sizeof(struct sr_nat_mapping *));
+	struct sr_nat_mapping *mapping, *next;
+	uint32_t i;
+
+	if (!by_int || !by_ext) {
+		free(by_int);
+		free(by_ext);
+		return;
+	}
+	for (i = 0; i <= shard->mask; i++) {
+		for (mapping = shard->by_int[i]; mapping; mapping = next) {
+			next = mapping->next_int;
+			sr_nat_link(by_int, by_ext, mask, mapping);
 		}
-		mapping = mapping->next;
 	}
+	free(shard->by_int);
+	free(shard->by_ext);
+	shard->by_int = by_int;
+	shard->by_ext = by_ext;
+	shard->mask = mask;
+}
 
-	pthread_mutex_unlock(&(nat->lock));
-	return copy;
+/* Put a new mapping in both tables.  Call with shard->lock held. */
+static void sr_nat_index(struct sr_nat_shard *shard, struct sr_nat_mapping *mapping) {
+	if (shard->count > shard->mask) {
+		sr_nat_grow(shard);
+	}
+	sr_nat_link(shard->by_int, shard->by_ext, shard->mask, mapping);
+	shard->count++;
 }
 
-/* Get the mapping associated with given internal (ip, port) pair.
-	 You must free the returned structure if it is not NULL. */
-struct sr_nat_mapping *sr_nat_lookup_internal(struct sr_nat *nat,
-	uint32_t ip_int, uint16_t aux_int, sr_nat_mapping_type type ) {
+/* Take a mapping out of both tables.  Call with shard->lock held. */
+static void sr_nat_unindex(struct sr_nat_shard *shard, struct sr_nat_mapping *mapping) {
+	struct sr_nat_mapping **pmapping;
 
-	pthread_mutex_lock(&(nat->lock));
+	pmapping = &(shard->by_int[sr_nat_hash(mapping->ip_int, mapping->aux_int, mapping->type) & shard->mask]);
+	while (*pmapping != mapping) {
+		pmapping = &((*pmapping)->next_int);
+	}
+	*pmapping = mapping->next_int;
+	pmapping = &(shard->by_ext[sr_nat_hash(mapping->ip_ext, mapping->aux_ext, mapping->type) & shard->mask]);
+	while (*pmapping != mapping) {
+		pmapping = &((*pmapping)->next_ext);
+	}
+	*pmapping = mapping->next_ext;
+	shard->count--;
+}
 
-	/* handle lookup here, malloc and assign to copy. */
-	struct sr_nat_mapping *copy = NULL;
+/* The free ports of type on ip_ext that shard owns, made with all of
+   them free the first time.  NULL if out of memory.  Call with
+   shard->lock held. */
+static struct sr_nat_ports *sr_nat_ports_of(struct sr_nat_shard *shard, uint32_t ip_ext, sr_nat_mapping_type type) {
+	struct sr_nat_ports *ports;
+	uint32_t aux = (type == nat_mapping_icmp ? SR_NAT_ICMP_ID_MIN : SR_NAT_TCP_PORT_MIN);
+
+	/* one per external address and protocol, a short list */
+	for (ports = shard->ports; ports; ports = ports->next) {
+		if (ports->ip_ext == ip_ext && ports->type == type) {
+			return ports;
+		}
+	}
+	ports = (struct sr_nat_ports *)malloc(sizeof(struct sr_nat_ports));
+	if (!ports) {
+		return NULL;
+	}
+	ports->ip_ext = ip_ext;
+	ports->type = type;
+	ports->head = 0;
+	ports->count = 0;
+	/* the ports from the first handed out whose low bits are shard->id */
+	for (aux += (shard->id - aux) & (SR_NAT_SHARDS - 1); aux <= 0xffff; aux += SR_NAT_SHARDS) {
+		ports->free[ports->count++] = aux;
+	}
+	ports->next = shard->ports;
+	shard->ports = ports;
+	return ports;
+}
 
-	struct sr_nat_mapping *mapping = nat->mappings;
+/* Give a mapping's external port back.  Call with shard->lock held. */
+static void sr_nat_release_aux_ext(struct sr_nat_shard *shard, struct sr_nat_mapping *mapping) {
+	struct sr_nat_ports *ports = sr_nat_ports_of(shard, mapping->ip_ext, mapping->type);
 
-	while (mapping) {
-		if (
-			(mapping->type == type) &&
-			(mapping->ip_int == ip_int) &&
-			(mapping->aux_int == aux_int)
-		) {
-			copy = (struct sr_nat_mapping *) malloc(sizeof(struct sr_nat_mapping));
-			memcpy(copy, mapping, sizeof(struct sr_nat_mapping));
-			break;
+	if (ports) {
+		ports->free[(ports->head + ports->count) & (SR_NAT_SHARD_PORTS - 1)] = mapping->aux_ext;
+		ports->count++;
+	}
+}
+
+/* The address new mappings get: eth2's, unless set before the first.
+   Shards may race to set it, to the same address. */
+static uint32_t sr_nat_external_ip(struct sr_nat *nat) {
+	uint32_t ip_ext = __atomic_load_n(&nat->ip_ext, __ATOMIC_RELAXED);
+
+	if (ip_ext == 0) {
+		struct sr_if *external = sr_get_interface(nat->sr_instance, "eth2");
+		if (external) {
+			ip_ext = external->ip;
+			__atomic_store_n(&nat->ip_ext, ip_ext, __ATOMIC_RELAXED);
 		}
-		mapping = mapping->next;
 	}
+	return ip_ext;
+}
 
-	pthread_mutex_unlock(&(nat->lock));
-	return copy;
+/* Free conn once no reader can have it borrowed.  It must be out of its
+   mapping already.  Call with shard->lock held. */
+static void sr_nat_retire_conn(struct sr_nat_shard *shard, struct sr_nat_connection *conn) {
+	sr_timer_cancel(&(shard->wheel), &(conn->timer));
+	conn->next = shard->retired_conns;
+	shard->retired_conns = conn;
 }
 
-/* Insert a new mapping into the nat's mapping table.
-	 Actually returns a copy to the new mapping, for thread safety.
- */
-struct sr_nat_mapping *sr_nat_insert_mapping(struct sr_nat *nat,
-	uint32_t ip_int, uint16_t aux_int, sr_nat_mapping_type type ) {
+/* Free retired mappings and connections.  No reader may have them. */
+static void sr_nat_reclaim(struct sr_nat_mapping *mappings, struct sr_nat_connection *conns) {
+	struct sr_nat_mapping *next;
+	struct sr_nat_connection *next_conn;
 
-	pthread_mutex_lock(&(nat->lock));
+	for (; mappings; mappings = next) {
+		next = mappings->next_int;
+		free(mappings);
+	}
+	for (; conns; conns = next_conn) {
+		next_conn = conns->next;
+		free(conns);
+	}
+}
 
-	/* handle insert here, create a mapping, and then return a copy of it */
-	struct sr_nat_mapping *new_entry = NULL;
-	struct sr_nat_mapping *copy = (struct sr_nat_mapping *) malloc(sizeof(struct sr_nat_mapping));
-	struct sr_nat_mapping *mapping = nat->mappings;
+/* The connection of mapping to (ip_dest, port_dest), or NULL.  Call with
+   its shard's lock held. */
+static struct sr_nat_connection *sr_nat_find_conn(struct sr_nat_mapping *mapping, uint32_t ip_dest, uint16_t port_dest) {
+	struct sr_nat_connection *conn;
+	uint32_t i;
+
+	if (!(mapping->conn_table)) {
+		for (i = 0; i < mapping->nconns; i++) {
+			conn = mapping->few[i];
+			if (conn->ip_dest == ip_dest && conn->port_dest == port_dest) {
+				return conn;
+			}
+		}
+		return NULL;
+	}
+	conn = mapping->conn_table[sr_nat_hash(ip_dest, port_dest, 0) & mapping->conn_mask];
+	while (conn && !(conn->ip_dest == ip_dest && conn->port_dest == port_dest)) {
+		conn = conn->next;
+	}
+	return conn;
+}
 
+/* Move mapping's connections to a table of mask + 1 buckets, from few or
+   a smaller table.  Returns -1, changing nothing, if out of memory. */
+static int sr_nat_rehash_conns(struct sr_nat_mapping *mapping, uint32_t mask) {
+	struct sr_nat_connection **table = (struct sr_nat_connection **)calloc(mask + 1, sizeof(struct sr_nat_connection *));
+	struct sr_nat_connection *conn, *next, **bucket;
+	uint32_t i;
 
-		/* If in list, update time */
-		while (mapping) {
-			if (
-				(mapping->type == type) &&
-				(mapping->ip_int == ip_int) &&
-				(mapping->aux_int == aux_int)
-			) {
-				mapping->last_updated = time(NULL);
-				memcpy(copy, mapping, sizeof(struct sr_nat_mapping));
-				break;
-			}
-			mapping = mapping->next;
+	if (!table) {
+		return -1;
+	}
+	for (i = 0; i < (mapping->conn_table ? mapping->conn_mask + 1 : mapping->nconns); i++) {
+		for (conn = mapping->conn_table ? mapping->conn_table[i] : mapping->few[i]; conn; conn = next) {
+			next = mapping->conn_table ? conn->next : NULL;
+			bucket = &(table[sr_nat_hash(conn->ip_dest, conn->port_dest, 0) & mask]);
+			conn->next = *bucket;
+			*bucket = conn;
 		}
-		/* If NOT in list, return new object */
-		if (mapping == NULL) {
-			new_entry =	(struct sr_nat_mapping *) malloc(sizeof(struct sr_nat_mapping));
-			new_entry->ip_int = ip_int;
-			new_entry->aux_int = aux_int;
-
-			struct sr_if * if_list = nat->sr_instance->if_list;
-			while(if_list) {
-			    if (strcmp(if_list->name, "eth2") == 0) {
-			        break;
-			    }
-			    if_list = if_list->next;
-			}
-			new_entry->ip_ext = if_list->ip;
-			new_entry->aux_ext = generate_aux_ext(nat, type);
-			new_entry->last_updated = time(NULL);
-			new_entry->conns = NULL;
-			new_entry->type = type;
+	}
+	free(mapping->conn_table);
+	mapping->conn_table = table;
+	mapping->conn_mask = mask;
+	return 0;
+}
 
-			new_entry->next = nat->mappings;
-			nat->mappings = new_entry;
+/* Add conn to mapping's connections.  Returns -1 if out of memory.  Call
+   with its shard's lock held. */
+static int sr_nat_add_conn(struct sr_nat_mapping *mapping, struct sr_nat_connection *conn) {
+	struct sr_nat_connection **bucket;
 
-			memcpy(copy, new_entry, sizeof(struct sr_nat_mapping));
+	if (!(mapping->conn_table) && mapping->nconns < SR_NAT_CONNS_FEW) {
+		mapping->few[mapping->nconns++] = conn;
+		return 0;
+	}
+	/* the table starts at four buckets a connection and doubles when full */
+	if (!(mapping->conn_table) || mapping->nconns > mapping->conn_mask) {
+		if (sr_nat_rehash_conns(mapping, mapping->conn_table ? 2 * mapping->conn_mask + 1 : 4 * SR_NAT_CONNS_FEW - 1) != 0 &&
+			!(mapping->conn_table)) {
+			return -1;
 		}
+	}
+	bucket = &(mapping->conn_table[sr_nat_hash(conn->ip_dest, conn->port_dest, 0) & mapping->conn_mask]);
+	conn->next = *bucket;
+	*bucket = conn;
+	mapping->nconns++;
+	return 0;
+}
 
-	pthread_mutex_unlock(&(nat->lock));
-	return copy;
+/* Take conn out of mapping's connections.  Call with its shard's lock held. */
+static void sr_nat_remove_conn(struct sr_nat_mapping *mapping, struct sr_nat_connection *conn) {
+	struct sr_nat_connection **pconn;
+	uint32_t i;
+
+	if (!(mapping->conn_table)) {
+		for (i = 0; mapping->few[i] != conn; i++);
+		mapping->few[i] = mapping->few[--(mapping->nconns)];
+		return;
+	}
+	pconn = &(mapping->conn_table[sr_nat_hash(conn->ip_dest, conn->port_dest, 0) & mapping->conn_mask]);
+	while (*pconn != conn) {
+		pconn = &((*pconn)->next);
+	}
+	*pconn = conn->next;
+	mapping->nconns--;
 }
 
-int generate_aux_ext(struct sr_nat *nat, sr_nat_mapping_type type) {
-	if (type == nat_mapping_icmp) {
-		return EXT_ID++;
+/* Retire all connections of mapping.  Call with shard->lock held. */
+static void sr_nat_free_conns(struct sr_nat_shard *shard, struct sr_nat_mapping *mapping) {
+	struct sr_nat_connection *conn, *next;
+	uint32_t i;
+
+	if (!(mapping->conn_table)) {
+		for (i = 0; i < mapping->nconns; i++) {
+			sr_nat_retire_conn(shard, mapping->few[i]);
+		}
 	} else {
-		struct sr_nat_mapping * mapping = NULL;
-		int not_found = 0;
-		int port = 1024;
-		while (1) {
-			mapping = nat->mappings;
-			while (mapping) {
-				if (mapping->aux_ext == port) {
-					not_found = 1;
-					break;
-				}
-				mapping = mapping->next;
-			}
-			if (not_found == 1){
-				port = 1024 + (port+1)%(65535 - 1024);
-				not_found = 0;
-			} else {
-				break;
+		for (i = 0; i <= mapping->conn_mask; i++) {
+			for (conn = mapping->conn_table[i]; conn; conn = next) {
+				next = conn->next;
+				sr_nat_retire_conn(shard, conn);
 			}
 		}
-		return port;
+		free(mapping->conn_table);
+		mapping->conn_table = NULL;
 	}
+	mapping->nconns = 0;
+}
 
+/* The shard of a copy returned by a lookup. */
+static struct sr_nat_shard *sr_nat_shard_of(struct sr_nat *nat, struct sr_nat_mapping *copy) {
+	return sr_nat_shard_ext(nat, copy->aux_ext);
 }
 
-void sr_nat_update_tcp_connection(struct sr_nat_mapping *mapping, uint32_t ip_dest, uint16_t port_dest) {
-	struct sr_nat_connection *current_connection = mapping->conns;
-	time_t curtime = time(NULL);
-	while(current_connection) {
-		if (
-			(current_connection->ip_dest == ip_dest) &&
-			(current_connection->port_dest == port_dest)
-		) {
+/* The mapping a copy returned by a lookup was made from, NULL if it is
+   gone.  Call with shard->lock held. */
+static struct sr_nat_mapping *sr_nat_mapping_of(struct sr_nat_shard *shard, struct sr_nat_mapping *copy) {
+	return sr_nat_find_external(shard, copy->type, copy->ip_ext, copy->aux_ext);
+}
+
+/* Seconds a connection in its state may stay idle */
+static int sr_nat_conn_timeout(struct sr_nat *nat, struct sr_nat_connection *conn) {
+	return conn->state == tcp_state_established ?
+		nat->tcpEstablishedTimeout : nat->tcpTransitoryTimeout;
+}
+
+/* Arm the connection's timer for when it times out, given its state and
+   last update.  Call with shard->lock held. */
+static void sr_nat_conn_arm(struct sr_nat_shard *shard, struct sr_nat_connection *conn) {
+	double left = sr_nat_conn_timeout(shard->nat, conn) - difftime(time(NULL), conn->last_updated);
+	sr_timer_arm(&(shard->wheel), &(conn->timer), left > 0 ? SR_TIMER_SEC(left) : 0);
+}
+
+/* A new connection of mapping, in state syn_sent.  Call with shard->lock held. */
+static struct sr_nat_connection *sr_nat_new_connection(struct sr_nat_shard *shard, struct sr_nat_mapping *mapping, uint32_t ip_dest, uint16_t port_dest) {
+	struct sr_nat_connection *new_connection = (struct sr_nat_connection *) calloc(1, sizeof(struct sr_nat_connection));
+	new_connection->ip_dest = ip_dest;
+	new_connection->port_dest = port_dest;
+	new_connection->last_updated = time(NULL);
+	new_connection->state = tcp_state_syn_sent;
+	new_connection->mapping = mapping;
+	sr_timer_init(&(new_connection->timer), sr_nat_conn_timer);
+	if (sr_nat_add_conn(mapping, new_connection) != 0) {
+		free(new_connection);
+		return NULL;
+	}
+	sr_nat_conn_arm(shard, new_connection);
+	return new_connection;
+}
+
+/* Unlink mapping and retire it with its connections.  Call with
+   shard->lock held. */
+static void sr_nat_free_mapping(struct sr_nat_shard *shard, struct sr_nat_mapping *mapping) {
+	sr_nat_unindex(shard, mapping);
+	sr_nat_release_aux_ext(shard, mapping);
+	sr_timer_cancel(&(shard->wheel), &(mapping->timer));
+	sr_nat_free_conns(shard, mapping);
+	/* out of the tables, next_int is free to chain it */
+	mapping->next_int = shard->retired;
+	shard->retired = mapping;
+	__atomic_add_fetch(&shard->nat->gen, 1, __ATOMIC_RELEASE);
+}
+
+/* A mapping's timer: an ICMP mapping idle for icmpTimeout seconds goes
+   away, a TCP mapping that still has no connection too. */
+static void sr_nat_mapping_timer(struct sr_timer *timer, void *arg) {
+	struct sr_nat_shard *shard = (struct sr_nat_shard *)arg;
+	struct sr_nat *nat = shard->nat;
+	struct sr_nat_mapping *mapping = (struct sr_nat_mapping *)((char *)timer - offsetof(struct sr_nat_mapping, timer));
+
+	if (mapping->type == nat_mapping_icmp) {
+		double idle = difftime(time(NULL), mapping->last_updated);
+		if (idle > nat->icmpTimeout) {
+			sr_nat_free_mapping(shard, mapping);
+		} else {
+			/* used since it was armed */
+			sr_timer_arm(&(shard->wheel), timer, SR_TIMER_SEC(nat->icmpTimeout - idle + 1));
+		}
+	} else if (mapping->nconns == 0) {
+		sr_nat_free_mapping(shard, mapping);
+	}
+}
+
+/* A connection's timer: drop the connection if it was idle for its
+   state's timeout, and its mapping with the last one. */
+static void sr_nat_conn_timer(struct sr_timer *timer, void *arg) {
+	struct sr_nat_shard *shard = (struct sr_nat_shard *)arg;
+	struct sr_nat_connection *conn = (struct sr_nat_connection *)((char *)timer - offsetof(struct sr_nat_connection, timer));
+	struct sr_nat_mapping *mapping = conn->mapping;
+
+	if (difftime(time(NULL), conn->last_updated) < sr_nat_conn_timeout(shard->nat, conn)) {
+		sr_nat_conn_arm(shard, conn);
+		return;
+	}
+
+	sr_nat_remove_conn(mapping, conn);
+	sr_nat_retire_conn(shard, conn);
+	__atomic_add_fetch(&shard->nat->gen, 1, __ATOMIC_RELEASE);
+
+	if (mapping->nconns == 0) {
+		sr_nat_free_mapping(shard, mapping);
+	}
+}
+
+/* Unlink a possible connection.  Call with shard->lock held. */
+static void sr_nat_unlink_possible(struct sr_nat_shard *shard, struct sr_possible_connection *p_conn) {
+	if (p_conn->prev) {
+		p_conn->prev->next = p_conn->next;
+	} else {
+		shard->possible_conns = p_conn->next;
+	}
+	if (p_conn->next) {
+		p_conn->next->prev = p_conn->prev;
+	}
+	sr_timer_cancel(&(shard->wheel), &(p_conn->timer));
+}
+
+static void sr_nat_free_possible(struct sr_possible_connection *p_conn) {
+	free(p_conn->unsolicited_packet);
+	free(p_conn);
+}
+
+/* A possible connection's timer: nobody inside answered the SYN.  The
+   port unreachable is sent by sr_nat_flush, without the lock. */
+static void sr_nat_possible_timer(struct sr_timer *timer, void *arg) {
+	struct sr_nat_shard *shard = (struct sr_nat_shard *)arg;
+	struct sr_possible_connection *p_conn = (struct sr_possible_connection *)((char *)timer - offsetof(struct sr_possible_connection, timer));
+
+	sr_nat_unlink_possible(shard, p_conn);
+	p_conn->next = shard->unanswered;
+	shard->unanswered = p_conn;
+}
+
+/* Runs on the timer thread after it dropped shard->lock. */
+static void sr_nat_flush(void *arg) {
+	struct sr_nat_shard *shard = (struct sr_nat_shard *)arg;
+	struct sr_nat *nat = shard->nat;
+	struct sr_possible_connection *p_conn = shard->unanswered;
+	struct sr_possible_connection *next;
+
+	/* what readers may still have borrowed is freed a grace period on;
+	the timer thread never waits for one, it looks again next tick */
+	if ((shard->reclaiming || shard->reclaiming_conns) && sr_rcu_done(shard->reclaim_gp)) {
+		sr_nat_reclaim(shard->reclaiming, shard->reclaiming_conns);
+		shard->reclaiming = NULL;
+		shard->reclaiming_conns = NULL;
+	}
+	if (!shard->reclaiming && !shard->reclaiming_conns) {
+		pthread_mutex_lock(&(shard->lock));
+		shard->reclaiming = shard->retired;
+		shard->reclaiming_conns = shard->retired_conns;
+		shard->retired = NULL;
+		shard->retired_conns = NULL;
+		pthread_mutex_unlock(&(shard->lock));
+		if (shard->reclaiming || shard->reclaiming_conns) {
+			shard->reclaim_gp = sr_rcu_start();
+		}
+	}
+
+	if (!p_conn) {
+		return;
+	}
+	shard->unanswered = NULL;
+	sr_send_batch_begin(nat->sr_instance);
+	sr_rcu_read_lock();
+	for (; p_conn; p_conn = next) {
+		next = p_conn->next;
+		modify_send_icmp_port_unreachable(nat->sr_instance, p_conn->unsolicited_packet, p_conn->len, p_conn->interface);
+		sr_nat_free_possible(p_conn);
+	}
+	sr_rcu_read_unlock();
+	sr_send_batch_end(nat->sr_instance);
+}
+
+void sr_nat_insert_possible_connection(struct sr_nat *nat, uint32_t ip, uint16_t port, uint8_t * packet, unsigned int len, int interface) {
+	struct sr_possible_connection *new_conn = (struct sr_possible_connection *)calloc(1, sizeof(struct sr_possible_connection));
+
+	new_conn->ip = ip;
+	new_conn->port = port;
+	new_conn->recv_time = time(NULL);
+	/* the router reuses its packet buffer once it is done with it */
+	new_conn->unsolicited_packet = (uint8_t *)malloc(len);
+	memcpy(new_conn->unsolicited_packet, packet, len);
+	new_conn->len = len;
+	new_conn->interface = interface;
+	sr_timer_init(&(new_conn->timer), sr_nat_possible_timer);
+
+	/* with the mapping the port would get */
+	struct sr_nat_shard *shard = sr_nat_shard_ext(nat, ntohs(port));
+	pthread_mutex_lock(&(shard->lock));
+	new_conn->next = shard->possible_conns;
+	if (shard->possible_conns) {
+		shard->possible_conns->prev = new_conn;
+	}
+	shard->possible_conns = new_conn;
+	sr_timer_arm(&(shard->wheel), &(new_conn->timer), SR_TIMER_SEC(SR_NAT_SYN_WAIT));
+	pthread_mutex_unlock(&(shard->lock));
+}
+
+void sr_nat_remove_possible_connection(struct sr_nat *nat, uint32_t ip, uint16_t port) {
+	struct sr_nat_shard *shard = sr_nat_shard_ext(nat, ntohs(port));
+	struct sr_possible_connection *p_conn;
+
+	pthread_mutex_lock(&(shard->lock));
+	for (p_conn = shard->possible_conns; p_conn; p_conn = p_conn->next) {
+		if (p_conn->port == port && p_conn->ip == ip) {
+			sr_nat_unlink_possible(shard, p_conn);
+			sr_nat_free_possible(p_conn);
 			break;
 		}
-		current_connection = current_connection->next;
 	}
+	pthread_mutex_unlock(&(shard->lock));
+}
+
+struct sr_nat_mapping *sr_nat_borrow_external(struct sr_nat *nat,
+		uint32_t ip_ext, uint16_t aux_ext, sr_nat_mapping_type type) {
+	struct sr_nat_shard *shard = sr_nat_shard_ext(nat, ntohs(aux_ext));
+
+	pthread_mutex_lock(&(shard->lock));
+	struct sr_nat_mapping *mapping = sr_nat_find_external(shard, type, ip_ext, ntohs(aux_ext));
+	pthread_mutex_unlock(&(shard->lock));
+	return mapping;
+}
+
+struct sr_nat_mapping *sr_nat_borrow_internal(struct sr_nat *nat,
+		uint32_t ip_int, uint16_t aux_int, sr_nat_mapping_type type) {
+	struct sr_nat_shard *shard = sr_nat_shard_int(nat, type, ip_int, aux_int);
+
+	pthread_mutex_lock(&(shard->lock));
+	struct sr_nat_mapping *mapping = sr_nat_find_internal(shard, type, ip_int, aux_int);
+	pthread_mutex_unlock(&(shard->lock));
+	return mapping;
+}
+
+/* The mapping of an internal key, made if there is none yet, refreshed
+   if there is.  NULL when no external port (ICMP id) is free. */
+struct sr_nat_mapping *sr_nat_borrow_mapping(struct sr_nat *nat,
+	uint32_t ip_int, uint16_t aux_int, sr_nat_mapping_type type) {
+	struct sr_nat_shard *shard = sr_nat_shard_int(nat, type, ip_int, aux_int);
+
+	pthread_mutex_lock(&(shard->lock));
+
+	struct sr_nat_mapping *mapping = sr_nat_find_internal(shard, type, ip_int, aux_int);
+
+		/* If in table, update time */
+		if (mapping) {
+			mapping->last_updated = time(NULL);
+		}
+		/* If NOT in table, return new object */
+		int aux_ext = -1;
+		if (mapping == NULL) {
+			aux_ext = generate_aux_ext(shard, type);
+		}
+		if (aux_ext >= 0) {
+			mapping = (struct sr_nat_mapping *) malloc(sizeof(struct sr_nat_mapping));
+			mapping->ip_int = ip_int;
+			mapping->aux_int = aux_int;
+			mapping->ip_ext = sr_nat_external_ip(nat);
+			mapping->aux_ext = aux_ext;
+			mapping->last_updated = time(NULL);
+			mapping->nconns = 0;
+			mapping->conn_table = NULL;
+			mapping->conn_mask = 0;
+			mapping->type = type;
+
+			sr_nat_index(shard, mapping);
+
+			sr_timer_init(&(mapping->timer), sr_nat_mapping_timer);
+			sr_timer_arm(&(shard->wheel), &(mapping->timer), SR_TIMER_SEC(type == nat_mapping_icmp ? nat->icmpTimeout + 1 : SR_NAT_TCP_IDLE));
+		}
+
+	pthread_mutex_unlock(&(shard->lock));
+	return mapping;
+}
+
+/* A copy of a borrowed mapping, NULL for NULL. */
+static struct sr_nat_mapping *sr_nat_copy(struct sr_nat_mapping *mapping) {
+	struct sr_nat_mapping *copy = NULL;
+
+	if (mapping) {
+		copy = (struct sr_nat_mapping *) malloc(sizeof(struct sr_nat_mapping));
+		memcpy(copy, mapping, sizeof(struct sr_nat_mapping));
+	}
+	return copy;
+}
+
+/* Get the mapping associated with given external (ip, port) pair.
+	 You must free the returned structure if it is not NULL. */
+struct sr_nat_mapping *sr_nat_lookup_external(struct sr_nat *nat,
+		uint32_t ip_ext, uint16_t aux_ext, sr_nat_mapping_type type ) {
+	struct sr_nat_mapping *copy;
+
+	sr_rcu_read_lock();
+	copy = sr_nat_copy(sr_nat_borrow_external(nat, ip_ext, aux_ext, type));
+	sr_rcu_read_unlock();
+	return copy;
+}
+
+/* Get the mapping associated with given internal (ip, port) pair.
+	 You must free the returned structure if it is not NULL. */
+struct sr_nat_mapping *sr_nat_lookup_internal(struct sr_nat *nat,
+	uint32_t ip_int, uint16_t aux_int, sr_nat_mapping_type type ) {
+	struct sr_nat_mapping *copy;
+
+	sr_rcu_read_lock();
+	copy = sr_nat_copy(sr_nat_borrow_internal(nat, ip_int, aux_int, type));
+	sr_rcu_read_unlock();
+	return copy;
+}
+
+/* Insert a new mapping into the nat's mapping table.
+	 Actually returns a copy to the new mapping, for thread safety.
+ */
+struct sr_nat_mapping *sr_nat_insert_mapping(struct sr_nat *nat,
+	uint32_t ip_int, uint16_t aux_int, sr_nat_mapping_type type ) {
+	struct sr_nat_mapping *copy;
+
+	sr_rcu_read_lock();
+	copy = sr_nat_copy(sr_nat_borrow_mapping(nat, ip_int, aux_int, type));
+	sr_rcu_read_unlock();
+	return copy;
+}
+
+int generate_aux_ext(struct sr_nat_shard *shard, sr_nat_mapping_type type) {
+	struct sr_nat_ports *ports = sr_nat_ports_of(shard, sr_nat_external_ip(shard->nat), type);
+	int port;
+
+	if (!ports || ports->count == 0) {
+		return -1;
+	}
+	port = ports->free[ports->head];
+	ports->head = (ports->head + 1) & (SR_NAT_SHARD_PORTS - 1);
+	ports->count--;
+	return port;
+}
+
+void sr_nat_update_tcp_connection(struct sr_nat *nat, struct sr_nat_mapping *mapping_cpy, uint32_t ip_dest, uint16_t port_dest) {
+	struct sr_nat_shard *shard = sr_nat_shard_of(nat, mapping_cpy);
+	pthread_mutex_lock(&(shard->lock));
+	struct sr_nat_mapping *mapping = sr_nat_mapping_of(shard, mapping_cpy);
+	struct sr_nat_connection *current_connection = mapping ? sr_nat_find_conn(mapping, ip_dest, port_dest) : NULL;
+	time_t curtime = time(NULL);
 	/* found connection with ip/port */
 	if (current_connection != NULL) {
 		if (current_connection->state == tcp_state_syn_sent) {
 			current_connection->last_updated = curtime;
 		}
-	} else {
-		struct sr_nat_connection *new_connection = (struct sr_nat_connection *) malloc(sizeof(struct sr_nat_connection));
-		new_connection->ip_dest = ip_dest;
-		new_connection->port_dest = port_dest;
-		new_connection->last_updated = curtime;
-		new_connection->state = tcp_state_syn_sent;
-
-		new_connection->next = mapping->conns;
-		mapping->conns = new_connection;
+	} else if (mapping) {
+		sr_nat_new_connection(shard, mapping, ip_dest, port_dest);
 	}
+	pthread_mutex_unlock(&(shard->lock));
+}
+
+/* The connection of mapping (a copy or borrowed) to (ip_dest, port_dest),
+   borrowed, or NULL. */
+struct sr_nat_connection *sr_nat_borrow_connection(struct sr_nat *nat, struct sr_nat_mapping *mapping_cpy, uint32_t ip_dest, uint16_t port_dest) {
+	struct sr_nat_shard *shard = sr_nat_shard_of(nat, mapping_cpy);
+
+	pthread_mutex_lock(&(shard->lock));
+
+	struct sr_nat_mapping *mapping = sr_nat_mapping_of(shard, mapping_cpy);
+	struct sr_nat_connection *current_connection = mapping ? sr_nat_find_conn(mapping, ip_dest, port_dest) : NULL;
+
+	pthread_mutex_unlock(&(shard->lock));
+
+	return current_connection;
 }
 
 /* Return the connection specified by (ip_dest, port_dest) in mapping->conns. If it doesn't exist,
 return NULL */
-struct sr_nat_connection* sr_nat_get_connection(struct sr_nat *nat, struct sr_nat_mapping *mapping, uint32_t ip_dest, uint16_t port_dest) {
-	struct sr_nat_connection *current_connection = mapping->conns;
+struct sr_nat_connection* sr_nat_get_connection(struct sr_nat *nat, struct sr_nat_mapping *mapping_cpy, uint32_t ip_dest, uint16_t port_dest) {
 	struct sr_nat_connection *copy = NULL;
+	struct sr_nat_connection *current_connection;
 
-	pthread_mutex_lock(&(nat->lock));
-
-	while (current_connection) {
-		if (
-			(current_connection->ip_dest == ip_dest) &&
-			(current_connection->port_dest == port_dest)
-		) {
-			copy = (struct sr_nat_connection *) malloc(sizeof(struct sr_nat_connection));
-			memcpy(copy, current_connection, sizeof(struct sr_nat_connection));
-			break;
-		}
-		current_connection = current_connection->next;
+	sr_rcu_read_lock();
+	current_connection = sr_nat_borrow_connection(nat, mapping_cpy, ip_dest, port_dest);
+	if (current_connection) {
+		copy = (struct sr_nat_connection *) malloc(sizeof(struct sr_nat_connection));
+		memcpy(copy, current_connection, sizeof(struct sr_nat_connection));
 	}
-
-	pthread_mutex_unlock(&(nat->lock));
+	sr_rcu_read_unlock();
 
 	return copy;
 }
 
 /* Return the connection specified by (ip_dest, port_dest) in mapping->conns. If it doesn't exist,
 return NULL */
-void sr_nat_update_connection_state(struct sr_nat *nat, struct sr_nat_mapping *mapping, uint32_t ip_dest, uint16_t port_dest, sr_tcp_state expected_state,
+void sr_nat_update_connection_state(struct sr_nat *nat, struct sr_nat_mapping *mapping_cpy, uint32_t ip_dest, uint16_t port_dest, sr_tcp_state expected_state,
 	sr_tcp_state new_state) {
 
-	pthread_mutex_lock(&(nat->lock));
-	struct sr_nat_connection *current_connection = mapping->conns;
+	struct sr_nat_shard *shard = sr_nat_shard_of(nat, mapping_cpy);
+	pthread_mutex_lock(&(shard->lock));
+	struct sr_nat_mapping *mapping = sr_nat_mapping_of(shard, mapping_cpy);
+	struct sr_nat_connection *current_connection = mapping ? sr_nat_find_conn(mapping, ip_dest, port_dest) : NULL;
 
-	while (current_connection) {
-		if (
-			(current_connection->ip_dest == ip_dest) &&
-			(current_connection->port_dest == port_dest)
-		) {
-			if (current_connection->state == expected_state) {
-				current_connection->state = new_state;
-			}
-			break;
-		}
-		current_connection = current_connection->next;
+	if (current_connection && current_connection->state == expected_state) {
+		current_connection->state = new_state;
+		/* its timeout may have changed */
+		sr_nat_conn_arm(shard, current_connection);
 	}
 
-	pthread_mutex_unlock(&(nat->lock));
+	pthread_mutex_unlock(&(shard->lock));
 }
 
 void sr_nat_insert_tcp_connection(struct sr_nat *nat, struct sr_nat_mapping *mapping_cpy, uint32_t ip_dest, uint16_t port_dest) {
-	pthread_mutex_lock(&(nat->lock));
-	time_t curtime = time(NULL);
+	struct sr_nat_shard *shard = sr_nat_shard_of(nat, mapping_cpy);
+	pthread_mutex_lock(&(shard->lock));
 
-	struct sr_nat_mapping *mapping = nat->mappings;
-
-	while (mapping) {
-		if (
-		(mapping->type == mapping_cpy->type) &&
-		(mapping->aux_ext == mapping_cpy->aux_ext)
-		) {
-			/* found connection with ip/port */
-			struct sr_nat_connection *new_connection = (struct sr_nat_connection *) malloc(sizeof(struct sr_nat_connection));
-			new_connection->ip_dest = ip_dest;
-			new_connection->port_dest = port_dest;
-			new_connection->last_updated = curtime;
-			new_connection->state = tcp_state_syn_sent;
-
-			new_connection->next = mapping->conns;
-			mapping->conns = new_connection;
-		}
-		mapping = mapping->next;
+	struct sr_nat_mapping *mapping = sr_nat_mapping_of(shard, mapping_cpy);
+
+	/* one connection per (ip, port) */
+	if (mapping && !sr_nat_find_conn(mapping, ip_dest, port_dest)) {
+		sr_nat_new_connection(shard, mapping, ip_dest, port_dest);
 	}
 
 
-	pthread_mutex_unlock(&(nat->lock));
+	pthread_mutex_unlock(&(shard->lock));
 }
 
 
-void sr_nat_insert_connection_packet(struct sr_nat *nat, struct sr_nat_mapping *mapping_cpy, uint32_t ip_dest, uint16_t port_dest, uint8_t * packet, unsigned int len, char * interface) {
-	pthread_mutex_lock(&(nat->lock));
+void sr_nat_insert_connection_packet(struct sr_nat *nat, struct sr_nat_mapping *mapping_cpy, uint32_t ip_dest, uint16_t port_dest, uint8_t * packet, unsigned int len, int interface) {
+	struct sr_nat_shard *shard = sr_nat_shard_of(nat, mapping_cpy);
+	pthread_mutex_lock(&(shard->lock));
 
-	struct sr_nat_mapping *mapping = nat->mappings;
+	struct sr_nat_mapping *mapping = sr_nat_mapping_of(shard, mapping_cpy);
+	struct sr_nat_connection *conn = mapping ? sr_nat_find_conn(mapping, ip_dest, port_dest) : NULL;
 
-	while (mapping) {
-		if (
-		(mapping->type == mapping_cpy->type) &&
-		(mapping->aux_ext == mapping_cpy->aux_ext)
-		) {
-			struct sr_nat_connection *conn = mapping->conns;
-			while (conn) {
-				if (
-				(conn->ip_dest == ip_dest) &&
-				(conn->port_dest == port_dest)
-				) {
-					conn->unsolicited_packet = packet;
-					conn->len = len;
-					conn->interface = interface;
-					break;
-				}
-				conn = conn->next;
-			}
-			break;
-		}
-		mapping = mapping->next;
+	if (conn) {
+		conn->unsolicited_packet = packet;
+		conn->len = len;
+		conn->interface = interface;
 	}
 
 
-	pthread_mutex_unlock(&(nat->lock));
+	pthread_mutex_unlock(&(shard->lock));
 }
\ No newline at end of file
@@ -8,7 +8,26 @@
 #include <string.h>
 #include <pthread.h>
 
+#include "sr_timer.h"
+
+#define SR_NAT_SYN_WAIT 6      /* seconds an unsolicited SYN waits for the
+                                  inside host to open the connection */
+#define SR_NAT_TCP_IDLE 1      /* seconds a TCP mapping lives without any
+                                  connection */
+#define SR_NAT_BUCKETS 256     /* mapping table buckets to start with; it
+                                  doubles as mappings outnumber buckets */
+#define SR_NAT_CONNS_FEW 4     /* connections a mapping holds inline */
+#define SR_NAT_TCP_PORT_MIN 1024 /* external ports handed out, up to 65535 */
+#define SR_NAT_ICMP_ID_MIN 1     /* external ICMP ids, likewise */
+#ifndef SR_NAT_SHARD_BITS
+#define SR_NAT_SHARD_BITS 4      /* log2 of the shards, at most 8 */
+#endif
+#define SR_NAT_SHARDS (1 << SR_NAT_SHARD_BITS)
+#define SR_NAT_SHARD_PORTS (65536 >> SR_NAT_SHARD_BITS) /* ports a shard owns */
+
 struct sr_instance;
+struct sr_nat;
+struct sr_nat_mapping;
 
 typedef enum {
   nat_mapping_icmp,
@@ -37,8 +56,10 @@ struct sr_nat_connection {
   sr_tcp_state state;
   uint8_t * unsolicited_packet;
   unsigned int len;
-  char* interface;
-  struct sr_nat_connection *next;
+  int interface;   /* ingress, sr_if_index(..) */
+  struct sr_nat_mapping *mapping; /* owner */
+  struct sr_timer timer; /* times out the connection */
+  struct sr_nat_connection *next; /* in its conn_table bucket */
 };
 
 struct sr_nat_mapping {
@@ -48,46 +69,110 @@ struct sr_nat_mapping {
   uint16_t aux_int; /* internal port or icmp id */
   uint16_t aux_ext; /* external port or icmp id */
   time_t last_updated; /* use to timeout mappings */
-  struct sr_nat_connection *conns; /* list of connections. null for ICMP */
-  struct sr_nat_mapping *next;
+  /* Connections by (ip_dest, port_dest), none for ICMP.  Up to
+     SR_NAT_CONNS_FEW are kept in few; past that they move to conn_table,
+     a hash table chained through the connections, for good. */
+  uint32_t nconns;
+  struct sr_nat_connection *few[SR_NAT_CONNS_FEW];
+  struct sr_nat_connection **conn_table;
+  uint32_t conn_mask; /* buckets - 1 */
+  struct sr_timer timer; /* ICMP: times out the mapping; TCP: drops it
+                            if it never gets a connection */
+  struct sr_nat_mapping *next_int; /* in its by_int bucket */
+  struct sr_nat_mapping *next_ext; /* in its by_ext bucket */
+};
+
+/* The external ports (ICMP ids) of one protocol on one external address
+   that no mapping of a shard holds, in a ring: allocating takes the one
+   at head, releasing puts one at the tail.  Both are O(1), and a released
+   port is handed out again only after all the others. */
+struct sr_nat_ports {
+  uint32_t ip_ext;
+  sr_nat_mapping_type type;
+  uint16_t free[SR_NAT_SHARD_PORTS]; /* host byte order */
+  uint32_t head;
+  uint32_t count;
+  struct sr_nat_ports *next;
+};
+
+/* A slice of the NAT with its own lock.  A mapping lives in the shard
+   its internal key hashes to, and gets an external port (ICMP id) that
+   shard owns: those whose low SR_NAT_SHARD_BITS bits are the shard's
+   id.  Packets going out find the shard from their internal key, packets
+   coming in from their destination port, and flows of different shards
+   never wait for each other. */
+struct sr_nat_shard {
+  struct sr_nat *nat;
+  unsigned int id;
+
+  /* Every mapping is in two hash tables: by its internal key (type,
+     ip_int, aux_int), for packets going out, and by its external key
+     (type, ip_ext, aux_ext), for packets coming in.  Buckets are chains
+     through the mapping itself. */
+  struct sr_nat_mapping **by_int;
+  struct sr_nat_mapping **by_ext;
+  uint32_t mask;  /* buckets - 1, the same for both tables */
+  uint32_t count; /* mappings */
+  struct sr_nat_ports *ports; /* per external address and type */
+  struct sr_possible_connection * possible_conns; /* SYNs to our ports */
+  struct sr_possible_connection * unanswered; /* timed out, for the timer
+                                                 thread to answer unlocked */
+
+  /* Mappings (through next_int) and connections (through next) that are
+     gone but may still be borrowed; the timer thread frees them once
+     every reader has left its read-side section. */
+  struct sr_nat_mapping *retired;
+  struct sr_nat_connection *retired_conns;
+
+  /* Retired ones the timer thread took, freed once grace period
+     reclaim_gp is over (sr_rcu_done).  Only the timer thread uses these. */
+  struct sr_nat_mapping *reclaiming;
+  struct sr_nat_connection *reclaiming_conns;
+  unsigned long reclaim_gp;
+
+  /* Timeouts are per object timers (sr_timer.h), fired under lock */
+  struct sr_wheel wheel;
+
+  pthread_mutex_t lock;
 };
 
 typedef struct sr_nat {
   /* add any fields here */
   struct sr_instance * sr_instance;
-  struct sr_nat_mapping *mappings;
+
+  struct sr_nat_shard shards[SR_NAT_SHARDS];
+  uint32_t ip_ext; /* address new mappings get, eth2's unless set */
+  int if_int; /* the internal interface, sr_if_index("eth1") */
   int tcpTransitoryTimeout;
   int tcpEstablishedTimeout;
   int icmpTimeout;
-  struct sr_possible_connection * possible_conns;
+  unsigned int gen; /* bumped whenever a mapping or connection goes away */
 
   /* threading */
-  pthread_mutex_t lock;
   pthread_mutexattr_t attr;
-  pthread_attr_t thread_attr;
-  pthread_t thread;
 } sr_nat_t;
 
 struct sr_possible_connection {
   /* add TCP connection state data members here */
   uint32_t ip; /* external ip addr */
-  uint16_t port; /* external port */
+  uint16_t port; /* external port, network byte order */
   time_t recv_time; /* use to timeout mappings */
 
-  uint8_t * unsolicited_packet;
+  uint8_t * unsolicited_packet; /* a copy, owned */
   unsigned int len;
-  char* interface;
+  int interface;   /* ingress, sr_if_index(..) */
+  struct sr_timer timer; /* answers the SYN after SR_NAT_SYN_WAIT */
   struct sr_possible_connection *next;
+  struct sr_possible_connection *prev;
 };
 
 int sr_nat_init(sr_nat_t *nat);     /* Initializes the nat */
 int sr_nat_destroy(struct sr_nat *nat);  /* Destroys the nat (free memory) */
-void *sr_nat_timeout(void *nat_ptr);  /* Periodic Timout */
 
-/* Get the mapping associated with given external port.
+/* Get the mapping associated with given external (ip, port) pair.
    You must free the returned structure if it is not NULL. */
 struct sr_nat_mapping *sr_nat_lookup_external(struct sr_nat *nat,
-    uint16_t aux_ext, sr_nat_mapping_type type );
+    uint32_t ip_ext, uint16_t aux_ext, sr_nat_mapping_type type );
 
 /* Get the mapping associated with given internal (ip, port) pair.
    You must free the returned structure if it is not NULL. */
@@ -95,16 +180,38 @@ struct sr_nat_mapping *sr_nat_lookup_internal(struct sr_nat *nat,
   uint32_t ip_int, uint16_t aux_int, sr_nat_mapping_type type );
 
 /* Insert a new mapping into the nat's mapping table.
-   You must free the returned structure if it is not NULL. */
+   You must free the returned structure if it is not NULL.  Returns NULL
+   when no external port (ICMP id) is free. */
 struct sr_nat_mapping *sr_nat_insert_mapping(struct sr_nat *nat,
   uint32_t ip_int, uint16_t aux_int, sr_nat_mapping_type type );
 
-
-int generate_aux_ext(struct sr_nat *nat, sr_nat_mapping_type type);
-void sr_nat_update_tcp_connection(struct sr_nat_mapping *mapping, uint32_t ip_dest, uint16_t port_dest);
+/* The same lookups without the copy, for the packet path.  They return
+   the NAT's own mapping (connection), borrowed: call them inside an
+   sr_rcu_read_lock() section, use the result only until its
+   sr_rcu_read_unlock(), and neither write nor free it.  Its keys stay
+   as they are; its state may change under the reader. */
+struct sr_nat_mapping *sr_nat_borrow_external(struct sr_nat *nat,
+  uint32_t ip_ext, uint16_t aux_ext, sr_nat_mapping_type type);
+struct sr_nat_mapping *sr_nat_borrow_internal(struct sr_nat *nat,
+  uint32_t ip_int, uint16_t aux_int, sr_nat_mapping_type type);
+struct sr_nat_mapping *sr_nat_borrow_mapping(struct sr_nat *nat,
+  uint32_t ip_int, uint16_t aux_int, sr_nat_mapping_type type);
+struct sr_nat_connection *sr_nat_borrow_connection(struct sr_nat *nat,
+  struct sr_nat_mapping *mapping, uint32_t ip_dest, uint16_t port_dest);
+
+
+/* A free external port (ICMP id) of type on nat->ip_ext that shard owns,
+   -1 if none is.  Call with shard->lock held. */
+int generate_aux_ext(struct sr_nat_shard *shard, sr_nat_mapping_type type);
+void sr_nat_update_tcp_connection(struct sr_nat *nat, struct sr_nat_mapping *mapping, uint32_t ip_dest, uint16_t port_dest);
 
 struct sr_nat_connection* sr_nat_get_connection(struct sr_nat *nat, struct sr_nat_mapping *mapping, uint32_t ip_dest, uint16_t port_dest);
 void sr_nat_update_connection_state(struct sr_nat *nat, struct sr_nat_mapping *mapping, uint32_t ip_dest, uint16_t port_dest, sr_tcp_state expected_state, sr_tcp_state new_state);
 void sr_nat_insert_tcp_connection(struct sr_nat *nat, struct sr_nat_mapping *mapping, uint32_t ip_dest, uint16_t port_dest);
-void sr_nat_insert_connection_packet(struct sr_nat *nat, struct sr_nat_mapping *mapping_cpy, uint32_t ip_dest, uint16_t port_dest, uint8_t * packet, unsigned int len, char * interface);
+/* Hold an unsolicited SYN from ip to port for SR_NAT_SYN_WAIT seconds,
+   then answer it with port unreachable unless the inside host opened the
+   connection meanwhile (sr_nat_remove_possible_connection). */
+void sr_nat_insert_possible_connection(struct sr_nat *nat, uint32_t ip, uint16_t port, uint8_t * packet, unsigned int len, int interface);
+void sr_nat_remove_possible_connection(struct sr_nat *nat, uint32_t ip, uint16_t port);
+void sr_nat_insert_connection_packet(struct sr_nat *nat, struct sr_nat_mapping *mapping_cpy, uint32_t ip_dest, uint16_t port_dest, uint8_t * packet, unsigned int len, int interface);
 #endif
@@ -0,0 +1,571 @@
+/*-----------------------------------------------------------------------------
+ * file:  sr_ortc.c
+ *
+ * Description:
+ *
+ * ORTC forwarding table compression, see sr_ortc.h.
+ *
+ * The routes are put into a binary trie, one node per prefix bit, and
+ * every distinct set of next hops is numbered as a class (class 0: no
+ * route).  Then the three ORTC passes run:
+ *
+ *   1. leaf pushing - every node gets zero or two children; a missing
+ *      half forwards like the nearest prefix above it.
+ *   2. bottom up    - a leaf's candidate set is its class, an inner
+ *      node's the intersection of its children's sets if that is not
+ *      empty and their union otherwise.
+ *   3. top down     - a node whose set holds the class inherited from
+ *      above needs no prefix; otherwise it gets a prefix for any class
+ *      of its set, which its children then inherit.
+ *
+ *---------------------------------------------------------------------------*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "sr_ortc.h"
+#include "sr_rt.h"
+
+#define SR_ORTC_UNSET 0xffffffffu
+
+#define sr_ortc_mask(len) ((len) ? (uint32_t)(0xffffffffu << (32 - (len))) : 0)
+
+struct sr_ortc_node
+{
+    uint32_t child[2];      /* 0: none, the root is nobody's child */
+    uint32_t cls;           /* class of the route for this very prefix */
+    uint32_t set;           /* the class itself if nset is 1, else in sets */
+    uint32_t nset;
+};
+
+struct sr_ortc_prefix
+{
+    uint32_t prefix;        /* host byte order */
+    uint32_t len;
+    uint32_t cls;
+};
+
+struct sr_ortc
+{
+    const struct sr_fib* fib;
+    uint32_t* nh_class;     /* routes[] slot -> class */
+    uint32_t* rep;          /* class -> routes[] slot it forwards with */
+    uint32_t nclass;
+    uint32_t* hash;         /* classes by hash of their paths, 0: empty */
+    uint32_t hash_cap;      /* power of two */
+
+    struct sr_ortc_node* nodes;
+    uint32_t nnodes;
+    uint32_t node_cap;
+
+    uint32_t* sets;         /* sorted candidate sets of more than one class */
+    uint32_t nsets;
+    uint32_t set_cap;
+
+    struct sr_ortc_prefix* out;
+    uint32_t nout;
+    uint32_t out_cap;
+
+    uint32_t nprefixes;     /* distinct prefixes of the routing table */
+};
+
+/* Make room for need elements of esize bytes in *arr.  Returns 0 or -1. */
+static int sr_ortc_reserve(void* arr, uint32_t* cap, uint64_t need,
+                           size_t esize)
+{
+    void** base = (void**)arr;
+    void* grown;
+    uint64_t size;
+
+    if(need <= *cap)
+    { return 0; }
+
+    size = *cap ? *cap : 64;
+    while(size < need)
+    { size *= 2; }
+    if(size > 0xffffffffu)
+    { return -1; }
+
+    grown = realloc(*base, (size_t)size * esize);
+    if(grown == 0)
+    { return -1; }
+    *base = grown;
+    *cap = (uint32_t)size;
+    return 0;
+}
+
+static uint32_t sr_ortc_new_node(struct sr_ortc* o)
+{
+    struct sr_ortc_node* node;
+
+    if(sr_ortc_reserve(&o->nodes, &o->node_cap, (uint64_t)o->nnodes + 1,
+                       sizeof(struct sr_ortc_node)) != 0)
+    { return SR_ORTC_UNSET; }
+
+    node = &o->nodes[o->nnodes];
+    node->child[0] = 0;
+    node->child[1] = 0;
+    node->cls = SR_ORTC_UNSET;
+    node->set = 0;
+    node->nset = 0;
+    return o->nnodes++;
+}
+
+static const uint32_t* sr_ortc_set(const struct sr_ortc* o, uint32_t n)
+{
+    return (o->nodes[n].nset == 1) ? &o->nodes[n].set : o->sets + o->nodes[n].set;
+}
+
+/*---------------------------------------------------------------------
+ * Method: sr_ortc_classify(..)
+ * Scope: Local
+ *
+ * Number the distinct next hop lists of the routes the LPM points at.
+ * Two routes are in the same class if their paths have the same gateways
+ * and interfaces in the same order, so ECMP picks the same path for a
+ * flow through either of them.
+ *
+ *---------------------------------------------------------------------*/
+
+static uint32_t sr_ortc_hash_paths(const struct sr_rt* rt)
+{
+    uint32_t h = 2166136261u;
+    uint32_t n = rt->npaths;
+    uint32_t i, c;
+
+    for(; rt && n > 0; rt = rt->next, n--)
+    {
+        h = (h ^ rt->gw.s_addr) * 16777619u;
+        for(i = 0; i < sr_IFACE_NAMELEN && rt->interface[i]; i++)
+        {
+            c = (uint8_t)rt->interface[i];
+            h = (h ^ c) * 16777619u;
+        }
+        h = (h ^ 0xff) * 16777619u;
+    }
+    return h;
+}
+
+static int sr_ortc_same_paths(const struct sr_rt* a, const struct sr_rt* b)
+{
+    uint32_t n = a->npaths;
+
+    if(n != b->npaths)
+    { return 0; }
+
+    for(; a && b && n > 0; a = a->next, b = b->next, n--)
+    {
+        if(a->gw.s_addr != b->gw.s_addr ||
+           strncmp(a->interface, b->interface, sr_IFACE_NAMELEN) != 0)
+        { return 0; }
+    }
+    return 1;
+}
+
+static int sr_ortc_classify(struct sr_ortc* o)
+{
+    const struct sr_fib* fib = o->fib;
+    const struct sr_rt* rt = 0;
+    uint32_t i, h, c;
+
+    o->hash_cap = 64;
+    while(o->hash_cap < 2 * fib->nroutes)
+    { o->hash_cap *= 2; }
+
+    o->nh_class = (uint32_t*)calloc(fib->nroutes, sizeof(uint32_t));
+    o->rep = (uint32_t*)malloc((fib->nroutes + 1) * sizeof(uint32_t));
+    o->hash = (uint32_t*)calloc(o->hash_cap, sizeof(uint32_t));
+    if(o->nh_class == 0 || o->rep == 0 || o->hash == 0)
+    { return -1; }
+
+    o->rep[0] = SR_FIB_DISCARD;
+    o->nclass = 1;
+
+    for(i = 1; i < fib->nroutes; i++)
+    {
+        rt = fib->routes[i];
+        if(rt == 0 || rt->npaths == 0)
+        { continue; }
+
+        h = sr_ortc_hash_paths(rt) & (o->hash_cap - 1);
+        while((c = o->hash[h]) != 0 &&
+              !sr_ortc_same_paths(fib->routes[o->rep[c]], rt))
+        { h = (h + 1) & (o->hash_cap - 1); }
+
+        if(c == 0)
+        {
+            c = o->nclass++;
+            o->rep[c] = i;
+            o->hash[h] = c;
+        }
+        o->nh_class[i] = c;
+    }
+    return 0;
+} /* -- sr_ortc_classify -- */
+
+/*---------------------------------------------------------------------
+ * Method: sr_ortc_build(..)
+ * Scope: Local
+ *
+ * Put every route the LPM points at into the binary trie.  Like the
+ * LPM, a later route for the same prefix replaces an earlier one and a
+ * non-contiguous mask counts with its leading bits.
+ *
+ *---------------------------------------------------------------------*/
+
+static int sr_ortc_build(struct sr_ortc* o)
+{
+    const struct sr_fib* fib = o->fib;
+    const struct sr_rt* rt = 0;
+    uint32_t prefix, len, bit, d, n, c, i;
+
+    if(sr_ortc_new_node(o) == SR_ORTC_UNSET)
+    { return -1; }
+
+    for(i = 1; i < fib->nroutes; i++)
+    {
+        rt = fib->routes[i];
+        if(rt == 0 || rt->npaths == 0)
+        { continue; }
+
+        len = sr_lpm_mask_len(ntohl(rt->mask.s_addr));
+        prefix = ntohl(rt->dest.s_addr) & sr_ortc_mask(len);
+
+        for(n = 0, d = 0; d < len; d++)
+        {
+            bit = (prefix >> (31 - d)) & 1;
+            if(o->nodes[n].child[bit] == 0)
+            {
+                c = sr_ortc_new_node(o);
+                if(c == SR_ORTC_UNSET)
+                { return -1; }
+                o->nodes[n].child[bit] = c;
+            }
+            n = o->nodes[n].child[bit];
+        }
+
+        if(o->nodes[n].cls == SR_ORTC_UNSET)
+        { o->nprefixes++; }
+        o->nodes[n].cls = o->nh_class[i];
+    }
+    return 0;
+} /* -- sr_ortc_build -- */
+
+/*---------------------------------------------------------------------
+ * Method: sr_ortc_sets(..)
+ * Scope: Local
+ *
+ * Passes 1 and 2 for the subtree at node n, which inherits class
+ * inherited from the prefixes above it.
+ *
+ *---------------------------------------------------------------------*/
+
+static int sr_ortc_sets(struct sr_ortc* o, uint32_t n, uint32_t inherited)
+{
+    const uint32_t* a = 0;
+    const uint32_t* b = 0;
+    uint32_t* res = 0;
+    uint32_t child[2];
+    uint32_t own, na, nb, i, j, k;
+    int side;
+
+    own = (o->nodes[n].cls != SR_ORTC_UNSET) ? o->nodes[n].cls : inherited;
+    child[0] = o->nodes[n].child[0];
+    child[1] = o->nodes[n].child[1];
+
+    if(child[0] == 0 && child[1] == 0)
+    {
+        o->nodes[n].set = own;
+        o->nodes[n].nset = 1;
+        return 0;
+    }
+
+    /* -- a missing half forwards like this prefix -- */
+    for(side = 0; side < 2; side++)
+    {
+        if(child[side] == 0)
+        {
+            child[side] = sr_ortc_new_node(o);
+            if(child[side] == SR_ORTC_UNSET)
+            { return -1; }
+            o->nodes[n].child[side] = child[side];
+        }
+        if(sr_ortc_sets(o, child[side], own) != 0)
+        { return -1; }
+    }
+
+    na = o->nodes[child[0]].nset;
+    nb = o->nodes[child[1]].nset;
+    if(sr_ortc_reserve(&o->sets, &o->set_cap, (uint64_t)o->nsets + na + nb,
+                       sizeof(uint32_t)) != 0)
+    { return -1; }
+    a = sr_ortc_set(o, child[0]);
+    b = sr_ortc_set(o, child[1]);
+    res = o->sets + o->nsets;
+
+    /* -- intersection if there is one, union otherwise -- */
+    for(i = 0, j = 0, k = 0; i < na && j < nb; )
+    {
+        if(a[i] < b[j])
+        { i++; }
+        else if(a[i] > b[j])
+        { j++; }
+        else
+        {
+            res[k++] = a[i];
+            i++;
+            j++;
+        }
+    }
+    if(k == 0)
+    {
+        for(i = 0, j = 0; i < na || j < nb; )
+        {
+            if(j == nb || (i < na && a[i] < b[j]))
+            { res[k++] = a[i++]; }
+            else if(i == na || b[j] < a[i])
+            { res[k++] = b[j++]; }
+            else
+            {
+                res[k++] = a[i];
+                i++;
+                j++;
+            }
+        }
+    }
+
+    if(k == 1)
+    { o->nodes[n].set = res[0]; }
+    else
+    {
+        o->nodes[n].set = o->nsets;
+        o->nsets += k;
+    }
+    o->nodes[n].nset = k;
+    return 0;
+} /* -- sr_ortc_sets -- */
+
+static int sr_ortc_has(const uint32_t* set, uint32_t n, uint32_t cls)
+{
+    uint32_t lo = 0;
+    uint32_t hi = n;
+    uint32_t mid;
+
+    while(lo < hi)
+    {
+        mid = lo + (hi - lo) / 2;
+        if(set[mid] < cls)
+        { lo = mid + 1; }
+        else
+        { hi = mid; }
+    }
+    return lo < n && set[lo] == cls;
+}
+
+/*---------------------------------------------------------------------
+ * Method: sr_ortc_choose(..)
+ * Scope: Local
+ *
+ * Pass 3 for the subtree at node n, which covers prefix/len and
+ * inherits class inherited.  Appends the prefixes it needs to o->out.
+ *
+ *---------------------------------------------------------------------*/
+
+static int sr_ortc_choose(struct sr_ortc* o, uint32_t n, uint32_t prefix,
+                          uint32_t len, uint32_t inherited)
+{
+    const uint32_t* set = sr_ortc_set(o, n);
+    struct sr_ortc_prefix* p = 0;
+    uint32_t chosen = inherited;
+
+    if(!sr_ortc_has(set, o->nodes[n].nset, inherited))
+    {
+        chosen = set[0];
+
+        if(sr_ortc_reserve(&o->out, &o->out_cap, (uint64_t)o->nout + 1,
+                           sizeof(struct sr_ortc_prefix)) != 0)
+        { return -1; }
+        p = &o->out[o->nout++];
+        p->prefix = prefix;
+        p->len = len;
+        p->cls = chosen;
+    }
+
+    if(o->nodes[n].child[0] == 0)
+    { return 0; }
+
+    if(sr_ortc_choose(o, o->nodes[n].child[0], prefix, len + 1, chosen) != 0 ||
+       sr_ortc_choose(o, o->nodes[n].child[1], prefix | (0x80000000u >> len),
+                      len + 1, chosen) != 0)
+    { return -1; }
+    return 0;
+} /* -- sr_ortc_choose -- */
+
+/* Class a lookup in a table built here or from the routes answered with. */
+static uint32_t sr_ortc_lookup(const struct sr_ortc* o,
+                               const struct sr_lpm* lpm, uint32_t ip)
+{
+    uint32_t nh = sr_lpm_lookup(lpm, ip);
+
+    return (nh == SR_LPM_NONE || nh == SR_FIB_DISCARD) ? 0 : o->nh_class[nh];
+}
+
+/* Add where prefix/len starts and where the addresses after it start. */
+static void sr_ortc_bounds(uint32_t* points, uint32_t* n, uint32_t prefix,
+                           uint32_t len)
+{
+    uint32_t last = prefix | ~sr_ortc_mask(len);
+
+    points[(*n)++] = prefix;
+    if(last != 0xffffffffu)
+    { points[(*n)++] = last + 1; }
+}
+
+static int sr_ortc_cmp(const void* a, const void* b)
+{
+    uint32_t x = *(const uint32_t*)a;
+    uint32_t y = *(const uint32_t*)b;
+
+    return (x > y) - (x < y);
+}
+
+/*---------------------------------------------------------------------
+ * Method: sr_ortc_verify(..)
+ * Scope: Local
+ *
+ * Check that the compressed LPM forwards like the original one.  Every
+ * prefix of either table starts at one boundary and ends right before
+ * another; between two consecutive boundaries the set of prefixes that
+ * cover an address does not change, and neither does either table's
+ * answer.  So comparing the two at each boundary covers all addresses.
+ *
+ *---------------------------------------------------------------------*/
+
+static int sr_ortc_verify(const struct sr_ortc* o, const struct sr_lpm* orig,
+                          const struct sr_lpm* comp)
+{
+    const struct sr_fib* fib = o->fib;
+    const struct sr_rt* rt = 0;
+    struct in_addr addr;
+    uint32_t* points = 0;
+    uint32_t npoints = 0;
+    uint32_t prefix, len, i, want, got;
+
+    points = (uint32_t*)malloc(((size_t)fib->nroutes + o->nout + 1) * 2 *
+                               sizeof(uint32_t));
+    if(points == 0)
+    { return -1; }
+
+    points[npoints++] = 0;
+    for(i = 1; i < fib->nroutes; i++)
+    {
+        rt = fib->routes[i];
+        if(rt == 0 || rt->npaths == 0)
+        { continue; }
+        len = sr_lpm_mask_len(ntohl(rt->mask.s_addr));
+        prefix = ntohl(rt->dest.s_addr) & sr_ortc_mask(len);
+        sr_ortc_bounds(points, &npoints, prefix, len);
+    }
+    for(i = 0; i < o->nout; i++)
+    { sr_ortc_bounds(points, &npoints, o->out[i].prefix, o->out[i].len); }
+
+    qsort(points, npoints, sizeof(uint32_t), sr_ortc_cmp);
+
+    for(i = 0; i < npoints; i++)
+    {
+        if(i > 0 && points[i] == points[i - 1])
+        { continue; }
+
+        want = sr_ortc_lookup(o, orig, points[i]);
+        got = sr_ortc_lookup(o, comp, points[i]);
+        if(want != got)
+        {
+            addr.s_addr = htonl(points[i]);
+            fprintf(stderr, "Compressed table differs from the routing table "
+                    "at %s\n", inet_ntoa(addr));
+            free(points);
+            return -1;
+        }
+    }
+
+    printf("Verified the compressed table at %u boundaries\n", npoints);
+    free(points);
+    return 0;
+} /* -- sr_ortc_verify -- */
+
+/*---------------------------------------------------------------------
+ * Method: sr_ortc_compress(..)
+ * Scope: Global
+ *
+ * Replace the LPM of fib, which must not be published yet, with one
+ * built from the smallest equivalent prefix set.  With verify set the
+ * result is checked against the original first.  Returns 0, or -1 with
+ * fib unchanged if there was not enough memory or the check failed.
+ *
+ *---------------------------------------------------------------------*/
+
+int sr_ortc_compress(struct sr_fib* fib, int verify)
+{
+    struct sr_lpm* lpm = 0;
+    struct sr_ortc o;
+    uint32_t nh, i;
+    int ret = -1;
+
+    /* -- REQUIRES -- */
+    assert(fib);
+    assert(!fib->live);
+
+    if(fib->compressed)
+    { return 0; }
+
+    memset(&o, 0, sizeof(o));
+    o.fib = fib;
+
+    if(sr_ortc_classify(&o) != 0 || sr_ortc_build(&o) != 0 ||
+       sr_ortc_sets(&o, 0, 0) != 0 || sr_ortc_choose(&o, 0, 0, 0, 0) != 0)
+    {
+        fprintf(stderr, "Not enough memory to compress the forwarding table\n");
+        goto done;
+    }
+
+    lpm = sr_lpm_create(sr_lpm_get_type(fib->lpm));
+    if(lpm == 0)
+    { goto done; }
+
+    for(i = 0; i < o.nout; i++)
+    {
+        nh = o.rep[o.out[i].cls];
+        if(sr_lpm_insert(lpm, o.out[i].prefix, o.out[i].len, nh) != 0)
+        { goto done; }
+        sr_lpm_reclaim(lpm);
+    }
+
+    if(verify && sr_ortc_verify(&o, fib->lpm, lpm) != 0)
+    { goto done; }
+
+    printf("Compressed forwarding table: %u -> %u prefixes, %lu -> %lu bytes\n",
+           o.nprefixes, o.nout, (unsigned long)sr_lpm_memory(fib->lpm),
+           (unsigned long)sr_lpm_memory(lpm));
+
+    sr_lpm_destroy(fib->lpm);
+    fib->lpm = lpm;
+    fib->compressed = 1;
+    lpm = 0;
+    ret = 0;
+
+done:
+    if(lpm)
+    { sr_lpm_destroy(lpm); }
+    free(o.nh_class);
+    free(o.rep);
+    free(o.hash);
+    free(o.nodes);
+    free(o.sets);
+    free(o.out);
+    return ret;
+} /* -- sr_ortc_compress -- */
@@ -0,0 +1,38 @@
+/*-----------------------------------------------------------------------------
+ * file:  sr_ortc.h
+ *
+ * Description:
+ *
+ * Forwarding table compression with ORTC (Optimal Routing Table
+ * Constructor, Draves et al.).  Routing tables often carry nested or
+ * adjacent prefixes that forward the same way; only the forwarding
+ * behaviour matters to the lookup structure, so it can be built from the
+ * smallest prefix set that forwards every address exactly like the
+ * routing table does.  Two routes forward the same way when they have
+ * the same next hops (gateway and interface) in the same order.
+ *
+ * The pass runs on a freshly loaded table before it is published.  The
+ * routing table list and routes[] are kept as they are; only the LPM is
+ * rebuilt, with each prefix pointing at a representative route.  Address
+ * ranges without a route under a compressed prefix get SR_FIB_DISCARD.
+ *
+ * With SR_ORTC_VERIFY the compressed LPM is checked against the original
+ * one at every boundary of every prefix in either table.  Both answer the
+ * same for all addresses between two consecutive boundaries, so this
+ * proves the tables equivalent for the whole address space.
+ *
+ * A compressed table cannot take incremental updates (sr_fib_update).
+ *
+ *---------------------------------------------------------------------------*/
+
+#ifndef SR_ORTC_H
+#define SR_ORTC_H
+
+#define SR_ORTC_ON     1    /* compress tables as they are loaded */
+#define SR_ORTC_VERIFY 2    /* and prove each one equivalent */
+
+struct sr_fib;
+
+int sr_ortc_compress(struct sr_fib* fib, int verify);
+
+#endif /* -- SR_ORTC_H -- */
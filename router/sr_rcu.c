@@ -0,0 +1,174 @@
+/*-----------------------------------------------------------------------------
+ * file:  sr_rcu.c
+ *
+ * Description:
+ *
+ * Every reader thread owns a counter.  It is 0 while the thread is outside
+ * a read-side section, otherwise it holds the value of the global grace
+ * period counter at the time the (outermost) section was entered.  A
+ * writer bumps the global counter and waits until no reader is sitting
+ * in a section that began before the bump.
+ *
+ *---------------------------------------------------------------------------*/
+
+#include <stdlib.h>
+#include <assert.h>
+#include <pthread.h>
+#include <sched.h>
+
+#include "sr_rcu.h"
+
+struct sr_rcu_reader
+{
+    unsigned long ctr;          /* 0 or grace period the section began in */
+    unsigned int  nesting;
+    struct sr_rcu_reader* next;
+};
+
+static unsigned long          sr_rcu_gp = 1;
+static struct sr_rcu_reader*  sr_rcu_readers = 0;
+static pthread_mutex_t        sr_rcu_registry_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t        sr_rcu_gp_lock = PTHREAD_MUTEX_INITIALIZER;
+static __thread struct sr_rcu_reader* sr_rcu_self = 0;
+
+static void sr_rcu_register(void)
+{
+    struct sr_rcu_reader* r =
+        (struct sr_rcu_reader*)calloc(1, sizeof(struct sr_rcu_reader));
+    assert(r);
+
+    pthread_mutex_lock(&sr_rcu_registry_lock);
+    r->next = sr_rcu_readers;
+    sr_rcu_assign(&sr_rcu_readers, r);
+    pthread_mutex_unlock(&sr_rcu_registry_lock);
+
+    sr_rcu_self = r;
+}
+
+/*---------------------------------------------------------------------
+ * Method: sr_rcu_read_lock(..)
+ * Scope: Global
+ *
+ *---------------------------------------------------------------------*/
+
+void sr_rcu_read_lock(void)
+{
+    struct sr_rcu_reader* self = sr_rcu_self;
+
+    if(self == 0)
+    {
+        sr_rcu_register();
+        self = sr_rcu_self;
+    }
+
+    if(self->nesting++ == 0)
+    {
+        __atomic_store_n(&self->ctr,
+                __atomic_load_n(&sr_rcu_gp, __ATOMIC_RELAXED), __ATOMIC_RELAXED);
+        /* -- pairs with the fence in sr_rcu_synchronize -- */
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    }
+} /* -- sr_rcu_read_lock -- */
+
+/*---------------------------------------------------------------------
+ * Method: sr_rcu_read_unlock(..)
+ * Scope: Global
+ *
+ *---------------------------------------------------------------------*/
+
+void sr_rcu_read_unlock(void)
+{
+    struct sr_rcu_reader* self = sr_rcu_self;
+
+    assert(self && self->nesting > 0);
+
+    if(--self->nesting == 0)
+    {
+        __atomic_store_n(&self->ctr, 0, __ATOMIC_RELEASE);
+    }
+} /* -- sr_rcu_read_unlock -- */
+
+/*---------------------------------------------------------------------
+ * Method: sr_rcu_synchronize(..)
+ * Scope: Global
+ *
+ * Wait for all pre-existing read-side sections to finish.
+ *
+ *---------------------------------------------------------------------*/
+
+void sr_rcu_synchronize(void)
+{
+    struct sr_rcu_reader* r;
+    unsigned long gp;
+    unsigned long ctr;
+
+    assert(sr_rcu_self == 0 || sr_rcu_self->nesting == 0);
+
+    pthread_mutex_lock(&sr_rcu_gp_lock);
+
+    /* -- order the caller's sr_rcu_assign before the counter bump -- */
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    gp = __atomic_add_fetch(&sr_rcu_gp, 1, __ATOMIC_SEQ_CST);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+    for(r = sr_rcu_deref(&sr_rcu_readers); r; r = r->next)
+    {
+        for(;;)
+        {
+            ctr = __atomic_load_n(&r->ctr, __ATOMIC_ACQUIRE);
+            if(ctr == 0 || ctr >= gp)
+            { break; }
+            sched_yield();
+        }
+    }
+
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    pthread_mutex_unlock(&sr_rcu_gp_lock);
+} /* -- sr_rcu_synchronize -- */
+
+/*---------------------------------------------------------------------
+ * Method: sr_rcu_start(..)
+ * Scope: Global
+ *
+ * Begin a grace period for what the caller unpublished so far, without
+ * waiting for it.  Pass the result to sr_rcu_done(..).
+ *
+ *---------------------------------------------------------------------*/
+
+unsigned long sr_rcu_start(void)
+{
+    unsigned long gp;
+
+    /* -- as in sr_rcu_synchronize, unpublishing before the bump -- */
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    gp = __atomic_add_fetch(&sr_rcu_gp, 1, __ATOMIC_SEQ_CST);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+    return gp;
+} /* -- sr_rcu_start -- */
+
+/*---------------------------------------------------------------------
+ * Method: sr_rcu_done(..)
+ * Scope: Global
+ *
+ * Whether every read-side section that began before grace period gp
+ * started has finished.  Looks once, never waits.
+ *
+ *---------------------------------------------------------------------*/
+
+int sr_rcu_done(unsigned long gp)
+{
+    struct sr_rcu_reader* r;
+    unsigned long ctr;
+
+    for(r = sr_rcu_deref(&sr_rcu_readers); r; r = r->next)
+    {
+        ctr = __atomic_load_n(&r->ctr, __ATOMIC_ACQUIRE);
+        if(ctr != 0 && ctr < gp)
+        { return 0; }
+    }
+
+    /* -- the caller's frees come after the readers' last accesses -- */
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    return 1;
+} /* -- sr_rcu_done -- */
@@ -0,0 +1,38 @@
+/*-----------------------------------------------------------------------------
+ * file:  sr_rcu.h
+ *
+ * Description:
+ *
+ * Minimal read-copy-update for structures that are read on every packet
+ * but replaced rarely (e.g. the forwarding table).
+ *
+ * Readers bracket their use of a published pointer with
+ * sr_rcu_read_lock()/sr_rcu_read_unlock().  These never block and may
+ * nest.  A writer builds the replacement off to the side, publishes it
+ * with sr_rcu_assign(), then calls sr_rcu_synchronize(), which returns
+ * once every reader that could still see the old pointer has left its
+ * read-side section.  The old structure can then be freed.
+ *
+ * A writer that must not wait, like the timer thread, starts a grace
+ * period with sr_rcu_start() instead and frees what it unpublished before
+ * once sr_rcu_done() says the grace period is over, on a later round.
+ *
+ * Threads register themselves the first time they enter a read-side
+ * section.  sr_rcu_synchronize() must not be called from inside one.
+ *
+ *---------------------------------------------------------------------------*/
+
+#ifndef SR_RCU_H
+#define SR_RCU_H
+
+/* Publish p through *pp / read the currently published pointer. */
+#define sr_rcu_assign(pp, p)  __atomic_store_n((pp), (p), __ATOMIC_RELEASE)
+#define sr_rcu_deref(pp)      __atomic_load_n((pp), __ATOMIC_ACQUIRE)
+
+void sr_rcu_read_lock(void);
+void sr_rcu_read_unlock(void);
+void sr_rcu_synchronize(void);
+unsigned long sr_rcu_start(void);
+int sr_rcu_done(unsigned long gp);
+
+#endif /* -- SR_RCU_H -- */
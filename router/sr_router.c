@@ -26,6 +26,10 @@
 #include "sr_arpcache.h"
 #include "sr_utils.h"
 #include "sr_nat.h"
+#include "sr_rcu.h"
+#include "sr_flowcache.h"
+#include "sr_ctl.h"
+#include "sr_vrf.h"
 
 /*---------------------------------------------------------------------
  * Method: sr_init(void)
@@ -41,7 +45,10 @@ void sr_init(struct sr_instance* sr)
 		assert(sr);
 
 		/* Initialize cache and cache cleanup thread */
-		sr_arpcache_init(&(sr->cache));
+		sr_arpcache_init(&(sr->cache), sr->arp_max, sr->arp_queue);
+
+		/* Forwarding decisions of active flows; forwarding works without */
+		sr->flows = sr_flowcache_create();
 
 		pthread_attr_init(&(sr->attr));
 		pthread_attr_setdetachstate(&(sr->attr), PTHREAD_CREATE_JOINABLE);
@@ -49,56 +56,70 @@ void sr_init(struct sr_instance* sr)
 		pthread_attr_setscope(&(sr->attr), PTHREAD_SCOPE_SYSTEM);
 		pthread_t thread;
 
-		pthread_create(&thread, &(sr->attr), sr_arpcache_timeout, sr);
+		/* ARP retries and expiry run on the shared timer thread */
+		sr_arpcache_start(sr);
+
+		/* Reload the routing table on SIGHUP */
+		pthread_create(&thread, &(sr->attr), sr_rt_reload_thread, sr);
 
-		/* Add initialization code here! */
+		/* Route updates from a routing daemon, if asked for */
+		if(sr->ctl_path)
+		{ sr_ctl_start(sr, sr->ctl_path); }
 
 } /* -- sr_init -- */
 
 /*---------------------------------------------------------------------
- * Method: sr_handlepacket(uint8_t* p,char* interface)
+ * Method: sr_handlepacket(uint8_t* p,int interface)
  * Scope:  Global
  *
  * This method is called each time the router receives a packet on the
- * interface.  The packet buffer, the packet length and the receiving
- * interface are passed in as parameters. The packet is complete with
- * ethernet headers.
+ * interface.  The packet buffer, the packet length and the index of the
+ * receiving interface (sr_if_get(..)) are passed in as parameters. The
+ * packet is complete with ethernet headers.
  *
- * Note: Both the packet buffer and the character's memory are handled
- * by sr_vns_comm.c that means do NOT delete either.  Make a copy of the
- * packet instead if you intend to keep it around beyond the scope of
- * the method call.
+ * Note: The packet buffer is handled by sr_vns_comm.c that means do NOT
+ * delete it.  Make a copy of the packet instead if you intend to keep it
+ * around beyond the scope of the method call.
  *
  *---------------------------------------------------------------------*/
 
 void sr_handlepacket(struct sr_instance* sr,
 				uint8_t * packet/* lent */,
 				unsigned int len,
-				char* interface/* lent */)
+				int interface)
 {
 	/* REQUIRES */
 	assert(sr);
 	assert(packet);
-	assert(interface);
 	sr_ethernet_hdr_t * ethernet_header = (sr_ethernet_hdr_t *)packet;
-	/* make a copy of the packet to pass to the functions */
-	uint8_t * packet_copy = (uint8_t *)malloc(sizeof(uint8_t) * len);
+	/* make a copy of the packet to pass to the functions, in a buffer
+	   the ARP queue can keep without copying it again */
+	uint8_t * packet_copy = sr_arpcache_buf_get(&(sr->cache), len);
 	memcpy(packet_copy, packet, len);
+	/* routes returned by the fib stay valid until the unlock */
+	sr_rcu_read_lock();
 	if (ntohs(ethernet_header->ether_type) == ethertype_arp) {
 		sr_handle_arp_packet(sr, packet_copy, len, interface);
 	} else {
 		sr_handle_ip_packet(sr, packet_copy, len, interface);
+		sr_flowcache_done();
 	}
-	free(packet_copy);
+	sr_rcu_read_unlock();
+	sr_arpcache_buf_put(&(sr->cache), packet_copy);
 }
 
 void sr_handle_arp_packet(struct sr_instance* sr,
 				uint8_t * packet/* lent */,
 				unsigned int len,
-				char* interface/* lent */)
+				int interface)
 {
 	sr_arp_hdr_t * arp_header = (sr_arp_hdr_t *)(packet + sizeof(sr_ethernet_hdr_t));
 
+	/* a sender flooding us is not worth the cache lock or a reply */
+	if (!sr_arpcache_admit(&(sr->cache), arp_header->ar_sha, arp_header->ar_sip)) {
+		return;
+	}
+
 	/* ARP REQUEST */
 	if (ntohs(arp_header->ar_op) == arp_op_request) {
 		/*
@@ -108,7 +129,8 @@ void sr_handle_arp_packet(struct sr_instance* sr,
 		arp_cache_check_add_queue_remove(
 			&(sr->cache),
 			arp_header->ar_sha,
-			arp_header->ar_sip
+			arp_header->ar_sip,
+			interface
 		);
 
 		arp_reply(sr, packet, len, interface);
@@ -118,7 +140,8 @@ void sr_handle_arp_packet(struct sr_instance* sr,
 			struct sr_arpreq * req = sr_arpcache_insert(
 				&(sr->cache),
 				arp_header->ar_sha,
-				arp_header->ar_sip
+				arp_header->ar_sip,
+				interface
 			);
 			if (req) {
 				send_arp_req_packets(sr, req, arp_header->ar_sha);
@@ -128,10 +151,10 @@ void sr_handle_arp_packet(struct sr_instance* sr,
 }
 
 /* Modify packet in place; returns reply packet */
-void arp_reply(struct sr_instance* sr, uint8_t * packet, unsigned int len, char* interface) {
+void arp_reply(struct sr_instance* sr, uint8_t * packet, unsigned int len, int interface) {
 	sr_ethernet_hdr_t * ethernet_header = (sr_ethernet_hdr_t *)packet;
 	sr_arp_hdr_t * arp_header = (sr_arp_hdr_t *)(packet + sizeof(sr_ethernet_hdr_t));
-	struct sr_if * interface_struct = sr_get_interface(sr, interface);
+	struct sr_if * interface_struct = sr_if_get(sr, interface);
 	/*
 		 Set ARP op_code -> reply
 		 Set ARP target ip to source ip
@@ -153,9 +176,14 @@ void arp_reply(struct sr_instance* sr, uint8_t * packet, unsigned int len, char*
 void sr_handle_ip_packet(struct sr_instance* sr,
 				uint8_t * packet/* lent */,
 				unsigned int len,
-				char* interface/* lent */)
+				int interface)
 {
 	if (is_ip_checksum_valid(packet)) {
+		/* ESTABLISHED FLOW: one cache probe instead of route, ARP and NAT lookups */
+		if (sr_flowcache_forward(sr, packet, len, interface) == 0) {
+			return;
+		}
+
 		/* FOR US */
 		if (is_ip_packet_matches_interfaces(sr, packet)) {
 				/* Nat DISABLED */
@@ -168,7 +196,7 @@ void sr_handle_ip_packet(struct sr_instance* sr,
 
 				/* INTERNAL 10.0.1.1, respond as before : handle_ip_for_us(sr, packet, len, interface); */
 				sr_ip_hdr_t * ip_header = (sr_ip_hdr_t *)(packet + sizeof(sr_ethernet_hdr_t));
-				if (strcmp(interface, "eth1") == 0) {
+				if (interface == sr->nat->if_int) {
 					handle_ip_for_us(sr, packet, len, interface);
 					return;
 				}
@@ -179,17 +207,17 @@ void sr_handle_ip_packet(struct sr_instance* sr,
 						/* IN: route */
 						/* OUT: drop */
 					sr_icmp_t8_hdr_t * icmp_header = (sr_icmp_t8_hdr_t *)(packet + sizeof(sr_ethernet_hdr_t) + sizeof(sr_ip_hdr_t));
-					struct sr_nat_mapping *external_mapping = sr_nat_lookup_external(sr->nat, icmp_header->icmp_id, nat_mapping_icmp);
+					struct sr_nat_mapping *external_mapping = sr_nat_borrow_external(sr->nat, ip_header->ip_dst, icmp_header->icmp_id, nat_mapping_icmp);
 					/* forward to internal host */
 					if (external_mapping) {
 
 						/* Change dest IP and icmp id*/
 						icmp_header->icmp_id = external_mapping->aux_int;
+						ip_header->ip_sum = cksum_adjust32(ip_header->ip_sum, ip_header->ip_dst, external_mapping->ip_int);
 						ip_header->ip_dst = external_mapping->ip_int;
 						icmp_header->icmp_sum = 0;
 						icmp_header->icmp_sum = cksum(icmp_header, len - (sizeof(sr_ethernet_hdr_t) + sizeof(sr_ip_hdr_t)));
 						forwarding_logic(sr, packet, len, interface);
-						free(external_mapping);
 					}
 					/*ELSE: DROP*/
 				} else if (ip_header->ip_p == ip_protocol_tcp) {
@@ -197,11 +225,11 @@ void sr_handle_ip_packet(struct sr_instance* sr,
 					/* external server sent packet for us */
 					/* check mappings */
 					sr_tcp_hdr_t * tcp_header = (sr_tcp_hdr_t *)(packet + sizeof(sr_ethernet_hdr_t) + sizeof(sr_ip_hdr_t));
-					struct sr_nat_mapping *external_mapping = sr_nat_lookup_external(sr->nat, tcp_header->dest_port, nat_mapping_tcp);
+					struct sr_nat_mapping *external_mapping = sr_nat_borrow_external(sr->nat, ip_header->ip_dst, tcp_header->dest_port, nat_mapping_tcp);
 
 					if (external_mapping) {
 						/* check if there is a connection */
-						struct sr_nat_connection* connection = sr_nat_get_connection(sr->nat, external_mapping, ip_header->ip_src, tcp_header->src_port);
+						struct sr_nat_connection* connection = sr_nat_borrow_connection(sr->nat, external_mapping, ip_header->ip_src, tcp_header->src_port);
 
 						if (connection) {
 							/* if SYN (from server) */
@@ -215,6 +243,7 @@ void sr_handle_ip_packet(struct sr_instance* sr,
 	*/							tcp_header->dest_port = external_mapping->aux_int;
 								/*tcp_header->flags = ((20<<12) | (tcp_header->flags)); */
 
+								ip_header->ip_sum = cksum_adjust32(ip_header->ip_sum, ip_header->ip_dst, external_mapping->ip_int);
 								ip_header->ip_dst = external_mapping->ip_int;
 
 								set_tcp_checksum(packet, len);
@@ -223,24 +252,23 @@ void sr_handle_ip_packet(struct sr_instance* sr,
 								/* forward? */
 								tcp_header->dest_port = external_mapping->aux_int;
 
+								ip_header->ip_sum = cksum_adjust32(ip_header->ip_sum, ip_header->ip_dst, external_mapping->ip_int);
 								ip_header->ip_dst = external_mapping->ip_int;
 								set_tcp_checksum(packet, len);
 								forwarding_logic(sr, packet, len, interface);
 							}
 							/* if FIN ACK */
-							free(connection);
 						} else {
 							/* forward? */
 							sr_nat_insert_tcp_connection(sr->nat, external_mapping, ip_header->ip_src, tcp_header->src_port);
 							tcp_header->dest_port = external_mapping->aux_int;
 
+							ip_header->ip_sum = cksum_adjust32(ip_header->ip_sum, ip_header->ip_dst, external_mapping->ip_int);
 							ip_header->ip_dst = external_mapping->ip_int;
 							set_tcp_checksum(packet, len);
 							forwarding_logic(sr, packet, len, interface);
 						}
 
-						free(external_mapping);
-
 					} else {
 						/* UNSOLICITED */
 						if (tcp_header->dest_port == htons(22)) {
@@ -256,16 +284,8 @@ void sr_handle_ip_packet(struct sr_instance* sr,
 							/* else */
 								/* drop packet*/
 						else {
-							if ((ntohs(tcp_header->flags) & tcp_flag_syn) == tcp_flag_syn && tcp_header->dest_port >= 1024) {
-								struct sr_possible_connection *new_conn = (struct sr_possible_connection *)malloc(sizeof(struct sr_possible_connection));
-								new_conn->ip = ip_header->ip_src;
-								new_conn->port = tcp_header->dest_port;
-								new_conn->recv_time = time(NULL);
-								new_conn->unsolicited_packet = packet;
-								new_conn->len = len;
-								new_conn->interface = interface;
-								new_conn->next = sr->nat->possible_conns;
-								sr->nat->possible_conns = new_conn;
+							if ((ntohs(tcp_header->flags) & tcp_flag_syn) == tcp_flag_syn && ntohs(tcp_header->dest_port) >= 1024) {
+								sr_nat_insert_possible_connection(sr->nat, ip_header->ip_src, tcp_header->dest_port, packet, len, interface);
 							} else {
 								modify_send_icmp_port_unreachable(sr, packet, len, interface);
 							}
@@ -293,14 +313,19 @@ void sr_handle_ip_packet(struct sr_instance* sr,
 					send_icmp_time_exceeded(sr, packet, len, interface);
 					return;
 				}
-				struct sr_rt * routing_entry = longest_prefix_match(sr, packet);
+				struct sr_rt * routing_entry = longest_prefix_match(sr, packet, len, interface);
 				if (routing_entry) {
 						sr_ip_hdr_t * ip_header = (sr_ip_hdr_t *)(packet + sizeof(sr_ethernet_hdr_t));
 						/* We found a match in the routing table */
 						if (ip_header->ip_p == ip_protocol_icmp) {
 							sr_icmp_t8_hdr_t * icmp_header = (sr_icmp_t8_hdr_t *)(packet + sizeof(sr_ethernet_hdr_t) + sizeof(sr_ip_hdr_t));
-							struct sr_nat_mapping *mapping = sr_nat_insert_mapping(sr->nat, ip_header->ip_src, icmp_header->icmp_id, nat_mapping_icmp);
+							struct sr_nat_mapping *mapping = sr_nat_borrow_mapping(sr->nat, ip_header->ip_src, icmp_header->icmp_id, nat_mapping_icmp);
+							if (mapping == NULL) {
+								/* no ICMP id left to give it, drop */
+								return;
+							}
 							icmp_header->icmp_id = htons(mapping->aux_ext);
+							ip_header->ip_sum = cksum_adjust32(ip_header->ip_sum, ip_header->ip_src, mapping->ip_ext);
 							ip_header->ip_src = mapping->ip_ext;
 							icmp_header->icmp_sum = 0;
 							icmp_header->icmp_sum = cksum(icmp_header, len - (sizeof(sr_ethernet_hdr_t) + sizeof(sr_ip_hdr_t)));
@@ -356,17 +381,21 @@ void set_tcp_checksum(uint8_t * packet, unsigned int len) {
 	tcp_header->checksum = cksum(checksum_struct, len - (sizeof(sr_ethernet_hdr_t) + sizeof(sr_ip_hdr_t)) + sizeof(sr_tcp_pseudo_hdr_t));
 	free(checksum_struct);
 }
-void handle_tcp_packet_from_int(struct sr_instance* sr, uint8_t * packet, unsigned int len, char* interface, struct sr_rt * routing_entry) {
+void handle_tcp_packet_from_int(struct sr_instance* sr, uint8_t * packet, unsigned int len, int interface, struct sr_rt * routing_entry) {
 	sr_ip_hdr_t * ip_header = (sr_ip_hdr_t *)(packet + sizeof(sr_ethernet_hdr_t));
 	sr_tcp_hdr_t * tcp_header = (sr_tcp_hdr_t *)(packet + sizeof(sr_ethernet_hdr_t) + sizeof(sr_ip_hdr_t));
 
-	struct sr_nat_mapping *internal_mapping = sr_nat_lookup_internal(sr->nat, ip_header->ip_src, tcp_header->src_port, nat_mapping_tcp);
+	struct sr_nat_mapping *internal_mapping = sr_nat_borrow_internal(sr->nat, ip_header->ip_src, tcp_header->src_port, nat_mapping_tcp);
 
 	if (internal_mapping == NULL) {
-		internal_mapping = sr_nat_insert_mapping(sr->nat, ip_header->ip_src, tcp_header->src_port, nat_mapping_tcp);
+		internal_mapping = sr_nat_borrow_mapping(sr->nat, ip_header->ip_src, tcp_header->src_port, nat_mapping_tcp);
+		if (internal_mapping == NULL) {
+			/* no port left to give it, drop */
+			return;
+		}
 	}
 
-	struct sr_nat_connection* connection = sr_nat_get_connection(sr->nat, internal_mapping, ip_header->ip_dst, tcp_header->dest_port);
+	struct sr_nat_connection* connection = sr_nat_borrow_connection(sr->nat, internal_mapping, ip_header->ip_dst, tcp_header->dest_port);
 
 	if (connection) {
 		if ((ntohs(tcp_header->flags) & tcp_flag_ack) == tcp_flag_ack) {
@@ -377,44 +406,24 @@ void handle_tcp_packet_from_int(struct sr_instance* sr, uint8_t * packet, unsign
 		else if (tcp_header->flags == 0) {
 			/* need to check if there is a connection, if so, forward it*/
 			if (connection->state != tcp_state_established) {
-				free(connection);
 				return;
 			}
 		}
-		free(connection);
 		/* if FIN ACK */
 	} else {		
 
 		if ((ntohs(tcp_header->flags) & tcp_flag_syn) == tcp_flag_syn) {
-			/* go through possible connections */
-			struct sr_possible_connection *curr_conn = sr->nat->possible_conns;
-			struct sr_possible_connection *prev_conn = NULL;
-			while(curr_conn) {
-				if (curr_conn->port == internal_mapping->aux_ext &&
-					curr_conn->ip == ip_header->ip_dst) {
-					if (prev_conn) {
-						prev_conn->next = curr_conn->next;
-					} else {
-						sr->nat->possible_conns = curr_conn->next;
-					}
-					free(curr_conn);
-					break;
-				}
-				curr_conn = curr_conn->next;
-			}
+			/* the outside host's SYN, if it was waiting, is answered now */
+			sr_nat_remove_possible_connection(sr->nat, ip_header->ip_dst, htons(internal_mapping->aux_ext));
 			sr_nat_insert_tcp_connection(sr->nat, internal_mapping, ip_header->ip_dst, tcp_header->dest_port);
 		}
-		sr_nat_get_connection(sr->nat, internal_mapping, ip_header->ip_dst, tcp_header->dest_port);
-
-
 	}
 	tcp_header->src_port = htons(internal_mapping->aux_ext);
 	/*tcp_header->flags = ((20<<12) | (tcp_header->flags));*/
+	ip_header->ip_sum = cksum_adjust32(ip_header->ip_sum, ip_header->ip_src, internal_mapping->ip_ext);
 	ip_header->ip_src = internal_mapping->ip_ext;
 	set_tcp_checksum(packet, len);
 	forwarding_logic(sr, packet, len, interface);
-
-	free(internal_mapping);
 }
 
 /* Check if we have a match for the next hop IP of this routing entry in
@@ -425,31 +434,35 @@ void handle_send_to_next_hop_ip(struct sr_instance* sr,
 	unsigned int len,
 	struct sr_rt * routing_entry)
 {
-	struct sr_arpentry * arp_entry = arp_cache_contains_entry(sr, routing_entry);
-	if (arp_entry) {
-		/* we found a match in the cache, can just forward the packet there */
-		sr_ip_hdr_t * ip_header = (sr_ip_hdr_t *)(packet + sizeof(sr_ethernet_hdr_t));
-		ip_header->ip_ttl--;
-		forward_packet(sr, packet, len, routing_entry->interface, arp_entry->mac);
-		free(arp_entry);
+	uint8_t eth[sizeof(sr_ethernet_hdr_t)];
+	sr_ip_hdr_t * ip_header = (sr_ip_hdr_t *)(packet + sizeof(sr_ethernet_hdr_t));
+	if (sr_arpcache_lookup_adj(&(sr->cache), routing_entry->gw.s_addr, routing_entry->ifindex, eth)) {
+		/* the adjacency has the whole header ready */
+		ip_ttl_decrement(ip_header);
+		/* remember the decision if the flow cache missed on this packet */
+		sr_flowcache_learn(sr, packet, routing_entry->ifindex, routing_entry->gw.s_addr,
+			((sr_ethernet_hdr_t *)eth)->ether_dhost);
+		memcpy(packet, eth, sizeof(eth));
+		sr_send_packet(sr, packet, len, routing_entry->ifindex);
 	} else {
-		/* didn't find match in the cache, need to send an arp request for this */
+		/* didn't find match on the route's interface, need to send an arp request for this */
 		sr_arpcache_queuereq(
 			&(sr->cache),
 			routing_entry->gw.s_addr,
 			packet,
 			len,
-			routing_entry->interface
+			routing_entry->ifindex
 		);
 	}
 }
 
-int arp_cache_check_add_queue_remove (struct sr_arpcache *cache, unsigned char *mac, uint32_t ip) {
+int arp_cache_check_add_queue_remove (struct sr_arpcache *cache, unsigned char *mac, uint32_t ip, int interface) {
 	/* Add to cache */
 	struct sr_arpreq * arp_queue_req = sr_arpcache_insert(
 		cache,
 		mac,
-		ip
+		ip,
+		interface
 	);
 
 	/* In queue, delete */
@@ -460,21 +473,44 @@ int arp_cache_check_add_queue_remove (struct sr_arpcache *cache, unsigned char *
 	return 0;
 }
 
-struct sr_rt * longest_prefix_match(struct sr_instance* sr, uint8_t * packet) {
+/*
+	Hash of the packet's 5-tuple, the same for every packet of a flow.
+	Ports are only used when they are there: unfragmented TCP/UDP with
+	the transport header in the packet.
+*/
+uint32_t ecmp_flow_hash(uint8_t * packet, unsigned int len) {
 	sr_ip_hdr_t * ip_header = (sr_ip_hdr_t *)(packet + sizeof(sr_ethernet_hdr_t));
-	struct sr_rt *routing_table = sr->routing_table;
+	unsigned int hdr_len = ip_header->ip_hl * 4;
+	uint32_t ports = 0;
+	uint32_t hash;
+
+	if ((ip_header->ip_p == ip_protocol_tcp || ip_header->ip_p == ip_protocol_udp) &&
+		!(ntohs(ip_header->ip_off) & (IP_MF | IP_OFFMASK)) &&
+		len >= sizeof(sr_ethernet_hdr_t) + hdr_len + 4) {
+		memcpy(&ports, packet + sizeof(sr_ethernet_hdr_t) + hdr_len, sizeof(ports));
+	}
 
-	struct sr_rt* matching = NULL;
+	hash = ntohl(ip_header->ip_src) * 0x9e3779b1u;
+	hash ^= ntohl(ip_header->ip_dst) * 0x85ebca6bu;
+	hash ^= (ports ^ ip_header->ip_p) * 0xc2b2ae35u;
+	hash ^= hash >> 16;
+	hash *= 0x7feb352du;
+	hash ^= hash >> 15;
 
-    while(routing_table) {
-        if((routing_table->dest.s_addr & routing_table->mask.s_addr) == (ip_header->ip_dst & routing_table->mask.s_addr)){
-            if(matching == NULL || routing_table->mask.s_addr > matching->mask.s_addr)
-                matching = routing_table;
-        }
-        routing_table = routing_table->next;
-    }
+	return hash;
+}
+
+struct sr_rt * longest_prefix_match(struct sr_instance* sr, uint8_t * packet, unsigned int len, int interface) {
+	sr_ip_hdr_t * ip_header = (sr_ip_hdr_t *)(packet + sizeof(sr_ethernet_hdr_t));
+	/* The routing table of the network the packet came from */
+	struct sr_fib * fib = sr_vrf_fib(sr, sr_if_get(sr, interface));
+	struct sr_rt * routing_entry = sr_fib_lookup(fib, ip_header->ip_dst);
 
-    return matching;
+	/* Equal-cost paths: keep each flow on one of them */
+	if (routing_entry && routing_entry->npaths > 1) {
+		routing_entry = sr_fib_select(sr, routing_entry, ecmp_flow_hash(packet, len));
+	}
+	return routing_entry;
 }
 
 void set_ethernet_src_dst(sr_ethernet_hdr_t * ethernet_header, uint8_t * new_src, uint8_t * new_dst) {
@@ -507,32 +543,29 @@ void set_arp_sha_tha(sr_arp_hdr_t * arp_header, unsigned char * new_sha, unsigne
 	);
 }
 
-void handle_ip_packets_for_us(struct sr_instance* sr, uint8_t * packet, unsigned int len) {
-	struct sr_rt * routing_entry = longest_prefix_match(sr, packet);
-	struct sr_arpentry * arp_entry = arp_cache_contains_entry(sr, routing_entry);
-	if (arp_entry) {
-		forward_packet(sr, packet, len, routing_entry->interface, arp_entry->mac);
-		free(arp_entry);
+void handle_ip_packets_for_us(struct sr_instance* sr, uint8_t * packet, unsigned int len, int interface) {
+	struct sr_rt * routing_entry = longest_prefix_match(sr, packet, len, interface);
+	if (!routing_entry) {
+		/* No way back into the network the packet came from */
+		return;
+	}
+	unsigned char mac[ETHER_ADDR_LEN];
+	if (arp_cache_contains_entry(sr, routing_entry, mac)) {
+		forward_packet(sr, packet, len, routing_entry->ifindex, mac);
 	} else {
 		sr_arpcache_queuereq(
 			&(sr->cache),
 			routing_entry->gw.s_addr,
 			packet,
 			len,
-			routing_entry->interface
+			routing_entry->ifindex
 		);
 	}
 }
 
 int check_ip_in_if_list(struct sr_instance* sr, uint32_t ip) {
-	struct sr_if * if_list = sr->if_list;
-	while(if_list) {
-		if (if_list->ip == ip) {
-			return 1;
-		}
-		if_list = if_list->next;
-	}
-	return 0;
+	/* one probe of the local address set, not a walk of the interfaces */
+	return sr_is_local(sr, ip);
 }
 
 int is_arp_reply_for_us(struct sr_instance* sr, uint8_t * packet) {
@@ -550,7 +583,7 @@ int is_ttl_valid(uint8_t * packet) {
 	return ip_header->ip_ttl > 1;
 }
 
-void modify_send_icmp(struct sr_instance* sr, uint8_t * packet, unsigned int len, char* interface, uint8_t type, uint8_t code) {
+void modify_send_icmp(struct sr_instance* sr, uint8_t * packet, unsigned int len, int interface, uint8_t type, uint8_t code) {
 	sr_ethernet_hdr_t * ethernet_header = (sr_ethernet_hdr_t *)packet;
 	sr_ip_hdr_t * ip_header = (sr_ip_hdr_t *)(packet + sizeof(sr_ethernet_hdr_t));
 	sr_icmp_hdr_t * icmp_header = (sr_icmp_hdr_t *)(packet + sizeof(sr_ethernet_hdr_t) + sizeof(sr_ip_hdr_t));
@@ -570,7 +603,7 @@ void modify_send_icmp(struct sr_instance* sr, uint8_t * packet, unsigned int len
 	ip_header->ip_dst = original_src;
 
 	ethernet_header->ether_type = htons(ethertype_ip);
-	handle_ip_packets_for_us(sr, packet, len);
+	handle_ip_packets_for_us(sr, packet, len, interface);
 	/* sr_send_packet(sr, packet, len, interface); */
 }
 
@@ -594,7 +627,7 @@ void set_ip_header_fields_new_icmp(sr_ip_hdr_t * ip_header, sr_ip_hdr_t * old_ip
 	ip_header->ip_p = (uint8_t) 1;
 
 }
-void send_new_icmp_type11(struct sr_instance* sr, uint8_t * packet, unsigned int len, char* interface) {
+void send_new_icmp_type11(struct sr_instance* sr, uint8_t * packet, unsigned int len, int interface) {
 	struct sr_packet * new_packet = (struct sr_packet*)malloc(sizeof(struct sr_packet));
 	new_packet->buf = (uint8_t *)malloc(sizeof(sr_ethernet_hdr_t) + sizeof(sr_ip_hdr_t) + sizeof(sr_icmp_t3_hdr_t));
 	new_packet->len = sizeof(sr_ethernet_hdr_t) + sizeof(sr_ip_hdr_t) + sizeof(sr_icmp_t3_hdr_t);
@@ -608,7 +641,7 @@ void send_new_icmp_type11(struct sr_instance* sr, uint8_t * packet, unsigned int
 	sr_ip_hdr_t * ip_header = (sr_ip_hdr_t *)(new_packet->buf + sizeof(sr_ethernet_hdr_t));
 
 	sr_icmp_t11_hdr_t * type11_icmp_header = (sr_icmp_t11_hdr_t *)(new_packet->buf + sizeof(sr_ethernet_hdr_t) + sizeof(sr_ip_hdr_t));
-	struct sr_if * interface_struct = sr_get_interface(sr, interface);
+	struct sr_if * interface_struct = sr_if_get(sr, interface);
 
 	put_ip_header_in_icmp_data(type11_icmp_header->data, old_ip_header);
 
@@ -620,7 +653,7 @@ void send_new_icmp_type11(struct sr_instance* sr, uint8_t * packet, unsigned int
 	ip_header->ip_dst = old_ip_header->ip_src;
 
 	ethernet_header->ether_type = htons(ethertype_ip);
-	handle_ip_packets_for_us(sr, new_packet->buf, new_packet->len);
+	handle_ip_packets_for_us(sr, new_packet->buf, new_packet->len, interface);
 	free(new_packet->buf);
 	free(new_packet);
 }
@@ -634,15 +667,15 @@ void set_fields_in_icmp_type11_header(sr_icmp_t11_hdr_t * type11_icmp_header) {
 	type11_icmp_header->icmp_sum = cksum(type11_icmp_header, sizeof(sr_icmp_t11_hdr_t));
 }
 
-void modify_send_icmp_reply(struct sr_instance* sr, uint8_t * packet, unsigned int len, char* interface) {
+void modify_send_icmp_reply(struct sr_instance* sr, uint8_t * packet, unsigned int len, int interface) {
 	modify_send_icmp(sr, packet, len, interface, (uint8_t) 0, (uint8_t) 0);
 }
 
-void send_icmp_time_exceeded(struct sr_instance* sr, uint8_t * packet, unsigned int len, char* interface) {
+void send_icmp_time_exceeded(struct sr_instance* sr, uint8_t * packet, unsigned int len, int interface) {
 	send_new_icmp_type11(sr, packet, len, interface);
 }
 
-void modify_send_icmp_type3(struct sr_instance* sr, uint8_t * packet, unsigned int len, char* interface, uint8_t code) {
+void modify_send_icmp_type3(struct sr_instance* sr, uint8_t * packet, unsigned int len, int interface, uint8_t code) {
 	struct sr_packet * new_packet = (struct sr_packet*)malloc(sizeof(struct sr_packet));
 	new_packet->buf = (uint8_t *)malloc(sizeof(sr_ethernet_hdr_t) + sizeof(sr_ip_hdr_t) + sizeof(sr_icmp_t3_hdr_t));
 	new_packet->len = sizeof(sr_ethernet_hdr_t) + sizeof(sr_ip_hdr_t) + sizeof(sr_icmp_t3_hdr_t);
@@ -656,7 +689,7 @@ void modify_send_icmp_type3(struct sr_instance* sr, uint8_t * packet, unsigned i
 	sr_ip_hdr_t * ip_header = (sr_ip_hdr_t *)(new_packet->buf + sizeof(sr_ethernet_hdr_t));
 
 	sr_icmp_t3_hdr_t * type3_icmp_header = (sr_icmp_t3_hdr_t *)(new_packet->buf + sizeof(sr_ethernet_hdr_t) + sizeof(sr_ip_hdr_t));
-	struct sr_if * interface_struct = sr_get_interface(sr, interface);
+	struct sr_if * interface_struct = sr_if_get(sr, interface);
 
 	/* Update ICMP header */
 	type3_icmp_header->icmp_type = (uint8_t) 3;
@@ -679,24 +712,24 @@ void modify_send_icmp_type3(struct sr_instance* sr, uint8_t * packet, unsigned i
 	ip_header->ip_dst = old_ip_header->ip_src;
 
 	ethernet_header->ether_type = htons(ethertype_ip);
-	handle_ip_packets_for_us(sr, new_packet->buf, new_packet->len);
+	handle_ip_packets_for_us(sr, new_packet->buf, new_packet->len, interface);
 	free(new_packet->buf);
 	free(new_packet);
 }
 
-void modify_send_icmp_port_unreachable(struct sr_instance* sr, uint8_t * packet, unsigned int len, char* interface) {
+void modify_send_icmp_port_unreachable(struct sr_instance* sr, uint8_t * packet, unsigned int len, int interface) {
 	modify_send_icmp_type3(sr, packet, len, interface, (uint8_t) 3);
 }
 
-void modify_send_icmp_net_unreachable(struct sr_instance* sr, uint8_t * packet, unsigned int len, char* interface) {
+void modify_send_icmp_net_unreachable(struct sr_instance* sr, uint8_t * packet, unsigned int len, int interface) {
 	modify_send_icmp_type3(sr, packet, len, interface, (uint8_t) 0);
 }
 
-void modify_send_icmp_host_unreachable(struct sr_instance* sr, uint8_t * packet, unsigned int len, char* interface) {
+void modify_send_icmp_host_unreachable(struct sr_instance* sr, uint8_t * packet, unsigned int len, int interface) {
 	modify_send_icmp_type3(sr, packet, len, interface, (uint8_t) 1);
 }
 
-int handle_icmp(struct sr_instance* sr, uint8_t * packet, unsigned int len, char* interface) {
+int handle_icmp(struct sr_instance* sr, uint8_t * packet, unsigned int len, int interface) {
 	sr_icmp_hdr_t * icmp_header = (sr_icmp_hdr_t *)(packet + sizeof(sr_ethernet_hdr_t) + sizeof(sr_ip_hdr_t));
 	uint8_t request = 8;
 	/*uint8_t reply = 0;
@@ -710,7 +743,7 @@ int handle_icmp(struct sr_instance* sr, uint8_t * packet, unsigned int len, char
 	return 0;
 }
 
-int handle_ip_for_us(struct sr_instance* sr, uint8_t * packet, unsigned int len, char* interface) {
+int handle_ip_for_us(struct sr_instance* sr, uint8_t * packet, unsigned int len, int interface) {
 	sr_ip_hdr_t * ip_header = (sr_ip_hdr_t *)(packet + sizeof(sr_ethernet_hdr_t));
 	if (ip_header->ip_p == ip_protocol_icmp){
 		sr_icmp_hdr_t * icmp_header = (sr_icmp_hdr_t *)(packet + sizeof(sr_ethernet_hdr_t) + sizeof(sr_ip_hdr_t));
@@ -739,22 +772,28 @@ int is_ip_checksum_valid (uint8_t * packet) {
 	return 0;
 }
 
-struct sr_arpentry * arp_cache_contains_entry(struct sr_instance* sr, struct sr_rt * entry) {
-	struct sr_arpcache *cache = &(sr->cache);
-	return sr_arpcache_lookup(cache, entry->gw.s_addr);
+/* Copies the next hop's MAC into mac if it is known on the route's
+interface; no lock, no malloc */
+int arp_cache_contains_entry(struct sr_instance* sr, struct sr_rt * entry, unsigned char * mac) {
+	uint8_t eth[sizeof(sr_ethernet_hdr_t)];
+	if (!sr_arpcache_lookup_adj(&(sr->cache), entry->gw.s_addr, entry->ifindex, eth)) {
+		return 0;
+	}
+	memcpy(mac, ((sr_ethernet_hdr_t *)eth)->ether_dhost, ETHER_ADDR_LEN);
+	return 1;
 }
 
 void forward_packet(
 	struct sr_instance* sr,
 	uint8_t * packet,
 	unsigned int len,
-	char* interface,
+	int interface,
 	unsigned char * dest_mac) {
 
 	sr_ethernet_hdr_t * ethernet_header = (sr_ethernet_hdr_t *)packet;
 	sr_ip_hdr_t * ip_header = (sr_ip_hdr_t *)(packet + sizeof(sr_ethernet_hdr_t));
 
-	struct sr_if* interface_to_send_from = sr_get_interface(sr, interface);
+	struct sr_if* interface_to_send_from = sr_if_get(sr, interface);
 
 	set_ethernet_src_dst(ethernet_header, interface_to_send_from->addr, dest_mac);
 
@@ -767,14 +806,14 @@ void forward_packet_nat_in(
 	struct sr_instance* sr,
 	uint8_t * packet,
 	unsigned int len,
-	char* interface,
+	int interface,
 	unsigned char * dest_mac,
 	struct sr_nat_mapping* mapping) {
 
 	sr_ethernet_hdr_t * ethernet_header = (sr_ethernet_hdr_t *)packet;
 	sr_ip_hdr_t * ip_header = (sr_ip_hdr_t *)(packet + sizeof(sr_ethernet_hdr_t));
 
-	struct sr_if* interface_to_send_from = sr_get_interface(sr, interface);
+	struct sr_if* interface_to_send_from = sr_if_get(sr, interface);
 	sr_icmp_t8_hdr_t * icmp_header = (sr_icmp_t8_hdr_t *)(packet + sizeof(sr_ethernet_hdr_t) + sizeof(sr_ip_hdr_t));
 
 	/* Set ICMP ID to internal */
@@ -790,6 +829,8 @@ void forward_packet_nat_in(
 
 void send_arp_req_packets(struct sr_instance* sr, struct sr_arpreq * req, unsigned char * dest_mac) {
 	struct sr_packet * head = req->packets;
+	/* one write for the whole queue */
+	sr_send_batch_begin(sr);
 	while (head) {
 			sr_ip_hdr_t * ip_header = (sr_ip_hdr_t *)(head->buf + sizeof(sr_ethernet_hdr_t));
 			if (ip_header->ip_ttl != INIT_TTL) {
@@ -798,16 +839,17 @@ void send_arp_req_packets(struct sr_instance* sr, struct sr_arpreq * req, unsign
 			forward_packet(sr, head->buf, head->len, head->iface, dest_mac);
 			head = head->next;
 	}
+	sr_send_batch_end(sr);
 	sr_arpreq_destroy(&(sr->cache), req);
 	return;
 }
 
-void forwarding_logic(struct sr_instance* sr, uint8_t * packet, unsigned int len, char* interface) {
+void forwarding_logic(struct sr_instance* sr, uint8_t * packet, unsigned int len, int interface) {
 	if (!is_ttl_valid(packet)) {
 		send_icmp_time_exceeded(sr, packet, len, interface);
 		return;
 	}
-	struct sr_rt * routing_entry = longest_prefix_match(sr, packet);
+	struct sr_rt * routing_entry = longest_prefix_match(sr, packet, len, interface);
 	if (routing_entry) {
 		/* We found a match in the routing table */
 		handle_send_to_next_hop_ip(sr, packet, len, routing_entry);
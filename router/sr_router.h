@@ -15,6 +15,7 @@
 
 #include "sr_protocol.h"
 #include "sr_arpcache.h"
+#include "sr_lpm.h"
 
 /* we dont like this debug , but what to do for varargs ? */
 #ifdef _DEBUG_
@@ -30,9 +31,16 @@
 #define INIT_TTL 255
 #define PACKET_DUMP_SIZE 1024
 
+/* packets and bytes sr_send_batch_begin/end write at once */
+#define SR_SEND_BATCH_MAX   64
+#define SR_SEND_BATCH_BYTES (64 * 1024)
+
 /* forward declare */
 struct sr_if;
 struct sr_rt;
+struct sr_fib;
+struct sr_vrf;
+struct sr_flowcache;
 
 struct sr_nat;
 struct sr_nat_mapping;
@@ -46,14 +54,26 @@ struct sr_nat_mapping;
 struct sr_instance
 {
     int  sockfd;   /* socket to server */
+    pthread_mutex_t send_lock; /* held for each write to sockfd, so frames
+                                  from different threads never interleave */
     char user[32]; /* user name */
     char host[32]; /* host name */ 
     char template[30]; /* template name if any */
     unsigned short topo_id;
     struct sockaddr_in sr_addr; /* address to server */
     struct sr_if* if_list; /* list of interfaces */
-    struct sr_rt* routing_table; /* routing table */
+    struct sr_if* ifaces[SR_IF_MAX]; /* interfaces by index, 0: not ours */
+    struct sr_local_set local; /* addresses of the router */
+    struct sr_fib* fib; /* routing table, RCU protected */
+    struct sr_vrf* vrfs; /* named tables picked by ingress interface */
+    const char* rtable_path; /* file the routing table is (re)loaded from */
+    sr_lpm_type lpm_type; /* LPM backend used for new fibs */
+    int ortc; /* SR_ORTC_* compression of loaded tables */
+    const char* ctl_path; /* Unix socket for route updates, or 0 */
     struct sr_arpcache cache;   /* ARP cache */
+    uint32_t arp_max; /* entries the ARP cache may grow to, 0: default */
+    uint32_t arp_queue; /* packets one ARP request may hold, 0: default */
+    struct sr_flowcache* flows; /* forwarding decisions of active flows */
     struct sr_nat* nat;
     pthread_attr_t attr;
     FILE* logfile;
@@ -63,58 +83,62 @@ struct sr_instance
 int sr_verify_routing_table(struct sr_instance* sr);
 
 /* -- sr_vns_comm.c -- */
-int sr_send_packet(struct sr_instance* , uint8_t* , unsigned int , const char*);
+int sr_send_packet(struct sr_instance* , uint8_t* , unsigned int , int);
+void sr_send_batch_begin(struct sr_instance* );
+int sr_send_batch_end(struct sr_instance* );
 int sr_connect_to_server(struct sr_instance* ,unsigned short , char* );
 int sr_read_from_server(struct sr_instance* );
 
 /* -- sr_router.c -- */
 void sr_init(struct sr_instance* );
-void sr_handlepacket(struct sr_instance* , uint8_t * , unsigned int , char* );
-void sr_handle_arp_packet(struct sr_instance* sr, uint8_t * packet, unsigned int len, char* interface);
-void sr_handle_ip_packet(struct sr_instance* sr, uint8_t * packet, unsigned int len, char* interface);
+void sr_handlepacket(struct sr_instance* , uint8_t * , unsigned int , int );
+void sr_handle_arp_packet(struct sr_instance* sr, uint8_t * packet, unsigned int len, int interface);
+void sr_handle_ip_packet(struct sr_instance* sr, uint8_t * packet, unsigned int len, int interface);
 
 void set_ethernet_src_dst(sr_ethernet_hdr_t * ethernet_header, uint8_t * new_src, uint8_t * new_dst);
 void set_arp_sha_tha(sr_arp_hdr_t * arp_header, unsigned char * new_sha, unsigned char * new_tha);
-int arp_cache_check_add_queue_remove (struct sr_arpcache *cache, unsigned char *mac, uint32_t ip);
-struct sr_rt * longest_prefix_match(struct sr_instance* sr, uint8_t * packet);
+int arp_cache_check_add_queue_remove (struct sr_arpcache *cache, unsigned char *mac, uint32_t ip, int interface);
+uint32_t ecmp_flow_hash(uint8_t * packet, unsigned int len);
+struct sr_rt * longest_prefix_match(struct sr_instance* sr, uint8_t * packet, unsigned int len, int interface);
 void handle_send_to_next_hop_ip(struct sr_instance* sr,
   uint8_t * packet,
   unsigned int len,  
   struct sr_rt * routing_entry);
-void handle_ip_packets_for_us(struct sr_instance* sr, uint8_t * packet, unsigned int len);
-void arp_reply(struct sr_instance* sr, uint8_t * packet, unsigned int len, char* interface);
+void handle_ip_packets_for_us(struct sr_instance* sr, uint8_t * packet, unsigned int len, int interface);
+void arp_reply(struct sr_instance* sr, uint8_t * packet, unsigned int len, int interface);
 int is_arp_reply_for_us(struct sr_instance* sr, uint8_t * packet);
 int is_ip_packet_matches_interfaces(struct sr_instance* sr, uint8_t * packet);
 int is_ttl_valid(uint8_t * packet);
 
-void modify_send_icmp(struct sr_instance* sr, uint8_t * packet, unsigned int len, char* interface, uint8_t type, uint8_t code);
+void modify_send_icmp(struct sr_instance* sr, uint8_t * packet, unsigned int len, int interface, uint8_t type, uint8_t code);
 void put_ip_header_in_icmp_data(uint8_t * data, sr_ip_hdr_t * ip_header);
 void set_ip_header_fields_new_icmp(sr_ip_hdr_t * ip_header, sr_ip_hdr_t * old_ip_header, size_t icmp_size);
-void send_new_icmp_type11(struct sr_instance* sr, uint8_t * packet, unsigned int len, char* interface);
+void send_new_icmp_type11(struct sr_instance* sr, uint8_t * packet, unsigned int len, int interface);
 void set_fields_in_icmp_type11_header(sr_icmp_t11_hdr_t * type11_icmp_header);
 void set_tcp_checksum(uint8_t * packet, unsigned int len);
 
-void modify_send_icmp_reply(struct sr_instance* sr, uint8_t * packet, unsigned int len, char* interface);
-void send_icmp_time_exceeded(struct sr_instance* sr, uint8_t * packet, unsigned int len, char* interface);
-void modify_send_icmp_type3(struct sr_instance* sr, uint8_t * packet, unsigned int len, char* interface, uint8_t code);
-void modify_send_icmp_port_unreachable(struct sr_instance* sr, uint8_t * packet, unsigned int len, char* interface);
-void modify_send_icmp_net_unreachable(struct sr_instance* sr, uint8_t * packet, unsigned int len, char* interface);
-void modify_send_icmp_host_unreachable(struct sr_instance* sr, uint8_t * packet, unsigned int len, char* interface);
-int handle_icmp(struct sr_instance* sr, uint8_t * packet, unsigned int len, char* interface);
-int handle_ip_for_us(struct sr_instance* sr, uint8_t * packet, unsigned int len, char* interface);
+void modify_send_icmp_reply(struct sr_instance* sr, uint8_t * packet, unsigned int len, int interface);
+void send_icmp_time_exceeded(struct sr_instance* sr, uint8_t * packet, unsigned int len, int interface);
+void modify_send_icmp_type3(struct sr_instance* sr, uint8_t * packet, unsigned int len, int interface, uint8_t code);
+void modify_send_icmp_port_unreachable(struct sr_instance* sr, uint8_t * packet, unsigned int len, int interface);
+void modify_send_icmp_net_unreachable(struct sr_instance* sr, uint8_t * packet, unsigned int len, int interface);
+void modify_send_icmp_host_unreachable(struct sr_instance* sr, uint8_t * packet, unsigned int len, int interface);
+int handle_icmp(struct sr_instance* sr, uint8_t * packet, unsigned int len, int interface);
+int handle_ip_for_us(struct sr_instance* sr, uint8_t * packet, unsigned int len, int interface);
 
 uint32_t get_internal_ip(struct sr_instance* sr);
-void handle_tcp_packet_from_int(struct sr_instance* sr, uint8_t * packet, unsigned int len, char* interface, struct sr_rt * routing_entry);
+void handle_tcp_packet_from_int(struct sr_instance* sr, uint8_t * packet, unsigned int len, int interface, struct sr_rt * routing_entry);
 int is_ip_checksum_valid (uint8_t * packet);
-struct sr_arpentry * arp_cache_contains_entry(struct sr_instance* sr, struct sr_rt * entry);
-void forward_packet(struct sr_instance* sr, uint8_t * packet, unsigned int len, char* interface, unsigned char * dest_mac);
-void forward_packet_nat_in(struct sr_instance* sr, uint8_t * packet, unsigned int len, char* interface, unsigned char * dest_mac, struct sr_nat_mapping * mapping);
+int arp_cache_contains_entry(struct sr_instance* sr, struct sr_rt * entry, unsigned char * mac);
+void forward_packet(struct sr_instance* sr, uint8_t * packet, unsigned int len, int interface, unsigned char * dest_mac);
+void forward_packet_nat_in(struct sr_instance* sr, uint8_t * packet, unsigned int len, int interface, unsigned char * dest_mac, struct sr_nat_mapping * mapping);
 void send_arp_req_packets(struct sr_instance* sr, struct sr_arpreq * req, unsigned char * dest_mac);
-void   forwarding_logic(struct sr_instance* sr, uint8_t * packet, unsigned int len, char* interface);
+void   forwarding_logic(struct sr_instance* sr, uint8_t * packet, unsigned int len, int interface);
 /* -- sr_if.c -- */
 void sr_add_interface(struct sr_instance* , const char* );
 void sr_set_ether_ip(struct sr_instance* , uint32_t );
 void sr_set_ether_addr(struct sr_instance* , const unsigned char* );
+void sr_set_ether_speed(struct sr_instance* , uint32_t );
 void sr_print_if_list(struct sr_instance* );
 
 #endif /* SR_ROUTER_H */
\ No newline at end of file
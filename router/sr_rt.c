@@ -12,6 +12,12 @@
 #include <assert.h>
 #include <string.h>
 #include <unistd.h>
+#include <signal.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 
 #include <sys/socket.h>
@@ -21,114 +27,367 @@
 
 #include "sr_rt.h"
 #include "sr_router.h"
+#include "sr_rcu.h"
+#include "sr_snapshot.h"
+#include "sr_ortc.h"
+#include "sr_vrf.h"
+
+static int sr_fib_insert(struct sr_fib* fib, struct sr_rt* entry);
 
 /*---------------------------------------------------------------------
- * Method:
+ * Method: sr_rt_skip_blanks(..), sr_rt_scan_ip(..), sr_rt_scan_word(..)
+ * Scope: Local
+ *
+ * Scanners for the rtable text.  Each one works on [*pos, end), moves
+ * *pos past what it consumed and returns 0, or returns -1 and leaves
+ * *pos alone.  Addresses must be plain dotted quads.
  *
  *---------------------------------------------------------------------*/
 
-int sr_load_rt(struct sr_instance* sr,const char* filename)
+#define sr_rt_is_blank(c) ((c) == ' ' || (c) == '\t' || (c) == '\r')
+
+static void sr_rt_skip_blanks(const char** pos, const char* end)
 {
-    FILE* fp;
-    char  line[BUFSIZ];
-    char  dest[32];
-    char  gw[32];
-    char  mask[32];
-    char  iface[32];
-    struct in_addr dest_addr;
-    struct in_addr gw_addr;
-    struct in_addr mask_addr;
-    int clear_routing_table = 0;
+    const char* p = *pos;
 
-    /* -- REQUIRES -- */
-    assert(filename);
-    if( access(filename,R_OK) != 0)
+    while(p < end && sr_rt_is_blank(*p))
+    { p++; }
+    *pos = p;
+}
+
+static int sr_rt_scan_ip(const char** pos, const char* end, struct in_addr* ip)
+{
+    const char* p = *pos;
+    uint32_t addr = 0;
+    uint32_t octet;
+    int digits;
+    int i;
+
+    for(i = 0; i < 4; i++)
     {
-        perror("access");
-        return -1;
+        if(i > 0)
+        {
+            if(p == end || *p != '.')
+            { return -1; }
+            p++;
+        }
+
+        octet = 0;
+        for(digits = 0; p < end && *p >= '0' && *p <= '9' && digits < 4; digits++)
+        { octet = octet * 10 + (*p++ - '0'); }
+
+        if(digits == 0 || digits > 3 || octet > 255)
+        { return -1; }
+        addr = (addr << 8) | octet;
     }
 
-    fp = fopen(filename,"r");
+    if(p < end && !sr_rt_is_blank(*p) && *p != '\n')
+    { return -1; }
+
+    ip->s_addr = htonl(addr);
+    *pos = p;
+    return 0;
+}
+
+static int sr_rt_scan_word(const char** pos, const char* end, char* word,
+                           size_t size)
+{
+    const char* p = *pos;
+    size_t len = 0;
 
-    while( fgets(line,BUFSIZ,fp) != 0)
+    while(p < end && !sr_rt_is_blank(*p) && *p != '\n')
     {
-        sscanf(line,"%s %s %s %s",dest,gw,mask,iface);
-        if(inet_aton(dest,&dest_addr) == 0)
-        { 
-            fprintf(stderr,
-                    "Error loading routing table, cannot convert %s to valid IP\n",
-                    dest);
-            return -1; 
+        if(len + 1 >= size)
+        { return -1; }
+        word[len++] = *p++;
+    }
+    if(len == 0)
+    { return -1; }
+
+    word[len] = 0;
+    *pos = p;
+    return 0;
+}
+
+/*---------------------------------------------------------------------
+ * Method: sr_rt_scan_route(..)
+ * Scope: Local
+ *
+ * Scan the rest of a route line, up to end,
+ *
+ *   dest gateway mask interface [gateway interface]...
+ *
+ * into u.  Each extra gateway/interface pair is another equal-cost next
+ * hop for the prefix.  Returns 0 or -1 if the line is malformed.
+ *
+ *---------------------------------------------------------------------*/
+
+static int sr_rt_scan_route(const char** pos, const char* end,
+                            struct sr_rt_update* u)
+{
+    const char* p = *pos;
+
+    u->withdraw = 0;
+    u->npaths = 0;
+
+    if(sr_rt_scan_ip(&p, end, &u->dest) != 0 ||
+       (sr_rt_skip_blanks(&p, end), sr_rt_scan_ip(&p, end, &u->gw[0])) != 0 ||
+       (sr_rt_skip_blanks(&p, end), sr_rt_scan_ip(&p, end, &u->mask)) != 0 ||
+       (sr_rt_skip_blanks(&p, end), sr_rt_scan_word(&p, end, u->interface[0],
+                                                    sr_IFACE_NAMELEN)) != 0)
+    { return -1; }
+    u->npaths = 1;
+
+    for(sr_rt_skip_blanks(&p, end); p < end; sr_rt_skip_blanks(&p, end))
+    {
+        if(u->npaths == SR_RT_MAX_PATHS ||
+           sr_rt_scan_ip(&p, end, &u->gw[u->npaths]) != 0 ||
+           (sr_rt_skip_blanks(&p, end), sr_rt_scan_word(&p, end,
+                u->interface[u->npaths], sr_IFACE_NAMELEN)) != 0)
+        { return -1; }
+        u->npaths++;
+    }
+
+    *pos = p;
+    return 0;
+} /* -- sr_rt_scan_route -- */
+
+/*---------------------------------------------------------------------
+ * Method: sr_rt_parse(..)
+ * Scope: Local
+ *
+ * Parse rtable text, one route per line as read by sr_rt_scan_route(..),
+ * and add every route to fib in a single pass.  Blank lines and lines
+ * starting with '#' are skipped.  Returns the number of routes added or
+ * -1 on error.
+ *
+ *---------------------------------------------------------------------*/
+
+static long sr_rt_parse(struct sr_fib* fib, const char* filename,
+                        const char* text, size_t size)
+{
+    const char* p = text;
+    const char* end = text + size;
+    const char* eol = 0;
+    struct sr_rt_update route;
+    unsigned long line = 0;
+    long count = 0;
+    uint32_t i;
+
+    while(p < end)
+    {
+        line++;
+        eol = memchr(p, '\n', end - p);
+        if(eol == 0)
+        { eol = end; }
+
+        sr_rt_skip_blanks(&p, eol);
+        if(p == eol || *p == '#')
+        {
+            p = eol + 1;
+            continue;
         }
-        if(inet_aton(gw,&gw_addr) == 0)
-        { 
+
+        if(sr_rt_scan_route(&p, eol, &route) != 0)
+        {
             fprintf(stderr,
-                    "Error loading routing table, cannot convert %s to valid IP\n",
-                    gw);
-            return -1; 
+                    "Error loading routing table, %s line %lu: expected "
+                    "'dest gateway mask interface [gateway interface]...' "
+                    "with at most %d next hops\n", filename, line,
+                    SR_RT_MAX_PATHS);
+            return -1;
         }
-        if(inet_aton(mask,&mask_addr) == 0)
-        { 
+
+        if(sr_fib_add_entry(fib,route.dest,route.gw[0],route.mask,
+                    route.interface[0]) != 0)
+        {
             fprintf(stderr,
-                    "Error loading routing table, cannot convert %s to valid IP\n",
-                    mask);
-            return -1; 
+                    "Error loading routing table, %s line %lu: cannot add route\n",
+                    filename, line);
+            return -1;
         }
-        if( clear_routing_table == 0 ){
-            printf("Loading routing table from server, clear local routing table.\n");
-            sr->routing_table = 0;
-            clear_routing_table = 1;
+        count++;
+
+        /* -- equal-cost next hops -- */
+        for(i = 1; i < route.npaths; i++)
+        {
+            if(sr_fib_add_path(fib,route.gw[i],route.interface[i]) != 0)
+            {
+                fprintf(stderr,
+                        "Error loading routing table, %s line %lu: cannot add "
+                        "next hop\n", filename, line);
+                return -1;
+            }
         }
-        sr_add_rt_entry(sr,dest_addr,gw_addr,mask_addr,iface);
+
+        p = eol + 1;
     } /* -- while -- */
 
+    return count;
+} /* -- sr_rt_parse -- */
+
+/*---------------------------------------------------------------------
+ * Method: sr_rt_parse_update(..)
+ * Scope: Global
+ *
+ * Parse one update line (without its newline) for sr_fib_update(..):
+ *
+ *   add dest gateway mask interface [gateway interface]...
+ *   withdraw dest mask
+ *
+ * Returns 0 or -1 if the line is malformed.
+ *
+ *---------------------------------------------------------------------*/
+
+int sr_rt_parse_update(const char* line, size_t len, struct sr_rt_update* u)
+{
+    const char* p = line;
+    const char* end = line + len;
+    char cmd[16];
+
+    /* -- REQUIRES -- */
+    assert(line);
+    assert(u);
+
+    sr_rt_skip_blanks(&p, end);
+    if(sr_rt_scan_word(&p, end, cmd, sizeof(cmd)) != 0)
+    { return -1; }
+    sr_rt_skip_blanks(&p, end);
+
+    if(strcmp(cmd, "add") == 0)
+    { return sr_rt_scan_route(&p, end, u); }
+
+    if(strcmp(cmd, "withdraw") != 0 ||
+       sr_rt_scan_ip(&p, end, &u->dest) != 0 ||
+       (sr_rt_skip_blanks(&p, end), sr_rt_scan_ip(&p, end, &u->mask)) != 0 ||
+       (sr_rt_skip_blanks(&p, end), p != end))
+    { return -1; }
+
+    u->withdraw = 1;
+    u->npaths = 0;
+    return 0;
+} /* -- sr_rt_parse_update -- */
+
+/*---------------------------------------------------------------------
+ * Method: sr_load_rt(..)
+ *
+ * Load a routing table from filename and publish it at *table, sr->fib
+ * or a named table's (sr_vrf.h).  The file is mapped and parsed in one
+ * pass into a new table, built off to the side while readers keep using
+ * the current one, which is then replaced.  A file with no routes leaves
+ * the current table in place.
+ *
+ *---------------------------------------------------------------------*/
+
+int sr_load_rt(struct sr_instance* sr, struct sr_fib** table,
+               const char* filename)
+{
+    struct timespec start;
+    struct timespec done;
+    struct stat st;
+    struct sr_fib* fib = 0;
+    const char* text = 0;
+    long count = 0;
+    int fd;
+
+    /* -- REQUIRES -- */
+    assert(filename);
+    if( access(filename,R_OK) != 0)
+    {
+        perror("access");
+        return -1;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    fd = open(filename, O_RDONLY);
+    if(fd < 0 || fstat(fd, &st) != 0)
+    {
+        perror("open");
+        if(fd >= 0)
+        { close(fd); }
+        return -1;
+    }
+
+    if(st.st_size == 0)
+    {
+        close(fd);
+        return 0;
+    }
+
+    text = (const char*)mmap(0, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if(text == MAP_FAILED)
+    {
+        perror("mmap");
+        return -1;
+    }
+    madvise((void*)text, st.st_size, MADV_SEQUENTIAL);
+
+    /* -- build the new table off to the side, readers keep the old one -- */
+    fib = sr_fib_create(sr->lpm_type);
+    if(fib == 0)
+    {
+        fprintf(stderr, "Error allocating forwarding table\n");
+        munmap((void*)text, st.st_size);
+        return -1;
+    }
+
+    count = sr_rt_parse(fib, filename, text, st.st_size);
+    munmap((void*)text, st.st_size);
+
+    if(count <= 0)
+    {
+        sr_fib_destroy(fib);
+        return (int)count;
+    }
+
+    if((sr->ortc & SR_ORTC_ON) &&
+       sr_ortc_compress(fib, sr->ortc & SR_ORTC_VERIFY) != 0)
+    { fprintf(stderr, "Warning: using the routing table uncompressed\n"); }
+
+    printf("Loading routing table from server, clear local routing table.\n");
+    sr_fib_publish(table, fib);
+
+    clock_gettime(CLOCK_MONOTONIC, &done);
+    printf("Loaded %ld prefixes from %s in %.1f ms\n", count, filename,
+            (done.tv_sec - start.tv_sec) * 1e3 +
+            (done.tv_nsec - start.tv_nsec) / 1e6);
+
     return 0; /* -- success -- */
 } /* -- sr_load_rt -- */
 
 /*---------------------------------------------------------------------
- * Method:
+ * Method: sr_add_rt_entry(..)
+ *
+ * Add a route to the published table in place.  This is only safe
+ * before packets are being forwarded; afterwards build a new table and
+ * use sr_fib_publish(..) (see sr_load_rt).
  *
  *---------------------------------------------------------------------*/
 
 void sr_add_rt_entry(struct sr_instance* sr, struct in_addr dest,
 struct in_addr gw, struct in_addr mask,char* if_name)
 {
-    struct sr_rt* rt_walker = 0;
+    struct sr_fib* fib = 0;
 
     /* -- REQUIRES -- */
     assert(if_name);
     assert(sr);
 
-    /* -- empty list special case -- */
-    if(sr->routing_table == 0)
+    if(sr->fib == 0)
     {
-        sr->routing_table = (struct sr_rt*)malloc(sizeof(struct sr_rt));
-        assert(sr->routing_table);
-        sr->routing_table->next = 0;
-        sr->routing_table->dest = dest;
-        sr->routing_table->gw   = gw;
-        sr->routing_table->mask = mask;
-        strncpy(sr->routing_table->interface,if_name,sr_IFACE_NAMELEN);
-
-        return;
+        fib = sr_fib_create(sr->lpm_type);
+        assert(fib);
+        sr_rcu_assign(&sr->fib, fib);
     }
 
-    /* -- find the end of the list -- */
-    rt_walker = sr->routing_table;
-    while(rt_walker->next){
-      rt_walker = rt_walker->next; 
+    if(sr_fib_add_entry(sr->fib,dest,gw,mask,if_name) != 0)
+    {
+        fprintf(stderr, "Error adding %s to the forwarding table\n",
+                inet_ntoa(dest));
     }
 
-    rt_walker->next = (struct sr_rt*)malloc(sizeof(struct sr_rt));
-    assert(rt_walker->next);
-    rt_walker = rt_walker->next;
-
-    rt_walker->next = 0;
-    rt_walker->dest = dest;
-    rt_walker->gw   = gw;
-    rt_walker->mask = mask;
-    strncpy(rt_walker->interface,if_name,sr_IFACE_NAMELEN);
-
 } /* -- sr_add_entry -- */
 
 /*---------------------------------------------------------------------
@@ -139,24 +398,32 @@ struct in_addr gw, struct in_addr mask,char* if_name)
 void sr_print_routing_table(struct sr_instance* sr)
 {
     struct sr_rt* rt_walker = 0;
+    struct sr_fib* fib = 0;
+    unsigned int printed = 0;
+
+    sr_rcu_read_lock();
 
-    if(sr->routing_table == 0)
+    fib = sr_rcu_deref(&sr->fib);
+    if(fib == 0 || fib->routing_table == 0)
     {
         printf(" *warning* Routing table empty \n");
+        sr_rcu_read_unlock();
         return;
     }
 
     printf("Destination\tGateway\t\tMask\tIface\n");
 
-    rt_walker = sr->routing_table;
-    
-    sr_print_routing_entry(rt_walker);
-    while(rt_walker->next)
+    /* -- full-size tables are summarized, not dumped -- */
+    for(rt_walker = fib->routing_table;
+        rt_walker && printed < SR_RT_PRINT_MAX;
+        rt_walker = rt_walker->next, printed++)
     {
-        rt_walker = rt_walker->next; 
         sr_print_routing_entry(rt_walker);
     }
+    if(rt_walker)
+    { printf("... %u more routes\n", fib->nlist - printed); }
 
+    sr_rcu_read_unlock();
 } /* -- sr_print_routing_table -- */
 
 /*---------------------------------------------------------------------
@@ -176,3 +443,924 @@ void sr_print_routing_entry(struct sr_rt* entry)
     printf("%s\n",entry->interface);
 
 } /* -- sr_print_routing_entry -- */
+
+/*---------------------------------------------------------------------
+ * Method: sr_fib_create(..)
+ * Scope: Global
+ *
+ * Create an empty forwarding table using the given LPM backend.
+ *
+ *---------------------------------------------------------------------*/
+
+struct sr_fib* sr_fib_create(sr_lpm_type type)
+{
+    struct sr_fib* fib = (struct sr_fib*)calloc(1, sizeof(struct sr_fib));
+
+    if(fib == 0)
+    { return 0; }
+
+    fib->lpm = sr_lpm_create(type);
+    if(fib->lpm == 0)
+    {
+        free(fib);
+        return 0;
+    }
+
+    /* -- slot 0 is SR_LPM_NONE -- */
+    fib->nroutes = 1;
+
+    return fib;
+} /* -- sr_fib_create -- */
+
+/* ----------------------------------------------------------------------------
+ * struct sr_fib_index
+ *
+ * What sr_fib_update(..) needs to change a published table in place: an
+ * exact match index from prefix to the first path of its route, the
+ * routes[] slots free for reuse, and what the running batch unlinked.
+ * Unlinked routes, their slots and outgrown routes[] arrays may still be
+ * in use by readers and are only released after a grace period.
+ *
+ * -------------------------------------------------------------------------- */
+
+struct sr_fib_slot
+{
+    uint32_t prefix;        /* host byte order, masked to len */
+    uint32_t len;
+    uint32_t nh;            /* SR_LPM_NONE: empty */
+};
+
+struct sr_fib_dead
+{
+    struct sr_rt* rt;
+    uint32_t nh;            /* routes[] slot it held, or SR_LPM_NONE */
+};
+
+struct sr_fib_index
+{
+    struct sr_fib_slot* slots;  /* open addressing, linear probing */
+    uint32_t cap;               /* power of two */
+    uint32_t used;
+
+    uint32_t* free_nh;
+    uint32_t nfree;
+    uint32_t free_cap;
+
+    struct sr_fib_dead* dead;
+    uint32_t ndead;
+    uint32_t dead_cap;
+
+    struct sr_rt*** old_routes;
+    uint32_t nold;
+    uint32_t old_cap;
+};
+
+/* Writers of the tables: reloads replacing them and updates changing them. */
+static pthread_mutex_t sr_fib_lock = PTHREAD_MUTEX_INITIALIZER;
+
+#define sr_fib_mask(len) ((len) ? (uint32_t)(0xffffffffu << (32 - (len))) : 0)
+
+/*---------------------------------------------------------------------
+ * Method: sr_fib_push(..)
+ * Scope: Local
+ *
+ * Append the esize byte item to the array *arr of *n elements, growing
+ * it as needed.  Returns 0 or -1 if the array cannot grow.
+ *
+ *---------------------------------------------------------------------*/
+
+static int sr_fib_push(void* arr, uint32_t* n, uint32_t* cap, size_t esize,
+                       const void* item)
+{
+    void** base = (void**)arr;
+    void* grown;
+    uint32_t size;
+
+    if(*n == *cap)
+    {
+        size = *cap ? *cap * 2 : 64;
+        grown = realloc(*base, (size_t)size * esize);
+        if(grown == 0)
+        { return -1; }
+        *base = grown;
+        *cap = size;
+    }
+
+    memcpy((char*)*base + (size_t)*n * esize, item, esize);
+    (*n)++;
+    return 0;
+} /* -- sr_fib_push -- */
+
+/* Does rt live in the table's route block rather than its own malloc? */
+static int sr_fib_in_block(const struct sr_fib* fib, const struct sr_rt* rt)
+{
+    return fib->route_block && rt >= fib->route_block &&
+           rt < fib->route_block + fib->route_block_len;
+}
+
+/*---------------------------------------------------------------------
+ * Method: sr_fib_destroy(..)
+ * Scope: Global
+ *
+ * Free the lookup structure and the routing table list it was built
+ * from.  The table must no longer be reachable by readers.
+ *
+ *---------------------------------------------------------------------*/
+
+void sr_fib_destroy(struct sr_fib* fib)
+{
+    struct sr_fib_index* idx = 0;
+    struct sr_rt* rt_walker = 0;
+    struct sr_rt* next = 0;
+    uint32_t i;
+
+    if(fib == 0)
+    { return; }
+
+    for(rt_walker = fib->routing_table; rt_walker; rt_walker = next)
+    {
+        next = rt_walker->next;
+        if(!sr_fib_in_block(fib, rt_walker))
+        { free(rt_walker); }
+    }
+
+    idx = fib->index;
+    if(idx)
+    {
+        for(i = 0; i < idx->ndead; i++)
+        {
+            if(!sr_fib_in_block(fib, idx->dead[i].rt))
+            { free(idx->dead[i].rt); }
+        }
+        for(i = 0; i < idx->nold; i++)
+        { free(idx->old_routes[i]); }
+        free(idx->slots);
+        free(idx->free_nh);
+        free(idx->dead);
+        free(idx->old_routes);
+        free(idx);
+    }
+
+    free(fib->route_block);
+    sr_lpm_destroy(fib->lpm);
+    if(fib->map)
+    { munmap(fib->map, fib->map_len); }
+    free(fib->routes);
+    free(fib);
+} /* -- sr_fib_destroy -- */
+
+/*---------------------------------------------------------------------
+ * Method: sr_fib_grow(..)
+ * Scope: Local
+ *
+ * Double the routes[] array.  Once updates run on a published table,
+ * readers may be indexing the array, so it is copied and the old one
+ * kept until the end of the batch.
+ *
+ *---------------------------------------------------------------------*/
+
+static int sr_fib_grow(struct sr_fib* fib)
+{
+    struct sr_fib_index* idx = fib->index;
+    struct sr_rt** grown;
+    uint32_t cap;
+
+    cap = fib->cap ? fib->cap * 2 : 16;
+
+    if(idx == 0)
+    {
+        grown = (struct sr_rt**)realloc(fib->routes, cap * sizeof(struct sr_rt*));
+        if(grown == 0)
+        { return -1; }
+    }
+    else
+    {
+        grown = (struct sr_rt**)malloc(cap * sizeof(struct sr_rt*));
+        if(grown == 0)
+        { return -1; }
+        memcpy(grown, fib->routes, fib->nroutes * sizeof(struct sr_rt*));
+        if(sr_fib_push(&idx->old_routes, &idx->nold, &idx->old_cap,
+                       sizeof(struct sr_rt**), &fib->routes) != 0)
+        {
+            free(grown);
+            return -1;
+        }
+    }
+
+    sr_rcu_assign(&fib->routes, grown);
+    fib->cap = cap;
+    return 0;
+} /* -- sr_fib_grow -- */
+
+/* Append entry to the routing list; entry->next must already be 0. */
+static void sr_fib_link(struct sr_fib* fib, struct sr_rt* entry,
+                        struct sr_rt* last)
+{
+    entry->prev = fib->tail;
+
+    /* -- empty list special case -- */
+    if(fib->routing_table == 0)
+    { sr_rcu_assign(&fib->routing_table, entry); }
+    else
+    { sr_rcu_assign(&fib->tail->next, entry); }
+    fib->tail = last;
+}
+
+/*---------------------------------------------------------------------
+ * Method: sr_fib_add_entry(..)
+ * Scope: Global
+ *
+ * Append a route to the table's routing list and insert it into the
+ * lookup structure.  Returns 0 on success.
+ *
+ *---------------------------------------------------------------------*/
+
+int sr_fib_add_entry(struct sr_fib* fib, struct in_addr dest,
+        struct in_addr gw, struct in_addr mask, const char* if_name)
+{
+    struct sr_rt* entry = 0;
+
+    /* -- REQUIRES -- */
+    assert(fib);
+    assert(if_name);
+
+    entry = (struct sr_rt*)malloc(sizeof(struct sr_rt));
+    if(entry == 0)
+    { return -1; }
+
+    entry->next = 0;
+    entry->dest = dest;
+    entry->gw   = gw;
+    entry->mask = mask;
+    entry->npaths = 1;
+    strncpy(entry->interface,if_name,sr_IFACE_NAMELEN);
+    entry->ifindex = sr_if_index(if_name);
+
+    if(entry->ifindex == SR_IF_NONE || sr_fib_insert(fib, entry) != 0)
+    {
+        free(entry);
+        return -1;
+    }
+
+    sr_fib_link(fib, entry, entry);
+    fib->group = entry;
+    fib->nlist++;
+
+    return 0;
+} /* -- sr_fib_add_entry -- */
+
+/*---------------------------------------------------------------------
+ * Method: sr_fib_add_path(..)
+ * Scope: Global
+ *
+ * Give the route added last by sr_fib_add_entry(..) another equal-cost
+ * next hop.  The path is appended right behind the route's other paths
+ * and takes a routes[] slot so snapshots keep it, but the LPM keeps
+ * pointing at the first path only.  Returns 0 on success.
+ *
+ *---------------------------------------------------------------------*/
+
+int sr_fib_add_path(struct sr_fib* fib, struct in_addr gw, const char* if_name)
+{
+    struct sr_rt* entry = 0;
+
+    /* -- REQUIRES -- */
+    assert(fib);
+    assert(if_name);
+
+    if(fib->group == 0 || fib->group->npaths >= SR_RT_MAX_PATHS ||
+       fib->nroutes >= SR_FIB_DISCARD)
+    { return -1; }
+
+    if(fib->nroutes >= fib->cap && sr_fib_grow(fib) != 0)
+    { return -1; }
+
+    entry = (struct sr_rt*)malloc(sizeof(struct sr_rt));
+    if(entry == 0)
+    { return -1; }
+
+    entry->ifindex = sr_if_index(if_name);
+    if(entry->ifindex == SR_IF_NONE)
+    {
+        free(entry);
+        return -1;
+    }
+
+    entry->next = 0;
+    entry->dest = fib->group->dest;
+    entry->gw   = gw;
+    entry->mask = fib->group->mask;
+    entry->npaths = 0;
+    strncpy(entry->interface,if_name,sr_IFACE_NAMELEN);
+
+    fib->routes[fib->nroutes++] = entry;
+    sr_fib_link(fib, entry, entry);
+    fib->group->npaths++;
+    fib->nlist++;
+
+    return 0;
+} /* -- sr_fib_add_path -- */
+
+/*---------------------------------------------------------------------
+ * Method: sr_fib_publish(..)
+ * Scope: Global
+ *
+ * Make fib the table published at *table, sr->fib or a named table's
+ * (sr_vrf.h).  Readers switch over with a single pointer swap and never
+ * wait; this call waits for the ones still using the previous table and
+ * then frees it.
+ *
+ *---------------------------------------------------------------------*/
+
+void sr_fib_publish(struct sr_fib** table, struct sr_fib* fib)
+{
+    struct sr_fib* old = 0;
+
+    /* -- REQUIRES -- */
+    assert(table);
+    assert(fib);
+
+    pthread_mutex_lock(&sr_fib_lock);
+
+    /* -- cached forwarding decisions die with the old table -- */
+    old = *table;
+    fib->gen = (old ? old->gen : 0) + 1;
+    fib->live = 1;
+    sr_rcu_assign(table, fib);
+    sr_rcu_synchronize();
+
+    pthread_mutex_unlock(&sr_fib_lock);
+
+    sr_fib_destroy(old);
+} /* -- sr_fib_publish -- */
+
+/*---------------------------------------------------------------------
+ * Method: sr_fib_insert(..)
+ * Scope: Local
+ *
+ * Make entry reachable through sr_fib_lookup(..).  A later entry for the
+ * same prefix replaces an earlier one.
+ *
+ * RETURN VALUES:
+ *
+ *  0 on success
+ *  -1 if the table could not grow
+ *
+ *---------------------------------------------------------------------*/
+
+static int sr_fib_insert(struct sr_fib* fib, struct sr_rt* entry)
+{
+    uint32_t mask;
+    unsigned int len;
+
+    /* -- REQUIRES -- */
+    assert(fib);
+    assert(entry);
+
+    if(fib->nroutes >= SR_FIB_DISCARD)
+    { return -1; }
+
+    if(fib->nroutes >= fib->cap && sr_fib_grow(fib) != 0)
+    { return -1; }
+
+    mask = ntohl(entry->mask.s_addr);
+    len = sr_lpm_mask_len(mask);
+    if(len < 32 && (mask << len) != 0)
+    {
+        fprintf(stderr, "Warning: non-contiguous mask %s, using its leading bits\n",
+                inet_ntoa(entry->mask));
+    }
+
+    if(sr_lpm_insert(fib->lpm, ntohl(entry->dest.s_addr), len,
+                fib->nroutes) != 0)
+    { return -1; }
+
+    fib->routes[fib->nroutes++] = entry;
+
+    /* -- nobody else can see a table being built, recycle right away -- */
+    if(!fib->live)
+    { sr_lpm_reclaim(fib->lpm); }
+
+    return 0;
+} /* -- sr_fib_insert -- */
+
+/*---------------------------------------------------------------------
+ * Method: sr_fib_lookup(..)
+ * Scope: Global
+ *
+ * Longest prefix match for ip (network byte order).  Returns the matching
+ * route or 0.  The caller must be inside an RCU read-side section for as
+ * long as it uses the route.
+ *
+ *---------------------------------------------------------------------*/
+
+struct sr_rt* sr_fib_lookup(const struct sr_fib* fib, uint32_t ip)
+{
+    uint32_t nh;
+
+    if(fib == 0)
+    { return 0; }
+
+    nh = sr_lpm_lookup(fib->lpm, ntohl(ip));
+
+    if(nh == SR_LPM_NONE || nh == SR_FIB_DISCARD)
+    { return 0; }
+
+    return sr_rcu_deref(&fib->routes)[nh];
+} /* -- sr_fib_lookup -- */
+
+/*---------------------------------------------------------------------
+ * Method: sr_fib_select(..)
+ * Scope: Global
+ *
+ * Pick one of the equal-cost paths of route, as returned by
+ * sr_fib_lookup(..), for a packet whose flow hashes to hash.  Each path
+ * is weighted by the speed of its interface (unknown speeds count as 1),
+ * so packets of one flow always take the same path while flows spread
+ * over the paths in proportion to their capacity.
+ *
+ *---------------------------------------------------------------------*/
+
+struct sr_rt* sr_fib_select(struct sr_instance* sr, struct sr_rt* route,
+                            uint32_t hash)
+{
+    uint32_t weight[SR_RT_MAX_PATHS];
+    struct sr_rt* path = 0;
+    struct sr_if* iface = 0;
+    uint64_t total = 0;
+    uint64_t pick;
+    uint32_t n = 0;
+    uint32_t i;
+
+    if(route == 0 || route->npaths <= 1)
+    { return route; }
+
+    for(path = route; path && n < route->npaths && n < SR_RT_MAX_PATHS;
+        path = path->next, n++)
+    {
+        iface = sr_if_get(sr, path->ifindex);
+        weight[n] = (iface && iface->speed) ? iface->speed : 1;
+        total += weight[n];
+    }
+
+    pick = hash % total;
+    for(path = route, i = 0; i + 1 < n; path = path->next, i++)
+    {
+        if(pick < weight[i])
+        { break; }
+        pick -= weight[i];
+    }
+
+    return path;
+} /* -- sr_fib_select -- */
+
+/*---------------------------------------------------------------------
+ * Index helpers for sr_fib_update(..)
+ *---------------------------------------------------------------------*/
+
+static uint32_t sr_fib_hash(uint32_t prefix, uint32_t len)
+{
+    uint32_t h = prefix * 0x9e3779b1u ^ (len + 1) * 0x85ebca6bu;
+
+    return h ^ (h >> 16);
+}
+
+/* Slot holding prefix/len, or the empty slot where it would go. */
+static struct sr_fib_slot* sr_fib_index_find(const struct sr_fib_index* idx,
+                                             uint32_t prefix, uint32_t len)
+{
+    uint32_t i = sr_fib_hash(prefix, len) & (idx->cap - 1);
+
+    while(idx->slots[i].nh != SR_LPM_NONE &&
+          (idx->slots[i].prefix != prefix || idx->slots[i].len != len))
+    { i = (i + 1) & (idx->cap - 1); }
+
+    return &idx->slots[i];
+}
+
+/* Make sure one more prefix fits without the slots moving later. */
+static int sr_fib_index_reserve(struct sr_fib_index* idx)
+{
+    struct sr_fib_slot* old = idx->slots;
+    struct sr_fib_slot* s;
+    uint32_t old_cap = idx->cap;
+    uint32_t i;
+
+    if((idx->used + 1) * 2 <= idx->cap)
+    { return 0; }
+
+    idx->slots = (struct sr_fib_slot*)calloc(old_cap * 2, sizeof(struct sr_fib_slot));
+    if(idx->slots == 0)
+    {
+        idx->slots = old;
+        return -1;
+    }
+    idx->cap = old_cap * 2;
+
+    for(i = 0; i < old_cap; i++)
+    {
+        if(old[i].nh != SR_LPM_NONE)
+        {
+            s = sr_fib_index_find(idx, old[i].prefix, old[i].len);
+            *s = old[i];
+        }
+    }
+    free(old);
+    return 0;
+}
+
+/* Empty slot s, shifting back entries that probed past it. */
+static void sr_fib_index_remove(struct sr_fib_index* idx, struct sr_fib_slot* s)
+{
+    uint32_t mask = idx->cap - 1;
+    uint32_t i = s - idx->slots;
+    uint32_t j = i;
+    uint32_t home;
+
+    for(;;)
+    {
+        j = (j + 1) & mask;
+        if(idx->slots[j].nh == SR_LPM_NONE)
+        { break; }
+        home = sr_fib_hash(idx->slots[j].prefix, idx->slots[j].len) & mask;
+        if(((j - home) & mask) >= ((j - i) & mask))
+        {
+            idx->slots[i] = idx->slots[j];
+            i = j;
+        }
+    }
+
+    idx->slots[i].nh = SR_LPM_NONE;
+    idx->used--;
+}
+
+/*---------------------------------------------------------------------
+ * Method: sr_fib_index_build(..)
+ * Scope: Local
+ *
+ * Index the routes of fib by prefix, ahead of its first update.
+ *
+ *---------------------------------------------------------------------*/
+
+static int sr_fib_index_build(struct sr_fib* fib)
+{
+    struct sr_fib_index* idx = 0;
+    struct sr_fib_slot* s = 0;
+    struct sr_rt* rt = 0;
+    uint32_t len;
+    uint32_t nh;
+
+    idx = (struct sr_fib_index*)calloc(1, sizeof(struct sr_fib_index));
+    if(idx == 0)
+    { return -1; }
+
+    for(idx->cap = 64; idx->cap < fib->nroutes * 2; idx->cap *= 2)
+        ;
+    idx->slots = (struct sr_fib_slot*)calloc(idx->cap, sizeof(struct sr_fib_slot));
+    if(idx->slots == 0)
+    {
+        free(idx);
+        return -1;
+    }
+
+    /* -- a later route for the same prefix is the one the LPM holds -- */
+    for(nh = 1; nh < fib->nroutes; nh++)
+    {
+        rt = fib->routes[nh];
+        if(rt == 0 || rt->npaths == 0)
+        { continue; }
+        len = sr_lpm_mask_len(ntohl(rt->mask.s_addr));
+        s = sr_fib_index_find(idx, ntohl(rt->dest.s_addr) & sr_fib_mask(len), len);
+        if(s->nh == SR_LPM_NONE)
+        { idx->used++; }
+        s->prefix = ntohl(rt->dest.s_addr) & sr_fib_mask(len);
+        s->len = len;
+        s->nh = nh;
+    }
+
+    fib->index = idx;
+    return 0;
+} /* -- sr_fib_index_build -- */
+
+/*---------------------------------------------------------------------
+ * Method: sr_fib_retire(..)
+ * Scope: Local
+ *
+ * Unlink the route in slot nh, with all its paths, from the routing
+ * list and keep it for sr_fib_release(..).  Paths loaded from a file
+ * hold the slots right behind nh, paths added by updates hold none.
+ *
+ *---------------------------------------------------------------------*/
+
+static void sr_fib_retire(struct sr_fib* fib, uint32_t nh)
+{
+    struct sr_fib_index* idx = fib->index;
+    struct sr_fib_dead dead;
+    struct sr_rt* head = fib->routes[nh];
+    struct sr_rt* last = head;
+    struct sr_rt* rt = 0;
+    uint32_t npaths = head->npaths;
+    uint32_t i;
+
+    for(i = 1; i < npaths && last->next; i++)
+    { last = last->next; }
+
+    /* -- readers on the unlinked routes can still walk off them -- */
+    if(head->prev)
+    { sr_rcu_assign(&head->prev->next, last->next); }
+    else
+    { sr_rcu_assign(&fib->routing_table, last->next); }
+    if(last->next)
+    { last->next->prev = head->prev; }
+    else
+    { fib->tail = head->prev; }
+
+    for(rt = head, i = 0; i < npaths; rt = rt->next, i++)
+    {
+        dead.rt = rt;
+        dead.nh = SR_LPM_NONE;
+        if(nh + i < fib->nroutes && fib->routes[nh + i] == rt)
+        { dead.nh = nh + i; }
+        sr_fib_push(&idx->dead, &idx->ndead, &idx->dead_cap,
+                    sizeof(dead), &dead);
+        fib->nlist--;
+        if(rt == last)
+        { break; }
+    }
+} /* -- sr_fib_retire -- */
+
+/*---------------------------------------------------------------------
+ * Method: sr_fib_release(..)
+ * Scope: Local
+ *
+ * Free what the batch retired.  Only called once readers that may have
+ * seen it are gone.
+ *
+ *---------------------------------------------------------------------*/
+
+static void sr_fib_release(struct sr_fib* fib)
+{
+    struct sr_fib_index* idx = fib->index;
+    struct sr_fib_dead* dead;
+    uint32_t i;
+
+    for(i = 0; i < idx->ndead; i++)
+    {
+        dead = &idx->dead[i];
+        if(dead->nh != SR_LPM_NONE)
+        {
+            fib->routes[dead->nh] = 0;
+            sr_fib_push(&idx->free_nh, &idx->nfree, &idx->free_cap,
+                        sizeof(uint32_t), &dead->nh);
+        }
+        if(!sr_fib_in_block(fib, dead->rt))
+        { free(dead->rt); }
+    }
+    idx->ndead = 0;
+
+    for(i = 0; i < idx->nold; i++)
+    { free(idx->old_routes[i]); }
+    idx->nold = 0;
+
+    sr_lpm_reclaim(fib->lpm);
+} /* -- sr_fib_release -- */
+
+/*---------------------------------------------------------------------
+ * Method: sr_fib_apply(..)
+ * Scope: Local
+ *
+ * Apply one update to fib.  Only the LPM entries of the prefix change;
+ * a new route for a known prefix goes live with the single LPM store
+ * that replaces its next hop.  Returns 0 or -1 if the update was
+ * rejected (malformed, unknown prefix, out of memory).
+ *
+ *---------------------------------------------------------------------*/
+
+static int sr_fib_apply(struct sr_fib* fib, const struct sr_rt_update* u)
+{
+    struct sr_fib_index* idx = fib->index;
+    struct sr_fib_slot* s = 0;
+    struct sr_rt* head = 0;
+    struct sr_rt* last = 0;
+    struct sr_rt* rt = 0;
+    uint32_t prefix;
+    uint32_t mask;
+    uint32_t len;
+    uint32_t old;
+    uint32_t nh;
+    uint32_t parent = SR_LPM_NONE;
+    uint32_t plen = 0;
+    uint32_t i;
+
+    mask = ntohl(u->mask.s_addr);
+    len = sr_lpm_mask_len(mask);
+    if((len < 32 && (mask << len) != 0) || u->npaths > SR_RT_MAX_PATHS ||
+       (!u->withdraw && u->npaths == 0))
+    { return -1; }
+    prefix = ntohl(u->dest.s_addr) & sr_fib_mask(len);
+
+    if(u->withdraw)
+    {
+        s = sr_fib_index_find(idx, prefix, len);
+        if(s->nh == SR_LPM_NONE)
+        { return -1; }
+
+        /* -- DIR-24-8 refills the range with the covering route -- */
+        for(plen = len; plen-- > 0; )
+        {
+            parent = sr_fib_index_find(idx, prefix & sr_fib_mask(plen), plen)->nh;
+            if(parent != SR_LPM_NONE)
+            { break; }
+        }
+        if(parent == SR_LPM_NONE)
+        { plen = 0; }
+
+        if(sr_lpm_delete(fib->lpm, prefix, len, parent, plen) != 0)
+        { return -1; }
+        old = s->nh;
+        sr_fib_index_remove(idx, s);
+        sr_fib_retire(fib, old);
+        return 0;
+    }
+
+    if(sr_fib_index_reserve(idx) != 0)
+    { return -1; }
+
+    /* -- a slot for the first path, reused ones went through a grace period -- */
+    if(idx->nfree)
+    { nh = idx->free_nh[--idx->nfree]; }
+    else if(fib->nroutes < SR_FIB_DISCARD &&
+            (fib->nroutes < fib->cap || sr_fib_grow(fib) == 0))
+    { nh = fib->nroutes++; }
+    else
+    { return -1; }
+
+    for(i = 0; i < u->npaths; i++)
+    {
+        rt = (struct sr_rt*)malloc(sizeof(struct sr_rt));
+        if(rt == 0)
+        { break; }
+        rt->ifindex = sr_if_index(u->interface[i]);
+        if(rt->ifindex == SR_IF_NONE)
+        {
+            free(rt);
+            break;
+        }
+        rt->dest = u->dest;
+        rt->gw   = u->gw[i];
+        rt->mask = u->mask;
+        rt->npaths = i ? 0 : u->npaths;
+        strncpy(rt->interface, u->interface[i], sr_IFACE_NAMELEN);
+        rt->interface[sr_IFACE_NAMELEN - 1] = 0;
+        rt->next = 0;
+        rt->prev = last;
+        if(last)
+        { last->next = rt; }
+        else
+        { head = rt; }
+        last = rt;
+    }
+
+    /* -- the slot is unreachable until the LPM points at it -- */
+    fib->routes[nh] = head;
+    if(i < u->npaths || sr_lpm_insert(fib->lpm, prefix, len, nh) != 0)
+    {
+        fib->routes[nh] = 0;
+        for(rt = head; rt; rt = last)
+        {
+            last = rt->next;
+            free(rt);
+        }
+        sr_fib_push(&idx->free_nh, &idx->nfree, &idx->free_cap,
+                    sizeof(uint32_t), &nh);
+        return -1;
+    }
+
+    sr_fib_link(fib, head, last);
+    fib->nlist += u->npaths;
+
+    s = sr_fib_index_find(idx, prefix, len);
+    old = s->nh;
+    if(old == SR_LPM_NONE)
+    { idx->used++; }
+    s->prefix = prefix;
+    s->len = len;
+    s->nh = nh;
+
+    if(old != SR_LPM_NONE)
+    { sr_fib_retire(fib, old); }
+
+    return 0;
+} /* -- sr_fib_apply -- */
+
+/*---------------------------------------------------------------------
+ * Method: sr_fib_update(..)
+ * Scope: Global
+ *
+ * Apply a batch of n route updates to the table published at *table in
+ * place, without rebuilding it.  Readers keep forwarding throughout and
+ * see each update take effect on its own.  The batch ends with one grace
+ * period, after which the memory it retired is released.
+ *
+ * Changes are lost on the next reload from the rtable file.
+ *
+ * RETURN VALUES:
+ *
+ *  the number of updates that were rejected, 0 if all were applied
+ *  -1 if there is no table to update or it is compressed
+ *
+ *---------------------------------------------------------------------*/
+
+int sr_fib_update(struct sr_fib** table, const struct sr_rt_update* updates,
+                  unsigned int n)
+{
+    struct sr_fib* fib = 0;
+    unsigned int failed = 0;
+    unsigned int i;
+
+    /* -- REQUIRES -- */
+    assert(table);
+    assert(updates || n == 0);
+
+    pthread_mutex_lock(&sr_fib_lock);
+
+    /* -- the LPM of a compressed table no longer has the routes' prefixes -- */
+    fib = *table;
+    if(fib == 0 || fib->compressed ||
+       (fib->index == 0 && sr_fib_index_build(fib) != 0))
+    {
+        pthread_mutex_unlock(&sr_fib_lock);
+        return -1;
+    }
+    fib->group = 0;
+
+    for(i = 0; i < n; i++)
+    {
+        if(sr_fib_apply(fib, &updates[i]) != 0)
+        { failed++; }
+    }
+
+    /* -- cached forwarding decisions may be stale now -- */
+    __atomic_add_fetch(&fib->gen, 1, __ATOMIC_RELEASE);
+
+    sr_rcu_synchronize();
+    sr_fib_release(fib);
+
+    pthread_mutex_unlock(&sr_fib_lock);
+
+    return (int)failed;
+} /* -- sr_fib_update -- */
+
+/*---------------------------------------------------------------------
+ * Method: sr_rt_reload_thread(..)
+ * Scope: Global
+ *
+ * Reload the routing table from sr->rtable_path, and every named table
+ * from its own file (sr_vrf.h), on every SIGHUP.  SIGHUP
+ * must be blocked in all threads so that it is only seen here.
+ *
+ *---------------------------------------------------------------------*/
+
+static int sr_rt_reload(struct sr_instance* sr, struct sr_fib** table,
+                        const char* path)
+{
+    printf("Reloading routing table from %s\n", path);
+    if(sr_load_rt(sr, table, path) != 0)
+    {
+        fprintf(stderr, "Reload failed, keeping the current routing table\n");
+        return -1;
+    }
+
+    /* -- keep updates off the table while it is written out -- */
+    pthread_mutex_lock(&sr_fib_lock);
+    if(*table && sr_snapshot_save(*table, path) != 0)
+    { fprintf(stderr, "Warning: could not write routing table snapshot\n"); }
+    pthread_mutex_unlock(&sr_fib_lock);
+
+    return 0;
+}
+
+void* sr_rt_reload_thread(void* sr_ptr)
+{
+    struct sr_instance* sr = (struct sr_instance*)sr_ptr;
+    struct sr_vrf* vrf = 0;
+    sigset_t set;
+    int sig;
+
+    sigemptyset(&set);
+    sigaddset(&set, SIGHUP);
+
+    while(1)
+    {
+        if(sigwait(&set, &sig) != 0)
+        { continue; }
+
+        if(sr->rtable_path && sr_rt_reload(sr, &sr->fib, sr->rtable_path) == 0)
+        { sr_print_routing_table(sr); }
+
+        for(vrf = sr->vrfs; vrf; vrf = vrf->next)
+        { sr_rt_reload(sr, &vrf->fib, vrf->rtable_path); }
+    }
+
+    return 0;
+} /* -- sr_rt_reload_thread -- */
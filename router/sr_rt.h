@@ -19,12 +19,27 @@
 #include <netinet/in.h>
 
 #include "sr_if.h"
+#include "sr_lpm.h"
+
+/* routes printed by sr_print_routing_table before it summarizes */
+#define SR_RT_PRINT_MAX 32
+
+/* equal-cost next hops one prefix may have */
+#define SR_RT_MAX_PATHS 16
+
+/* next hop of address ranges a compressed table must not route (sr_ortc.h) */
+#define SR_FIB_DISCARD SR_LPM_NH_MAX
 
 /* ----------------------------------------------------------------------------
  * struct sr_rt
  *
  * Node in the routing table 
  *
+ * A prefix with several equal-cost next hops is a group of consecutive
+ * nodes: the first one is what the lookup returns and carries the number
+ * of paths in npaths, the others follow it with npaths 0.  A prefix with
+ * a single next hop has npaths 1.
+ *
  * -------------------------------------------------------------------------- */
 
 struct sr_rt
@@ -33,15 +48,89 @@ struct sr_rt
     struct in_addr gw;
     struct in_addr mask;
     char   interface[sr_IFACE_NAMELEN];
+    int    ifindex;     /* sr_if_index(interface) */
+    uint32_t npaths;
     struct sr_rt* next;
+    struct sr_rt* prev;
+};
+
+/* ----------------------------------------------------------------------------
+ * struct sr_rt_update
+ *
+ * One change for sr_fib_update(..): add the route for dest/mask with
+ * npaths equal-cost next hops, replacing any route for the same prefix,
+ * or withdraw the route for dest/mask.
+ *
+ * -------------------------------------------------------------------------- */
+
+struct sr_rt_update
+{
+    int withdraw;
+    struct in_addr dest;
+    struct in_addr mask;
+    uint32_t npaths;
+    struct in_addr gw[SR_RT_MAX_PATHS];
+    char   interface[SR_RT_MAX_PATHS][sr_IFACE_NAMELEN];
 };
 
+struct sr_fib_index;
+
+/* ----------------------------------------------------------------------------
+ * struct sr_fib
+ *
+ * Forwarding table built from the routing table list.  The next hop kept
+ * in the LPM for each prefix is an index into routes[].
+ *
+ * The router forwards with sr->fib, or the named table (sr_vrf.h) bound to
+ * the ingress interface.  Tables are published with RCU (sr_rcu.h):
+ * readers hold sr_rcu_read_lock() while they use one or any route it
+ * returned.  A reload replaces it as a whole through
+ * sr_fib_publish(..); sr_fib_update(..) changes single prefixes in place.
+ *
+ * -------------------------------------------------------------------------- */
 
-int sr_load_rt(struct sr_instance*,const char*);
+struct sr_fib
+{
+    struct sr_rt* routing_table; /* the routes, owned by the table */
+    struct sr_rt* tail;          /* last route, for O(1) appends */
+    struct sr_rt* group;         /* first path of the last prefix added */
+    struct sr_lpm* lpm;
+    struct sr_rt** routes;  /* next hop -> route, slot 0 unused */
+    uint32_t nroutes;
+    uint32_t cap;
+    uint32_t nlist;         /* routes on the routing_table list */
+    unsigned int gen;       /* changes whenever lookups may answer differently */
+    int    live;            /* published, readers may be using it */
+    int    compressed;      /* lpm holds the ORTC prefix set (sr_ortc.h) */
+    struct sr_fib_index* index; /* set up by the first sr_fib_update(..) */
+
+    /* -- set when the table was loaded from a snapshot (sr_snapshot.h) -- */
+    struct sr_rt* route_block;   /* routes allocated as one array */
+    uint32_t route_block_len;
+    void*  map;                  /* snapshot mapping the lpm points into */
+    size_t map_len;
+};
+
+int sr_load_rt(struct sr_instance*, struct sr_fib** table, const char*);
 void sr_add_rt_entry(struct sr_instance*, struct in_addr,struct in_addr,
                   struct in_addr, char*);
 void sr_print_routing_table(struct sr_instance* sr);
 void sr_print_routing_entry(struct sr_rt* entry);
 
+void* sr_rt_reload_thread(void* sr_ptr);
+
+struct sr_fib* sr_fib_create(sr_lpm_type type);
+void sr_fib_destroy(struct sr_fib* fib);
+int sr_fib_add_entry(struct sr_fib* fib, struct in_addr dest,
+                     struct in_addr gw, struct in_addr mask, const char* if_name);
+int sr_fib_add_path(struct sr_fib* fib, struct in_addr gw, const char* if_name);
+void sr_fib_publish(struct sr_fib** table, struct sr_fib* fib);
+int sr_fib_update(struct sr_fib** table, const struct sr_rt_update* updates,
+                  unsigned int n);
+int sr_rt_parse_update(const char* line, size_t len, struct sr_rt_update* u);
+struct sr_rt* sr_fib_lookup(const struct sr_fib* fib, uint32_t ip);
+struct sr_rt* sr_fib_select(struct sr_instance* sr, struct sr_rt* route,
+                            uint32_t hash);
+
 
 #endif  /* --  sr_RT_H -- */
@@ -0,0 +1,463 @@
+/*-----------------------------------------------------------------------------
+ * file:  sr_snapshot.c
+ *
+ * Description:
+ *
+ * Snapshot file layout (all offsets from the start of the file):
+ *
+ *   struct sr_snapshot_hdr
+ *   struct sr_snapshot_route[nroutes]      at routes_off, next hop order
+ *   LPM image part 0                       at lpm_off[0], page aligned
+ *   LPM image part 1                       at lpm_off[1], page aligned
+ *
+ * Gaps between sections are zero and the file is padded to a multiple of
+ * 8 bytes.  The checksum runs over every 64 bit word after the header and
+ * then over the header itself with the checksum field zeroed.
+ *
+ *---------------------------------------------------------------------------*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "sr_snapshot.h"
+#include "sr_rt.h"
+
+#define SR_SNAPSHOT_ALIGN 4096
+
+#define SR_SNAPSHOT_ORTC  0x1   /* the LPM is ORTC-compressed */
+
+struct sr_snapshot_hdr
+{
+    char     magic[8];
+    uint32_t version;
+    uint32_t lpm_type;
+    uint32_t nroutes;           /* routes, not counting slot 0 */
+    uint32_t lpm_count[SR_LPM_IMAGE_PARTS];
+    uint32_t flags;             /* SR_SNAPSHOT_* */
+    uint64_t routes_off;
+    uint64_t lpm_off[SR_LPM_IMAGE_PARTS];
+    uint64_t lpm_size[SR_LPM_IMAGE_PARTS];
+    uint64_t file_size;
+    uint64_t src_size;          /* the rtable the table was built from */
+    int64_t  src_mtime;
+    int64_t  src_mtime_nsec;
+    uint64_t src_ino;
+    uint64_t checksum;
+};
+
+struct sr_snapshot_route
+{
+    uint32_t dest;              /* network byte order, as in struct sr_rt */
+    uint32_t gw;
+    uint32_t mask;
+    uint32_t npaths;            /* see struct sr_rt */
+    char     interface[sr_IFACE_NAMELEN];
+};
+
+/* Running checksum: two 64 bit sums over 64 bit words (Fletcher style). */
+struct sr_snapshot_sum
+{
+    uint64_t a;
+    uint64_t b;
+};
+
+struct sr_snapshot_writer
+{
+    FILE*    out;
+    uint64_t off;
+};
+
+/* data must be 8 byte aligned and len a multiple of 8.  Unrolled since
+   it runs over the whole snapshot on every start. */
+static void sr_snapshot_sum(struct sr_snapshot_sum* s, const void* data,
+                            size_t len)
+{
+    const uint64_t* w = (const uint64_t*)data;
+    const uint64_t* end = w + len / sizeof(uint64_t);
+    uint64_t a = s->a;
+    uint64_t b = s->b;
+
+    assert(len % sizeof(uint64_t) == 0);
+
+    for(; w + 4 <= end; w += 4)
+    {
+        a += w[0]; b += a;
+        a += w[1]; b += a;
+        a += w[2]; b += a;
+        a += w[3]; b += a;
+    }
+    for(; w < end; w++)
+    {
+        a += *w;
+        b += a;
+    }
+    s->a = a;
+    s->b = b;
+}
+
+/* Checksum of a whole snapshot image of len bytes starting with hdr. */
+static uint64_t sr_snapshot_sum_file(const uint8_t* map, size_t len,
+                                     struct sr_snapshot_hdr* hdr)
+{
+    struct sr_snapshot_sum sum;
+    uint64_t saved = hdr->checksum;
+
+    memset(&sum, 0, sizeof(sum));
+    sr_snapshot_sum(&sum, map + sizeof(*hdr), len - sizeof(*hdr));
+
+    hdr->checksum = 0;
+    sr_snapshot_sum(&sum, hdr, sizeof(*hdr));
+    hdr->checksum = saved;
+
+    return (sum.b << 32) ^ sum.b ^ sum.a;
+}
+
+static int sr_snapshot_write(struct sr_snapshot_writer* w, const void* data,
+                             size_t len)
+{
+    if(len && fwrite(data, 1, len, w->out) != len)
+    { return -1; }
+    w->off += len;
+    return 0;
+}
+
+/* Zero fill up to the next multiple of align. */
+static int sr_snapshot_pad(struct sr_snapshot_writer* w, uint64_t align)
+{
+    static const uint32_t zero[64];
+    size_t n;
+
+    while(w->off % align)
+    {
+        n = align - (w->off % align);
+        if(n > sizeof(zero))
+        { n = sizeof(zero); }
+        if(sr_snapshot_write(w, zero, n) != 0)
+        { return -1; }
+    }
+    return 0;
+}
+
+static char* sr_snapshot_path(const char* rtable, const char* suffix)
+{
+    size_t len = strlen(rtable);
+    char* path = (char*)malloc(len + strlen(suffix) + 1);
+
+    if(path)
+    {
+        memcpy(path, rtable, len);
+        strcpy(path + len, suffix);
+    }
+    return path;
+}
+
+/*---------------------------------------------------------------------
+ * Method: sr_snapshot_save(..)
+ * Scope: Global
+ *
+ * Write fib, built from rtable, to rtable's snapshot.  The file is
+ * written under a temporary name and renamed into place, so a reader
+ * never sees a partial snapshot.  A table changed by sr_fib_update(..)
+ * no longer matches rtable and is not written.  Returns 0 on success.
+ *
+ *---------------------------------------------------------------------*/
+
+int sr_snapshot_save(const struct sr_fib* fib, const char* rtable)
+{
+    struct sr_snapshot_writer w;
+    struct sr_snapshot_hdr hdr;
+    struct sr_snapshot_route rec;
+    struct sr_lpm_image img;
+    struct stat st;
+    uint8_t* map = 0;
+    char* path = 0;
+    char* tmp = 0;
+    uint32_t i;
+
+    /* -- REQUIRES -- */
+    assert(fib);
+    assert(rtable);
+
+    if(fib->index || stat(rtable, &st) != 0)
+    { return -1; }
+
+    path = sr_snapshot_path(rtable, SR_SNAPSHOT_SUFFIX);
+    tmp = sr_snapshot_path(rtable, SR_SNAPSHOT_SUFFIX ".tmp");
+    if(path == 0 || tmp == 0)
+    { goto fail; }
+
+    memset(&w, 0, sizeof(w));
+    w.out = fopen(tmp, "w+b");
+    if(w.out == 0)
+    { goto fail; }
+
+    sr_lpm_export(fib->lpm, &img);
+
+    memset(&hdr, 0, sizeof(hdr));
+    memcpy(hdr.magic, SR_SNAPSHOT_MAGIC, sizeof(hdr.magic));
+    hdr.version = SR_SNAPSHOT_VERSION;
+    hdr.lpm_type = img.type;
+    hdr.nroutes = fib->nroutes - 1;
+    hdr.flags = fib->compressed ? SR_SNAPSHOT_ORTC : 0;
+    hdr.src_size = st.st_size;
+    hdr.src_mtime = st.st_mtim.tv_sec;
+    hdr.src_mtime_nsec = st.st_mtim.tv_nsec;
+    hdr.src_ino = st.st_ino;
+
+    /* -- body first, the header goes in last once the sums are known -- */
+    if(fseek(w.out, sizeof(hdr), SEEK_SET) != 0)
+    { goto fail; }
+    w.off = sizeof(hdr);
+
+    hdr.routes_off = w.off;
+    for(i = 1; i < fib->nroutes; i++)
+    {
+        memset(&rec, 0, sizeof(rec));
+        rec.dest = fib->routes[i]->dest.s_addr;
+        rec.gw   = fib->routes[i]->gw.s_addr;
+        rec.mask = fib->routes[i]->mask.s_addr;
+        rec.npaths = fib->routes[i]->npaths;
+        strncpy(rec.interface, fib->routes[i]->interface, sr_IFACE_NAMELEN);
+        if(sr_snapshot_write(&w, &rec, sizeof(rec)) != 0)
+        { goto fail; }
+    }
+
+    for(i = 0; i < SR_LPM_IMAGE_PARTS; i++)
+    {
+        if(sr_snapshot_pad(&w, SR_SNAPSHOT_ALIGN) != 0)
+        { goto fail; }
+        hdr.lpm_count[i] = img.count[i];
+        hdr.lpm_off[i] = w.off;
+        hdr.lpm_size[i] = img.size[i];
+        if(sr_snapshot_write(&w, img.part[i], img.size[i]) != 0)
+        { goto fail; }
+    }
+    if(sr_snapshot_pad(&w, sizeof(uint64_t)) != 0 || fflush(w.out) != 0)
+    { goto fail; }
+    hdr.file_size = w.off;
+
+    /* -- sum what actually went to disk, exactly as the loader will -- */
+    map = (uint8_t*)mmap(0, w.off, PROT_READ, MAP_SHARED, fileno(w.out), 0);
+    if(map == MAP_FAILED)
+    { goto fail; }
+    hdr.checksum = sr_snapshot_sum_file(map, w.off, &hdr);
+    munmap(map, w.off);
+
+    if(fseek(w.out, 0, SEEK_SET) != 0 ||
+       fwrite(&hdr, 1, sizeof(hdr), w.out) != sizeof(hdr) ||
+       fflush(w.out) != 0 || fsync(fileno(w.out)) != 0)
+    { goto fail; }
+
+    fclose(w.out);
+    w.out = 0;
+
+    if(rename(tmp, path) != 0)
+    { goto fail; }
+
+    free(path);
+    free(tmp);
+    return 0;
+
+fail:
+    perror("sr_snapshot_save");
+    if(w.out)
+    { fclose(w.out); }
+    if(tmp)
+    { unlink(tmp); }
+    free(path);
+    free(tmp);
+    return -1;
+} /* -- sr_snapshot_save -- */
+
+/*---------------------------------------------------------------------
+ * Method: sr_snapshot_check(..)
+ * Scope: Local
+ *
+ * Returns 0 if the mapped snapshot is intact, fresh with respect to src
+ * and uses the wanted LPM type and compression, otherwise a short reason.
+ *
+ *---------------------------------------------------------------------*/
+
+static const char* sr_snapshot_check(const uint8_t* map, size_t len,
+                                     const struct stat* src, sr_lpm_type type,
+                                     int compressed)
+{
+    struct sr_snapshot_hdr hdr;
+    unsigned int i;
+
+    if(len < sizeof(hdr))
+    { return "truncated"; }
+    memcpy(&hdr, map, sizeof(hdr));
+
+    if(memcmp(hdr.magic, SR_SNAPSHOT_MAGIC, sizeof(hdr.magic)) != 0)
+    { return "not a snapshot"; }
+    if(hdr.version != SR_SNAPSHOT_VERSION)
+    { return "old format"; }
+    if(hdr.file_size != len)
+    { return "truncated"; }
+    if(hdr.src_size != (uint64_t)src->st_size ||
+       hdr.src_mtime != (int64_t)src->st_mtim.tv_sec ||
+       hdr.src_mtime_nsec != (int64_t)src->st_mtim.tv_nsec ||
+       hdr.src_ino != (uint64_t)src->st_ino)
+    { return "stale"; }
+    if(hdr.lpm_type != (uint32_t)type)
+    { return "different lookup structure"; }
+    if(!(hdr.flags & SR_SNAPSHOT_ORTC) != !compressed)
+    { return "different compression"; }
+    if(hdr.nroutes == 0 || hdr.nroutes >= SR_FIB_DISCARD ||
+       hdr.routes_off != sizeof(hdr) ||
+       hdr.routes_off + (uint64_t)hdr.nroutes * sizeof(struct sr_snapshot_route) > len)
+    { return "corrupt"; }
+    for(i = 0; i < SR_LPM_IMAGE_PARTS; i++)
+    {
+        if(hdr.lpm_off[i] % SR_SNAPSHOT_ALIGN ||
+           hdr.lpm_off[i] > len || hdr.lpm_size[i] > len - hdr.lpm_off[i])
+        { return "corrupt"; }
+    }
+
+    if(len % sizeof(uint64_t) ||
+       sr_snapshot_sum_file(map, len, &hdr) != hdr.checksum)
+    { return "checksum mismatch"; }
+
+    return 0;
+} /* -- sr_snapshot_check -- */
+
+/*---------------------------------------------------------------------
+ * Method: sr_snapshot_load(..)
+ * Scope: Global
+ *
+ * Map rtable's snapshot and build a forwarding table on top of it.  The
+ * LPM arrays are used straight from the mapping; only the route list is
+ * rebuilt.  compressed asks for a table built with ORTC compression.
+ * Returns 0, after saying why when a snapshot exists, if there is no
+ * usable snapshot and the text rtable has to be loaded instead.
+ *
+ *---------------------------------------------------------------------*/
+
+struct sr_fib* sr_snapshot_load(const char* rtable, sr_lpm_type type,
+                                int compressed)
+{
+    const struct sr_snapshot_hdr* hdr = 0;
+    const struct sr_snapshot_route* rec = 0;
+    struct sr_lpm_image img;
+    struct sr_fib* fib = 0;
+    struct sr_rt* entry = 0;
+    struct stat src;
+    struct stat st;
+    const char* reason = 0;
+    uint8_t* map = 0;
+    char* path = 0;
+    uint32_t i;
+    int fd;
+
+    /* -- REQUIRES -- */
+    assert(rtable);
+
+    if(stat(rtable, &src) != 0)
+    { return 0; }
+
+    path = sr_snapshot_path(rtable, SR_SNAPSHOT_SUFFIX);
+    if(path == 0)
+    { return 0; }
+
+    fd = open(path, O_RDONLY);
+    if(fd < 0)
+    {
+        free(path);
+        return 0;
+    }
+    if(fstat(fd, &st) != 0 || st.st_size == 0)
+    {
+        close(fd);
+        free(path);
+        return 0;
+    }
+
+    map = (uint8_t*)mmap(0, st.st_size, PROT_READ, MAP_PRIVATE | MAP_POPULATE,
+                        fd, 0);
+    close(fd);
+    if(map == MAP_FAILED)
+    {
+        free(path);
+        return 0;
+    }
+
+    reason = sr_snapshot_check(map, st.st_size, &src, type, compressed);
+    if(reason)
+    {
+        printf("Ignoring routing table snapshot %s: %s\n", path, reason);
+        goto fail;
+    }
+    hdr = (const struct sr_snapshot_hdr*)map;
+
+    fib = (struct sr_fib*)calloc(1, sizeof(struct sr_fib));
+    if(fib == 0)
+    { goto fail; }
+    fib->map = map;
+    fib->map_len = st.st_size;
+
+    img.type = hdr->lpm_type;
+    for(i = 0; i < SR_LPM_IMAGE_PARTS; i++)
+    {
+        img.count[i] = hdr->lpm_count[i];
+        img.part[i] = map + hdr->lpm_off[i];
+        img.size[i] = hdr->lpm_size[i];
+    }
+    fib->lpm = sr_lpm_import(&img);
+    if(fib->lpm == 0)
+    {
+        printf("Ignoring routing table snapshot %s: corrupt\n", path);
+        goto fail;
+    }
+
+    fib->nroutes = hdr->nroutes + 1;
+    fib->cap = fib->nroutes;
+    fib->routes = (struct sr_rt**)calloc(fib->cap, sizeof(struct sr_rt*));
+    fib->route_block = (struct sr_rt*)calloc(hdr->nroutes, sizeof(struct sr_rt));
+    fib->route_block_len = hdr->nroutes;
+    if(fib->routes == 0 || fib->route_block == 0)
+    { goto fail; }
+
+    rec = (const struct sr_snapshot_route*)(map + hdr->routes_off);
+    for(i = 0; i < hdr->nroutes; i++)
+    {
+        entry = &fib->route_block[i];
+        entry->dest.s_addr = rec[i].dest;
+        entry->gw.s_addr   = rec[i].gw;
+        entry->mask.s_addr = rec[i].mask;
+        entry->npaths = rec[i].npaths;
+        memcpy(entry->interface, rec[i].interface, sr_IFACE_NAMELEN);
+        entry->interface[sr_IFACE_NAMELEN - 1] = 0;
+        entry->ifindex = sr_if_index(entry->interface);
+        if(entry->ifindex == SR_IF_NONE)
+        {
+            printf("Ignoring routing table snapshot %s: too many interfaces\n",
+                   path);
+            goto fail;
+        }
+        entry->next = (i + 1 < hdr->nroutes) ? entry + 1 : 0;
+        entry->prev = i ? entry - 1 : 0;
+        fib->routes[i + 1] = entry;
+    }
+    fib->routing_table = fib->route_block;
+    fib->tail = entry;
+    fib->nlist = hdr->nroutes;
+    fib->compressed = (hdr->flags & SR_SNAPSHOT_ORTC) != 0;
+
+    free(path);
+    return fib;
+
+fail:
+    if(fib)
+    { sr_fib_destroy(fib); }
+    else
+    { munmap(map, st.st_size); }
+    free(path);
+    return 0;
+} /* -- sr_snapshot_load -- */
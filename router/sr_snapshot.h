@@ -0,0 +1,35 @@
+/*-----------------------------------------------------------------------------
+ * file:  sr_snapshot.h
+ *
+ * Description:
+ *
+ * Binary snapshots of a built forwarding table.  After the text rtable
+ * has been parsed the resulting table is written next to it as
+ * <rtable>.fib: the routes plus the raw arrays of the LPM structure.
+ * On the next start the snapshot is mapped and used in place, so the
+ * router can forward without parsing text or inserting a single prefix.
+ *
+ * A snapshot is only used when it is fresh: it must carry the current
+ * format version, its checksum must match and the size, mtime and inode
+ * of the rtable it was built from must match the rtable on disk, and it
+ * must have been built with the same LPM backend and compression.  The
+ * snapshot is native byte order and only meant for the host that wrote it.
+ *
+ *---------------------------------------------------------------------------*/
+
+#ifndef SR_SNAPSHOT_H
+#define SR_SNAPSHOT_H
+
+#include "sr_lpm.h"
+
+#define SR_SNAPSHOT_SUFFIX  ".fib"
+#define SR_SNAPSHOT_MAGIC   "SRFIBSNP"
+#define SR_SNAPSHOT_VERSION 3
+
+struct sr_fib;
+
+int            sr_snapshot_save(const struct sr_fib* fib, const char* rtable);
+struct sr_fib* sr_snapshot_load(const char* rtable, sr_lpm_type type,
+                                int compressed);
+
+#endif /* -- SR_SNAPSHOT_H -- */
@@ -0,0 +1,338 @@
+/*-----------------------------------------------------------------------------
+ * file:  sr_timer.c
+ *
+ * Description:
+ *
+ * Slots are circular lists with the slot itself as the head.  A timer
+ * sits in the level whose span covers the ticks it has left, in the slot
+ * of its expiry at that level's granularity.  Each time level 0 wraps,
+ * the current slot of level 1 is emptied into the levels below, and so on
+ * up: a timer is moved at most SR_TIMER_LEVELS - 1 times before it fires.
+ *
+ *---------------------------------------------------------------------------*/
+
+#include <stdlib.h>
+#include <assert.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "sr_timer.h"
+
+#define SR_TIMER_MASK (SR_TIMER_SLOTS - 1)
+#define SR_TIMER_SPAN ((uint32_t)1 << (SR_TIMER_BITS * SR_TIMER_LEVELS))
+
+static struct sr_wheel* sr_timer_wheels = 0;
+static pthread_mutex_t  sr_timer_registry_lock = PTHREAD_MUTEX_INITIALIZER;
+static int              sr_timer_running = 0;
+
+static void sr_timer_unlink(struct sr_timer* t)
+{
+    t->prev->next = t->next;
+    t->next->prev = t->prev;
+    t->next = t->prev = 0;
+}
+
+static void sr_wheel_insert(struct sr_wheel* w, struct sr_timer* t)
+{
+    struct sr_timer* head;
+    uint32_t delta = t->expires - w->now;
+    int level = 0;
+
+    if(delta >= SR_TIMER_SPAN)
+    {
+        delta = SR_TIMER_SPAN - 1;
+        t->expires = w->now + delta;
+    }
+    while(level < SR_TIMER_LEVELS - 1 &&
+          delta >= (uint32_t)1 << (SR_TIMER_BITS * (level + 1)))
+    { level++; }
+
+    head = &w->slots[level][(t->expires >> (SR_TIMER_BITS * level)) & SR_TIMER_MASK];
+    t->prev = head->prev;
+    t->next = head;
+    head->prev->next = t;
+    head->prev = t;
+} /* -- sr_wheel_insert -- */
+
+/* Move the timers of one slot to where their remaining ticks belong now */
+static void sr_wheel_cascade(struct sr_wheel* w, int level, uint32_t slot)
+{
+    struct sr_timer* head = &w->slots[level][slot];
+    struct sr_timer* t;
+    struct sr_timer* next;
+
+    if(head->next == head)
+    { return; }
+
+    t = head->next;
+    head->prev->next = 0;
+    head->next = head->prev = head;
+    for(; t; t = next)
+    {
+        next = t->next;
+        sr_wheel_insert(w, t);
+    }
+} /* -- sr_wheel_cascade -- */
+
+/*---------------------------------------------------------------------
+ * Method: sr_timer_thread(..)
+ * Scope: Local
+ *
+ * Advances every started wheel to the current tick, once a tick.
+ *
+ *---------------------------------------------------------------------*/
+
+static void* sr_timer_thread(void* arg)
+{
+    struct timespec ts;
+    struct timespec pause;
+    struct sr_wheel* w;
+    uint32_t now;
+    long ns_per_tick = 1000000000L / SR_TIMER_HZ;
+
+    for(;;)
+    {
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        pause.tv_sec = 0;
+        pause.tv_nsec = ns_per_tick - ts.tv_nsec % ns_per_tick;
+        nanosleep(&pause, 0);
+
+        now = sr_timer_now();
+        pthread_mutex_lock(&sr_timer_registry_lock);
+        for(w = sr_timer_wheels; w; w = w->next)
+        {
+            pthread_mutex_lock(w->lock);
+            sr_wheel_advance(w, now);
+            pthread_mutex_unlock(w->lock);
+            if(w->flush)
+            { w->flush(w->arg); }
+        }
+        pthread_mutex_unlock(&sr_timer_registry_lock);
+    }
+
+    return 0;
+} /* -- sr_timer_thread -- */
+
+/*---------------------------------------------------------------------
+ * Method: sr_timer_now(void)
+ * Scope: Global
+ *
+ * The current tick, from the monotonic clock.  Wraps; compare ticks by
+ * their signed difference.
+ *
+ *---------------------------------------------------------------------*/
+
+uint32_t sr_timer_now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint32_t)ts.tv_sec * SR_TIMER_HZ +
+           (uint32_t)(ts.tv_nsec / (1000000000L / SR_TIMER_HZ));
+} /* -- sr_timer_now -- */
+
+/*---------------------------------------------------------------------
+ * Method: sr_wheel_init(..)
+ * Scope: Global
+ *
+ * An empty wheel whose timers fire with lock held and get arg.
+ *
+ *---------------------------------------------------------------------*/
+
+void sr_wheel_init(struct sr_wheel* w, pthread_mutex_t* lock, void* arg)
+{
+    int level, slot;
+
+    for(level = 0; level < SR_TIMER_LEVELS; level++)
+    {
+        for(slot = 0; slot < SR_TIMER_SLOTS; slot++)
+        {
+            w->slots[level][slot].next = &w->slots[level][slot];
+            w->slots[level][slot].prev = &w->slots[level][slot];
+        }
+    }
+    w->now = sr_timer_now();
+    w->armed = 0;
+    w->lock = lock;
+    w->arg = arg;
+    w->flush = 0;
+    w->started = 0;
+    w->next = 0;
+} /* -- sr_wheel_init -- */
+
+/*---------------------------------------------------------------------
+ * Method: sr_wheel_start(..)
+ * Scope: Global
+ *
+ * Have the timer thread advance w, starting the thread if need be.
+ *
+ *---------------------------------------------------------------------*/
+
+void sr_wheel_start(struct sr_wheel* w)
+{
+    pthread_t thread;
+    pthread_attr_t attr;
+
+    pthread_mutex_lock(&sr_timer_registry_lock);
+    if(!w->started)
+    {
+        w->next = sr_timer_wheels;
+        sr_timer_wheels = w;
+        w->started = 1;
+    }
+    if(!sr_timer_running)
+    {
+        pthread_attr_init(&attr);
+        pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+        if(pthread_create(&thread, &attr, sr_timer_thread, 0) == 0)
+        { sr_timer_running = 1; }
+        pthread_attr_destroy(&attr);
+    }
+    pthread_mutex_unlock(&sr_timer_registry_lock);
+} /* -- sr_wheel_start -- */
+
+/*---------------------------------------------------------------------
+ * Method: sr_wheel_stop(..)
+ * Scope: Global
+ *
+ * Stop advancing w.  Once this returns no timer of w is firing.
+ *
+ *---------------------------------------------------------------------*/
+
+void sr_wheel_stop(struct sr_wheel* w)
+{
+    struct sr_wheel** pw;
+
+    pthread_mutex_lock(&sr_timer_registry_lock);
+    for(pw = &sr_timer_wheels; *pw; pw = &(*pw)->next)
+    {
+        if(*pw == w)
+        {
+            *pw = w->next;
+            break;
+        }
+    }
+    w->started = 0;
+    pthread_mutex_unlock(&sr_timer_registry_lock);
+} /* -- sr_wheel_stop -- */
+
+/*---------------------------------------------------------------------
+ * Method: sr_wheel_advance(..)
+ * Scope: Global
+ *
+ * Fire the timers due up to tick now, in order.  Call with the owner's
+ * lock held.
+ *
+ *---------------------------------------------------------------------*/
+
+void sr_wheel_advance(struct sr_wheel* w, uint32_t now)
+{
+    struct sr_timer* head;
+    struct sr_timer* t;
+    uint32_t idx, slot;
+    int level;
+
+    while((int32_t)(now - w->now) > 0)
+    {
+        /* -- nothing to fire or cascade on the way -- */
+        if(w->armed == 0)
+        {
+            w->now = now;
+            break;
+        }
+
+        w->now++;
+        idx = w->now & SR_TIMER_MASK;
+        if(idx == 0)
+        {
+            for(level = 1; level < SR_TIMER_LEVELS; level++)
+            {
+                slot = (w->now >> (SR_TIMER_BITS * level)) & SR_TIMER_MASK;
+                sr_wheel_cascade(w, level, slot);
+                if(slot != 0)
+                { break; }
+            }
+        }
+
+        /* -- callbacks may arm and cancel timers, take them one by one -- */
+        head = &w->slots[0][idx];
+        while(head->next != head)
+        {
+            t = head->next;
+            sr_timer_unlink(t);
+            w->armed--;
+            t->fn(t, w->arg);
+        }
+    }
+} /* -- sr_wheel_advance -- */
+
+/*---------------------------------------------------------------------
+ * Method: sr_timer_init(..)
+ * Scope: Global
+ *
+ *---------------------------------------------------------------------*/
+
+void sr_timer_init(struct sr_timer* t, sr_timer_fn fn)
+{
+    t->next = t->prev = 0;
+    t->expires = 0;
+    t->fn = fn;
+} /* -- sr_timer_init -- */
+
+/*---------------------------------------------------------------------
+ * Method: sr_timer_arm(..)
+ * Scope: Global
+ *
+ * (Re)arm t to fire ticks ticks from now, at the earliest the next tick.
+ * Call with the owner's lock held.
+ *
+ *---------------------------------------------------------------------*/
+
+void sr_timer_arm(struct sr_wheel* w, struct sr_timer* t, uint32_t ticks)
+{
+    assert(t->fn);
+
+    if(sr_timer_armed(t))
+    {
+        sr_timer_unlink(t);
+        w->armed--;
+    }
+    t->expires = w->now + (ticks ? ticks : 1);
+    sr_wheel_insert(w, t);
+    w->armed++;
+} /* -- sr_timer_arm -- */
+
+/*---------------------------------------------------------------------
+ * Method: sr_timer_cancel(..)
+ * Scope: Global
+ *
+ *---------------------------------------------------------------------*/
+
+void sr_timer_cancel(struct sr_wheel* w, struct sr_timer* t)
+{
+    if(sr_timer_armed(t))
+    {
+        sr_timer_unlink(t);
+        w->armed--;
+    }
+} /* -- sr_timer_cancel -- */
+
+/*---------------------------------------------------------------------
+ * Method: sr_timer_move(..)
+ * Scope: Global
+ *
+ * Put to in the place of from, for objects that are moved in memory.
+ * Call with the owner's lock held.
+ *
+ *---------------------------------------------------------------------*/
+
+void sr_timer_move(struct sr_timer* from, struct sr_timer* to)
+{
+    *to = *from;
+    if(sr_timer_armed(from))
+    {
+        to->prev->next = to;
+        to->next->prev = to;
+        from->next = from->prev = 0;
+    }
+} /* -- sr_timer_move -- */
@@ -0,0 +1,84 @@
+/*-----------------------------------------------------------------------------
+ * file:  sr_timer.h
+ *
+ * Description:
+ *
+ * Timers for per-object expiry and retransmission, kept in hierarchical
+ * timing wheels.  A timer is embedded in the object it times and armed
+ * for a number of ticks (SR_TIMER_HZ per second); arming, rearming,
+ * cancelling and firing each cost O(1), whatever the number of timers.
+ *
+ * Every subsystem owns a wheel and the lock that guards its objects.
+ * Timers are armed and cancelled with that lock held, and one shared
+ * thread advances every started wheel once a tick, with the owner's lock
+ * held while it fires the timers that are due.  A callback may therefore
+ * free its object, and arm or cancel any timer of the same wheel.  A
+ * timer fires once; callbacks that want more rearm it.
+ *
+ * Callbacks should not send packets: that would hold the owner's lock
+ * through routing and socket writes.  They queue the work on their
+ * owner instead, and the wheel's flush function, which the timer thread
+ * runs right after dropping the lock, sends it.
+ *
+ * A wheel has SR_TIMER_LEVELS levels of SR_TIMER_SLOTS slots.  Level 0
+ * holds timers due within SR_TIMER_SLOTS ticks, one slot per tick; each
+ * level above covers SR_TIMER_SLOTS times the span of the one below and
+ * moves its timers down a level as their time comes closer.  Timers
+ * further out than the top level reaches wait there and fire late.
+ *
+ *---------------------------------------------------------------------------*/
+
+#ifndef SR_TIMER_H
+#define SR_TIMER_H
+
+#include <inttypes.h>
+#include <pthread.h>
+
+#define SR_TIMER_HZ     10      /* ticks a second */
+#define SR_TIMER_BITS   6
+#define SR_TIMER_SLOTS  (1 << SR_TIMER_BITS)
+#define SR_TIMER_LEVELS 4       /* 64^4 ticks: about 19 days */
+
+/* ticks in s seconds / ms milliseconds, at least one */
+#define SR_TIMER_SEC(s) ((uint32_t)(s) * SR_TIMER_HZ)
+#define SR_TIMER_MS(ms) (((uint32_t)(ms) * SR_TIMER_HZ + 999) / 1000)
+
+struct sr_timer;
+
+/* Called with the wheel owner's lock held; arg is the wheel's */
+typedef void (*sr_timer_fn)(struct sr_timer* t, void* arg);
+
+struct sr_timer
+{
+    struct sr_timer* next;      /* in a wheel slot, 0 when not armed */
+    struct sr_timer* prev;
+    uint32_t    expires;        /* tick it is due */
+    sr_timer_fn fn;
+};
+
+struct sr_wheel
+{
+    struct sr_timer  slots[SR_TIMER_LEVELS][SR_TIMER_SLOTS]; /* list heads */
+    uint32_t         now;       /* last tick advanced to */
+    uint32_t         armed;     /* timers in the wheel */
+    pthread_mutex_t* lock;      /* owner's lock */
+    void*            arg;       /* passed to callbacks */
+    void           (*flush)(void* arg); /* run after firing, unlocked, or 0 */
+    int              started;
+    struct sr_wheel* next;      /* started wheels */
+};
+
+void sr_wheel_init(struct sr_wheel* w, pthread_mutex_t* lock, void* arg);
+void sr_wheel_start(struct sr_wheel* w);
+void sr_wheel_stop(struct sr_wheel* w);
+void sr_wheel_advance(struct sr_wheel* w, uint32_t now);
+
+void sr_timer_init(struct sr_timer* t, sr_timer_fn fn);
+void sr_timer_arm(struct sr_wheel* w, struct sr_timer* t, uint32_t ticks);
+void sr_timer_cancel(struct sr_wheel* w, struct sr_timer* t);
+void sr_timer_move(struct sr_timer* from, struct sr_timer* to);
+uint32_t sr_timer_now(void);
+
+#define sr_timer_armed(t) ((t)->next != 0)
+
+#endif /* -- SR_TIMER_H -- */
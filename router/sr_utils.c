@@ -19,6 +19,37 @@ uint16_t cksum (const void *_data, int len) {
   return sum ? sum : 0xffff;
 }
 
+/* Update a stored checksum for a 16 bit field changing from old to new
+   without summing the data again (RFC 1624).  sum, old and new are all
+   taken as they sit in the packet, i.e. in network byte order.  Like
+   cksum, never returns 0, the same sum as 0xffff. */
+uint16_t cksum_adjust16(uint16_t sum, uint16_t old, uint16_t new) {
+  uint32_t s = (uint16_t)~sum + (uint16_t)~old + new;
+
+  s = (s & 0xffff) + (s >> 16);
+  s = (s & 0xffff) + (s >> 16);
+  s = (uint16_t)~s;
+  return s ? s : 0xffff;
+}
+
+/* Same for a 32 bit field, e.g. an address covered by a pseudo header. */
+uint16_t cksum_adjust32(uint16_t sum, uint32_t old, uint32_t new) {
+  sum = cksum_adjust16(sum, old >> 16, new >> 16);
+  return cksum_adjust16(sum, old & 0xffff, new & 0xffff);
+}
+
+/* Decrement the TTL of a forwarded packet and patch its header checksum,
+   instead of summing the header again.  TTL shares its 16 bit word with
+   the protocol. */
+void ip_ttl_decrement(struct sr_ip_hdr *iphdr) {
+  uint16_t old, new;
+
+  memcpy(&old, &iphdr->ip_ttl, sizeof(old));
+  iphdr->ip_ttl--;
+  memcpy(&new, &iphdr->ip_ttl, sizeof(new));
+  iphdr->ip_sum = cksum_adjust16(iphdr->ip_sum, old, new);
+}
+
 
 uint16_t ethertype(uint8_t *buf) {
   sr_ethernet_hdr_t *ehdr = (sr_ethernet_hdr_t *)buf;
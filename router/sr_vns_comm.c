@@ -35,6 +35,7 @@
 #include <netinet/in.h>
 #include <arpa/inet.h>
 #include <sys/time.h>
+#include <sys/uio.h>
 
 #include "sr_dumper.h"
 #include "sr_router.h"
@@ -48,7 +49,7 @@ static void sr_log_packet(struct sr_instance* , uint8_t* , int );
 static int  sr_arp_req_not_for_us(struct sr_instance* sr,
                                   uint8_t * packet /* lent */,
                                   unsigned int len,
-                                  char* interface  /* lent */);
+                                  struct sr_if* iface /* borrowed */);
 int sr_read_from_server_expect(struct sr_instance* sr /* borrowed */, int expected_cmd);
 
 /*-----------------------------------------------------------------------------
@@ -201,6 +202,8 @@ int sr_handle_hwinfo(struct sr_instance* sr, c_hwinfo* hwinfo)
             case HWSPEED:
                 /* Debug("Speed: %d\n",
                         ntohl(*((unsigned int*)hwinfo->mHWInfo[i].value))); */
+                sr_set_ether_speed(sr,
+                        ntohl(*((unsigned int*)hwinfo->mHWInfo[i].value)));
                 break;
             case HWSUBNET:
                 /* Debug("Subnet: %s\n",inet_ntoa(
@@ -336,6 +339,7 @@ int sr_read_from_server_expect(struct sr_instance* sr /* borrowed */, int expect
     int command, len;
     unsigned char *buf = 0;
     c_packet_ethernet_header* sr_pkt = 0;
+    struct sr_if* iface = 0;
     int ret = 0, bytes_read = 0;
 
     /* REQUIRES */
@@ -426,12 +430,21 @@ int sr_read_from_server_expect(struct sr_instance* sr /* borrowed */, int expect
         case VNSPACKET:
             sr_pkt = (c_packet_ethernet_header *)buf;
 
+            /* -- the router only knows interfaces by index from here on -- */
+            iface = sr_get_interface(sr, (char*)(buf + sizeof(c_base)));
+            if ( iface == 0 )
+            {
+                fprintf(stderr, "** Error, packet on unknown interface %.16s\n",
+                        (char*)(buf + sizeof(c_base)));
+                break;
+            }
+
             /* -- check if it is an ARP to another router if so drop   -- */
             if ( sr_arp_req_not_for_us(sr,
                     (buf+sizeof(c_packet_header)),
                     len - sizeof(c_packet_ethernet_header) +
                     sizeof(struct sr_ethernet_hdr),
-                    (char*)(buf + sizeof(c_base))) )
+                    iface) )
             { break; }
 
             /* -- log packet -- */
@@ -443,7 +456,7 @@ int sr_read_from_server_expect(struct sr_instance* sr /* borrowed */, int expect
                     (buf+sizeof(c_packet_header)),
                     len - sizeof(c_packet_ethernet_header) +
                     sizeof(struct sr_ethernet_hdr),
-                    (char*)(buf + sizeof(c_base)));
+                    iface->index);
 
             break;
 
@@ -517,21 +530,19 @@ int sr_read_from_server_expect(struct sr_instance* sr /* borrowed */, int expect
 static int
 sr_ether_addrs_match_interface( struct sr_instance* sr, /* borrowed */
                                 uint8_t* buf, /* borrowed */
-                                const char* name /* borrowed */ )
+                                struct sr_if* iface, /* borrowed */
+                                int index )
 {
     struct sr_ethernet_hdr* ether_hdr = 0;
-    struct sr_if* iface = 0;
 
     /* -- REQUIRES -- */
     assert(sr);
     assert(buf);
-    assert(name);
 
     ether_hdr = (struct sr_ethernet_hdr*)buf;
-    iface = sr_get_interface(sr, name);
 
     if ( iface == 0 ){
-        fprintf( stderr, "** Error, interface %s, does not exist\n", name);
+        fprintf( stderr, "** Error, interface %d, does not exist\n", index);
         return 0;
     }
 
@@ -550,27 +561,145 @@ sr_ether_addrs_match_interface( struct sr_instance* sr, /* borrowed */
 
 } /* -- sr_ether_addrs_match_interface -- */
 
+/* -- frames queued between sr_send_batch_begin/end on this thread -- */
+struct sr_send_batch
+{
+    c_packet_header hdr[SR_SEND_BATCH_MAX];
+    struct iovec iov[2 * SR_SEND_BATCH_MAX];  /* header, frame */
+    uint8_t  data[SR_SEND_BATCH_BYTES];       /* the frames */
+    unsigned int n;
+    size_t   used;
+    unsigned int depth;
+};
+
+static __thread struct sr_send_batch* sr_send_batch_self = 0;
+
+/*-----------------------------------------------------------------------------
+ * Method: sr_writev_all(..)
+ * Scope: Local
+ *
+ * Write all of iov, picking up after short writes.
+ *
+ *---------------------------------------------------------------------------*/
+
+static int sr_writev_all(int fd, struct iovec* iov, int cnt)
+{
+    ssize_t n;
+
+    while(cnt > 0)
+    {
+        n = writev(fd, iov, cnt);
+        if(n < 0)
+        {
+            if(errno == EINTR)
+            { continue; }
+            return -1;
+        }
+        while(cnt > 0 && (size_t)n >= iov->iov_len)
+        {
+            n -= iov->iov_len;
+            iov++;
+            cnt--;
+        }
+        if(cnt > 0)
+        {
+            iov->iov_base = (uint8_t*)iov->iov_base + n;
+            iov->iov_len -= n;
+        }
+    }
+    return 0;
+} /* -- sr_writev_all -- */
+
+/*-----------------------------------------------------------------------------
+ * Method: sr_send_batch_flush(..)
+ * Scope: Local
+ *
+ *---------------------------------------------------------------------------*/
+
+static int sr_send_batch_flush(struct sr_instance* sr, struct sr_send_batch* b)
+{
+    int rc = 0;
+
+    if(b->n > 0)
+    {
+        /* -- the whole batch, short writes included, in one go -- */
+        pthread_mutex_lock(&sr->send_lock);
+        rc = sr_writev_all(sr->sockfd, b->iov, 2 * b->n);
+        pthread_mutex_unlock(&sr->send_lock);
+        if(rc != 0)
+        { fprintf(stderr, "Error writing %u packets\n", b->n); }
+    }
+    b->n = 0;
+    b->used = 0;
+    return rc;
+} /* -- sr_send_batch_flush -- */
+
+/*-----------------------------------------------------------------------------
+ * Method: sr_send_batch_begin(..)
+ * Scope: Global
+ *
+ * Until the matching sr_send_batch_end(..), packets this thread sends with
+ * sr_send_packet(..) are collected and written to the server together, with
+ * one writev() per SR_SEND_BATCH_MAX packets.  For bursts: packets waiting
+ * on ARP, ICMP errors for all of them.  Calls nest.
+ *
+ *---------------------------------------------------------------------------*/
+
+void sr_send_batch_begin(struct sr_instance* sr)
+{
+    if(sr_send_batch_self == 0)
+    {
+        sr_send_batch_self =
+            (struct sr_send_batch*)calloc(1, sizeof(struct sr_send_batch));
+        if(sr_send_batch_self == 0)
+        { return; } /* -- unbatched then -- */
+    }
+    sr_send_batch_self->depth++;
+} /* -- sr_send_batch_begin -- */
+
+/*-----------------------------------------------------------------------------
+ * Method: sr_send_batch_end(..)
+ * Scope: Global
+ *
+ *---------------------------------------------------------------------------*/
+
+int sr_send_batch_end(struct sr_instance* sr)
+{
+    struct sr_send_batch* b = sr_send_batch_self;
+
+    if(b == 0 || b->depth == 0 || --b->depth > 0)
+    { return 0; }
+    return sr_send_batch_flush(sr, b);
+} /* -- sr_send_batch_end -- */
+
 /*-----------------------------------------------------------------------------
  * Method: sr_send_packet(..)
  * Scope: Global
  *
  * Send a packet (ethernet header included!) of length 'len' to the server
- * to be injected onto the wire.
+ * to be injected onto the wire of the interface with index iface.  Inside
+ * sr_send_batch_begin/end the packet is copied into the batch instead.
  *
  *---------------------------------------------------------------------------*/
 
 int sr_send_packet(struct sr_instance* sr /* borrowed */,
                          uint8_t* buf /* borrowed */ ,
                          unsigned int len,
-                         const char* iface /* borrowed */)
+                         int iface)
 {
     c_packet_header *sr_pkt;
+    c_packet_header hdr;
+    struct iovec iov[2];
+    struct sr_if* out = 0;
+    struct sr_send_batch* b = sr_send_batch_self;
     unsigned int total_len =  len + (sizeof(c_packet_header));
+    int rc;
 
     /* REQUIRES */
     assert(sr);
     assert(buf);
-    assert(iface);
+
+    out = sr_if_get(sr, iface);
 
     /* don't waste my time ... */
     if ( len < sizeof(struct sr_ethernet_hdr) ){
@@ -578,33 +707,50 @@ int sr_send_packet(struct sr_instance* sr /* borrowed */,
         return -1;
     }
 
-    /* Create packet */
-    sr_pkt = (c_packet_header *)malloc(len +
-            sizeof(c_packet_header));
-    assert(sr_pkt);
-    sr_pkt->mLen  = htonl(total_len);
-    sr_pkt->mType = htonl(VNSPACKET);
-    strncpy(sr_pkt->mInterfaceName,iface,16);
-    memcpy(((uint8_t*)sr_pkt) + sizeof(c_packet_header),
-            buf,len);
-
     /* -- log packet -- */
     sr_log_packet(sr,buf,len);
 
-    if ( ! sr_ether_addrs_match_interface( sr, buf, iface) ){
+    if ( ! sr_ether_addrs_match_interface( sr, buf, out, iface) ){
         fprintf( stderr, "*** Error: problem with ethernet header, check log\n");
-        free ( sr_pkt );
         return -1;
     }
 
-    if( write(sr->sockfd, sr_pkt, total_len) < total_len ){
+    /* -- batching: the caller may reuse buf once we return, keep a copy -- */
+    if ( b && b->depth > 0 && len <= SR_SEND_BATCH_BYTES ){
+        if ( b->n == SR_SEND_BATCH_MAX || b->used + len > SR_SEND_BATCH_BYTES ){
+            sr_send_batch_flush(sr, b);
+        }
+        sr_pkt = &b->hdr[b->n];
+        sr_pkt->mLen  = htonl(total_len);
+        sr_pkt->mType = htonl(VNSPACKET);
+        strncpy(sr_pkt->mInterfaceName,out ? out->name : "",16);
+        memcpy(b->data + b->used, buf, len);
+        b->iov[2 * b->n].iov_base = sr_pkt;
+        b->iov[2 * b->n].iov_len = sizeof(c_packet_header);
+        b->iov[2 * b->n + 1].iov_base = b->data + b->used;
+        b->iov[2 * b->n + 1].iov_len = len;
+        b->used += len;
+        b->n++;
+        return 0;
+    }
+
+    /* Create packet */
+    hdr.mLen  = htonl(total_len);
+    hdr.mType = htonl(VNSPACKET);
+    strncpy(hdr.mInterfaceName,out ? out->name : "",16);
+    iov[0].iov_base = &hdr;
+    iov[0].iov_len = sizeof(c_packet_header);
+    iov[1].iov_base = buf;
+    iov[1].iov_len = len;
+
+    pthread_mutex_lock(&sr->send_lock);
+    rc = sr_writev_all(sr->sockfd, iov, 2);
+    pthread_mutex_unlock(&sr->send_lock);
+    if( rc != 0 ){
         fprintf(stderr, "Error writing packet\n");
-        free(sr_pkt);
         return -1;
     }
 
-    free(sr_pkt);
-
     return 0;
 } /* -- sr_send_packet -- */
 
@@ -644,9 +790,8 @@ void sr_log_packet(struct sr_instance* sr, uint8_t* buf, int len )
 int  sr_arp_req_not_for_us(struct sr_instance* sr,
                            uint8_t * packet /* lent */,
                            unsigned int len,
-                           char* interface  /* lent */)
+                           struct sr_if* iface /* borrowed */)
 {
-    struct sr_if* iface = sr_get_interface(sr, interface);
     struct sr_ethernet_hdr* e_hdr = 0;
     struct sr_arp_hdr*       a_hdr = 0;
 
@@ -661,7 +806,11 @@ int  sr_arp_req_not_for_us(struct sr_instance* sr,
     if ( (e_hdr->ether_type == htons(ethertype_arp)) &&
             (a_hdr->ar_op      == htons(arp_op_request))   &&
             (a_hdr->ar_tip     != iface->ip ) )
-    { return 1; }
+    {
+        /* -- counted with the ARP the cache ignored, same thread -- */
+        sr->cache.ignored[sr_arpignore_not_for_us]++;
+        return 1;
+    }
 
     return 0;
 } /* -- sr_arp_req_not_for_us -- */
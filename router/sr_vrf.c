@@ -0,0 +1,217 @@
+/*-----------------------------------------------------------------------------
+ * file:  sr_vrf.c
+ *
+ * Description:
+ *
+ * Named routing tables selected by ingress interface, see sr_vrf.h.
+ *
+ *---------------------------------------------------------------------------*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+
+#include "sr_vrf.h"
+#include "sr_router.h"
+#include "sr_rt.h"
+#include "sr_rcu.h"
+
+#define SR_VRF_LINE_MAX 1024
+
+/* The table interface name is bound to, or 0. */
+static struct sr_vrf* sr_vrf_of(struct sr_instance* sr, const char* name)
+{
+    struct sr_vrf* vrf = 0;
+    unsigned int i;
+
+    for(vrf = sr->vrfs; vrf; vrf = vrf->next)
+    {
+        for(i = 0; i < vrf->nifaces; i++)
+        {
+            if(strncmp(vrf->ifaces[i], name, sr_IFACE_NAMELEN) == 0)
+            { return vrf; }
+        }
+    }
+    return 0;
+}
+
+/*---------------------------------------------------------------------
+ * Method: sr_vrf_parse(..)
+ * Scope: Local
+ *
+ * Parse one "name rtable interface..." line into a new table.  Returns
+ * the table, or 0 with a message on stderr.
+ *
+ *---------------------------------------------------------------------*/
+
+static struct sr_vrf* sr_vrf_parse(struct sr_instance* sr, char* line,
+                                   const char* filename, unsigned long lineno)
+{
+    struct sr_vrf* vrf = 0;
+    const char* why = 0;
+    char* name = strtok(line, " \t\r\n");
+    char* rtable = strtok(0, " \t\r\n");
+    char* iface = 0;
+
+    vrf = (struct sr_vrf*)calloc(1, sizeof(struct sr_vrf));
+    if(vrf == 0)
+    { return 0; }
+
+    if(rtable == 0)
+    { why = "expected 'name rtable interface...'"; }
+    else if(strlen(name) >= SR_VRF_NAMELEN)
+    { why = "table name too long"; }
+    else if(strcmp(name, SR_VRF_DEFAULT) == 0 || sr_vrf_table(sr, name))
+    { why = "table name already used"; }
+
+    while(why == 0 && (iface = strtok(0, " \t\r\n")) != 0)
+    {
+        if(strlen(iface) >= sr_IFACE_NAMELEN)
+        { why = "interface name too long"; }
+        else if(vrf->nifaces == SR_VRF_MAX_IFACES)
+        { why = "too many interfaces"; }
+        else if(sr_vrf_of(sr, iface))
+        { why = "interface already bound to another table"; }
+        else
+        { strcpy(vrf->ifaces[vrf->nifaces++], iface); }
+    }
+    if(why == 0 && vrf->nifaces == 0)
+    { why = "no interfaces"; }
+
+    if(why == 0)
+    {
+        strcpy(vrf->name, name);
+        vrf->rtable_path = (char*)malloc(strlen(rtable) + 1);
+        if(vrf->rtable_path)
+        {
+            strcpy(vrf->rtable_path, rtable);
+            return vrf;
+        }
+        why = "out of memory";
+    }
+
+    fprintf(stderr, "Error in routing table list %s line %lu: %s\n",
+            filename, lineno, why);
+    free(vrf);
+    return 0;
+} /* -- sr_vrf_parse -- */
+
+/*---------------------------------------------------------------------
+ * Method: sr_vrf_config(..)
+ * Scope: Global
+ *
+ * Read the list of named tables from filename (see sr_vrf.h).  This only
+ * sets the tables up; their routes are loaded like the default table's.
+ * Must be called before interfaces are added.  Returns 0 on success.
+ *
+ *---------------------------------------------------------------------*/
+
+int sr_vrf_config(struct sr_instance* sr, const char* filename)
+{
+    char line[SR_VRF_LINE_MAX];
+    struct sr_vrf* vrf = 0;
+    struct sr_vrf** tail = 0;
+    unsigned long lineno = 0;
+    const char* p = 0;
+    FILE* fp = 0;
+
+    /* -- REQUIRES -- */
+    assert(sr);
+    assert(filename);
+    assert(sr->if_list == 0);
+
+    fp = fopen(filename, "r");
+    if(fp == 0)
+    {
+        perror(filename);
+        return -1;
+    }
+
+    for(tail = &sr->vrfs; *tail; tail = &(*tail)->next);
+
+    while(fgets(line, sizeof(line), fp))
+    {
+        lineno++;
+        for(p = line; *p == ' ' || *p == '\t'; p++);
+        if(*p == '\n' || *p == '\r' || *p == '#' || *p == 0)
+        { continue; }
+
+        vrf = sr_vrf_parse(sr, line, filename, lineno);
+        if(vrf == 0)
+        {
+            fclose(fp);
+            return -1;
+        }
+        *tail = vrf;
+        tail = &vrf->next;
+    }
+
+    fclose(fp);
+    return 0;
+} /* -- sr_vrf_config -- */
+
+/*---------------------------------------------------------------------
+ * Method: sr_vrf_bind(..)
+ * Scope: Global
+ *
+ * Bind a newly added interface to the table listing it, if any.
+ *
+ *---------------------------------------------------------------------*/
+
+void sr_vrf_bind(struct sr_instance* sr, struct sr_if* iface)
+{
+    /* -- REQUIRES -- */
+    assert(sr);
+    assert(iface);
+
+    iface->vrf = sr_vrf_of(sr, iface->name);
+    if(iface->vrf)
+    { printf("Interface %s uses routing table %s\n", iface->name, iface->vrf->name); }
+} /* -- sr_vrf_bind -- */
+
+/*---------------------------------------------------------------------
+ * Method: sr_vrf_table(..)
+ * Scope: Global
+ *
+ * Where the table called name is published, for sr_fib_publish(..) and
+ * sr_fib_update(..).  SR_VRF_DEFAULT is the -r table.  Returns 0 if
+ * there is no such table.
+ *
+ *---------------------------------------------------------------------*/
+
+struct sr_fib** sr_vrf_table(struct sr_instance* sr, const char* name)
+{
+    struct sr_vrf* vrf = 0;
+
+    /* -- REQUIRES -- */
+    assert(sr);
+    assert(name);
+
+    if(strcmp(name, SR_VRF_DEFAULT) == 0)
+    { return &sr->fib; }
+
+    for(vrf = sr->vrfs; vrf; vrf = vrf->next)
+    {
+        if(strcmp(vrf->name, name) == 0)
+        { return &vrf->fib; }
+    }
+    return 0;
+} /* -- sr_vrf_table -- */
+
+/*---------------------------------------------------------------------
+ * Method: sr_vrf_fib(..)
+ * Scope: Global
+ *
+ * The table for packets received on interface in (0: the default table).
+ * The caller must be in an RCU read-side section.
+ *
+ *---------------------------------------------------------------------*/
+
+struct sr_fib* sr_vrf_fib(struct sr_instance* sr, const struct sr_if* in)
+{
+    if(in && in->vrf)
+    { return sr_rcu_deref(&in->vrf->fib); }
+
+    return sr_rcu_deref(&sr->fib);
+} /* -- sr_vrf_fib -- */
@@ -0,0 +1,50 @@
+/*-----------------------------------------------------------------------------
+ * file:  sr_vrf.h
+ *
+ * Description:
+ *
+ * Named routing tables (VRFs) selected by the interface a packet arrives
+ * on, so separate networks can be routed through one router.  Tables are
+ * listed in a file given with -F, one per line:
+ *
+ *   name rtable interface [interface]...
+ *
+ * Each table is loaded from its own rtable file, in the same format and
+ * with its own snapshot, and is reloaded on SIGHUP with the default one.
+ * Packets received on a listed interface are routed with that table,
+ * packets from every other interface with the default table (-r).
+ *
+ * Every table is a complete struct sr_fib with its own LPM, so a lookup
+ * costs the same however many tables there are.  Note that each DIR-24-8
+ * table has its own 64 MB first level; many tables are cheaper with the
+ * trie backend.
+ *
+ *---------------------------------------------------------------------------*/
+
+#ifndef SR_VRF_H
+#define SR_VRF_H
+
+#include "sr_if.h"
+
+#define SR_VRF_NAMELEN    32
+#define SR_VRF_MAX_IFACES 16
+#define SR_VRF_DEFAULT    "default"  /* name of the -r table */
+
+struct sr_fib;
+
+struct sr_vrf
+{
+    char   name[SR_VRF_NAMELEN];
+    char*  rtable_path;             /* file it is (re)loaded from */
+    char   ifaces[SR_VRF_MAX_IFACES][sr_IFACE_NAMELEN];
+    unsigned int nifaces;
+    struct sr_fib* fib;             /* RCU protected, like sr->fib */
+    struct sr_vrf* next;
+};
+
+int             sr_vrf_config(struct sr_instance* sr, const char* filename);
+void            sr_vrf_bind(struct sr_instance* sr, struct sr_if* iface);
+struct sr_fib** sr_vrf_table(struct sr_instance* sr, const char* name);
+struct sr_fib*  sr_vrf_fib(struct sr_instance* sr, const struct sr_if* in);
+
+#endif /* -- SR_VRF_H -- */